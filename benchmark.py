@@ -0,0 +1,333 @@
+"""
+Benchmark harness for cbrrr's decoder and encoder.
+
+Builds reproducible synthetic corpora (plus, optionally, the blocks of real
+CAR files), then times decoding and encoding of each one separately, in each
+mode, with warmup runs and repeats. Results can be saved as JSON, and
+compared against a previous run to catch regressions:
+
+	python3 benchmark.py --json before.json
+	# ...make changes, rebuild...
+	python3 benchmark.py --compare before.json
+
+Throughput figures are based on the fastest repeat, which is the least noisy
+estimate of what the code itself costs. The median is recorded too.
+"""
+
+import argparse
+import gc
+import json
+import platform
+import random
+import statistics
+import sys
+import time
+
+import cbrrr
+
+
+class PyCID:
+	"""
+	A minimal pure-python CID class, standing in for something like
+	multiformats.CID, to measure the cost of calling back into python.
+	"""
+
+	__slots__ = ("raw",)
+
+	def __init__(self, raw: bytes):
+		self.raw = raw
+
+	def __bytes__(self) -> bytes:
+		return self.raw
+
+	def __eq__(self, other):
+		return isinstance(other, PyCID) and self.raw == other.raw
+
+	def __hash__(self):
+		return hash(self.raw)
+
+
+def rand_bytes(rng, n):
+	return rng.getrandbits(n * 8).to_bytes(n, "little") if n else b""
+
+
+def rand_cid(rng):
+	return cbrrr.CID.cidv1_dag_cbor_sha256_32_from(rand_bytes(rng, 8))
+
+
+def rand_str(rng, lo, hi):
+	return "".join(rng.choice("abcdefghijklmnopqrstuvwxyz      ") for _ in range(rng.randint(lo, hi)))
+
+
+def rand_tid(rng):
+	return "".join(rng.choice("234567abcdefghijklmnopqrstuvwxyz") for _ in range(13))
+
+
+def rand_did(rng):
+	return "did:plc:" + "".join(rng.choice("234567abcdefghijklmnopqrstuvwxyz") for _ in range(24))
+
+
+def rand_date(rng):
+	return "2024-%02d-%02dT%02d:%02d:%02d.%03dZ" % (
+		rng.randint(1, 12), rng.randint(1, 28), rng.randint(0, 23),
+		rng.randint(0, 59), rng.randint(0, 59), rng.randint(0, 999),
+	)
+
+
+def rand_uri(rng, collection):
+	return f"at://{rand_did(rng)}/{collection}/{rand_tid(rng)}"
+
+
+def gen_record(rng):
+	"""
+	Something shaped like a block from an atproto repo. The mix of records
+	and MST nodes is chosen to roughly match the type frequencies noted in
+	cbrrr_encode_object_scratch (i.e. mostly str, bytes and CIDs).
+	"""
+	r = rng.random()
+	if r < 0.35:
+		return {
+			"$type": "app.bsky.feed.like",
+			"subject": {"cid": str(rand_cid(rng)), "uri": rand_uri(rng, "app.bsky.feed.post")},
+			"createdAt": rand_date(rng),
+		}
+	if r < 0.50:
+		return {"$type": "app.bsky.graph.follow", "subject": rand_did(rng), "createdAt": rand_date(rng)}
+	if r < 0.70:
+		post = {
+			"$type": "app.bsky.feed.post",
+			"text": rand_str(rng, 0, 300),
+			"langs": ["en"],
+			"createdAt": rand_date(rng),
+		}
+		if rng.random() < 0.3:
+			root = {"cid": str(rand_cid(rng)), "uri": rand_uri(rng, "app.bsky.feed.post")}
+			post["reply"] = {"root": root, "parent": root}
+		if rng.random() < 0.2:
+			post["embed"] = {
+				"$type": "app.bsky.embed.images",
+				"images": [
+					{
+						"alt": rand_str(rng, 0, 50),
+						"image": {
+							"$type": "blob",
+							"ref": rand_cid(rng),
+							"mimeType": "image/jpeg",
+							"size": rng.randint(1000, 1000000),
+						},
+					}
+				],
+			}
+		return post
+	# an MST node
+	return {
+		"e": [
+			{
+				"k": rand_bytes(rng, rng.randint(1, 20)),
+				"p": rng.randint(0, 40),
+				"t": rand_cid(rng) if rng.random() < 0.2 else None,
+				"v": rand_cid(rng),
+			}
+			for _ in range(rng.randint(1, 8))
+		],
+		"l": rand_cid(rng) if rng.random() < 0.3 else None,
+	}
+
+
+def gen_tiny(rng):
+	r = rng.random()
+	if r < 0.25:
+		return rng.randint(-1000, 1000)
+	if r < 0.5:
+		return rand_str(rng, 0, 8)
+	if r < 0.75:
+		return {"a": rng.randint(0, 100)}
+	return [None, True]
+
+
+def gen_deep(rng, depth=500):
+	if depth == 0:
+		return rand_str(rng, 1, 8)
+	if depth % 2:
+		return [gen_deep(rng, depth - 1)]
+	return {"x": gen_deep(rng, depth - 1)}
+
+
+def gen_wide(rng, width=5000):
+	return {rand_tid(rng) + str(i): rng.randint(0, 2**32) for i in range(width)}
+
+
+def gen_blob(rng, size=1 << 20):
+	return {"$type": "blob", "mimeType": "application/octet-stream", "data": rand_bytes(rng, size)}
+
+
+# name: (generator, number of objects at scale=1)
+CORPORA = {
+	"records": (gen_record, 20000),
+	"tiny": (gen_tiny, 100000),
+	"deep": (gen_deep, 200),
+	"wide": (gen_wide, 40),
+	"blobs": (gen_blob, 40),
+}
+
+MODES = ["default", "atjson", "cid_ctor"]
+
+
+def build_corpus(name, scale, seed):
+	gen, count = CORPORA[name]
+	rng = random.Random(f"{seed}:{name}")  # independent of which other corpora are selected
+	return [cbrrr.encode_dag_cbor(gen(rng)) for _ in range(max(1, int(count * scale)))]
+
+
+def car_corpus(path):
+	with open(path, "rb") as f:
+		car = f.read()
+	_header, blocks = cbrrr.decode_car(car)
+	encoded = [cbrrr.encode_dag_cbor(block) for block in blocks.values() if not isinstance(block, bytes)]
+	return car, encoded
+
+
+def mode_kwargs(mode):
+	"""returns (decode kwargs, encode kwargs)"""
+	if mode == "atjson":
+		return {"atjson_mode": True}, {"atjson_mode": True}
+	if mode == "cid_ctor":
+		return {"cid_ctor": PyCID}, {"cid_type": PyCID}
+	return {}, {}
+
+
+def measure(fn, warmup, repeat, keep_gc):
+	for _ in range(warmup):
+		fn()
+	times = []
+	for _ in range(repeat):
+		gc.collect()
+		if not keep_gc:
+			gc.disable()
+		try:
+			start = time.perf_counter_ns()
+			fn()
+			times.append(time.perf_counter_ns() - start)
+		finally:
+			gc.enable()
+	return min(times), int(statistics.median(times))
+
+
+def result(corpus, mode, op, nbytes, nobjects, best_ns, median_ns):
+	return {
+		"corpus": corpus,
+		"mode": mode,
+		"op": op,
+		"bytes": nbytes,
+		"objects": nobjects,
+		"best_ns": best_ns,
+		"median_ns": median_ns,
+		"mb_per_s": (nbytes / (1024 * 1024)) / (best_ns / 1e9),
+		"objects_per_s": nobjects / (best_ns / 1e9),
+	}
+
+
+def bench_corpus(name, encoded, modes, args):
+	nbytes = sum(map(len, encoded))
+	results = []
+	for mode in modes:
+		dec_kwargs, enc_kwargs = mode_kwargs(mode)
+		decode, encode = cbrrr.decode_dag_cbor, cbrrr.encode_dag_cbor
+		# the objects to encode are whatever this mode decodes to
+		objs = [decode(b, **dec_kwargs) for b in encoded]
+		if [encode(o, **enc_kwargs) for o in objs] != encoded:
+			raise AssertionError(f"{name}/{mode} did not round-trip")
+
+		best, median = measure(lambda: [decode(b, **dec_kwargs) for b in encoded], args.warmup, args.repeat, args.keep_gc)
+		results.append(result(name, mode, "decode", nbytes, len(encoded), best, median))
+		report(results[-1])
+
+		best, median = measure(lambda: [encode(o, **enc_kwargs) for o in objs], args.warmup, args.repeat, args.keep_gc)
+		results.append(result(name, mode, "encode", nbytes, len(encoded), best, median))
+		report(results[-1])
+	return results
+
+
+def report(r):
+	print(
+		f"{r['corpus']:>16} {r['mode']:>8} {r['op']:>10}: "
+		f"{r['mb_per_s']:9.2f} MB/s {r['objects_per_s']:12.0f} objects/s "
+		f"(best {r['best_ns'] / 1e6:.2f}ms, median {r['median_ns'] / 1e6:.2f}ms)"
+	)
+
+
+def compare(results, baseline_path, threshold):
+	"""prints the change in time for each result, returning the number of regressions"""
+	with open(baseline_path) as f:
+		baseline = {(r["corpus"], r["mode"], r["op"]): r for r in json.load(f)["results"]}
+	print(f"\ncompared to {baseline_path}:")
+	regressions = 0
+	for r in results:
+		old = baseline.get((r["corpus"], r["mode"], r["op"]))
+		if old is None or old["bytes"] != r["bytes"]:
+			continue  # not comparable (different corpus, scale or seed)
+		change = r["best_ns"] / old["best_ns"] - 1
+		flag = ""
+		if change > threshold:
+			flag = "  <-- REGRESSION"
+			regressions += 1
+		print(f"{r['corpus']:>16} {r['mode']:>8} {r['op']:>10}: {change * 100:+6.1f}%{flag}")
+	return regressions
+
+
+def package_version():
+	try:
+		from importlib.metadata import version  # py3.8+
+		return version("cbrrr")
+	except Exception:
+		return None
+
+
+def main():
+	parser = argparse.ArgumentParser(description="benchmark cbrrr's decoder and encoder")
+	parser.add_argument("--corpus", action="append", choices=list(CORPORA), help="synthetic corpus to run (default: all)")
+	parser.add_argument("--mode", action="append", choices=MODES, help="mode to run (default: all)")
+	parser.add_argument("--car", action="append", default=[], help="also benchmark the blocks of this CAR file (and decode_car)")
+	parser.add_argument("--scale", type=float, default=1.0, help="multiplier for the size of the synthetic corpora")
+	parser.add_argument("--seed", type=int, default=0)
+	parser.add_argument("--warmup", type=int, default=2)
+	parser.add_argument("--repeat", type=int, default=10)
+	parser.add_argument("--keep-gc", action="store_true", help="leave the cyclic GC enabled while timing")
+	parser.add_argument("--json", help="save the results to this file")
+	parser.add_argument("--compare", help="compare against results previously saved with --json")
+	parser.add_argument("--threshold", type=float, default=0.1, help="slowdown (as a fraction) to count as a regression")
+	args = parser.parse_args()
+
+	modes = args.mode or MODES
+	results = []
+	for name in args.corpus or list(CORPORA):
+		results += bench_corpus(name, build_corpus(name, args.scale, args.seed), modes, args)
+	for path in args.car:
+		car, encoded = car_corpus(path)
+		name = path.rsplit("/", 1)[-1]
+		results += bench_corpus(name, encoded, modes, args)
+		for mode in modes:
+			dec_kwargs, _ = mode_kwargs(mode)
+			best, median = measure(lambda: cbrrr.decode_car(car, **dec_kwargs), args.warmup, args.repeat, args.keep_gc)
+			results.append(result(name, mode, "decode_car", len(car), len(encoded), best, median))
+			report(results[-1])
+
+	if args.json:
+		meta = {
+			"cbrrr_version": package_version(),
+			"python": sys.version,
+			"implementation": platform.python_implementation(),
+			"platform": platform.platform(),
+			"machine": platform.machine(),
+			"time": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+			"args": vars(args),
+		}
+		with open(args.json, "w") as f:
+			json.dump({"meta": meta, "results": results}, f, indent="\t")
+
+	if args.compare and compare(results, args.compare, args.threshold):
+		sys.exit(1)
+
+
+if __name__ == "__main__":
+	main()
@@ -1,7 +1,7 @@
 import io
 import sys
 import time
-from cbrrr import decode_dag_cbor, encode_dag_cbor, CID
+from cbrrr import decode_dag_cbor, encode_dag_cbor, decode_car, CID
 
 ATJSON_MODE = True
 
@@ -20,7 +20,7 @@ def parse_varint(stream):
 		shift += 7
 
 
-enctime = 00
+enctime = 0
 dectime = 0
 
 
@@ -51,13 +51,13 @@ def parse_car(stream, length):
 		assert len(block_data) == block_len - 36
 		# content_hash = hashlib.sha256(block_data).digest()
 		# assert(cid_raw.endswith(content_hash))
-		start = time.time()
+		start = time.perf_counter()
 		block = decode_dag_cbor(block_data, atjson_mode=ATJSON_MODE)
 		# block = libipld.decode_dag_cbor(block_data)
-		dectime += time.time() - start
-		start = time.time()
+		dectime += time.perf_counter() - start
+		start = time.perf_counter()
 		roundtrip = encode_dag_cbor(block, atjson_mode=ATJSON_MODE)
-		enctime += time.time() - start
+		enctime += time.perf_counter() - start
 		assert block_data == roundtrip
 		# print(block)
 		nodes[cid] = block
@@ -69,7 +69,7 @@ if __name__ == "__main__":
 	import sys
 
 	car = open(sys.argv[1], "rb").read()
-	start_time = time.time()
+	start_time = time.perf_counter()
 
 	root, nodes = parse_car(io.BytesIO(car), len(car))
 
@@ -79,9 +79,15 @@ if __name__ == "__main__":
 	enc_speed = (len(car) / (1024 * 1024)) / enctime
 	print(f"Encoded {len(car)} bytes at {enc_speed:.2f}MB/s")
 
-	# start = time.time()
+	start = time.perf_counter()
+	decode_car(car, atjson_mode=ATJSON_MODE)
+	duration = time.perf_counter() - start
+	car_speed = (len(car) / (1024 * 1024)) / duration
+	print(f"cbrrr.decode_car {len(car)} bytes at {car_speed:.2f}MB/s")
+
+	# start = time.perf_counter()
 	# libipld.decode_car(car)
-	# duration = time.time()-start
+	# duration = time.perf_counter()-start
 	# car_speed = (len(car)/(1024*1024))/duration
 	# print(f"libipld.decode_car {len(car)} bytes at {car_speed:.2f}MB/s")
 
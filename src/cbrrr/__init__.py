@@ -1,138 +1,266 @@
-from typing import Type, Iterator, Union, Callable, Any, List, Dict
-import base64
-import hashlib
+import os
+import inspect
+from typing import Type, Iterator, Iterable, Union, Callable, Any, List, Dict, Tuple, Optional, IO
+from collections.abc import Mapping, Sequence
 from . import _cbrrr  # type: ignore
 
 CbrrrDecodeError = _cbrrr.CbrrrDecodeError
 
 
-class CID:
+# CIDs are implemented natively, so that the codecs can handle them without
+# calling back into python. See help(CID) for details.
+CID = _cbrrr.CID
+
+
+# nb: | syntax not supported in <=py3.9
+DagCborTypes = Union[str, bytes, int, bool, float, CID, List["DagCborTypes"], Dict[str, "DagCborTypes"], None]
+
+
+class Schema(_cbrrr.Schema):
 	"""
-	This class is very minimal, intended to support atproto use cases and not
-	much else.
+	Maps record classes to DAG-CBOR map shapes. See help(_cbrrr.Schema) for
+	details.
+
+	If required isn't given to register(), it's worked out from cls's
+	signature, i.e. the keyword arguments that have no default value. Maps
+	that are missing any of them are decoded as plain dicts, rather than
+	making the whole decode fail when cls is called.
 	"""
 
-	# fmt: off
-	CIDV1_DAG_CBOR_SHA256_32_PFX = b"\x01\x71\x12\x20"
-	CIDV1_RAW_SHA256_32_PFX      = b"\x01\x55\x12\x20"
-	# fmt: on
+	__slots__ = ()
 
-	__slots__ = ("cid_bytes",)
+	def register(
+		self,
+		cls: Callable[..., Any],
+		fields: Union[Iterable[str], Mapping],
+		type_name: Optional[str] = None,
+		required: Optional[Iterable[str]] = None,
+	) -> None:
+		if required is None:
+			required = _required_kwargs(cls)
+		super().register(cls, fields, type_name, required)
 
-	def __init__(self, cid_bytes: bytes) -> None:
-		"""
-		Expects raw byes, without a multibase prefix.
 
-		If you don't have raw bytes, you probably want CID.decode()
+def _required_kwargs(cls: Callable[..., Any]) -> Tuple[str, ...]:
+	try:
+		params = inspect.signature(cls).parameters.values()
+	except (TypeError, ValueError):  # e.g. some builtins
+		return ()
+	return tuple(
+		p.name for p in params
+		if p.default is p.empty and p.kind in (p.POSITIONAL_OR_KEYWORD, p.KEYWORD_ONLY)
+	)
 
-		NOTE: No validation is performed here! You're responsible for ensuring
-		the CID has a format you recognise. the is_cidv1_dag_cbor_sha256_32()
-		and is_cidv1_raw_sha256_32() methods may be useful for this.
-		"""
-		self.cid_bytes = cid_bytes
 
-	@classmethod
-	def cidv1_dag_cbor_sha256_32_from(cls, data: bytes) -> "CID":
-		return cls(cls.CIDV1_DAG_CBOR_SHA256_32_PFX + hashlib.sha256(data).digest())
+def decode_dag_cbor(
+	data: bytes,
+	atjson_mode: bool = False,
+	cid_ctor: Callable[[bytes], Any] = CID,
+	schema: Optional[Schema] = None,
+) -> DagCborTypes:
+	"""
+	Decode DAG-CBOR bytes into python objects.
 
-	@classmethod
-	def cidv1_raw_sha256_32_from(cls, data: bytes) -> "CID":
-		return cls(cls.CIDV1_RAW_SHA256_32_PFX + hashlib.sha256(data).digest())
+	If atjson_mode is True, bytes will be represented as {"$bytes": "b64..."},
+	and CIDs will be represented as {"$link": "b32..."}. Otherwise they'll
+	be represented as bytes objects, or CID classes, respectively.
 
-	@classmethod
-	def decode(cls, data: Union[bytes, str]) -> "CID":
-		"""
-		Currently supported codecs: identity/raw, base32
-		"""
+	If a schema is given, maps matching one of its registered classes (either
+	by $type value, or by exact key set) are decoded directly into instances of
+	that class, which is called with the map's values as keyword arguments.
+	For $type matches, the $type item itself is not passed, and any keys the
+	class has no field for cause a fallback to a plain dict. e.g.:
 
-		if isinstance(data, str):
-			data = data.encode()
+		schema = Schema()
+		schema.register(Post, ["text", "createdAt"], type_name="app.bsky.feed.post")
+		schema.register(StrongRef, {"cid": "cid", "uri": "uri"})
+	"""
 
-		if data.startswith(b"\x00"):  # identity multibase codec
-			return cls(data[1:])
+	parsed, length = _cbrrr.decode_dag_cbor(data, cid_ctor, atjson_mode, schema)
+	if length != len(data):
+		raise ValueError("did not parse to end of buffer")
+	return parsed
 
-		if data.startswith(b"b"):  # base32 multibase codec
-			data = data[1:]  # strip prefix
-			if data.endswith(b"="):
-				raise ValueError("unexpected base32 padding")
-			# add back correct amount of padding (python is fussy)
-			data += b"=" * ((-len(data)) % 8)
-			decoded = base64.b32decode(data, casefold=True)
-			return cls(decoded)
 
-		raise ValueError("I don't know how to decode this CID")
+LazyMap = _cbrrr.LazyMap
+LazyList = _cbrrr.LazyList
+Mapping.register(LazyMap)
+Sequence.register(LazyList)
 
-	def encode(self, base="base32") -> str:
-		if base == "base32":
-			return "b" + base64.b32encode(self.cid_bytes).decode().lower().rstrip("=")
-		# this function might support other encodings in the future
-		raise ValueError("unsupported base encoding")
 
-	def is_cidv1_dag_cbor_sha256_32(self) -> bool:
-		return (
-			self.cid_bytes.startswith(self.CIDV1_DAG_CBOR_SHA256_32_PFX)
-			and len(self.cid_bytes) == 36
-		)
+def decode_dag_cbor_lazy(
+	data: bytes, atjson_mode: bool = False, cid_ctor: Callable[[bytes], Any] = CID
+) -> Union[LazyMap, LazyList, DagCborTypes]:
+	"""
+	Like decode_dag_cbor, but maps and arrays are returned as read-only LazyMap
+	and LazyList views over the input buffer. Their members are only decoded
+	when accessed (nested maps and arrays become further lazy views), which is
+	much cheaper if you only need a few fields.
 
-	def is_cidv1_raw_sha256_32(self) -> bool:
-		return (
-			self.cid_bytes.startswith(self.CIDV1_RAW_SHA256_32_PFX)
-			and len(self.cid_bytes) == 36
-		)
+	The whole input is still validated up front, with the same strictness
+	rules as decode_dag_cbor. Call .materialize() on a view to fully decode it.
 
-	def __bytes__(self):
-		return self.cid_bytes
+	If data is not a bytes object, it'll be copied into one.
+	"""
 
-	def __repr__(self):
-		return f"CID({self.encode()})"
+	parsed, length = _cbrrr.decode_dag_cbor_lazy(data, cid_ctor, atjson_mode)
+	if length != len(data):
+		raise ValueError("did not parse to end of buffer")
+	return parsed
 
-	def __hash__(self) -> int:
-		return self.cid_bytes.__hash__()
 
-	def __eq__(self, __value: object) -> bool:
-		if not isinstance(__value, CID):
-			return False
-		return self.cid_bytes == __value.cid_bytes
+def decode_many(
+	buffers: Iterable[bytes],
+	atjson_mode: bool = False,
+	cid_ctor: Callable[[bytes], Any] = CID,
+	threads: Optional[int] = None,
+) -> List[DagCborTypes]:
+	"""
+	Decode a batch of independent DAG-CBOR buffers, each of which must contain
+	exactly one object, as with decode_dag_cbor.
 
+	Parsing and validation happen with the GIL released, spread over up to
+	`threads` threads. Only building the python objects has to happen on the
+	calling thread. By default, up to one thread per CPU is used, but only as
+	many as the total size of the input makes worthwhile (so small batches are
+	decoded on the calling thread alone).
 
-# nb: | syntax not supported in <=py3.9
-DagCborTypes = Union[str, bytes, int, bool, float, CID, List["DagCborTypes"], Dict[str, "DagCborTypes"], None]
+	If any buffer is invalid, CbrrrDecodeError is raised for the first one
+	(in order), and nothing is returned.
+	"""
 
+	if not isinstance(buffers, (list, tuple)):
+		buffers = list(buffers)
+	if threads is None:
+		return _cbrrr.decode_many(buffers, cid_ctor, atjson_mode, os.cpu_count() or 1, True)
+	return _cbrrr.decode_many(buffers, cid_ctor, atjson_mode, threads)
 
-def decode_dag_cbor(
-	data: bytes, atjson_mode: bool = False, cid_ctor: Callable[[bytes], Any] = CID
-) -> DagCborTypes:
+
+def validate_dag_cbor(data: bytes, allow_trailing: bool = False) -> int:
 	"""
-	Decode DAG-CBOR bytes into python objects.
+	Check that data is valid DAG-CBOR, with the same strictness rules as
+	decode_dag_cbor, but without building any python objects. The GIL is
+	released while validating.
 
-	If atjson_mode is True, bytes will be represented as {"$bytes": "b64..."},
-	and CIDs will be represented as {"$link": "b32..."}. Otherwise they'll
-	be represented as bytes objects, or CID classes, respectively.
+	Returns the length of the object. If allow_trailing is False (the default),
+	that must be the whole buffer.
+
+	Raises CbrrrDecodeError if the object is invalid. The exception's .offset
+	attribute is the offset of the item that failed validation.
+	"""
+
+	length = _cbrrr.validate_dag_cbor(data)
+	if not allow_trailing and length != len(data):
+		raise ValueError("did not parse to end of buffer")
+	return length
+
+
+def extract(
+	data: bytes,
+	paths: Iterable[Iterable[Any]],
+	atjson_mode: bool = False,
+	cid_ctor: Callable[[bytes], Any] = CID,
+) -> List[List[DagCborTypes]]:
+	"""
+	Decode only the values at the given paths, without building the rest of
+	the object. Each path is an iterable of map keys (str), array indices (int,
+	negative indices count from the end) and wildcards (...), which match any
+	key or index. For example, ["ops", ..., "path"] selects the path field of
+	every op in a firehose commit.
+
+	Returns a list of matches for each path, in the order they appear in the
+	encoding. Paths that don't match anything get an empty list.
+
+	The whole buffer is still validated, with the same strictness rules as
+	decode_dag_cbor. At most 64 paths can be extracted at once.
 	"""
 
-	parsed, length = _cbrrr.decode_dag_cbor(data, cid_ctor, atjson_mode)
+	results, length = _cbrrr.extract(data, paths, cid_ctor, atjson_mode)
 	if length != len(data):
 		raise ValueError("did not parse to end of buffer")
-	return parsed
+	return results
+
+
+MultiDecoder = _cbrrr.MultiDecoder
 
 
 def decode_multi_dag_cbor_in_violation_of_the_spec(
-	data: bytes, atjson_mode: bool = False, cid_ctor: Callable[[bytes], Any] = CID
-) -> Iterator[DagCborTypes]:
+	data: bytes,
+	atjson_mode: bool = False,
+	cid_ctor: Callable[[bytes], Any] = CID,
+	max_items: Optional[int] = None,
+) -> MultiDecoder:
 	"""
 	https://ipld.io/specs/codecs/dag-cbor/spec/#strictness
 
 	"Encode and decode must operate on a single top-level CBOR object.
 	Back-to-back concatenated objects are not allowed or supported, as suggested
 	by section 5.1 of RFC 8949 for streaming applications."
+
+	Returns an iterator over the objects. If max_items is set, it stops after
+	that many. Its .offset attribute is the number of bytes consumed so far,
+	which can be used to resume from where it left off.
 	"""
-	view = memoryview(data)
-	offset = 0
-	while offset < len(data):
-		parsed, length = _cbrrr.decode_dag_cbor(view[offset:], cid_ctor, atjson_mode)
-		yield parsed
-		offset += length
-	assert offset == len(data)  # should never fail!
+	return MultiDecoder(data, cid_ctor, atjson_mode, -1 if max_items is None else max_items)
+
+
+def multi_dag_cbor_offsets_in_violation_of_the_spec(
+	data: bytes, max_items: Optional[int] = None
+) -> List[int]:
+	"""
+	Like decode_multi_dag_cbor_in_violation_of_the_spec, but only finds the
+	boundaries between objects. Each object is still fully validated, but not
+	decoded, and the GIL is released while doing so.
+
+	Returns [0, end_0, end_1, ...], i.e. object i is data[b[i]:b[i+1]].
+	"""
+	return _cbrrr.multi_offsets(data, -1 if max_items is None else max_items)
+
+
+class StreamDecoder(_cbrrr.StreamDecoder):
+	"""
+	Incrementally decodes back-to-back DAG-CBOR objects (in violation of the
+	spec, see decode_multi_dag_cbor_in_violation_of_the_spec) from input that
+	arrives in arbitrarily sized chunks, e.g. from a socket or a large file.
+
+	Only the current, incomplete object is buffered between calls to feed().
+	Objects larger than max_object_size bytes (None for no limit) raise a
+	CbrrrDecodeError as soon as their headers show they'll be too big, so a
+	malicious peer can't make us buffer without limit.
+
+	Example::
+
+		decoder = StreamDecoder()
+		for chunk in iter(lambda: f.read(0x10000), b""):
+			for obj in decoder.feed(chunk):
+				...
+		decoder.finish()  # raises if the stream was truncated
+	"""
+
+	__slots__ = ()
+
+	def __init__(
+		self,
+		atjson_mode: bool = False,
+		cid_ctor: Callable[[bytes], Any] = CID,
+		max_object_size: Optional[int] = 64 * 1024 * 1024,
+	) -> None:
+		super().__init__(cid_ctor, atjson_mode, -1 if max_object_size is None else max_object_size)
+
+
+def decode_car(
+	data: bytes, atjson_mode: bool = False, cid_ctor: Callable[[bytes], Any] = CID
+) -> Tuple[Dict[str, DagCborTypes], Dict[Any, DagCborTypes]]:
+	"""
+	Parse a CARv1 file in one go.
+
+	Returns the decoded header, and a dict mapping each block's CID (as
+	constructed by cid_ctor) to its decoded contents. Blocks with a codec other
+	than DAG-CBOR (e.g. raw) are returned as bytes.
+
+	NOTE: Block hashes are not verified against their CIDs!
+	"""
+	return _cbrrr.decode_car(data, cid_ctor, atjson_mode)
 
 
 def encode_dag_cbor(
@@ -148,11 +276,262 @@ def encode_dag_cbor(
 	return _cbrrr.encode_dag_cbor(obj, cid_type, atjson_mode)
 
 
+def encoded_size(
+	obj: DagCborTypes, atjson_mode: bool = False, cid_type: Type = CID
+) -> int:
+	"""
+	Returns the exact length of obj's DAG-CBOR encoding, i.e.
+	len(encode_dag_cbor(obj, ...)), without building the encoded bytes.
+
+	It goes through all the same validation as encode_dag_cbor (key types,
+	atjson $bytes/$link parsing etc.), so it raises the same exceptions.
+	"""
+	return _cbrrr.encoded_size(obj, cid_type, atjson_mode)
+
+
+def encode_dag_cbor_into(
+	obj: DagCborTypes,
+	buf: Union[bytearray, memoryview],
+	offset: int = 0,
+	atjson_mode: bool = False,
+	cid_type: Type = CID,
+) -> int:
+	"""
+	Like encode_dag_cbor, but writes the encoded bytes directly into a writable
+	buffer (e.g. a bytearray or memoryview), starting at offset.
+
+	Returns the number of bytes written. If the encoding doesn't fit, raises
+	ValueError (and the contents of buf after offset are unspecified).
+	"""
+	return _cbrrr.encode_dag_cbor_into(obj, buf, offset, cid_type, atjson_mode)
+
+
+def encode_dag_cbor_to(
+	obj: DagCborTypes,
+	writer: Union[IO[bytes], int],
+	chunk_size: int = 0x10000,
+	atjson_mode: bool = False,
+	cid_type: Type = CID,
+) -> int:
+	"""
+	Like encode_dag_cbor, but writes the encoded bytes out as it goes, in
+	chunks of roughly chunk_size, so memory use stays bounded however big the
+	output is. Large strings and bytes are passed through in chunk_size pieces,
+	rather than being buffered.
+
+	writer is either something with a .write() method (e.g. a file opened in
+	binary mode, or a socket.makefile("wb")), or a raw file descriptor. Partial
+	writes (i.e. write() returning a short count) are handled.
+
+	Returns the total number of bytes written. If an exception is raised, some
+	of the output may already have been written.
+	"""
+	return _cbrrr.encode_dag_cbor_to(obj, writer, chunk_size, cid_type, atjson_mode)
+
+
+def encode_dag_cbor_with_cid(
+	obj: DagCborTypes,
+	atjson_mode: bool = False,
+	cid_type: Type = CID,
+	cid_ctor: Optional[Callable[[bytes], Any]] = None,
+) -> Tuple[bytes, Any]:
+	"""
+	Like encode_dag_cbor, but also returns the CIDv1 (dag-cbor, sha256) of the
+	encoded bytes, as (bytes, cid). The hash is computed as the output is
+	written, rather than in a second pass over it.
+
+	cid_ctor is called on the raw CID bytes, and defaults to cid_type.
+	"""
+	return _cbrrr.encode_dag_cbor_with_cid(
+		obj, cid_type, atjson_mode, cid_type if cid_ctor is None else cid_ctor
+	)
+
+
+def hash_dag_cbor(
+	obj: DagCborTypes,
+	atjson_mode: bool = False,
+	cid_type: Type = CID,
+	cid_ctor: Optional[Callable[[bytes], Any]] = None,
+) -> Any:
+	"""
+	Returns the CIDv1 (dag-cbor, sha256) that obj would have when encoded,
+	without ever holding the whole encoding in memory.
+
+	Equivalent to encode_dag_cbor_with_cid(...)[1]
+	"""
+	return _cbrrr.hash_dag_cbor(
+		obj, cid_type, atjson_mode, cid_type if cid_ctor is None else cid_ctor
+	)
+
+
+def encode_car(
+	roots: Iterable[Any],
+	blocks: Iterable[DagCborTypes],
+	dedupe: bool = True,
+	atjson_mode: bool = False,
+	cid_type: Type = CID,
+) -> bytes:
+	"""
+	Build a CARv1 file in one go, with the given root CIDs in its header.
+
+	Each of blocks is encoded as DAG-CBOR, and written out alongside its CIDv1
+	(dag-cbor, sha256), which is computed as we go. If dedupe is True,
+	identical blocks are only written once.
+
+	To find out the CIDs of the blocks, or to write the output to a file as
+	it's built, use CarWriter instead.
+	"""
+	return _cbrrr.encode_car(roots, blocks, dedupe, cid_type, atjson_mode)
+
+
+# Incremental version of encode_car. See help(CarWriter) for details.
+CarWriter = _cbrrr.CarWriter
+
+
+def mst_walk(
+	car: bytes,
+	root: Optional[Any] = None,
+	start: Optional[str] = None,
+	end: Optional[str] = None,
+	cid_ctor: Callable[[bytes], Any] = CID,
+) -> Iterator[Tuple[str, Any]]:
+	"""
+	Walk an atproto Merkle Search Tree (e.g. a repo's records), reading its
+	nodes directly out of a CAR file. Yields (key, value_cid) pairs, in key
+	order, where keys look like "app.bsky.feed.post/3k2...".
+
+	By default, the tree is the one referenced by the "data" field of the
+	commit that's the CAR's root (i.e. what you get from a repo export).
+	Otherwise, root is the CID of the tree's root node.
+
+	If start and/or end are given, only keys in the range [start, end) are
+	yielded, and subtrees that can't contain any of them aren't visited.
+
+	Nodes are strictly validated (including key ordering), and a missing node
+	raises CbrrrDecodeError. Like decode_car, block hashes are not verified.
+	"""
+	return _cbrrr.mst_walk(car, root, start, end, cid_ctor)
+
+
+def mst_diff(
+	old_car: bytes,
+	new_car: bytes,
+	old_root: Optional[Any] = None,
+	new_root: Optional[Any] = None,
+	start: Optional[str] = None,
+	end: Optional[str] = None,
+	cid_ctor: Callable[[bytes], Any] = CID,
+) -> Iterator[Tuple[str, Optional[Any], Optional[Any]]]:
+	"""
+	Compare two atproto Merkle Search Trees (see mst_walk), yielding
+	(key, old_cid, new_cid) for each key that was created (old_cid is None),
+	deleted (new_cid is None), or updated, in key order.
+
+	Subtrees that are identical on both sides are skipped without being
+	visited, so the cost is proportional to the size of the difference.
+
+	If both trees are in the same CAR, pass it as both old_car and new_car,
+	along with both roots.
+	"""
+	return _cbrrr.mst_diff(old_car, new_car, old_root, new_root, start, end, cid_ctor)
+
+
+# Reusable versions of decode_dag_cbor and encode_dag_cbor, for when you're
+# processing lots of small objects. See help(Decoder) and help(Encoder).
+Decoder = _cbrrr.Decoder
+Encoder = _cbrrr.Encoder
+
+
+def set_key_cache_size(size: int) -> None:
+	"""
+	The decoder caches str objects for map keys (keyed on their raw UTF-8 bytes),
+	so that common keys like "$type" are only ever allocated once.
+
+	This resizes (and clears) that cache. The size is rounded up to a power of
+	two, and 0 disables caching entirely.
+	"""
+	_cbrrr.set_key_cache_size(size)
+
+
+def key_cache_info() -> Dict[str, int]:
+	"""
+	Returns hit/miss counters for the map key cache, along with its current
+	size and the maximum length (in bytes) of keys eligible for caching.
+	The counters are reset whenever the cache is resized.
+	"""
+	return _cbrrr.key_cache_info()
+
+
+def set_stats_enabled(enabled: bool) -> None:
+	"""
+	Turns hot-path statistics collection on or off (it's off by default), for
+	all threads. While it's on, the decoder and encoder count what they see
+	and do, which costs a little speed - so don't leave it on in production.
+
+	Raises RuntimeError if cbrrr was built without stats support
+	(-DCBRRR_STATS=0).
+	"""
+	_cbrrr.set_stats_enabled(enabled)
+
+
+def get_stats() -> Dict[str, Any]:
+	"""
+	Returns the calling thread's statistics, as collected since the last
+	reset_stats() (or since the thread started) while stats were enabled.
+
+	The "decode" and "encode" entries each count calls, bytes, tokens and
+	token_bytes per CBOR major type (token_bytes covers string payloads, but
+	not the contents of arrays and maps), the maximum nesting depth, how often
+	the stack had to be reallocated, and failures by exception type.
+	Alongside those are counts of CIDs created (and how many of those went via
+	a python-level cid_ctor), output buffer reallocations ("buf_grows"), and
+	map key sorts and the comparisons they took.
+
+	Only the main decoder and encoder are instrumented, so decode_many's
+	(multithreaded) parser, for example, only shows up in the CID counts.
+	"""
+	return _cbrrr.get_stats()
+
+
+def reset_stats() -> None:
+	"""
+	Zeroes the calling thread's statistics.
+	"""
+	_cbrrr.reset_stats()
+
+
 __all__ = [
 	"CbrrrDecodeError",
 	"CID",
 	"DagCborTypes",
 	"decode_dag_cbor",
+	"Schema",
+	"LazyMap",
+	"LazyList",
+	"decode_dag_cbor_lazy",
+	"decode_many",
+	"validate_dag_cbor",
+	"extract",
+	"MultiDecoder",
 	"decode_multi_dag_cbor_in_violation_of_the_spec",
+	"multi_dag_cbor_offsets_in_violation_of_the_spec",
+	"decode_car",
+	"StreamDecoder",
 	"encode_dag_cbor",
+	"encoded_size",
+	"encode_dag_cbor_into",
+	"encode_dag_cbor_to",
+	"encode_dag_cbor_with_cid",
+	"hash_dag_cbor",
+	"encode_car",
+	"CarWriter",
+	"mst_walk",
+	"mst_diff",
+	"Decoder",
+	"Encoder",
+	"set_key_cache_size",
+	"key_cache_info",
+	"set_stats_enabled",
+	"get_stats",
+	"reset_stats",
 ]
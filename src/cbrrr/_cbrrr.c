@@ -2,8 +2,137 @@
 #include <Python.h>
 
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <limits.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CBRRR_HAVE_X86_SHA 1
+#define CBRRR_HAVE_X86_AVX2 1
+#include <immintrin.h>
+#include <cpuid.h>
+#else
+#define CBRRR_HAVE_X86_SHA 0
+#define CBRRR_HAVE_X86_AVX2 0
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CBRRR_HAVE_SSE2 1 // part of the x86-64 baseline
+#include <emmintrin.h>
+#else
+#define CBRRR_HAVE_SSE2 0
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define CBRRR_HAVE_NEON 1 // part of the aarch64 baseline
+#include <arm_neon.h>
+#else
+#define CBRRR_HAVE_NEON 0
+#endif
+
+/* The SHA-256 instructions are optional in ARMv8.0, so unless they're part of
+   the compile-time target, they're selected at runtime (where we know how to
+   ask the OS about them, and the compiler lets us use them per-function) */
+#if CBRRR_HAVE_NEON && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#define CBRRR_HAVE_ARM_SHA 1
+#define CBRRR_ARM_SHA_RUNTIME 0
+#define CBRRR_ARM_SHA_TARGET
+#elif CBRRR_HAVE_NEON && defined(__linux__) && defined(__clang__) && __clang_major__ >= 16
+#define CBRRR_HAVE_ARM_SHA 1
+#define CBRRR_ARM_SHA_RUNTIME 1
+#define CBRRR_ARM_SHA_TARGET __attribute__((target("crypto")))
+#elif CBRRR_HAVE_NEON && defined(__linux__) && !defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 8
+#define CBRRR_HAVE_ARM_SHA 1
+#define CBRRR_ARM_SHA_RUNTIME 1
+#define CBRRR_ARM_SHA_TARGET __attribute__((target("+crypto")))
+#else
+#define CBRRR_HAVE_ARM_SHA 0
+#define CBRRR_ARM_SHA_RUNTIME 0
+#endif
+
+#if CBRRR_ARM_SHA_RUNTIME
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6) // from the kernel's asm/hwcap.h
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// count trailing zeros (x must be nonzero)
+static inline int
+cbrrr_ctz(uint32_t x)
+{
+#if defined(_MSC_VER)
+	unsigned long idx;
+	_BitScanForward(&idx, x);
+	return (int)idx;
+#else
+	return __builtin_ctz(x);
+#endif
+}
+
+static inline int
+cbrrr_ctzll(uint64_t x)
+{
+#if defined(_MSC_VER)
+	unsigned long idx;
+	_BitScanForward64(&idx, x);
+	return (int)idx;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+// filled in once, by cbrrr_cpu_detect() (via cbrrr_process_init)
+#if CBRRR_HAVE_X86_AVX2
+static int CBRRR_CPU_HAS_AVX2;
+#endif
+#if CBRRR_HAVE_X86_SHA || CBRRR_ARM_SHA_RUNTIME
+static int CBRRR_CPU_HAS_SHA; // the SHA-256 instructions, on either architecture
+#endif
+
+#if CBRRR_ARM_SHA_RUNTIME
+static void
+cbrrr_cpu_detect(void)
+{
+	CBRRR_CPU_HAS_SHA = (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+#elif CBRRR_HAVE_X86_SHA || CBRRR_HAVE_X86_AVX2
+// all via cpuid
+static void
+cbrrr_cpu_detect(void)
+{
+	unsigned int eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+	int ssse3, sse41, osxsave;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return;
+	}
+	ssse3 = (ecx >> 9) & 1;
+	sse41 = (ecx >> 19) & 1;
+	osxsave = (ecx >> 27) & 1;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		return;
+	}
+	CBRRR_CPU_HAS_SHA = ssse3 && sse41 && ((ebx >> 29) & 1);
+
+	// AVX2 also needs the OS to be saving the ymm registers for us
+	if (osxsave && ((ebx >> 5) & 1)) {
+		__asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+		(void)xcr0_hi;
+		CBRRR_CPU_HAS_AVX2 = (xcr0_lo & 0x6) == 0x6; // XMM and YMM state
+	}
+}
+#endif
 
 #define STATIC_ASSERT(COND,MSG) typedef char static_assertion_##MSG[(COND)?1:-1]
 
@@ -18,15 +147,164 @@
 */
 STATIC_ASSERT(sizeof(size_t) == 8, _64bit_platforms_only); // this'll hopefully be relaxed in the future
 
-// XXX: not sure having these as globals is the right thing to do?
-static PyObject *PY_ZERO;
-static PyObject *PY_UINT64_MAX;
-static PyObject *PY_UINT64_MAX_INVERTED;
-static PyObject *PY_STRING_ENCODE;
-static PyObject *PY_STRING_DECODE;
-static PyObject *PY_STRING_LINK;
-static PyObject *PY_STRING_BYTES;
-static PyObject *PY_CBRRR_DECODE_ERROR;
+/* Free-threaded builds (PEP 703) need real locking around the few bits of
+   mutable state that are shared between calls. With a GIL these compile away
+   to nothing. */
+#ifdef Py_GIL_DISABLED
+#define CBRRR_TRYLOCK(lock) (!__atomic_test_and_set((lock), __ATOMIC_ACQUIRE))
+#define CBRRR_UNLOCK(lock) __atomic_clear((lock), __ATOMIC_RELEASE)
+#define CBRRR_LOAD_RELAXED(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define CBRRR_STORE_RELAXED(var, val) __atomic_store_n(&(var), (val), __ATOMIC_RELAXED)
+#else
+#define CBRRR_TRYLOCK(lock) ((void)(lock), 1)
+#define CBRRR_UNLOCK(lock) ((void)(lock))
+#define CBRRR_LOAD_RELAXED(var) (var)
+#define CBRRR_STORE_RELAXED(var, val) ((var) = (val))
+#endif
+
+// PyType_Slot holds functions as void *, which -Wpedantic objects to
+#if defined(__GNUC__)
+#define CBRRR_SLOT(fn) (__extension__ (void *)(fn))
+#else
+#define CBRRR_SLOT(fn) ((void *)(fn))
+#endif
+
+// like static types, ours can't have their attributes changed
+#ifdef Py_TPFLAGS_IMMUTABLETYPE
+#define CBRRR_TPFLAGS_IMMUTABLETYPE Py_TPFLAGS_IMMUTABLETYPE
+#else
+#define CBRRR_TPFLAGS_IMMUTABLETYPE 0
+#endif
+
+/* Instances of our (heap) types own a reference to their type, which their
+   deallocator must release. Except on 3.7, where subtype_dealloc does it for
+   instances of python subclasses. */
+#if PY_VERSION_HEX >= 0x03080000
+#define CBRRR_RELEASE_TYPE(tp, dealloc) Py_DECREF(tp)
+#else
+#define CBRRR_RELEASE_TYPE(tp, dealloc) do { if ((tp)->tp_dealloc == (destructor)(dealloc)) Py_DECREF(tp); } while (0)
+#endif
+
+// per-object locks, for objects with methods that mutate them (no-ops unless free-threaded)
+#if PY_VERSION_HEX >= 0x030D0000
+#define CBRRR_BEGIN_CRITICAL_SECTION(op) Py_BEGIN_CRITICAL_SECTION(op)
+#define CBRRR_END_CRITICAL_SECTION() Py_END_CRITICAL_SECTION()
+#else
+#define CBRRR_BEGIN_CRITICAL_SECTION(op) {
+#define CBRRR_END_CRITICAL_SECTION() }
+#endif
+
+/* Map keys are overwhelmingly drawn from a small vocabulary ("$type", "text",
+   "createdAt", ...), so we keep a direct-mapped cache of str objects keyed on
+   their raw UTF-8 bytes. Each cached str has its hash precomputed, which also
+   makes the subsequent PyDict_SetItem cheaper.
+
+   nb: we deliberately don't intern these. Interned strings are immortal on
+   recent python versions, and a hostile input could mint arbitrarily many
+   distinct keys. */
+#define CBRRR_KEY_CACHE_DEFAULT_SIZE 1024
+#define CBRRR_KEY_CACHE_MAX_KEY_LEN 64
+
+typedef struct {
+	PyObject *str; // NULL for an empty slot
+	uint32_t hash; // hash of the raw UTF-8 bytes
+} KeyCacheEntry;
+
+#define CBRRR_SHAPE_CACHE_SIZE 256 // must be a power of 2 (see cbrrr_shape_lookup)
+
+struct ShapeCacheEntry;
+
+/*
+Everything the module needs that holds python objects lives in here, one
+instance per module object (python objects can't be shared between
+interpreters, and one interpreter can load the module more than once, e.g.
+after it's been removed from sys.modules).
+
+Module-level functions find it via their module argument, and type methods
+via their type (see cbrrr_type_state). Everything below those takes it as an
+argument.
+*/
+typedef struct {
+	PyObject *decode_error;
+	PyObject *zero;
+	PyObject *uint64_max;
+	PyObject *uint64_max_inverted;
+	PyObject *string_link;
+	PyObject *string_bytes;
+	PyObject *keys_view; // collections.abc.KeysView etc., for LazyMap
+	PyObject *values_view;
+	PyObject *items_view;
+
+	PyTypeObject *cid_type;
+	PyTypeObject *schema_type;
+	PyTypeObject *stream_decoder_type;
+	PyTypeObject *multi_decoder_type;
+	PyTypeObject *lazy_map_type;
+	PyTypeObject *lazy_list_type;
+	PyTypeObject *decoder_type;
+	PyTypeObject *encoder_type;
+	PyTypeObject *car_writer_type;
+	PyTypeObject *mst_walker_type;
+
+	KeyCacheEntry *key_cache;
+	size_t key_cache_size; // always a power of 2, or 0 if the cache is disabled
+	uint64_t key_cache_hits;
+	uint64_t key_cache_misses;
+	char key_cache_lock; // only used when free-threaded, contended lookups bypass the cache
+
+	struct ShapeCacheEntry *shape_cache[CBRRR_SHAPE_CACHE_SIZE];
+	uint64_t shape_cache_pending[CBRRR_SHAPE_CACHE_SIZE]; // hashes of shapes seen once
+	char shape_cache_lock; // ditto
+} CbrrrState;
+
+static struct PyModuleDef cbrrrmodule; // defined at the very end
+
+static CbrrrState *
+cbrrr_module_state(PyObject *module)
+{
+	return (CbrrrState *)PyModule_GetState(module);
+}
+
+/* The state of the module instance that created tp (or the nearest of its
+   bases that we created, if it's a subclass). This is how type methods, which
+   don't get a module argument, find their state. Each instance references its
+   type, which references the module, so the state is valid for as long as the
+   caller holds onto the instance (or type). */
+static CbrrrState *
+cbrrr_type_state(PyTypeObject *tp)
+{
+#if PY_VERSION_HEX >= 0x030B0000
+	PyObject *m = PyType_GetModuleByDef(tp, &cbrrrmodule);
+	return m == NULL ? NULL : cbrrr_module_state(m);
+#else
+	for (; tp != NULL; tp = tp->tp_base) {
+		if (!(tp->tp_flags & Py_TPFLAGS_HEAPTYPE)) {
+			continue;
+		}
+#if PY_VERSION_HEX >= 0x03090000
+		// PyType_GetModuleByDef is 3.11+, this is what it does
+		PyObject *m = ((PyHeapTypeObject *)tp)->ht_module;
+#else
+		// types don't have a module before 3.9, so cbrrr_module_add_type stashes it
+		PyObject *m = tp->tp_dict == NULL ? NULL : PyDict_GetItemString(tp->tp_dict, "__cbrrr_module__");
+#endif
+		if (m != NULL && PyModule_Check(m) && PyModule_GetDef(m) == &cbrrrmodule) {
+			return cbrrr_module_state(m);
+		}
+	}
+	PyErr_SetString(PyExc_TypeError, "not a cbrrr type");
+	return NULL;
+#endif
+}
+
+// the native CID type (defined further down)
+typedef struct {
+	PyObject_VAR_HEAD
+	Py_hash_t hash; // cached, or -1 if not yet computed
+	uint8_t cid_bytes[]; // ob_size bytes long
+} CIDObject;
+
+static PyObject *cbrrr_cid_from_raw(CbrrrState *st, PyObject *cid_ctor, const uint8_t *data, size_t len);
 
 typedef enum {
 	DCMT_UNSIGNED_INT = 0,
@@ -39,6 +317,171 @@ typedef enum {
 	DCMT_FLOAT = 7,
 } DCMajorType;
 
+/*
+Optional hot-path statistics, for figuring out where the time goes on a given
+workload (see set_stats_enabled). The counters are per-thread, so that threads
+don't fight over cache lines, and so that they don't need any locking.
+
+Everything is gated on cbrrr_stats(), which returns NULL when stats are
+disabled at runtime (the default), in which case the cost is one predictable
+branch per token. Building with -DCBRRR_STATS=0 removes them entirely.
+*/
+#ifndef CBRRR_STATS
+#define CBRRR_STATS 1
+#endif
+
+#if defined(_MSC_VER)
+#define CBRRR_THREAD_LOCAL __declspec(thread)
+#else
+#define CBRRR_THREAD_LOCAL __thread
+#endif
+
+typedef enum {
+	CBRRR_FAIL_DECODE_ERROR, // (this order is exposed via the USDT probes, see below)
+	CBRRR_FAIL_TYPE_ERROR,
+	CBRRR_FAIL_VALUE_ERROR,
+	CBRRR_FAIL_OVERFLOW_ERROR,
+	CBRRR_FAIL_MEMORY_ERROR,
+	CBRRR_FAIL_OTHER,
+	CBRRR_FAIL_KINDS // (count)
+} CbrrrFailKind;
+
+typedef struct {
+	uint64_t calls;
+	uint64_t bytes;
+	uint64_t tokens[8]; // indexed by major type
+	uint64_t token_bytes[8]; // ditto, including string payloads but not container contents
+	uint64_t max_depth;
+	uint64_t stack_reallocs;
+	uint64_t failures[CBRRR_FAIL_KINDS];
+} CbrrrStatsDir;
+
+typedef struct {
+	CbrrrStatsDir decode;
+	CbrrrStatsDir encode;
+	uint64_t cids; // CID objects created from raw bytes (mostly by the decoder)
+	uint64_t cid_ctor_calls; // ...of which went via a python-level cid_ctor
+	uint64_t buf_grows; // output buffer reallocations
+	uint64_t sorts; // map key lists that needed sorting
+	uint64_t sort_comparisons;
+} CbrrrStats;
+
+#if CBRRR_STATS
+static char CBRRR_STATS_ENABLED;
+static CBRRR_THREAD_LOCAL CbrrrStats CBRRR_THREAD_STATS;
+
+static inline CbrrrStats *
+cbrrr_stats(void)
+{
+	return CBRRR_LOAD_RELAXED(CBRRR_STATS_ENABLED) ? &CBRRR_THREAD_STATS : NULL;
+}
+#else
+#define cbrrr_stats() ((CbrrrStats *)NULL)
+#endif
+
+static inline void
+cbrrr_stats_token(CbrrrStatsDir *dir, DCMajorType type, size_t len)
+{
+	dir->tokens[type]++;
+	dir->token_bytes[type] += len;
+}
+
+// classifies the currently-raised exception
+static CbrrrFailKind
+cbrrr_fail_kind(CbrrrState *st)
+{
+	PyObject *exc = PyErr_Occurred();
+	if (exc == NULL) {
+		return CBRRR_FAIL_OTHER; // shouldn't happen, but this is no place to assert about it
+	}
+	if (PyErr_GivenExceptionMatches(exc, st->decode_error)) {
+		return CBRRR_FAIL_DECODE_ERROR;
+	}
+	if (PyErr_GivenExceptionMatches(exc, PyExc_TypeError)) {
+		return CBRRR_FAIL_TYPE_ERROR;
+	}
+	if (PyErr_GivenExceptionMatches(exc, PyExc_ValueError)) { // including invalid UTF-8
+		return CBRRR_FAIL_VALUE_ERROR;
+	}
+	if (PyErr_GivenExceptionMatches(exc, PyExc_OverflowError)) {
+		return CBRRR_FAIL_OVERFLOW_ERROR;
+	}
+	if (PyErr_GivenExceptionMatches(exc, PyExc_MemoryError)) {
+		return CBRRR_FAIL_MEMORY_ERROR;
+	}
+	return CBRRR_FAIL_OTHER;
+}
+
+/*
+USDT probes, for tracing live processes with bpftrace, perf, systemtap etc.
+without needing a special build. Each one compiles to a single nop (plus an
+ELF note describing where to find its arguments), so they're always on where
+<sys/sdt.h> is available, unless disabled with -DCBRRR_USDT=0. e.g.
+
+	bpftrace -e 'usdt:/path/to/_cbrrr*.so:cbrrr:decode__done { @[arg3] = hist(arg1); }'
+
+Probes (provider "cbrrr"):
+	decode__start(const uint8_t *buf, size_t len)
+	decode__done(size_t len, size_t consumed, size_t max_depth, int error)
+	encode__start()
+	encode__done(size_t written, size_t max_depth, int error)
+	cid__ctor__start(size_t len) // around calls to a python cid_ctor
+	cid__ctor__done(int error)
+	sort__start(size_t num_keys) // around sorting map keys for encoding
+	sort__done(size_t num_keys)
+
+error is 0 on success, otherwise 1 + the CbrrrFailKind of the exception.
+The decode probes fire once per decode_dag_cbor() or Decoder.decode() call
+(not for the values decoded by extract(), decode_car() etc.). The encode
+probes fire once per top-level object encoded, whichever API it came from.
+*/
+#ifndef CBRRR_USDT
+#define CBRRR_USDT 1
+#endif
+
+/* sys/sdt.h isn't written with -std=c99 -Wpedantic -Werror in mind, so those
+   warnings are silenced for it, and for the probe sites that expand its
+   macros (which is where most of them would be reported) */
+#if defined(__GNUC__) || defined(__clang__)
+#define CBRRR_USDT_QUIET_BEGIN _Pragma("GCC diagnostic push") _Pragma("GCC diagnostic ignored \"-Wpedantic\"")
+#define CBRRR_USDT_QUIET_END _Pragma("GCC diagnostic pop")
+#else
+#define CBRRR_USDT_QUIET_BEGIN
+#define CBRRR_USDT_QUIET_END
+#endif
+
+#if CBRRR_USDT && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+CBRRR_USDT_QUIET_BEGIN
+#include <sys/sdt.h>
+CBRRR_USDT_QUIET_END
+#define CBRRR_HAVE_USDT 1
+#endif
+#endif
+#ifndef CBRRR_HAVE_USDT
+#define CBRRR_HAVE_USDT 0
+#endif
+
+#if CBRRR_HAVE_USDT
+#define CBRRR_PROBE0(name) do { CBRRR_USDT_QUIET_BEGIN DTRACE_PROBE(cbrrr, name); CBRRR_USDT_QUIET_END } while (0)
+#define CBRRR_PROBE1(name, a) do { CBRRR_USDT_QUIET_BEGIN DTRACE_PROBE1(cbrrr, name, a); CBRRR_USDT_QUIET_END } while (0)
+#define CBRRR_PROBE2(name, a, b) do { CBRRR_USDT_QUIET_BEGIN DTRACE_PROBE2(cbrrr, name, a, b); CBRRR_USDT_QUIET_END } while (0)
+#define CBRRR_PROBE3(name, a, b, c) do { CBRRR_USDT_QUIET_BEGIN DTRACE_PROBE3(cbrrr, name, a, b, c); CBRRR_USDT_QUIET_END } while (0)
+#define CBRRR_PROBE4(name, a, b, c, d) do { CBRRR_USDT_QUIET_BEGIN DTRACE_PROBE4(cbrrr, name, a, b, c, d); CBRRR_USDT_QUIET_END } while (0)
+#else
+#define CBRRR_PROBE0(name) ((void)0)
+#define CBRRR_PROBE1(name, a) ((void)0)
+#define CBRRR_PROBE2(name, a, b) ((void)0)
+#define CBRRR_PROBE3(name, a, b, c) ((void)0)
+#define CBRRR_PROBE4(name, a, b, c, d) ((void)0)
+#endif
+
+typedef struct {
+	PyObject *obj;
+	const uint8_t *str; // points into the input buffer
+	size_t len;
+} DCStagedKey;
+
 typedef struct {
 	DCMajorType type;
 	PyObject *value;
@@ -47,23 +490,171 @@ typedef struct {
 	// used to ensure map key ordering
 	const uint8_t *prev_key;
 	size_t prev_key_len;
+
+	// only used for maps, when decoding with a Schema
+	PyObject **slot; // where the finished object goes (within the parent)
+	DCStagedKey *staged_keys;
+	PyObject **staged_values;
+	Py_ssize_t staged_count;
+	uint64_t keyset_hash;
 } DCToken; // also used as the parser's stack frame
 
-// growable buffer for storing the encoded result
+typedef void (*CbrrrSha256BlocksFn)(uint32_t state[8], const uint8_t *data, size_t nblocks);
+
 typedef struct {
+	uint32_t state[8];
+	uint64_t length; // total number of bytes hashed
+	uint8_t block[64]; // partial block, waiting for more data
+	size_t block_len;
+	CbrrrSha256BlocksFn blocks; // the implementation in use (see cbrrr_sha256_select_impl)
+} CbrrrSha256;
+
+#define CBRRR_PRESIZE_THRESHOLD 0x40000 // see cbrrr_encode_to_bytes
+#define CBRRR_PRESIZE_MIN_AVG_WRITE 64 // bytes
+
+// growable buffer for storing the encoded result
+typedef struct CbrrrBuf {
 	uint8_t *buf;
 	size_t length;
 	size_t capacity;
+	PyObject *bytes; // if non-NULL, buf is the storage of this (not yet shared) bytes object, sized to the expected output
+	int fixed; // if set, buf belongs to the caller and can't be resized
+
+	/* If chunked is set, buf is a scratch area that gets flushed (and emptied)
+	   rather than growing. flush may be NULL, in which case the data is simply
+	   discarded whenever the buffer fills up. Otherwise, flushing can run
+	   arbitrary python code, so it only happens when the encoder reaches a
+	   safe point (in between items) after length passes flush_at, and the
+	   buffer grows in the meantime */
+	int chunked;
+	int (*flush)(struct CbrrrBuf *buf, const uint8_t *data, size_t len); // sets python exception on fail
+	size_t flushed; // total number of bytes flushed so far
+	size_t flush_at; // SIZE_MAX unless flush is set
+
+	CbrrrSha256 *hash; // if non-NULL, all data written gets hashed
+	size_t hashed; // how much of buf has been hashed so far
+
+	/* If set, cbrrr_buf_write_payload only counts the bytes (in flushed),
+	   without copying them anywhere. Only ever set along with chunked (with
+	   no flush callback), which takes care of everything else */
+	int count_only;
+
+	/* If limit is non-zero, the buffer won't grow beyond it unless the writes
+	   so far have been small on average (see cbrrr_encode_to_bytes). Hitting
+	   it fails with overflowed set, and no python exception */
+	size_t writes; // number of cbrrr_buf_write calls
+	size_t limit;
+	int overflowed;
+
+	/* Set for encoder passes that are an implementation detail of some other
+	   call (see cbrrr_encode_to_bytes), which takes care of the per-call
+	   stats and probes itself. max_depth gets reported back for its benefit */
+	int internal;
+	size_t max_depth;
 } CbrrrBuf;
 
+/* nb: frames hold strong references to their dict/list, since flushing the
+   output part-way through (see CbrrrBuf) can run arbitrary python code,
+   which might mutate the containers we're in the middle of */
 typedef struct {
 	PyObject *dict; // the dict, or NULL if this frame is a list
-	PyObject *list; // either the list, or the sorted map keys
+	PyObject *list; // either the list, or the sorted map keys (or NULL, if shape is set)
+	struct ShapeCacheEntry *shape; // if set, the dict's keys come from here instead
 	Py_ssize_t idx; // the current list index
+	Py_ssize_t len; // for lists, the length we wrote in the header
 } EncoderStackFrame;
 
 static const uint8_t B64_CHARSET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+/*
+Vectorised base64 kernels. These only ever handle whole blocks of known-good
+input, leaving the tail (and the reporting of any errors) to the scalar code,
+so the overall behaviour is exactly the same as the scalar-only version.
+
+AVX2 is selected at runtime, NEON is part of the aarch64 baseline.
+*/
+
+#if CBRRR_HAVE_X86_AVX2
+/* encodes 24-byte blocks of input into 32-byte blocks of output, returning
+   the number of input bytes consumed. It reads 4 bytes past the end of each
+   block, so it stops 4 bytes early */
+__attribute__((target("avx2")))
+static size_t
+cbrrr_b64_encode_avx2(uint8_t *out, const uint8_t *data, size_t data_len)
+{
+	const __m256i shuf = _mm256_setr_epi8(
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	const __m256i offsets = _mm256_setr_epi8(
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	size_t i = 0;
+
+	while (i + 28 <= data_len) {
+		__m256i in = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)&data[i])),
+			_mm_loadu_si128((const __m128i *)&data[i + 12]), 1);
+
+		// split each 3 bytes into 4 6-bit indices (one per output byte)
+		in = _mm256_shuffle_epi8(in, shuf);
+		__m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+		__m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+		__m256i idx = _mm256_or_si256(t0, t1);
+
+		// map the indices onto the charset, by adding an offset that depends on the range they're in
+		__m256i range = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+		range = _mm256_sub_epi8(range, _mm256_cmpgt_epi8(idx, _mm256_set1_epi8(25)));
+		idx = _mm256_add_epi8(idx, _mm256_shuffle_epi8(offsets, range));
+
+		_mm256_storeu_si256((__m256i *)out, idx);
+		out += 32;
+		i += 24;
+	}
+	return i;
+}
+
+#endif
+
+#if CBRRR_HAVE_NEON
+// the charset, split into the 4 tables that vqtbl4q_u8 wants
+static uint8x16x4_t
+cbrrr_neon_load_table(const uint8_t *table)
+{
+	uint8x16x4_t res;
+	res.val[0] = vld1q_u8(table);
+	res.val[1] = vld1q_u8(table + 16);
+	res.val[2] = vld1q_u8(table + 32);
+	res.val[3] = vld1q_u8(table + 48);
+	return res;
+}
+
+// encodes 48-byte blocks of input into 64-byte blocks of output, returning the number of input bytes consumed
+static size_t
+cbrrr_b64_encode_neon(uint8_t *out, const uint8_t *data, size_t data_len)
+{
+	const uint8x16x4_t charset = cbrrr_neon_load_table(B64_CHARSET);
+	const uint8x16_t mask_3f = vdupq_n_u8(0x3f);
+	size_t i = 0;
+
+	while (i + 48 <= data_len) {
+		uint8x16x3_t in = vld3q_u8(&data[i]); // de-interleaves the 3 bytes of each group
+		uint8x16x4_t res;
+		res.val[0] = vshrq_n_u8(in.val[0], 2);
+		res.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), mask_3f);
+		res.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), mask_3f);
+		res.val[3] = vandq_u8(in.val[2], mask_3f);
+		for (int j=0; j<4; j++) {
+			res.val[j] = vqtbl4q_u8(charset, res.val[j]);
+		}
+		vst4q_u8(out, res); // re-interleaves
+		out += 64;
+		i += 48;
+	}
+	return i;
+}
+
+#endif
+
 static PyObject*
 cbrrr_bytes_to_b64_string_nopad(const uint8_t *data, size_t data_len)
 {
@@ -77,6 +668,15 @@ cbrrr_bytes_to_b64_string_nopad(const uint8_t *data, size_t data_len)
 	uint8_t *resbuf = PyUnicode_DATA(res);
 	uint8_t a, b, c;
 	size_t data_i = 0;
+#if CBRRR_HAVE_X86_AVX2
+	if (CBRRR_CPU_HAS_AVX2) {
+		data_i = cbrrr_b64_encode_avx2(resbuf, data, data_len);
+		resbuf += data_i / 3 * 4;
+	}
+#elif CBRRR_HAVE_NEON
+	data_i = cbrrr_b64_encode_neon(resbuf, data, data_len);
+	resbuf += data_i / 3 * 4;
+#endif
 	while ( data_i + 2 < data_len) {
 		a = data[data_i++];
 		b = data[data_i++];
@@ -124,25 +724,29 @@ cbrrr_bytes_to_b32_multibase(const uint8_t *data, size_t data_len)
 	}
 	uint8_t *resbuf = PyUnicode_DATA(res);
 	*resbuf++ = 'b'; // b prefix indicates multibase base32
-	uint8_t a, b, c, d, e;
+	uint8_t a, b, c, d;
 	size_t data_i = 0;
 	while ( data_i + 4 < data_len) {
-		a = data[data_i++];
-		b = data[data_i++];
-		c = data[data_i++];
-		d = data[data_i++];
-		e = data[data_i++];
-		// 76543 21076 54321 07654 32107 65432 10765 43210
-		// aaaaa aaabb bbbbb bcccc ccccd ddddd ddeee eeeee
-		// 43210 43210 43210 43210 43210 43210 43210 43210
-		*resbuf++ = B32_CHARSET[(           (a >> 3)) & 0x1f];
-		*resbuf++ = B32_CHARSET[((a << 2) | (b >> 6)) & 0x1f];
-		*resbuf++ = B32_CHARSET[(           (b >> 1)) & 0x1f];
-		*resbuf++ = B32_CHARSET[((b << 4) | (c >> 4)) & 0x1f];
-		*resbuf++ = B32_CHARSET[((c << 1) | (d >> 7)) & 0x1f];
-		*resbuf++ = B32_CHARSET[(           (d >> 2)) & 0x1f];
-		*resbuf++ = B32_CHARSET[((d << 3) | (e >> 5)) & 0x1f];
-		*resbuf++ = B32_CHARSET[((e << 0)           ) & 0x1f];
+		/* SWAR: spread the 8 5-bit groups out into the 8 bytes of a uint64,
+		   then map them all onto the charset at once */
+		uint64_t v = (uint64_t)data[data_i] << 32 | (uint64_t)data[data_i+1] << 24
+		           | (uint64_t)data[data_i+2] << 16 | (uint64_t)data[data_i+3] << 8 | data[data_i+4];
+		data_i += 5;
+		v = ((v & 0x000000fffff00000ULL) << 12) | (v & 0x00000000000fffffULL);
+		v = ((v & 0x000ffc00000ffc00ULL) <<  6) | (v & 0x000003ff000003ffULL);
+		v = ((v & 0x03e003e003e003e0ULL) <<  3) | (v & 0x001f001f001f001fULL);
+		// 0-25 -> 'a'-'z', 26-31 -> '2'-'7'
+		uint64_t hi = ((v + 0x6666666666666666ULL) & 0x8080808080808080ULL) >> 7;
+		v = v + 0x6161616161616161ULL - hi * ('a' - '2' + 26);
+		/* the compiler should be smart about emitting an endian swap if necessary */
+		*resbuf++ = v >> 56;
+		*resbuf++ = v >> 48;
+		*resbuf++ = v >> 40;
+		*resbuf++ = v >> 32;
+		*resbuf++ = v >> 24;
+		*resbuf++ = v >> 16;
+		*resbuf++ = v >>  8;
+		*resbuf++ = v >>  0;
 	}
 	switch (data_len - data_i) // TODO: can this be simplified, with fallrthu perhaps?
 	{
@@ -194,50 +798,95 @@ cbrrr_bytes_to_b32_multibase(const uint8_t *data, size_t data_len)
 }
 
 
+/*
+Errors that can be detected without touching any python objects (and therefore
+without holding the GIL). The python-facing wrappers below turn these into
+exceptions.
+*/
+typedef enum {
+	CBRRR_ERR_NONE = 0,
+	CBRRR_ERR_TRUNCATED,
+	CBRRR_ERR_NOT_MINIMAL,
+	CBRRR_ERR_EXTRA_INFO,
+	CBRRR_ERR_FLOAT_EXTRA_INFO,
+	CBRRR_ERR_NAN,
+	CBRRR_ERR_INFINITY,
+	CBRRR_ERR_INDEX_OVERFLOW,
+	CBRRR_ERR_UNEXPECTED_TYPE,
+	CBRRR_ERR_TRUNCATED_ARRAY,
+	CBRRR_ERR_TRUNCATED_MAP,
+	CBRRR_ERR_TAG,
+	CBRRR_ERR_CID_PREFIX,
+	CBRRR_ERR_KEY_ORDER,
+	CBRRR_ERR_UNICODE,
+	CBRRR_ERR_NO_MEMORY,
+} CbrrrError;
+
+static const char *CBRRR_ERROR_MESSAGES[] = {
+	[CBRRR_ERR_NONE] = "no error",
+	[CBRRR_ERR_TRUNCATED] = "not enough bytes left in buffer",
+	[CBRRR_ERR_NOT_MINIMAL] = "integer not minimally encoded",
+	[CBRRR_ERR_EXTRA_INFO] = "invalid extra info",
+	[CBRRR_ERR_FLOAT_EXTRA_INFO] = "invalid extra info for float mtype",
+	[CBRRR_ERR_NAN] = "NaNs are not allowed",
+	[CBRRR_ERR_INFINITY] = "+/-Infinities are not allowed",
+	[CBRRR_ERR_INDEX_OVERFLOW] = "index overflow",
+	[CBRRR_ERR_UNEXPECTED_TYPE] = "unexpected type",
+	[CBRRR_ERR_TRUNCATED_ARRAY] = "not enough bytes left in buffer for an array that long",
+	[CBRRR_ERR_TRUNCATED_MAP] = "not enough bytes left in buffer for a map that long",
+	[CBRRR_ERR_TAG] = "invalid tag value",
+	[CBRRR_ERR_CID_PREFIX] = "invalid CID (nonzero start byte)",
+	[CBRRR_ERR_KEY_ORDER] = "non-canonical map key ordering",
+	[CBRRR_ERR_UNICODE] = "invalid UTF-8",
+	[CBRRR_ERR_NO_MEMORY] = "out of memory",
+};
+
+
 // return value is length of input that was parsed, or -1 on error.
-// result is stored in `value`.
+// result is stored in `value`, error code (if any) is stored in `err`.
+// nb: this does not need the GIL
 static size_t
-cbrrr_parse_minimal_varint(const uint8_t *buf, size_t len, uint64_t *value)
+cbrrr_parse_minimal_varint_nogil(const uint8_t *buf, size_t len, uint64_t *value, CbrrrError *err)
 {
 	switch (*value)
 	{
 	case 24:
 		if (len < 1) {
-			PyErr_SetString(PY_CBRRR_DECODE_ERROR, "not enough bytes left in buffer");
+			*err = CBRRR_ERR_TRUNCATED;
 			return -1;
 		}
 		*value = buf[0];
 		if (*value < 24) {
-			PyErr_SetString(PY_CBRRR_DECODE_ERROR, "integer not minimally encoded");
+			*err = CBRRR_ERR_NOT_MINIMAL;
 			return -1;
 		}
 		return 1;
 	case 25:
 		if (len < 2) {
-			PyErr_SetString(PY_CBRRR_DECODE_ERROR, "not enough bytes left in buffer");
+			*err = CBRRR_ERR_TRUNCATED;
 			return -1;
 		}
 		*value = buf[0] << 8 | buf[1] << 0;
 		if (*value < 0x100) {
-			PyErr_SetString(PY_CBRRR_DECODE_ERROR, "integer not minimally encoded");
+			*err = CBRRR_ERR_NOT_MINIMAL;
 			return -1;
 		}
 		return 2;
 	case 26:
 		if (len < 4) {
-			PyErr_SetString(PY_CBRRR_DECODE_ERROR, "not enough bytes left in buffer");
+			*err = CBRRR_ERR_TRUNCATED;
 			return -1;
 		}
 		*value = (uint64_t)buf[0] << 24 | (uint64_t)buf[1] << 16
 		       | (uint64_t)buf[2] << 8  | (uint64_t)buf[3] << 0;
 		if (*value < 0x10000) {
-			PyErr_SetString(PY_CBRRR_DECODE_ERROR, "integer not minimally encoded");
+			*err = CBRRR_ERR_NOT_MINIMAL;
 			return -1;
 		}
 		return 4;
 	case 27:
 		if (len < 8) {
-			PyErr_SetString(PY_CBRRR_DECODE_ERROR, "not enough bytes left in buffer");
+			*err = CBRRR_ERR_TRUNCATED;
 			return -1;
 		}
 		*value = (uint64_t)buf[0] << 56 | (uint64_t)buf[1] << 48
@@ -245,51 +894,67 @@ cbrrr_parse_minimal_varint(const uint8_t *buf, size_t len, uint64_t *value)
 		       | (uint64_t)buf[4] << 24 | (uint64_t)buf[5] << 16
 		       | (uint64_t)buf[6] << 8  | (uint64_t)buf[7] << 0;
 		if (*value < 0x100000000L) {
-			PyErr_SetString(PY_CBRRR_DECODE_ERROR, "integer not minimally encoded");
+			*err = CBRRR_ERR_NOT_MINIMAL;
 			return -1;
 		}
 		return 8;
 	default:
 		if (*value > 27) {
-			PyErr_Format(PY_CBRRR_DECODE_ERROR, "invalid extra info (%lu)", *value);
+			*err = CBRRR_ERR_EXTRA_INFO;
 			return -1;
 		}
 		return 0;
 	}
 }
 
+// as above, but sets a python exception on failure
+static size_t
+cbrrr_parse_minimal_varint(CbrrrState *st, const uint8_t *buf, size_t len, uint64_t *value)
+{
+	CbrrrError err = CBRRR_ERR_NONE;
+	size_t res = cbrrr_parse_minimal_varint_nogil(buf, len, value, &err);
+	if (res == (size_t)-1) {
+		if (err == CBRRR_ERR_EXTRA_INFO) {
+			PyErr_Format(st->decode_error, "invalid extra info (%lu)", *value);
+		} else {
+			PyErr_SetString(st->decode_error, CBRRR_ERROR_MESSAGES[err]);
+		}
+	}
+	return res;
+}
+
 // special case, used for parsing map keys and CIDs
+// nb: this does not need the GIL
 static size_t
-cbrrr_parse_raw_string(const uint8_t *buf, size_t len, DCMajorType type, const uint8_t **str, size_t *str_len)
+cbrrr_parse_raw_string_nogil(const uint8_t *buf, size_t len, DCMajorType type, const uint8_t **str, size_t *str_len, CbrrrError *err)
 {
 	size_t idx = 0, res;
 	uint64_t actual_str_len;
 
 	if (len < idx + 1) {
-		PyErr_SetString(PY_CBRRR_DECODE_ERROR, "not enough bytes left in buffer");
+		*err = CBRRR_ERR_TRUNCATED;
 		return -1;
 	}
 	actual_str_len = buf[idx++];
 	if ((actual_str_len >> 5) != type) {
-		PyErr_Format(PY_CBRRR_DECODE_ERROR, "unexpected type (%lu), expected %lu", (actual_str_len >> 5), type);
+		*err = CBRRR_ERR_UNEXPECTED_TYPE;
 		return -1;
 	}
 	actual_str_len &= 0x1f;
-	res = cbrrr_parse_minimal_varint(&buf[idx], len-idx, &actual_str_len);
+	res = cbrrr_parse_minimal_varint_nogil(&buf[idx], len-idx, &actual_str_len, err);
 	if (res == (size_t)-1) {
-		// python error has been set by cbrrr_parse_minimal_varint
 		return -1;
 	}
 
 	// should only be plausible on 32-bit platforms
 	if (idx > SIZE_MAX - res) {
-		PyErr_SetString(PY_CBRRR_DECODE_ERROR, "index overflow");
+		*err = CBRRR_ERR_INDEX_OVERFLOW;
 		return -1;
 	}
 	idx += res;
 
 	if (actual_str_len > (uint64_t)len - idx) { // should also handle cases where actual_str_len is > SIZE_MAX
-		PyErr_SetString(PY_CBRRR_DECODE_ERROR, "not enough bytes left in buffer");
+		*err = CBRRR_ERR_TRUNCATED;
 		return -1;
 	}
 	*str = &buf[idx];
@@ -297,41 +962,203 @@ cbrrr_parse_raw_string(const uint8_t *buf, size_t len, DCMajorType type, const u
 	return idx + actual_str_len;
 }
 
-// returns number of bytes parsed, -1 on failure
+// as above, but sets a python exception on failure
+static size_t
+cbrrr_parse_raw_string(CbrrrState *st, const uint8_t *buf, size_t len, DCMajorType type, const uint8_t **str, size_t *str_len)
+{
+	CbrrrError err = CBRRR_ERR_NONE;
+	size_t res = cbrrr_parse_raw_string_nogil(buf, len, type, str, str_len, &err);
+	if (res == (size_t)-1) {
+		if (err == CBRRR_ERR_UNEXPECTED_TYPE) {
+			PyErr_Format(st->decode_error, "unexpected type (%lu), expected %lu", (uint64_t)(buf[0] >> 5), (uint64_t)type);
+		} else if (err == CBRRR_ERR_EXTRA_INFO) {
+			PyErr_Format(st->decode_error, "invalid extra info (%lu)", (uint64_t)(buf[0] & 0x1f));
+		} else {
+			PyErr_SetString(st->decode_error, CBRRR_ERROR_MESSAGES[err]);
+		}
+	}
+	return res;
+}
+
+/*
+Returns the length of the run of ASCII bytes at the start of str (i.e. len, if
+it's all ASCII). Text strings are overwhelmingly ASCII in practice, so this
+is on the hot path for decoding.
+*/
+static size_t
+cbrrr_ascii_prefix_len(const uint8_t *str, size_t len)
+{
+	size_t i = 0;
+#if CBRRR_HAVE_SSE2
+	while (i + 32 <= len) {
+		__m128i a = _mm_loadu_si128((const __m128i *)&str[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&str[i + 16]);
+		if (_mm_movemask_epi8(_mm_or_si128(a, b))) {
+			break;
+		}
+		i += 32;
+	}
+	while (i + 16 <= len) {
+		int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)&str[i]));
+		if (mask) {
+			return i + cbrrr_ctz((uint32_t)mask);
+		}
+		i += 16;
+	}
+#elif CBRRR_HAVE_NEON
+	while (i + 16 <= len) {
+		if (vmaxvq_u8(vld1q_u8(&str[i])) & 0x80) {
+			break;
+		}
+		i += 16;
+	}
+#endif
+	while (i + 8 <= len) {
+		uint64_t chunk;
+		memcpy(&chunk, &str[i], sizeof(chunk));
+		if (chunk & 0x8080808080808080ULL) {
+			break;
+		}
+		i += 8;
+	}
+	while (i < len && str[i] < 0x80) {
+		i++;
+	}
+	return i;
+}
+
+// builds a str from bytes that are already known to be pure ASCII
+static PyObject *
+cbrrr_unicode_from_ascii(const uint8_t *str, size_t len)
+{
+	PyObject *res = PyUnicode_New(len, 127);
+	if (res == NULL) {
+		return NULL;
+	}
+	memcpy(PyUnicode_DATA(res), str, len);
+	return res;
+}
+
+/*
+Equivalent to PyUnicode_FromStringAndSize, but pure-ASCII strings (by far the
+most common case) skip CPython's decoder and get built with a single memcpy.
+*/
+static PyObject *
+cbrrr_unicode_from_utf8(const uint8_t *str, size_t len)
+{
+	if (cbrrr_ascii_prefix_len(str, len) != len) {
+		return PyUnicode_DecodeUTF8((const char *)str, len, NULL);
+	}
+	return cbrrr_unicode_from_ascii(str, len);
+}
+
+/*
+Strict UTF-8 validation, matching the rules that PyUnicode_DecodeUTF8 applies
+(no overlong encodings, no surrogates, nothing above U+10FFFF).
+Returns 0 if valid, -1 otherwise. Doesn't need the GIL.
+*/
+static int
+cbrrr_validate_utf8(const uint8_t *str, size_t len)
+{
+	size_t i = 0;
+	uint8_t c, c1, c2, c3;
+
+	while (i < len) {
+		i += cbrrr_ascii_prefix_len(&str[i], len - i);
+		if (i >= len) {
+			break;
+		}
+
+		c = str[i];
+		if (c < 0x80) {
+			i += 1;
+			continue;
+		}
+		if (c < 0xc2) { // stray continuation byte, or overlong 2-byte sequence
+			return -1;
+		}
+		if (c < 0xe0) {
+			if (len - i < 2 || (str[i+1] & 0xc0) != 0x80) {
+				return -1;
+			}
+			i += 2;
+			continue;
+		}
+		if (c < 0xf0) {
+			if (len - i < 3) {
+				return -1;
+			}
+			c1 = str[i+1];
+			c2 = str[i+2];
+			if ((c1 & 0xc0) != 0x80 || (c2 & 0xc0) != 0x80) {
+				return -1;
+			}
+			if (c == 0xe0 && c1 < 0xa0) { // overlong
+				return -1;
+			}
+			if (c == 0xed && c1 >= 0xa0) { // surrogate
+				return -1;
+			}
+			i += 3;
+			continue;
+		}
+		if (c < 0xf5) {
+			if (len - i < 4) {
+				return -1;
+			}
+			c1 = str[i+1];
+			c2 = str[i+2];
+			c3 = str[i+3];
+			if ((c1 & 0xc0) != 0x80 || (c2 & 0xc0) != 0x80 || (c3 & 0xc0) != 0x80) {
+				return -1;
+			}
+			if (c == 0xf0 && c1 < 0x90) { // overlong
+				return -1;
+			}
+			if (c == 0xf4 && c1 >= 0x90) { // > U+10FFFF
+				return -1;
+			}
+			i += 4;
+			continue;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/*
+The non-allocating counterpart to cbrrr_parse_token. Validates a single token,
+returning its length (not including any array/map members), or -1 on error.
+Except for floats/simple values, `info` is set to the token's argument: the
+value of an int, the length of a string, the member count of an array or
+map, or the length of a CID (including its leading 0 byte).
+Doesn't need the GIL.
+*/
 static size_t
-cbrrr_parse_token(const uint8_t *buf, size_t len, DCToken *token, PyObject *cid_ctor, int atjson_mode)
+cbrrr_validate_token(const uint8_t *buf, size_t len, DCMajorType *type, uint64_t *info_out, CbrrrError *err)
 {
 	uint64_t info;
 	size_t idx = 0, res;
-	PyObject *tmp;
 
 	if (len < idx + 1) {
-		PyErr_SetString(PY_CBRRR_DECODE_ERROR, "not enough bytes left in buffer");
+		*err = CBRRR_ERR_TRUNCATED;
 		return -1;
 	}
 
-	token->type = buf[idx] >> 5;
+	*type = buf[idx] >> 5;
 	info = buf[idx] & 0x1f;
 	idx += 1;
 
-	if (token->type == DCMT_FLOAT) { // the special case
+	if (*type == DCMT_FLOAT) { // the special case
 		switch (info)
 		{
 		case 20:
-			token->value = Py_False;
-			Py_INCREF(token->value);
-			return idx;
 		case 21:
-			token->value = Py_True;
-			Py_INCREF(token->value);
-			return idx;
 		case 22:
-			token->value = Py_None;
-			Py_INCREF(token->value);
 			return idx;
 		case 27:
 			if (len < idx + sizeof(double)) {
-				PyErr_SetString(PY_CBRRR_DECODE_ERROR, "not enough bytes left in buffer");
+				*err = CBRRR_ERR_TRUNCATED;
 				return -1;
 			}
 			uint64_t intval = \
@@ -339,1145 +1166,8632 @@ cbrrr_parse_token(const uint8_t *buf, size_t len, DCToken *token, PyObject *cid_
 				| (uint64_t)buf[idx+2] << 40 | (uint64_t)buf[idx+3] << 32
 				| (uint64_t)buf[idx+4] << 24 | (uint64_t)buf[idx+5] << 16
 				| (uint64_t)buf[idx+6] << 8  | (uint64_t)buf[idx+7] << 0;
-			double doubleval = ((union {uint64_t num; double dub;}){.num=intval}).dub; // TODO: rewrite lol
+			double doubleval = ((union {uint64_t num; double dub;}){.num=intval}).dub;
 			if (isnan(doubleval)) {
-				PyErr_SetString(PY_CBRRR_DECODE_ERROR, "NaNs are not allowed");
+				*err = CBRRR_ERR_NAN;
 				return -1;
 			}
 			if (isinf(doubleval)) {
-				PyErr_SetString(PY_CBRRR_DECODE_ERROR, "+/-Infinities are not allowed");
+				*err = CBRRR_ERR_INFINITY;
 				return -1;
 			}
-			token->value = PyFloat_FromDouble(doubleval);
 			return idx + sizeof(double);
 		default:
-			PyErr_Format(PY_CBRRR_DECODE_ERROR, "invalid extra info for float mtype (%lu)", info);
+			*err = CBRRR_ERR_FLOAT_EXTRA_INFO;
 			return -1;
 		}
 	}
 
-	res = cbrrr_parse_minimal_varint(&buf[idx], len-idx, &info);
+	res = cbrrr_parse_minimal_varint_nogil(&buf[idx], len-idx, &info, err);
 	if (res == (size_t)-1) {
-		// python error set by cbrrr_parse_minimal_varint
 		return -1;
 	}
-
-	// should only be plausible on 32-bit platforms
 	if (idx > SIZE_MAX - res) {
-		PyErr_SetString(PY_CBRRR_DECODE_ERROR, "index overflow");
+		*err = CBRRR_ERR_INDEX_OVERFLOW;
 		return -1;
 	}
 	idx += res;
+	*info_out = info;
 
-	// at this point, `info` represents its actual value, with meaning depending on the major type
-
-	switch (token->type)
+	switch (*type)
 	{
 	case DCMT_UNSIGNED_INT:
-		token->value = PyLong_FromUnsignedLongLong(info);
-		if (token->value == NULL) {
-			return -1;
-		}
-		return idx;
 	case DCMT_NEGATIVE_INT:
-		tmp = PyLong_FromUnsignedLongLong(info);
-		if (tmp == NULL) {
-			return -1;
-		}
-		token->value = PyNumber_Invert(tmp);
-		Py_DECREF(tmp);
-		if (token->value == NULL) {
-			return -1;
-		}
 		return idx;
 	case DCMT_BYTE_STRING:
-		if (info > len - idx) {
-			PyErr_SetString(PY_CBRRR_DECODE_ERROR, "not enough bytes left in buffer");
+		if (info > (uint64_t)len - idx) {
+			*err = CBRRR_ERR_TRUNCATED;
 			return -1;
 		}
-		if (atjson_mode) { /* wrap in {"$bytes", "b64..."} */
-			tmp = cbrrr_bytes_to_b64_string_nopad((uint8_t*)&buf[idx], info);
-			if (tmp == NULL) {
-				return -1;
-			}
-			token->value = PyDict_New();
-			if (token->value == NULL) {
-				Py_DECREF(tmp);
-				return -1;
-			}
-			if (PyDict_SetItem(token->value, PY_STRING_BYTES, tmp) != 0) {
-				Py_DECREF(tmp);
-				return -1;
-			}
-			Py_DECREF(tmp);
-		} else {
-			token->value = PyBytes_FromStringAndSize((const char*)&buf[idx], info);
-			if (token->value == NULL) {
-				return -1;
-			}
-		}
 		return idx + info;
 	case DCMT_TEXT_STRING:
 		if (info > (uint64_t)len - idx) {
-			PyErr_SetString(PY_CBRRR_DECODE_ERROR, "not enough bytes left in buffer");
+			*err = CBRRR_ERR_TRUNCATED;
 			return -1;
 		}
-		token->value = PyUnicode_FromStringAndSize((const char *)&buf[idx], info);
-		if (token->value == NULL) { // invalid unicode
+		if (cbrrr_validate_utf8(&buf[idx], info) < 0) {
+			*err = CBRRR_ERR_UNICODE;
 			return -1;
 		}
 		return idx + info;
 	case DCMT_ARRAY:
 		if (info > (uint64_t)len - idx) {
-			PyErr_SetString(PY_CBRRR_DECODE_ERROR, "not enough bytes left in buffer for an array that long");
+			*err = CBRRR_ERR_TRUNCATED_ARRAY;
 			return -1;
 		}
-		token->value = PyList_New(info);
-		if (token->value == NULL) { // probably tried to allocate a too-big list
-			return -1;
-		}
-		token->count = info;
 		return idx;
 	case DCMT_MAP:
 		if (info > (uint64_t)len - idx) {
-			PyErr_SetString(PY_CBRRR_DECODE_ERROR, "not enough bytes left in buffer for a map that long");
-			return -1;
-		}
-		token->value = PyDict_New();
-		if (token->value == NULL) { // something bad happened I guess
+			*err = CBRRR_ERR_TRUNCATED_MAP;
 			return -1;
 		}
-		token->count = info;
-		token->prev_key = NULL;
-		token->prev_key_len = 0;
 		return idx;
 	case DCMT_TAG:
 		if (info != 42) { // only tag type 42=CID is supported
-			PyErr_Format(PY_CBRRR_DECODE_ERROR, "invalid tag value (%lu)", info);
+			*err = CBRRR_ERR_TAG;
 			return -1;
 		}
-		// parse a byte string
 		const uint8_t *str;
 		size_t str_len;
-		res = cbrrr_parse_raw_string(&buf[idx], len-idx, DCMT_BYTE_STRING, &str, &str_len);
+		res = cbrrr_parse_raw_string_nogil(&buf[idx], len-idx, DCMT_BYTE_STRING, &str, &str_len, err);
 		if (res == (size_t)-1) {
-			// python error set by cbrrr_parse_raw_string
 			return -1;
 		}
 		if (str_len == 0 || str[0] != 0) {
-			PyErr_SetString(PY_CBRRR_DECODE_ERROR, "invalid CID (nonzero start byte)");
+			*err = CBRRR_ERR_CID_PREFIX;
 			return -1;
 		}
-		if (atjson_mode) { /* wrap in {"$link", "b32..."} */
-			tmp = cbrrr_bytes_to_b32_multibase(str + 1, str_len - 1); // slice off the leading 0
-			if (tmp == NULL) {
-				return -1;
-			}
-			token->value = PyDict_New();
-			if (token->value == NULL) {
-				Py_DECREF(tmp);
-				return -1;
-			}
-			if (PyDict_SetItem(token->value, PY_STRING_LINK, tmp) != 0) {
-				Py_DECREF(tmp);
-				return -1;
-			}
-			Py_DECREF(tmp);
-		} else {
-			tmp = PyBytes_FromStringAndSize((const char*)str + 1, str_len - 1); // slice off the leading 0
-			if (tmp == NULL) {
-				return -1;
-			}
-			token->value = PyObject_CallFunctionObjArgs(cid_ctor, tmp, NULL);
-			Py_DECREF(tmp);
-			if (token->value == NULL) {
-				return -1; // exception in cid_ctor
-			}
+		*info_out = str_len;
+		return idx + res;
+	default: // unreachable
+		*err = CBRRR_ERR_UNEXPECTED_TYPE;
+		return -1;
+	}
+}
+
+typedef struct {
+	uint64_t remaining; // number of array items/map entries left at this level
+	int is_map;
+
+	// used to ensure map key ordering
+	const uint8_t *prev_key;
+	size_t prev_key_len;
+} ValidatorFrame;
+
+/*
+Parses and validates a map key, checking that it sorts after *prev_key (unless
+that's NULL, i.e. it's the first key), and then updating *prev_key to point
+to it. Returns the number of bytes consumed, or -1 on error.
+*/
+static size_t
+cbrrr_validate_map_key(const uint8_t *buf, size_t len, const uint8_t **prev_key, size_t *prev_key_len, CbrrrError *err)
+{
+	const uint8_t *key;
+	size_t key_len;
+	size_t res = cbrrr_parse_raw_string_nogil(buf, len, DCMT_TEXT_STRING, &key, &key_len, err);
+	if (res == (size_t)-1) {
+		return -1;
+	}
+	if (cbrrr_validate_utf8(key, key_len) < 0) {
+		*err = CBRRR_ERR_UNICODE;
+		return -1;
+	}
+	if (*prev_key != NULL) { // don't check the first key
+		if (key_len < *prev_key_len || (
+			key_len == *prev_key_len
+			&& memcmp(key, *prev_key, key_len) <= 0
+		)) {
+			*err = CBRRR_ERR_KEY_ORDER;
+			return -1;
 		}
+	}
+	*prev_key = key;
+	*prev_key_len = key_len;
+	return res;
+}
 
-		return idx + res;
+// the hash used by the map key cache
+static uint32_t
+cbrrr_key_hash(const uint8_t *str, size_t len)
+{
+	uint32_t hash = 0x811c9dc5; // FNV-1a
+	for (size_t i=0; i<len; i++) {
+		hash = (hash ^ str[i]) * 0x01000193;
+	}
+	return hash;
+}
+
+/*
+A tape is a flat, pre-order record of every token in an object (including map
+keys), written by cbrrr_validate_object. It has everything needed to build
+the python objects later on, without re-parsing or re-validating anything, so
+the expensive part of decoding can happen without the GIL (see decode_many).
+*/
+
+typedef enum {
+	TAPE_UNSIGNED_INT = DCMT_UNSIGNED_INT,
+	TAPE_NEGATIVE_INT = DCMT_NEGATIVE_INT,
+	TAPE_BYTE_STRING = DCMT_BYTE_STRING,
+	TAPE_TEXT_STRING = DCMT_TEXT_STRING,
+	TAPE_ARRAY = DCMT_ARRAY,
+	TAPE_MAP = DCMT_MAP,
+	TAPE_CID = DCMT_TAG,
+	TAPE_FLOAT = DCMT_FLOAT,
+	TAPE_FALSE,
+	TAPE_TRUE,
+	TAPE_NULL,
+	TAPE_ASCII_STRING, // a text string that's known to be pure ASCII
+} CbrrrTapeKind;
+
+typedef struct {
+	uint64_t value; // int value, string/CID length, array/map count, or the bits of a double
+	size_t offset; // where string/CID bytes start (CIDs include the leading 0)
+	CbrrrTapeKind kind;
+	uint32_t key_hash; // for map keys, the cbrrr_key_hash of the key (if it's short enough to be cached)
+} CbrrrTapeEntry;
+
+typedef struct {
+	CbrrrTapeEntry *entries;
+	size_t length;
+	size_t capacity;
+} CbrrrTape;
+
+static int
+cbrrr_tape_push(CbrrrTape *tape, CbrrrTapeKind kind, uint64_t value, size_t offset)
+{
+	if (tape->length == tape->capacity) {
+		size_t new_capacity = tape->capacity ? tape->capacity * 2 : 64;
+		CbrrrTapeEntry *new_entries = realloc(tape->entries, new_capacity * sizeof(*new_entries));
+		if (new_entries == NULL) {
+			return -1;
+		}
+		tape->entries = new_entries;
+		tape->capacity = new_capacity;
+	}
+	CbrrrTapeEntry *entry = &tape->entries[tape->length++];
+	entry->kind = kind;
+	entry->value = value;
+	entry->offset = offset;
+	entry->key_hash = 0;
+	return 0;
+}
+
+// records a token that cbrrr_validate_token has already accepted, given its start and length
+static int
+cbrrr_tape_push_token(CbrrrTape *tape, const uint8_t *buf, size_t start, size_t token_len, DCMajorType type, uint64_t info)
+{
+	switch (type)
+	{
+	case DCMT_FLOAT:
+		switch (buf[start] & 0x1f)
+		{
+		case 20:
+			return cbrrr_tape_push(tape, TAPE_FALSE, 0, 0);
+		case 21:
+			return cbrrr_tape_push(tape, TAPE_TRUE, 0, 0);
+		case 22:
+			return cbrrr_tape_push(tape, TAPE_NULL, 0, 0);
+		default: { // 27, a double
+			const uint8_t *p = &buf[start + 1];
+			uint64_t bits = \
+				  (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48
+				| (uint64_t)p[2] << 40 | (uint64_t)p[3] << 32
+				| (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16
+				| (uint64_t)p[6] << 8  | (uint64_t)p[7] << 0;
+			return cbrrr_tape_push(tape, TAPE_FLOAT, bits, 0);
+		}
+		}
+	case DCMT_TEXT_STRING: // saves rescanning the string when we build it
+		if (cbrrr_ascii_prefix_len(&buf[start + token_len - info], info) == info) {
+			return cbrrr_tape_push(tape, TAPE_ASCII_STRING, info, start + token_len - info);
+		}
+		/* fallthrough */
+	case DCMT_BYTE_STRING:
+	case DCMT_TAG: // the string (or CID) bytes are always at the end of the token
+		return cbrrr_tape_push(tape, (CbrrrTapeKind)type, info, start + token_len - info);
 	default:
-		PyErr_Format(PyExc_AssertionError, "you reached unreachable code??? (type=%lu)", token->type);
-		return -1; // unreachable?
+		return cbrrr_tape_push(tape, (CbrrrTapeKind)type, info, 0);
 	}
 }
 
+/*
+The non-allocating counterpart to cbrrr_parse_object. Applies all the same
+strictness rules, but doesn't build any python objects.
+Returns the length of the object, or -1 on error (in which case `err` and
+`err_offset` describe what went wrong, and where). Doesn't need the GIL.
+If `tape` is non-NULL, each token gets appended to it.
+*/
 static size_t
-cbrrr_parse_object(const uint8_t *buf, size_t len, PyObject **value, PyObject *cid_ctor, int atjson_mode)
+cbrrr_validate_object(const uint8_t *buf, size_t len, CbrrrError *err, size_t *err_offset, CbrrrTape *tape)
 {
-	/* The stack will get realloc'd whenever we run out (and freed on return) */
-	/* stack[sp+1] is used like a local variable to hold all parsed tokens */
 	size_t stack_len = 16;
-	DCToken *parse_stack = malloc(stack_len * sizeof(*parse_stack));
+	ValidatorFrame *stack = malloc(stack_len * sizeof(*stack));
 
-	if (parse_stack == NULL) {
-		PyErr_SetString(PyExc_MemoryError, "malloc failed");
+	*err_offset = 0;
+	if (stack == NULL) {
+		*err = CBRRR_ERR_NO_MEMORY;
 		return -1;
 	}
 
-	/* pretend that we're parsing an array of length 1
-	   (avoids needing to special-case root-level parsing) */
-	parse_stack[0].type = DCMT_ARRAY;
-	parse_stack[0].value = PyList_New(1);
-	parse_stack[0].count = 1;
+	/* as in cbrrr_parse_object, pretend that we're parsing an array of length 1 */
+	stack[0].remaining = 1;
+	stack[0].is_map = 0;
 
 	size_t sp = 0;
-	size_t idx = 0;
-
-	/* parser stack machine thing... if it looks confusing it's because it is */
+	size_t idx = 0, res;
+	int ok = 0;
 
 	for (;;) {
-		if (parse_stack[sp].count == 0) { /* If we're done on this level of the stack */
-			if (sp == 0) { /* no more stack left, parsing is complete! */
-				/* pull the parsed result out of the dummy list of length 1 we created at the start */
-				*value = PyList_GET_ITEM(parse_stack[0].value, 0);
-				Py_XINCREF(*value); // nb: this would be cleaner with Py_XNewRef, available in py3.10+. You could probably drop the X too, I can't think why PyList_GET_ITEM would fail.
-				break;
+		if (stack[sp].remaining == 0) {
+			if (sp == 0) {
+				ok = 1;
+				break; // done!
 			}
-			sp -= 1; /* "return" to the previous stack frame */
+			sp -= 1;
 			continue;
 		}
+		stack[sp].remaining -= 1;
 
-		if (parse_stack[sp].type == DCMT_ARRAY) { /* if we're currently parsing an array */
-			size_t res = cbrrr_parse_token(&buf[idx], len-idx, &parse_stack[sp+1], cid_ctor, atjson_mode);
-			if (res == (size_t)-1) {
-				idx = -1;
-				break;
-			}
-			//printf("DEBUG: token type %u, start=%lu len=%lu\n", parse_stack[sp+1].type, idx, res);
-			idx += res;
-			// move ownership of sp+1 into sp
-			PyList_SET_ITEM(
-				parse_stack[sp].value,
-				PyList_GET_SIZE(parse_stack[sp].value) - parse_stack[sp].count,
-				parse_stack[sp+1].value
-			);
-			parse_stack[sp].count -= 1;
-		} else { /* if we're currently parsing a map */
-			const uint8_t *str;
-			size_t str_len;
-			size_t res = cbrrr_parse_raw_string(&buf[idx], len-idx, DCMT_TEXT_STRING, &str, &str_len);
+		if (stack[sp].is_map) {
+			res = cbrrr_validate_map_key(&buf[idx], len-idx, &stack[sp].prev_key, &stack[sp].prev_key_len, err);
 			if (res == (size_t)-1) {
-				// panik
-				idx = -1;
-				break;
-			}
-			idx += res;
-			// check unicode validity before parsing next token to avoid leaking a reference when we bail out
-			// TODO:PERF: fast-path(s) for common/short keys, via interning?
-			PyObject *key = PyUnicode_FromStringAndSize((const char*)str, str_len);
-			if (key == NULL) { // unicode error
-				idx = -1;
 				break;
 			}
-			if (parse_stack[sp].prev_key != NULL) { // don't check the first key
-				if (str_len < parse_stack[sp].prev_key_len) { // key order violation
-					// panik
-					PyObject *tmp = PyUnicode_FromStringAndSize((const char*)parse_stack[sp].prev_key, parse_stack[sp].prev_key_len);
-					PyErr_Format(PY_CBRRR_DECODE_ERROR, "non-canonical map key ordering (len(%R) < len(%R))", key, tmp);
-					Py_DECREF(tmp);
-					idx = -1;
+			if (tape != NULL) {
+				if (cbrrr_tape_push(tape, TAPE_TEXT_STRING, stack[sp].prev_key_len, stack[sp].prev_key - buf) < 0) {
+					*err = CBRRR_ERR_NO_MEMORY;
 					break;
-				} else if (str_len == parse_stack[sp].prev_key_len) { // ditto
-					if (memcmp(str, parse_stack[sp].prev_key, str_len) <= 0) {
-						PyObject *tmp = PyUnicode_FromStringAndSize((const char*)parse_stack[sp].prev_key, parse_stack[sp].prev_key_len);
-						PyErr_Format(PY_CBRRR_DECODE_ERROR, "non-canonical map key ordering (%R <= %R)", key, tmp);
-						Py_DECREF(tmp);
-						idx = -1;
-						break;
-					}
+				}
+				if (stack[sp].prev_key_len <= CBRRR_KEY_CACHE_MAX_KEY_LEN) {
+					tape->entries[tape->length - 1].key_hash = cbrrr_key_hash(stack[sp].prev_key, stack[sp].prev_key_len);
 				}
 			}
-			parse_stack[sp].prev_key = str;
-			parse_stack[sp].prev_key_len = str_len;
-
-			res = cbrrr_parse_token(&buf[idx], len-idx, &parse_stack[sp+1], cid_ctor, atjson_mode);
-			if (res == (size_t)-1) {
-				idx = -1;
-				break;
-			}
-			//printf("DEBUG: (map value) token type %u, start=%lu len=%lu\n", parse_stack[sp+1].type, idx, res);
 			idx += res;
+		}
 
-			// move ownership of sp+1 into sp
-			if(PyDict_SetItem(parse_stack[sp].value, key, parse_stack[sp+1].value) < 0) {
-				idx = -1;
-				break;
-			}
-			Py_DECREF(key);
-			Py_DECREF(parse_stack[sp+1].value);
-			parse_stack[sp].count -= 1;
+		DCMajorType type;
+		uint64_t count;
+		res = cbrrr_validate_token(&buf[idx], len-idx, &type, &count, err);
+		if (res == (size_t)-1) {
+			break;
 		}
+		if (tape != NULL && cbrrr_tape_push_token(tape, buf, idx, res, type, count) < 0) {
+			*err = CBRRR_ERR_NO_MEMORY;
+			break;
+		}
+		idx += res;
 
-		/* If the token we just parsed was the start of an array or map,
-		   push a new stack frame, growing the stack if necessary */
-		if ((parse_stack[sp+1].type == DCMT_ARRAY) || (parse_stack[sp+1].type == DCMT_MAP)) {
+		if (type == DCMT_ARRAY || type == DCMT_MAP) {
 			sp += 1;
-			if ((sp + 1) >= stack_len) {
-				stack_len *= 2; // TODO:PERF: smaller increments?
-				DCToken* new_stack = realloc(parse_stack, stack_len * sizeof(*parse_stack));
+			if (sp >= stack_len) {
+				stack_len *= 2;
+				ValidatorFrame *new_stack = realloc(stack, stack_len * sizeof(*stack));
 				if (new_stack == NULL) {
-					PyErr_SetString(PyExc_MemoryError, "realloc failed");
-					idx = -1;
+					*err = CBRRR_ERR_NO_MEMORY;
 					break;
 				}
-				parse_stack = new_stack;
+				stack = new_stack;
 			}
+			stack[sp].remaining = count;
+			stack[sp].is_map = type == DCMT_MAP;
+			stack[sp].prev_key = NULL;
+			stack[sp].prev_key_len = 0;
 		}
 	}
 
-	// under non-error conditions, the final GetItem preserves the refcount of the actual result,
-	// but we still want to free the dummy array of length 1 we initially created
-
-	// under error conditions, this *also* acheives the desired effect
-	Py_DecRef(parse_stack[0].value);
-
-	free(parse_stack);
+	free(stack);
+	if (!ok) {
+		*err_offset = idx;
+		return -1;
+	}
 	return idx;
 }
 
-
-static PyObject *
-cbrrr_decode_dag_cbor(PyObject *self, PyObject *args)
+/*
+sets a python exception describing a cbrrr_validate_object failure. The
+offset (of the item that failed validation) is also available as the
+exception's .offset attribute. buf_index says which buffer it was in, for
+decode_many (or -1, if not applicable)
+*/
+static void
+cbrrr_raise_validation_error_in(CbrrrState *st, CbrrrError err, size_t offset, Py_ssize_t buf_index)
 {
-	Py_buffer buf;
-	PyObject *cid_ctor;
-	int atjson_mode;
-
-	(void)self; // unused
-
-	if (!PyArg_ParseTuple(args, "y*Op", &buf, &cid_ctor, &atjson_mode)) {
-		return NULL;
+	if (err == CBRRR_ERR_NO_MEMORY) {
+		PyErr_NoMemory();
+		return;
 	}
-
-	PyObject *value = NULL;
-
-	size_t res = cbrrr_parse_object(buf.buf, buf.len, &value, cid_ctor, atjson_mode);
-	PyBuffer_Release(&buf);
-
-	if (res == (size_t)-1) {
-		return NULL;
+	PyObject *exc = PyObject_CallFunction(st->decode_error, "N", buf_index < 0
+		? PyUnicode_FromFormat("%s (at offset %zu)", CBRRR_ERROR_MESSAGES[err], offset)
+		: PyUnicode_FromFormat("%s (at offset %zu of buffer %zd)", CBRRR_ERROR_MESSAGES[err], offset, buf_index)
+	); // nb: "N" fails cleanly if the message is NULL
+	if (exc == NULL) {
+		return;
 	}
-
-	PyObject *lenvar = PyLong_FromUnsignedLongLong(res);
-
-	PyObject *restuple = PyTuple_Pack(2, value, lenvar);
-	Py_DECREF(value);
-	Py_DECREF(lenvar);
-
-	return restuple;
+	PyObject *offset_obj = PyLong_FromSize_t(offset);
+	if (offset_obj == NULL || PyObject_SetAttrString(exc, "offset", offset_obj) < 0) {
+		Py_XDECREF(offset_obj);
+		Py_DECREF(exc);
+		return;
+	}
+	Py_DECREF(offset_obj);
+	PyErr_SetObject(st->decode_error, exc);
+	Py_DECREF(exc);
 }
 
+static void
+cbrrr_raise_validation_error(CbrrrState *st, CbrrrError err, size_t offset)
+{
+	cbrrr_raise_validation_error_in(st, err, offset, -1);
+}
 
+/* Hot paths only ever try the lock, and skip the cache if it's contended. The
+   rare callers that must have it spin, letting other threads (and the GC) run
+   in the meantime. */
+static void
+cbrrr_lock_blocking(char *lock)
+{
+	while (!CBRRR_TRYLOCK(lock)) {
+		Py_BEGIN_ALLOW_THREADS
+		Py_END_ALLOW_THREADS
+	}
+}
 
+// returns a new reference to a str object representing the key, or NULL on error
+static PyObject *
+cbrrr_key_cache_lookup_hashed(CbrrrState *st, const uint8_t *str, size_t len, uint32_t hash)
+{
+	if (len > CBRRR_KEY_CACHE_MAX_KEY_LEN || !CBRRR_TRYLOCK(&st->key_cache_lock)) {
+		return cbrrr_unicode_from_utf8(str, len);
+	}
+	if (st->key_cache_size == 0) {
+		CBRRR_UNLOCK(&st->key_cache_lock);
+		return cbrrr_unicode_from_utf8(str, len);
+	}
 
+	KeyCacheEntry *entry = &st->key_cache[hash & (st->key_cache_size - 1)];
+	if (entry->str != NULL && entry->hash == hash) {
+		Py_ssize_t cached_len;
+		const char *cached_str = PyUnicode_AsUTF8AndSize(entry->str, &cached_len); // can't fail, the UTF-8 repr was cached on insertion
+		if ((size_t)cached_len == len && memcmp(cached_str, str, len) == 0) {
+			st->key_cache_hits++;
+			PyObject *key = entry->str;
+			Py_INCREF(key);
+			CBRRR_UNLOCK(&st->key_cache_lock);
+			return key;
+		}
+	}
 
+	st->key_cache_misses++;
+	PyObject *key = cbrrr_unicode_from_utf8(str, len);
+	/* precompute the hash, and make sure the UTF-8 representation is cached
+	   (a no-op for ASCII strings) so that future lookups can't fail */
+	if (key != NULL && (PyObject_Hash(key) == -1 || PyUnicode_AsUTF8AndSize(key, NULL) == NULL)) {
+		Py_CLEAR(key);
+	}
+	if (key != NULL) { // (NULL if it was invalid unicode)
+		Py_XDECREF(entry->str);
+		Py_INCREF(key);
+		entry->str = key;
+		entry->hash = hash;
+	}
+	CBRRR_UNLOCK(&st->key_cache_lock);
+	return key;
+}
 
+static PyObject *
+cbrrr_key_cache_lookup(CbrrrState *st, const uint8_t *str, size_t len)
+{
+	return cbrrr_key_cache_lookup_hashed(st, str, len, len > CBRRR_KEY_CACHE_MAX_KEY_LEN ? 0 : cbrrr_key_hash(str, len));
+}
 
-
-
-
-
-
-
-
-
+// sets python exception on fail. size is rounded up to a power of 2, 0 disables the cache.
 static int
-cbrrr_buf_make_room(CbrrrBuf *buf, size_t len) // sets python exception on fail
+cbrrr_key_cache_resize(CbrrrState *st, size_t size)
 {
-	while (buf->capacity - buf->length < len){
-		buf->capacity = buf->capacity * 2;
-		buf->buf = realloc(buf->buf, buf->capacity);
-		if (buf->buf == NULL) {
-			PyErr_SetString(PyExc_MemoryError, "realloc failed");
+	KeyCacheEntry *new_cache = NULL;
+
+	if (size > 0) {
+		size_t rounded = 1;
+		while (rounded < size) {
+			rounded <<= 1;
+		}
+		size = rounded;
+		new_cache = calloc(size, sizeof(*new_cache));
+		if (new_cache == NULL) {
+			PyErr_SetString(PyExc_MemoryError, "calloc failed");
 			return -1;
 		}
 	}
+
+	cbrrr_lock_blocking(&st->key_cache_lock);
+	KeyCacheEntry *old_cache = st->key_cache;
+	size_t old_size = st->key_cache_size;
+	st->key_cache = new_cache;
+	st->key_cache_size = size;
+	st->key_cache_hits = 0;
+	st->key_cache_misses = 0;
+	CBRRR_UNLOCK(&st->key_cache_lock);
+
+	for (size_t i=0; i<old_size; i++) {
+		Py_XDECREF(old_cache[i].str);
+	}
+	free(old_cache);
 	return 0;
 }
 
-static int
-cbrrr_buf_write(CbrrrBuf *buf, const uint8_t *data, size_t len)
+// returns {key: value}, stealing the reference to value (which may be NULL, to pass an error through)
+static PyObject *
+cbrrr_atjson_wrap(PyObject *key, PyObject *value)
 {
-	if (cbrrr_buf_make_room(buf, len) < 0) {
-		return -1;
+	if (value == NULL) {
+		return NULL;
 	}
-	memcpy(buf->buf+buf->length, data, len);
-	buf->length += len;
-	return 0;
+	PyObject *res = PyDict_New();
+	if (res == NULL || PyDict_SetItem(res, key, value) < 0) {
+		Py_XDECREF(res);
+		Py_DECREF(value);
+		return NULL;
+	}
+	Py_DECREF(value);
+	return res;
 }
 
-static int
-cbrrr_write_cbor_varint(CbrrrBuf *buf, DCMajorType type, uint64_t value)
+// returns number of bytes parsed, -1 on failure
+static size_t
+cbrrr_parse_token(CbrrrState *st, const uint8_t *buf, size_t len, DCToken *token, PyObject *cid_ctor, int atjson_mode)
 {
-	uint8_t tmp[9];
-	/*
-	In theory, small values are more likely, so this if-chain order is probably
-	optimal. However, the compiler might try to be clever and turn it into a
-	binary tree. I haven't checked. It probably doesn't meaningfully matter.
-	*/
-	if (value < 24) {
-		tmp[0] = type << 5 | value;
-		return cbrrr_buf_write(buf, tmp, 1);
+	uint64_t info;
+	size_t idx = 0, res;
+	PyObject *tmp;
+
+	if (len < idx + 1) {
+		PyErr_SetString(st->decode_error, "not enough bytes left in buffer");
+		return -1;
 	}
-	if (value < 0x100) {
-		tmp[0] = type << 5 | 24;
-		tmp[1] = value;
-		return cbrrr_buf_write(buf, tmp, 2);
+
+	token->type = buf[idx] >> 5;
+	info = buf[idx] & 0x1f;
+	idx += 1;
+
+	if (token->type == DCMT_FLOAT) { // the special case
+		switch (info)
+		{
+		case 20:
+			token->value = Py_False;
+			Py_INCREF(token->value);
+			return idx;
+		case 21:
+			token->value = Py_True;
+			Py_INCREF(token->value);
+			return idx;
+		case 22:
+			token->value = Py_None;
+			Py_INCREF(token->value);
+			return idx;
+		case 27:
+			if (len < idx + sizeof(double)) {
+				PyErr_SetString(st->decode_error, "not enough bytes left in buffer");
+				return -1;
+			}
+			uint64_t intval = \
+				  (uint64_t)buf[idx+0] << 56 | (uint64_t)buf[idx+1] << 48
+				| (uint64_t)buf[idx+2] << 40 | (uint64_t)buf[idx+3] << 32
+				| (uint64_t)buf[idx+4] << 24 | (uint64_t)buf[idx+5] << 16
+				| (uint64_t)buf[idx+6] << 8  | (uint64_t)buf[idx+7] << 0;
+			double doubleval = ((union {uint64_t num; double dub;}){.num=intval}).dub; // TODO: rewrite lol
+			if (isnan(doubleval)) {
+				PyErr_SetString(st->decode_error, "NaNs are not allowed");
+				return -1;
+			}
+			if (isinf(doubleval)) {
+				PyErr_SetString(st->decode_error, "+/-Infinities are not allowed");
+				return -1;
+			}
+			token->value = PyFloat_FromDouble(doubleval);
+			return idx + sizeof(double);
+		default:
+			PyErr_Format(st->decode_error, "invalid extra info for float mtype (%lu)", info);
+			return -1;
+		}
 	}
-	if (value < 0x10000) {
-		tmp[0] = type << 5 | 25;
-		tmp[1] = value >> 8;
-		tmp[2] = value;
-		return cbrrr_buf_write(buf, tmp, 3);
+
+	res = cbrrr_parse_minimal_varint(st, &buf[idx], len-idx, &info);
+	if (res == (size_t)-1) {
+		// python error set by cbrrr_parse_minimal_varint
+		return -1;
 	}
-	if (value < 0x100000000L) {
-		tmp[0] = type << 5 | 26;
-		tmp[1] = value >> 24;
-		tmp[2] = value >> 16;
-		tmp[3] = value >> 8;
-		tmp[4] = value;
-		return cbrrr_buf_write(buf, tmp, 5);
+
+	// should only be plausible on 32-bit platforms
+	if (idx > SIZE_MAX - res) {
+		PyErr_SetString(st->decode_error, "index overflow");
+		return -1;
+	}
+	idx += res;
+
+	// at this point, `info` represents its actual value, with meaning depending on the major type
+
+	switch (token->type)
+	{
+	case DCMT_UNSIGNED_INT:
+		token->value = PyLong_FromUnsignedLongLong(info);
+		if (token->value == NULL) {
+			return -1;
+		}
+		return idx;
+	case DCMT_NEGATIVE_INT:
+		if (info <= INT64_MAX) { // the result fits in an int64, no need for bigint arithmetic
+			token->value = PyLong_FromLongLong(-1 - (long long)info);
+			if (token->value == NULL) {
+				return -1;
+			}
+			return idx;
+		}
+		tmp = PyLong_FromUnsignedLongLong(info);
+		if (tmp == NULL) {
+			return -1;
+		}
+		token->value = PyNumber_Invert(tmp);
+		Py_DECREF(tmp);
+		if (token->value == NULL) {
+			return -1;
+		}
+		return idx;
+	case DCMT_BYTE_STRING:
+		if (info > len - idx) {
+			PyErr_SetString(st->decode_error, "not enough bytes left in buffer");
+			return -1;
+		}
+		if (atjson_mode) { /* wrap in {"$bytes", "b64..."} */
+			token->value = cbrrr_atjson_wrap(st->string_bytes, cbrrr_bytes_to_b64_string_nopad((uint8_t*)&buf[idx], info));
+			if (token->value == NULL) {
+				return -1;
+			}
+		} else {
+			token->value = PyBytes_FromStringAndSize((const char*)&buf[idx], info);
+			if (token->value == NULL) {
+				return -1;
+			}
+		}
+		return idx + info;
+	case DCMT_TEXT_STRING:
+		if (info > (uint64_t)len - idx) {
+			PyErr_SetString(st->decode_error, "not enough bytes left in buffer");
+			return -1;
+		}
+		token->value = cbrrr_unicode_from_utf8(&buf[idx], info);
+		if (token->value == NULL) { // invalid unicode
+			return -1;
+		}
+		return idx + info;
+	case DCMT_ARRAY:
+		if (info > (uint64_t)len - idx) {
+			PyErr_SetString(st->decode_error, "not enough bytes left in buffer for an array that long");
+			return -1;
+		}
+		token->value = PyList_New(info);
+		if (token->value == NULL) { // probably tried to allocate a too-big list
+			return -1;
+		}
+		token->count = info;
+		return idx;
+	case DCMT_MAP:
+		if (info > (uint64_t)len - idx) {
+			PyErr_SetString(st->decode_error, "not enough bytes left in buffer for a map that long");
+			return -1;
+		}
+		token->value = PyDict_New();
+		if (token->value == NULL) { // something bad happened I guess
+			return -1;
+		}
+		token->count = info;
+		token->prev_key = NULL;
+		token->prev_key_len = 0;
+		return idx;
+	case DCMT_TAG:
+		if (info != 42) { // only tag type 42=CID is supported
+			PyErr_Format(st->decode_error, "invalid tag value (%lu)", info);
+			return -1;
+		}
+		// parse a byte string
+		const uint8_t *str;
+		size_t str_len;
+		res = cbrrr_parse_raw_string(st, &buf[idx], len-idx, DCMT_BYTE_STRING, &str, &str_len);
+		if (res == (size_t)-1) {
+			// python error set by cbrrr_parse_raw_string
+			return -1;
+		}
+		if (str_len == 0 || str[0] != 0) {
+			PyErr_SetString(st->decode_error, "invalid CID (nonzero start byte)");
+			return -1;
+		}
+		if (atjson_mode) { /* wrap in {"$link", "b32..."} */
+			token->value = cbrrr_atjson_wrap(st->string_link, cbrrr_bytes_to_b32_multibase(str + 1, str_len - 1)); // slice off the leading 0
+			if (token->value == NULL) {
+				return -1;
+			}
+		} else {
+			token->value = cbrrr_cid_from_raw(st, cid_ctor, str + 1, str_len - 1); // slice off the leading 0
+			if (token->value == NULL) {
+				return -1; // exception in cid_ctor
+			}
+		}
+
+		return idx + res;
+	default:
+		PyErr_Format(PyExc_AssertionError, "you reached unreachable code??? (type=%lu)", token->type);
+		return -1; // unreachable?
 	}
-	tmp[0] = type << 5 | 27;
-	tmp[1] = value >> 56;
-	tmp[2] = value >> 48;
-	tmp[3] = value >> 40;
-	tmp[4] = value >> 32;
-	tmp[5] = value >> 24;
-	tmp[6] = value >> 16;
-	tmp[7] = value >> 8;
-	tmp[8] = value;
-	return cbrrr_buf_write(buf, tmp, 9);
 }
 
+/*
+Schemas: decoding maps directly into instances of user-supplied record
+classes, rather than dicts.
+
+A class is registered either against a $type value, or against an exact key
+set. While a map is being parsed (with a schema in use), its keys and values
+are staged in its stack frame, rather than going into a dict. Once the map is
+complete, we look for a matching class, match the staged keys up with its
+fields (both are in canonical order, so this is a single merge pass), and
+call the class with the values as keyword arguments. If there's no match,
+there's a key that the class doesn't have a field for, or one of the fields
+the class requires is missing, the staged items go into a regular dict
+instead.
+
+Key ordering etc. is still checked exactly as before, since the staging
+happens after all that.
+*/
 
+typedef struct {
+	PyObject *cls;
+	PyObject *keys; // tuple of str, the map keys, in canonical order
+	PyObject *kwnames; // tuple of str, the corresponding constructor kwargs
+	PyObject *required; // bytes, nonzero for each field the constructor can't do without
+	Py_ssize_t num_required;
+	uint64_t keyset_hash;
+} SchemaEntry;
 
 /*
-Decodes maybe-padded base64 according to https://atproto.com/specs/data-model#bytes (RFC-4648, section 4)
-Returns 0 on success, -1 on failure (setting a python exception).
+The decoder reads the registered classes without holding any locks, and calls
+out to arbitrary python code (including Schema.register) while it does, so
+they live in a table that's never modified once it's been published. Instead,
+Schema.register swaps in an updated copy, and each decode holds a reference to
+whichever table was current when it started.
 */
+typedef struct {
+	size_t refcnt; // only modified atomically, when free-threaded
+	PyObject *by_type; // dict mapping $type values to SchemaEntry capsules
+	SchemaEntry *keysets; // classes registered by key set
+	size_t num_keysets;
+} SchemaTable;
 
-static const uint8_t B64_DECODE_LUT[] = {
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
-	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
-	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
-	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
-	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
-	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-};
+typedef struct {
+	PyObject_HEAD
+	SchemaTable *table; // only NULL once cleared
+} SchemaObject;
+
+static uint64_t
+cbrrr_keyset_hash_step(uint64_t hash, const uint8_t *key, size_t key_len)
+{
+	return (hash ^ cbrrr_key_hash(key, key_len)) * 0x100000001b3ULL;
+}
+
+static void
+cbrrr_schema_entry_clear(SchemaEntry *entry)
+{
+	Py_CLEAR(entry->cls);
+	Py_CLEAR(entry->keys);
+	Py_CLEAR(entry->kwnames);
+	Py_CLEAR(entry->required);
+}
+
+static void
+cbrrr_schema_capsule_destructor(PyObject *capsule)
+{
+	SchemaEntry *entry = PyCapsule_GetPointer(capsule, "cbrrr.SchemaEntry");
+	cbrrr_schema_entry_clear(entry);
+	PyMem_Free(entry);
+}
 
+// canonical ordering of (key, kwname) pairs, by key (already known to be valid strs)
 static int
-cbrrr_write_cbor_bytes_from_b64(CbrrrBuf *buf, const uint8_t *b64_str, size_t str_len)
+cbrrr_compare_field_pairs(const void *a, const void *b)
 {
-	// strip padding
-	while (str_len && b64_str[str_len - 1] == '=') str_len--;
-	if ((str_len % 4) == 1) {
-		PyErr_SetString(PyExc_ValueError, "invalid b64 length");
-		return -1;
+	Py_ssize_t len_a, len_b;
+	const char *str_a = PyUnicode_AsUTF8AndSize(*(PyObject**)a, &len_a);
+	const char *str_b = PyUnicode_AsUTF8AndSize(*(PyObject**)b, &len_b);
+	if (len_a != len_b) {
+		return len_a < len_b ? -1 : 1; /* shorter strings sort first */
 	}
+	return memcmp(str_a, str_b, len_a);
+}
 
-	/* nb: this length integer could overflow, but it comes from a python string,
-	   so it should be < PY_SSIZE_T_MAX. Unless you have close to 2^63 bytes of
-	   RAM, you're safe. I think the uint64 cast should make it safe
-	   on 32-bit platforms too. (decoded_length is always < str_len) */
-	size_t decoded_length = ((uint64_t)str_len*3)/4;
-	if (cbrrr_write_cbor_varint(buf, DCMT_BYTE_STRING, decoded_length) < 0) {
+/*
+Populates entry from the fields argument of Schema.register(), which is either
+an iterable of keys, or a mapping of keys to kwarg names, and the required
+argument, an iterable of kwarg names (or NULL, for none).
+*/
+static int
+cbrrr_schema_entry_init(SchemaEntry *entry, PyObject *cls, PyObject *fields, PyObject *required)
+{
+	PyObject *items, *required_list = NULL;
+	int is_mapping = 0;
+	if (PyUnicode_Check(fields) || PyBytes_Check(fields)) {
+		// these are iterables, but surely not what was meant
+		PyErr_SetString(PyExc_TypeError, "fields must be an iterable of field names, or a mapping, not str or bytes");
 		return -1;
 	}
-	if (cbrrr_buf_make_room(buf, decoded_length) < 0) {
+	if (PyDict_Check(fields)) {
+		is_mapping = 1;
+		items = PyDict_Items(fields);
+	} else if (PyMapping_Check(fields) && PyObject_HasAttrString(fields, "keys")) { // like dict.update(), since a list passes PyMapping_Check too
+		is_mapping = 1;
+		items = PyMapping_Items(fields);
+	} else {
+		items = PySequence_List(fields);
+	}
+	if (items == NULL) {
 		return -1;
 	}
-	uint8_t *bufptr = buf->buf + buf->length;
-	buf->length += decoded_length;
+	Py_ssize_t n = PyList_GET_SIZE(items);
+	PyObject **pairs = PyMem_Malloc((n ? n : 1) * 2 * sizeof(PyObject *));
+	if (pairs == NULL) {
+		Py_DECREF(items);
+		PyErr_NoMemory();
+		return -1;
+	}
+	int res = -1;
+	for (Py_ssize_t i=0; i<n; i++) {
+		PyObject *item = PyList_GET_ITEM(items, i);
+		if (is_mapping) {
+			if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+				PyErr_SetString(PyExc_TypeError, "fields mapping items must be (key, kwarg name) pairs");
+				goto done;
+			}
+			pairs[i*2] = PyTuple_GET_ITEM(item, 0);
+			pairs[i*2+1] = PyTuple_GET_ITEM(item, 1);
+		} else {
+			pairs[i*2] = pairs[i*2+1] = item;
+		}
+		if (!PyUnicode_CheckExact(pairs[i*2]) || !PyUnicode_Check(pairs[i*2+1])) {
+			PyErr_SetString(PyExc_TypeError, "field names must be strings");
+			goto done;
+		}
+		if (PyUnicode_AsUTF8AndSize(pairs[i*2], NULL) == NULL) {
+			goto done;
+		}
+	}
+	qsort(pairs, n, 2 * sizeof(PyObject *), cbrrr_compare_field_pairs);
 
-	size_t str_i = 0;
-	uint8_t a, b, c, d;
-	while (str_i+3 < str_len) {
-		a = B64_DECODE_LUT[b64_str[str_i++]];
-		b = B64_DECODE_LUT[b64_str[str_i++]];
-		c = B64_DECODE_LUT[b64_str[str_i++]];
-		d = B64_DECODE_LUT[b64_str[str_i++]];
-		if ((a | b | c | d) & 0x80) {
-			PyErr_SetString(PyExc_ValueError, "invalid b64 character");
-			return -1;
+	entry->keys = PyTuple_New(n);
+	entry->kwnames = PyTuple_New(n);
+	if (entry->keys == NULL || entry->kwnames == NULL) {
+		goto done;
+	}
+	entry->keyset_hash = 0;
+	for (Py_ssize_t i=0; i<n; i++) {
+		Py_ssize_t key_len;
+		const char *key = PyUnicode_AsUTF8AndSize(pairs[i*2], &key_len);
+		if (i > 0 && PyUnicode_Compare(pairs[i*2], pairs[i*2-2]) == 0) {
+			PyErr_Format(PyExc_ValueError, "duplicate field %R", pairs[i*2]);
+			goto done;
 		}
-		*bufptr++ = (a << 2) | (b >> 4);
-		*bufptr++ = (b << 4) | (c >> 2);
-		*bufptr++ = (c << 6) | (d >> 0);
+		entry->keyset_hash = cbrrr_keyset_hash_step(entry->keyset_hash, (const uint8_t *)key, key_len);
+		Py_INCREF(pairs[i*2]);
+		PyTuple_SET_ITEM(entry->keys, i, pairs[i*2]);
+		Py_INCREF(pairs[i*2+1]);
+		PyTuple_SET_ITEM(entry->kwnames, i, pairs[i*2+1]);
 	}
-	switch (str_len - str_i)
-	{
-	case 3:
-		a = B64_DECODE_LUT[b64_str[str_i++]];
-		b = B64_DECODE_LUT[b64_str[str_i++]];
-		c = B64_DECODE_LUT[b64_str[str_i++]];
-		if ((a | b | c) & 0x80) {
-			PyErr_SetString(PyExc_ValueError, "invalid b64 character");
-			return -1;
+
+	entry->required = PyBytes_FromStringAndSize(NULL, n);
+	required_list = required == NULL ? PyList_New(0) : PySequence_List(required);
+	if (entry->required == NULL || required_list == NULL) {
+		goto done;
+	}
+	memset(PyBytes_AS_STRING(entry->required), 0, n);
+	entry->num_required = 0;
+	for (Py_ssize_t i=0; i<PyList_GET_SIZE(required_list); i++) {
+		PyObject *name = PyList_GET_ITEM(required_list, i);
+		Py_ssize_t field_i;
+		for (field_i=0; field_i<n; field_i++) {
+			int eq = PyObject_RichCompareBool(PyTuple_GET_ITEM(entry->kwnames, field_i), name, Py_EQ);
+			if (eq < 0) {
+				goto done;
+			}
+			if (eq) {
+				break;
+			}
 		}
-		*bufptr++ = (a << 2) | (b >> 4);
-		*bufptr++ = (b << 4) | (c >> 2);
-		// should we check (c << 6) & 0xff == 0?
-		break;
-	
-	case 2:
-		a = B64_DECODE_LUT[b64_str[str_i++]];
-		b = B64_DECODE_LUT[b64_str[str_i++]];
-		if ((a | b) & 0x80) {
-			PyErr_SetString(PyExc_ValueError, "invalid b64 character");
-			return -1;
+		if (field_i == n) {
+			PyErr_Format(PyExc_ValueError, "required argument %R isn't one of the fields", name);
+			goto done;
 		}
-		*bufptr++ = (a << 2) | (b >> 4);
-		// should we check (b << 4) & 0xff == 0?
-		break;
-	
-	case 0:
-		break;
+		if (!PyBytes_AS_STRING(entry->required)[field_i]) {
+			PyBytes_AS_STRING(entry->required)[field_i] = 1;
+			entry->num_required++;
+		}
+	}
+	Py_INCREF(cls);
+	entry->cls = cls;
+	res = 0;
 
-	default:
-		PyErr_SetString(PyExc_AssertionError, "unreachable!?");
-		return -1;
+done:
+	if (res < 0) {
+		cbrrr_schema_entry_clear(entry);
 	}
+	PyMem_Free(pairs);
+	Py_DECREF(items);
+	Py_XDECREF(required_list);
+	return res;
+}
 
-	return 0;
+static void
+cbrrr_schema_table_decref(SchemaTable *table)
+{
+#ifdef Py_GIL_DISABLED
+	if (__atomic_sub_fetch(&table->refcnt, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+#else
+	if (--table->refcnt) {
+		return;
+	}
+#endif
+	Py_XDECREF(table->by_type);
+	for (size_t i=0; i<table->num_keysets; i++) {
+		cbrrr_schema_entry_clear(&table->keysets[i]);
+	}
+	PyMem_Free(table->keysets);
+	PyMem_Free(table);
 }
 
+/*
+A new table with the same contents as src (or an empty one, if src is NULL),
+with room for one more key set entry. Sets a python exception on failure.
+*/
+static SchemaTable *
+cbrrr_schema_table_copy(const SchemaTable *src)
+{
+	size_t num_keysets = src == NULL ? 0 : src->num_keysets;
+	SchemaTable *table = PyMem_Malloc(sizeof(*table));
+	if (table == NULL) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+	table->refcnt = 1;
+	table->num_keysets = 0;
+	table->keysets = PyMem_Malloc((num_keysets + 1) * sizeof(*table->keysets));
+	table->by_type = src == NULL ? PyDict_New() : PyDict_Copy(src->by_type); // the capsules themselves are immutable
+	if (table->keysets == NULL || table->by_type == NULL) {
+		if (table->keysets == NULL) {
+			PyErr_NoMemory();
+		}
+		cbrrr_schema_table_decref(table);
+		return NULL;
+	}
+	for (size_t i=0; i<num_keysets; i++) {
+		table->keysets[i] = src->keysets[i];
+		Py_INCREF(table->keysets[i].cls);
+		Py_INCREF(table->keysets[i].keys);
+		Py_INCREF(table->keysets[i].kwnames);
+		Py_INCREF(table->keysets[i].required);
+	}
+	table->num_keysets = num_keysets;
+	return table;
+}
 
-// nb: case insensitive
-static const uint8_t B32_DECODE_LUT[] = {
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, 26, 27, 28, 29, 30, 31, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
-	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
-	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
-	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
-};
+// a new reference to the schema's current table, or NULL (without an exception) if it's been cleared
+static SchemaTable *
+cbrrr_schema_table_acquire(SchemaObject *schema)
+{
+	SchemaTable *table;
+	CBRRR_BEGIN_CRITICAL_SECTION(schema);
+	table = schema->table;
+	if (table != NULL) {
+#ifdef Py_GIL_DISABLED
+		__atomic_add_fetch(&table->refcnt, 1, __ATOMIC_RELAXED);
+#else
+		table->refcnt++;
+#endif
+	}
+	CBRRR_END_CRITICAL_SECTION();
+	return table;
+}
 
+static PyObject *
+Schema_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	(void)args; // unused
+	(void)kwds; // unused
+	SchemaObject *self = (SchemaObject *)type->tp_alloc(type, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+	self->table = cbrrr_schema_table_copy(NULL);
+	if (self->table == NULL) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	return (PyObject *)self;
+}
 
 static int
-cbrrr_write_cbor_bytes_from_multibase_b32_nopad(CbrrrBuf *buf, const uint8_t *b32_str, size_t str_len)
+Schema_traverse(SchemaObject *self, visitproc visit, void *arg)
 {
-	if (str_len == 0 || b32_str[0] != 'b') {
-		PyErr_SetString(PyExc_ValueError, "invalid/unsupported multibase prefix");
-		return -1; // multibase prefix
+#if PY_VERSION_HEX >= 0x03090000
+	Py_VISIT(Py_TYPE(self));
+#endif
+	/* nb: decoders hold references to tables, but only for the duration of a
+	   call, so the current one is effectively ours */
+	if (self->table != NULL) {
+		Py_VISIT(self->table->by_type);
+		for (size_t i=0; i<self->table->num_keysets; i++) {
+			Py_VISIT(self->table->keysets[i].cls);
+		}
 	}
-	b32_str++;
-	str_len--;
+	return 0;
+}
 
-	/* nb: see comment in b64 fn above re: integer overflow */
-	size_t decoded_length = ((uint64_t)str_len*5)/8;
-	if (cbrrr_write_cbor_varint(buf, DCMT_BYTE_STRING, decoded_length + 1) < 0) {
-		return -1;
-	}
-	if (cbrrr_buf_make_room(buf, decoded_length + 1) < 0) {
-		return -1;
+static int
+Schema_clear(SchemaObject *self)
+{
+	SchemaTable *table = self->table;
+	self->table = NULL;
+	if (table != NULL) {
+		cbrrr_schema_table_decref(table);
 	}
-	uint8_t *bufptr = buf->buf + buf->length;
-	buf->length += decoded_length + 1;
+	return 0;
+}
 
-	*bufptr++ = 0; // multibase raw
+static void
+Schema_dealloc(SchemaObject *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+	PyObject_GC_UnTrack(self);
+	Schema_clear(self);
+	tp->tp_free((PyObject *)self);
+	CBRRR_RELEASE_TYPE(tp, Schema_dealloc);
+}
 
-	size_t str_i = 0;
-	uint8_t a, b, c, d, e, f, g, h;
-	while (str_i+7 < str_len) {
-		a = B32_DECODE_LUT[b32_str[str_i++]];
-		b = B32_DECODE_LUT[b32_str[str_i++]];
-		c = B32_DECODE_LUT[b32_str[str_i++]];
-		d = B32_DECODE_LUT[b32_str[str_i++]];
-		e = B32_DECODE_LUT[b32_str[str_i++]];
-		f = B32_DECODE_LUT[b32_str[str_i++]];
-		g = B32_DECODE_LUT[b32_str[str_i++]];
-		h = B32_DECODE_LUT[b32_str[str_i++]];
-		if ((a | b | c | d | e | f | g | h) & 0x80) {
-			PyErr_SetString(PyExc_ValueError, "invalid b32 character");
-			return -1;
-		}
-		// 43210432 10432104 32104321 04321043 21043210
-		// aaaaabbb bbcccccd ddddeeee efffffgg ggghhhhh
-		// 76543210 76543210 76543210 76543210 76543210
-		*bufptr++ =            (a << 3) | (b >> 2);
-		*bufptr++ = (b << 6) | (c << 1) | (d >> 4);
-		*bufptr++ = (d << 4) |            (e >> 1);
-		*bufptr++ = (e << 7) | (f << 2) | (g >> 3);
-		*bufptr++ = (g << 5) | (h << 0)           ;
+// builds an updated copy of the table, and swaps it in (see SchemaTable)
+static PyObject *
+Schema_register_locked(SchemaObject *self, PyObject *cls, PyObject *fields, PyObject *type_name, PyObject *required)
+{
+	if (self->table == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "Schema has been cleared");
+		return NULL;
 	}
-	switch (str_len - str_i)
-	{
-	case 7:
-		a = B32_DECODE_LUT[b32_str[str_i++]];
-		b = B32_DECODE_LUT[b32_str[str_i++]];
-		c = B32_DECODE_LUT[b32_str[str_i++]];
-		d = B32_DECODE_LUT[b32_str[str_i++]];
-		e = B32_DECODE_LUT[b32_str[str_i++]];
-		f = B32_DECODE_LUT[b32_str[str_i++]];
-		g = B32_DECODE_LUT[b32_str[str_i++]];
-		if ((a | b | c | d | e | f | g) & 0x80) {
-			PyErr_SetString(PyExc_ValueError, "invalid b32 character");
-			return -1;
-		}
-		*bufptr++ =            (a << 3) | (b >> 2);
-		*bufptr++ = (b << 6) | (c << 1) | (d >> 4);
-		*bufptr++ = (d << 4) |            (e >> 1);
-		*bufptr++ = (e << 7) | (f << 2) | (g >> 3);
-		if (g & 0x07) {
-			PyErr_SetString(PyExc_ValueError, "non-canonical b32 encoding");
-			return -1;
-		}
-		break;
-	case 5:
-		a = B32_DECODE_LUT[b32_str[str_i++]];
-		b = B32_DECODE_LUT[b32_str[str_i++]];
-		c = B32_DECODE_LUT[b32_str[str_i++]];
-		d = B32_DECODE_LUT[b32_str[str_i++]];
-		e = B32_DECODE_LUT[b32_str[str_i++]];
-		if ((a | b | c | d | e) & 0x80) {
-			PyErr_SetString(PyExc_ValueError, "invalid b32 character");
-			return -1;
-		}
-		*bufptr++ =            (a << 3) | (b >> 2);
-		*bufptr++ = (b << 6) | (c << 1) | (d >> 4);
-		*bufptr++ = (d << 4) |            (e >> 1);
-		if (e & 0x01) {
-			PyErr_SetString(PyExc_ValueError, "non-canonical b32 encoding");
-			return -1;
-		}
-		break;
-	case 4:
-		a = B32_DECODE_LUT[b32_str[str_i++]];
-		b = B32_DECODE_LUT[b32_str[str_i++]];
-		c = B32_DECODE_LUT[b32_str[str_i++]];
-		d = B32_DECODE_LUT[b32_str[str_i++]];
-		if ((a | b | c | d) & 0x80) {
-			PyErr_SetString(PyExc_ValueError, "invalid b32 character");
-			return -1;
+	if (!PyCallable_Check(cls)) {
+		PyErr_SetString(PyExc_TypeError, "cls must be callable");
+		return NULL;
+	}
+	if (type_name != Py_None && !PyUnicode_CheckExact(type_name)) {
+		PyErr_SetString(PyExc_TypeError, "type_name must be a string");
+		return NULL;
+	}
+
+	SchemaEntry entry = {NULL, NULL, NULL, NULL, 0, 0};
+	if (cbrrr_schema_entry_init(&entry, cls, fields, required) < 0) {
+		return NULL;
+	}
+	SchemaTable *table = cbrrr_schema_table_copy(self->table);
+	if (table == NULL) {
+		cbrrr_schema_entry_clear(&entry);
+		return NULL;
+	}
+
+	if (type_name != Py_None) {
+		SchemaEntry *entry_copy = PyMem_Malloc(sizeof(entry));
+		if (entry_copy == NULL) {
+			cbrrr_schema_entry_clear(&entry);
+			PyErr_NoMemory();
+			goto fail;
 		}
-		*bufptr++ =            (a << 3) | (b >> 2);
-		*bufptr++ = (b << 6) | (c << 1) | (d >> 4);
-		if (d & 0x0f) {
-			PyErr_SetString(PyExc_ValueError, "non-canonical b32 encoding");
-			return -1;
+		*entry_copy = entry;
+		PyObject *capsule = PyCapsule_New(entry_copy, "cbrrr.SchemaEntry", cbrrr_schema_capsule_destructor);
+		if (capsule == NULL) {
+			cbrrr_schema_entry_clear(entry_copy);
+			PyMem_Free(entry_copy);
+			goto fail;
 		}
-		break;
-	case 2:
-		a = B32_DECODE_LUT[b32_str[str_i++]];
-		b = B32_DECODE_LUT[b32_str[str_i++]];
-		if ((a | b) & 0x80) {
-			PyErr_SetString(PyExc_ValueError, "invalid b32 character");
-			return -1;
+		int res = PyDict_SetItem(table->by_type, type_name, capsule);
+		Py_DECREF(capsule);
+		if (res < 0) {
+			goto fail;
 		}
-		*bufptr++ =            (a << 3) | (b >> 2);
-		if (b & 0x03) {
-			PyErr_SetString(PyExc_ValueError, "non-canonical b32 encoding");
-			return -1;
+	} else {
+		// by key set. If the same key set was registered before, replace it
+		size_t i;
+		for (i=0; i<table->num_keysets; i++) {
+			if (table->keysets[i].keyset_hash == entry.keyset_hash) {
+				int eq = PyObject_RichCompareBool(table->keysets[i].keys, entry.keys, Py_EQ);
+				if (eq < 0) {
+					cbrrr_schema_entry_clear(&entry);
+					goto fail;
+				}
+				if (eq) {
+					cbrrr_schema_entry_clear(&table->keysets[i]);
+					break;
+				}
+			}
 		}
-		break;
-	
-	case 0:
-		// nothing to do here
-		break;
-
-	case 1:
-	case 3:
-	case 6:
-		PyErr_SetString(PyExc_ValueError, "invalid b32 length");
-		return -1;
-
-	default:
-		PyErr_SetString(PyExc_AssertionError, "unreachable!?");
-		return -1;
+		table->keysets[i] = entry; // nb: cbrrr_schema_table_copy left room for one more
+		table->num_keysets += i == table->num_keysets;
 	}
 
-	return 0;
+	SchemaTable *old = self->table;
+	self->table = table;
+	cbrrr_schema_table_decref(old); // nb: this may run arbitrary code, so it comes last
+	Py_RETURN_NONE;
+
+fail:
+	cbrrr_schema_table_decref(table);
+	return NULL;
 }
 
+static PyObject *
+Schema_register(SchemaObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"cls", "fields", "type_name", "required", NULL};
+	PyObject *cls, *fields, *type_name = Py_None, *required = NULL, *res;
 
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|OO:register", kwlist, &cls, &fields, &type_name, &required)) {
+		return NULL;
+	}
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	res = Schema_register_locked(self, cls, fields, type_name, required);
+	CBRRR_END_CRITICAL_SECTION();
+	return res;
+}
 
-static int
-cbrrr_compare_map_keys(const void *a, const void *b)
+static PyObject *
+Schema_get_by_type(SchemaObject *self, void *closure)
 {
-	// nb: the comparison needs to be performed on the byte representations of the strings
+	(void)closure; // unused
+	SchemaTable *table = cbrrr_schema_table_acquire(self);
+	PyObject *res = PyDict_New();
+	if (res == NULL || table == NULL) {
+		goto done;
+	}
+	Py_ssize_t pos = 0;
+	PyObject *key, *capsule;
+	while (PyDict_Next(table->by_type, &pos, &key, &capsule)) {
+		SchemaEntry *entry = PyCapsule_GetPointer(capsule, "cbrrr.SchemaEntry");
+		if (PyDict_SetItem(res, key, entry->cls) < 0) {
+			Py_CLEAR(res);
+			goto done;
+		}
+	}
+done:
+	if (table != NULL) {
+		cbrrr_schema_table_decref(table);
+	}
+	return res;
+}
 
-	PyObject *obj_a = *(PyObject**)a;
-	PyObject *obj_b = *(PyObject**)b;
-	Py_ssize_t len_a, len_b;
-	const char *str_a = PyUnicode_AsUTF8AndSize(obj_a, &len_a);
-	const char *str_b = PyUnicode_AsUTF8AndSize(obj_b, &len_b);
+static PyMethodDef Schema_methods[] = {
+	{"register", (PyCFunction)(void(*)(void))Schema_register, METH_VARARGS | METH_KEYWORDS,
+		"register a class to be constructed from maps with a given $type value, or key set"},
+	{NULL, NULL, 0, NULL}
+};
 
-	/* Handle the (invalid!) case where one or both args are not strings
-	   (they'll get properly type-checked later, we don't have a good way
-	   to raise an exception from within qsort) */
-	if (str_a == NULL || str_b == NULL) {
-		/* this logic is here to make sure the comparison fn is transitive,
-		   lest we invoke UB, as in
-		   https://www.openwall.com/lists/oss-security/2024/01/30/7 */
-		if (str_a == NULL && str_b == NULL) {
-			return 0;
+static PyGetSetDef Schema_getset[] = {
+	{"by_type", (getter)Schema_get_by_type, NULL, "a dict of the classes registered by $type value", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyType_Slot Schema_slots[] = {
+	{Py_tp_doc,
+		"Schema()\n"
+		"--\n\n"
+		"A mapping from DAG-CBOR map shapes to record classes, for decode_dag_cbor.\n\n"
+		"Schema.register(cls, fields, type_name=None, required=()) registers cls (any\n"
+		"callable that takes keyword arguments) to be called for maps with the given\n"
+		"$type value, or if type_name is None, for maps with exactly the given key set.\n"
+		"fields is either an iterable of map keys (which double as the kwarg names),\n"
+		"or a mapping of map keys to kwarg names. Maps that lack any of the kwargs\n"
+		"named in required are decoded as plain dicts instead.\n\n"
+		"Classes registered while a decode is in progress (e.g. by a record class)\n"
+		"only apply to subsequent decodes."},
+	{Py_tp_new, CBRRR_SLOT(Schema_new)},
+	{Py_tp_dealloc, CBRRR_SLOT(Schema_dealloc)},
+	{Py_tp_traverse, CBRRR_SLOT(Schema_traverse)},
+	{Py_tp_clear, CBRRR_SLOT(Schema_clear)},
+	{Py_tp_methods, Schema_methods},
+	{Py_tp_getset, Schema_getset},
+	{0, NULL}
+};
+
+static PyType_Spec Schema_spec = {
+	.name = "cbrrr._cbrrr.Schema",
+	.basicsize = sizeof(SchemaObject),
+	.itemsize = 0,
+	.flags = Py_TPFLAGS_DEFAULT | CBRRR_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+	.slots = Schema_slots,
+};
+
+// frees a map frame's staged items, e.g. after an error
+static void
+cbrrr_schema_release_frame(DCToken *frame)
+{
+	for (Py_ssize_t i=0; i<frame->staged_count; i++) {
+		Py_DECREF(frame->staged_keys[i].obj);
+		Py_XDECREF(frame->staged_values[i]); // NULL if it's a map that's still being parsed
+	}
+	free(frame->staged_keys);
+	free(frame->staged_values);
+	frame->staged_keys = NULL;
+	frame->staged_values = NULL;
+	frame->staged_count = 0;
+}
+
+// returns the entry registered for the map's $type value, if any (borrowed, doesn't set an exception)
+static SchemaEntry *
+cbrrr_schema_lookup_type(const SchemaTable *schema, DCToken *frame, Py_ssize_t *type_idx)
+{
+	for (Py_ssize_t i=0; i<frame->staged_count; i++) {
+		if (frame->staged_keys[i].len > 5) {
+			break; // keys are in canonical order, so it's not there
+		}
+		if (frame->staged_keys[i].len == 5 && memcmp(frame->staged_keys[i].str, "$type", 5) == 0) {
+			PyObject *type_name = frame->staged_values[i];
+			if (!PyUnicode_CheckExact(type_name)) {
+				break;
+			}
+			PyObject *capsule = PyDict_GetItem(schema->by_type, type_name); // borrowed
+			if (capsule == NULL) {
+				break;
+			}
+			*type_idx = i;
+			return PyCapsule_GetPointer(capsule, "cbrrr.SchemaEntry");
 		}
-		return str_a == NULL ? -1 : 1; /* non-strings sort first */
 	}
+	return NULL;
+}
 
-	/* shorter strings sort first */
-	if (len_a < len_b) {
-		return -1;
+/*
+Builds an instance of the entry's class from the staged items, skipping the
+one at skip_idx (if not -1). Returns NULL without setting an exception if
+the keys don't fit the class's fields.
+*/
+static PyObject *
+cbrrr_schema_build(SchemaEntry *entry, DCToken *frame, Py_ssize_t skip_idx)
+{
+	Py_ssize_t num_fields = PyTuple_GET_SIZE(entry->keys);
+	Py_ssize_t num_args = frame->staged_count - (skip_idx >= 0);
+	PyObject *small_args[16];
+	PyObject **args = small_args;
+	PyObject *kwnames = NULL;
+	PyObject *res = NULL;
+
+	if (num_args > num_fields) {
+		return NULL; // can't possibly fit
 	}
-	if (len_a > len_b) {
-		return 1;
+	if (num_args > (Py_ssize_t)(sizeof(small_args) / sizeof(small_args[0]))) {
+		args = PyMem_Malloc(num_args * sizeof(PyObject *));
+		if (args == NULL) {
+			return PyErr_NoMemory();
+		}
 	}
-	
-	/* do byte-wise comparision for equal-length strings */
-	return memcmp(str_a, str_b, len_a);
+	if (num_args == num_fields) { // the common case, every field is present
+		kwnames = entry->kwnames;
+		Py_INCREF(kwnames);
+	} else {
+		kwnames = PyTuple_New(num_args);
+		if (kwnames == NULL) {
+			goto done;
+		}
+	}
+
+	// both lists are in canonical order, so we can match them up in one pass
+	Py_ssize_t field_i = 0, arg_i = 0, num_required = 0;
+	for (Py_ssize_t i=0; i<frame->staged_count; i++) {
+		if (i == skip_idx) {
+			continue;
+		}
+		const uint8_t *key = frame->staged_keys[i].str;
+		size_t key_len = frame->staged_keys[i].len;
+		for (;;) {
+			if (field_i == num_fields) {
+				goto done; // no such field (nb: res is NULL, without an exception)
+			}
+			Py_ssize_t field_len;
+			const char *field = PyUnicode_AsUTF8AndSize(PyTuple_GET_ITEM(entry->keys, field_i), &field_len); // can't fail, checked on registration
+			int cmp = ((size_t)field_len > key_len) - ((size_t)field_len < key_len);
+			if (cmp == 0) {
+				cmp = memcmp(field, key, key_len);
+			}
+			if (cmp > 0) {
+				goto done; // no such field
+			}
+			field_i++;
+			if (cmp == 0) {
+				break;
+			}
+		}
+		num_required += PyBytes_AS_STRING(entry->required)[field_i - 1];
+		if (kwnames != entry->kwnames) {
+			PyObject *kwname = PyTuple_GET_ITEM(entry->kwnames, field_i - 1);
+			Py_INCREF(kwname);
+			PyTuple_SET_ITEM(kwnames, arg_i, kwname);
+		}
+		args[arg_i++] = frame->staged_values[i];
+	}
+	if (num_required != entry->num_required) {
+		goto done; // a required field is missing
+	}
+
+	// nb: the call may run arbitrary code, including Schema.register (which is fine, see SchemaTable)
+	PyObject *cls = entry->cls; // borrowed, so we hold our own reference for the duration of the call
+#if PY_VERSION_HEX >= 0x03090000
+	Py_INCREF(cls);
+	res = PyObject_Vectorcall(cls, args, 0, kwnames);
+	Py_DECREF(cls);
+#else
+	PyObject *kwargs = PyDict_New();
+	if (kwargs == NULL) {
+		goto done;
+	}
+	for (Py_ssize_t i=0; i<num_args; i++) {
+		if (PyDict_SetItem(kwargs, PyTuple_GET_ITEM(kwnames, i), args[i]) < 0) {
+			Py_DECREF(kwargs);
+			goto done;
+		}
+	}
+	PyObject *empty = PyTuple_New(0);
+	if (empty != NULL) {
+		Py_INCREF(cls);
+		res = PyObject_Call(cls, empty, kwargs);
+		Py_DECREF(cls);
+		Py_DECREF(empty);
+	}
+	Py_DECREF(kwargs);
+#endif
+	if (res == NULL && !PyErr_Occurred()) { // make sure we don't look like a non-match
+		PyErr_SetString(PyExc_SystemError, "record class construction failed");
+	}
+
+done:
+	Py_XDECREF(kwnames);
+	if (args != small_args) {
+		PyMem_Free(args);
+	}
+	return res;
 }
 
+/*
+Turns a completed map frame into an object, either a record class instance,
+or a dict. The staged items are released either way. Returns a new reference,
+or NULL on error.
+*/
+static PyObject *
+cbrrr_schema_close_map(const SchemaTable *schema, DCToken *frame)
+{
+	PyObject *res = NULL;
+	Py_ssize_t type_idx = -1;
+
+	if (PyDict_Size(schema->by_type)) {
+		SchemaEntry *entry = cbrrr_schema_lookup_type(schema, frame, &type_idx);
+		if (entry != NULL) {
+			res = cbrrr_schema_build(entry, frame, type_idx);
+			if (res == NULL && PyErr_Occurred()) {
+				goto done;
+			}
+		}
+	}
+	for (size_t i=0; res == NULL && i<schema->num_keysets; i++) {
+		SchemaEntry *entry = &schema->keysets[i];
+		if (entry->keyset_hash != frame->keyset_hash || PyTuple_GET_SIZE(entry->keys) != frame->staged_count) {
+			continue;
+		}
+		res = cbrrr_schema_build(entry, frame, -1); // checks the keys for real
+		if (res == NULL && PyErr_Occurred()) {
+			goto done;
+		}
+	}
+	if (res == NULL) { // fall back to a regular dict
+		res = PyDict_New();
+		if (res == NULL) {
+			goto done;
+		}
+		for (Py_ssize_t i=0; i<frame->staged_count; i++) {
+			if (PyDict_SetItem(res, frame->staged_keys[i].obj, frame->staged_values[i]) < 0) {
+				Py_CLEAR(res);
+				goto done;
+			}
+		}
+	}
+done:
+	cbrrr_schema_release_frame(frame);
+	return res;
+}
 
+/*
+Sets up a freshly parsed map token for staging (see above). The empty dict
+created by cbrrr_parse_token is discarded, and the eventual result will be
+written to *slot when the map is complete.
+*/
 static int
-cbrrr_encode_object(CbrrrBuf *buf, PyObject *obj_in, PyObject* cid_type, int atjson_mode)
+cbrrr_schema_open_map(DCToken *token, PyObject **slot)
 {
-	/*
-	in a slightly unscientific test, frequency counts for each type
-	in an atproto repo looked like this:
+	Py_CLEAR(token->value);
+	token->slot = slot;
+	token->staged_count = 0;
+	token->keyset_hash = 0;
+	token->staged_keys = malloc((token->count ? token->count : 1) * sizeof(*token->staged_keys));
+	token->staged_values = malloc((token->count ? token->count : 1) * sizeof(*token->staged_values));
+	if (token->staged_keys == NULL || token->staged_values == NULL) {
+		free(token->staged_keys);
+		free(token->staged_values);
+		token->staged_keys = NULL;
+		token->staged_values = NULL;
+		PyErr_SetString(PyExc_MemoryError, "malloc failed");
+		return -1;
+	}
+	return 0;
+}
 
-	233805 str
-	135608 bytes
-	88726 cid
-	61775 dict
-	49079 int
-	36341 list
-	12585 none
-	2 bool
-	0 float
-	*/
+/*
+The stack lives in *stack_ptr (which may start out NULL), and is handed back
+there on return so that it can be reused by the next call (see Decoder).
+The caller is responsible for freeing it. If max_depth_out isn't NULL, the
+greatest nesting depth reached is written there (for the probes).
+*/
+static size_t
+cbrrr_parse_object_scratch(CbrrrState *st, const uint8_t *buf, size_t len, PyObject **value, PyObject *cid_ctor, int atjson_mode, const SchemaTable *schema, DCToken **stack_ptr, size_t *stack_len_ptr, size_t *max_depth_out)
+{
+	CbrrrStats *stats = cbrrr_stats();
 
-	size_t stack_len = 16;
-	EncoderStackFrame *encoder_stack = malloc(stack_len * sizeof(*encoder_stack));
+	/* The stack will get realloc'd whenever we run out */
+	/* stack[sp+1] is used like a local variable to hold all parsed tokens */
+	size_t stack_len = *stack_len_ptr;
+	DCToken *parse_stack = *stack_ptr;
 
-	if (encoder_stack == NULL) {
-		PyErr_SetString(PyExc_MemoryError, "malloc failed");
-		return -1;
+	if (parse_stack == NULL) {
+		stack_len = 16;
+		parse_stack = malloc(stack_len * sizeof(*parse_stack));
+		if (parse_stack == NULL) {
+			PyErr_SetString(PyExc_MemoryError, "malloc failed");
+			return -1;
+		}
+		*stack_ptr = parse_stack;
+		*stack_len_ptr = stack_len;
 	}
 
-	encoder_stack[0].dict = NULL;
-	encoder_stack[0].list = NULL;
-	encoder_stack[0].idx = 0;
+	/* pretend that we're parsing an array of length 1
+	   (avoids needing to special-case root-level parsing) */
+	parse_stack[0].type = DCMT_ARRAY;
+	parse_stack[0].value = PyList_New(1);
+	parse_stack[0].count = 1;
 
 	size_t sp = 0;
+	size_t max_sp = 0; // (just for stats/tracing)
+	size_t idx = 0;
 
-	int res = -1; // assume failure by default
+	/* parser stack machine thing... if it looks confusing it's because it is */
 
 	for (;;) {
-		// make sure there's always at least 1 free slot at the top of the stack
-		if ((sp + 1) >= stack_len) {
-			stack_len *= 2; // TODO:PERF: smaller increments?
-			EncoderStackFrame *new_stack = realloc(encoder_stack, stack_len * sizeof(*encoder_stack));
-			if (new_stack == NULL) {
-				PyErr_SetString(PyExc_MemoryError, "realloc failed");
+		if (parse_stack[sp].count == 0) { /* If we're done on this level of the stack */
+			if (sp == 0) { /* no more stack left, parsing is complete! */
+				/* pull the parsed result out of the dummy list of length 1 we created at the start */
+				*value = PyList_GET_ITEM(parse_stack[0].value, 0);
+				Py_XINCREF(*value); // nb: this would be cleaner with Py_XNewRef, available in py3.10+. You could probably drop the X too, I can't think why PyList_GET_ITEM would fail.
 				break;
 			}
-			encoder_stack = new_stack;
+			if (schema != NULL && parse_stack[sp].type == DCMT_MAP) {
+				PyObject *obj = cbrrr_schema_close_map(schema, &parse_stack[sp]);
+				if (obj == NULL) {
+					idx = -1;
+					break;
+				}
+				*parse_stack[sp].slot = obj;
+			}
+			sp -= 1; /* "return" to the previous stack frame */
+			continue;
 		}
 
-		PyObject *obj;
-		if (sp == 0) { // we're at the root level
-			if (encoder_stack[sp].idx > 0) {
-				res = 0;
-				break; // we're done!
+		if (parse_stack[sp].type == DCMT_ARRAY) { /* if we're currently parsing an array */
+			size_t res = cbrrr_parse_token(st, &buf[idx], len-idx, &parse_stack[sp+1], cid_ctor, atjson_mode);
+			if (res == (size_t)-1) {
+				idx = -1;
+				break;
 			}
-			encoder_stack[sp].idx++;
-			obj = obj_in;
-		} else if (encoder_stack[sp].dict == NULL) { // we're working on a list
-			if (encoder_stack[sp].idx >= PySequence_Fast_GET_SIZE(encoder_stack[sp].list)) {
-				sp--;
-				continue;
+			if (stats != NULL) {
+				cbrrr_stats_token(&stats->decode, parse_stack[sp+1].type, res);
 			}
-			obj = PySequence_Fast_GET_ITEM(encoder_stack[sp].list, encoder_stack[sp].idx++); // borrowed ref
-		} else { // we're working on a dict
-			if (encoder_stack[sp].idx >= PySequence_Fast_GET_SIZE(encoder_stack[sp].list)) {
-				Py_DECREF(encoder_stack[sp].list);
-				sp--;
-				continue;
+			//printf("DEBUG: token type %u, start=%lu len=%lu\n", parse_stack[sp+1].type, idx, res);
+			idx += res;
+			Py_ssize_t list_idx = PyList_GET_SIZE(parse_stack[sp].value) - parse_stack[sp].count;
+			parse_stack[sp].count -= 1;
+			if (schema != NULL && parse_stack[sp+1].type == DCMT_MAP) {
+				// the list item stays NULL until the map is complete
+				if (cbrrr_schema_open_map(&parse_stack[sp+1], &PySequence_Fast_ITEMS(parse_stack[sp].value)[list_idx]) < 0) {
+					idx = -1;
+					break;
+				}
+			} else {
+				// move ownership of sp+1 into sp
+				PyList_SET_ITEM(parse_stack[sp].value, list_idx, parse_stack[sp+1].value);
 			}
-			PyObject *key = PySequence_Fast_GET_ITEM(encoder_stack[sp].list, encoder_stack[sp].idx++); // borrowed ref
-			if (!PyUnicode_CheckExact(key)) {
-				PyErr_SetString(PyExc_TypeError, "map keys must be strings");
+		} else { /* if we're currently parsing a map */
+			const uint8_t *str;
+			size_t str_len;
+			size_t res = cbrrr_parse_raw_string(st, &buf[idx], len-idx, DCMT_TEXT_STRING, &str, &str_len);
+			if (res == (size_t)-1) {
+				// panik
+				idx = -1;
 				break;
 			}
-			Py_ssize_t key_len;
-			const char *key_str = PyUnicode_AsUTF8AndSize(key, &key_len);
-			if (key_str == NULL) {
-				break;
+			idx += res;
+			if (stats != NULL) {
+				cbrrr_stats_token(&stats->decode, DCMT_TEXT_STRING, res);
 			}
-			if (cbrrr_write_cbor_varint(buf, DCMT_TEXT_STRING, key_len) < 0) {
+			// check unicode validity before parsing next token to avoid leaking a reference when we bail out
+			PyObject *key = cbrrr_key_cache_lookup(st, str, str_len);
+			if (key == NULL) { // unicode error
+				idx = -1;
 				break;
 			}
-			if (cbrrr_buf_write(buf, (uint8_t *)key_str, key_len) < 0) {
-				break;
+			if (parse_stack[sp].prev_key != NULL) { // don't check the first key
+				if (str_len < parse_stack[sp].prev_key_len) { // key order violation
+					// panik
+					PyObject *tmp = PyUnicode_FromStringAndSize((const char*)parse_stack[sp].prev_key, parse_stack[sp].prev_key_len);
+					PyErr_Format(st->decode_error, "non-canonical map key ordering (len(%R) < len(%R))", key, tmp);
+					Py_DECREF(tmp);
+					Py_DECREF(key);
+					idx = -1;
+					break;
+				} else if (str_len == parse_stack[sp].prev_key_len) { // ditto
+					if (memcmp(str, parse_stack[sp].prev_key, str_len) <= 0) {
+						PyObject *tmp = PyUnicode_FromStringAndSize((const char*)parse_stack[sp].prev_key, parse_stack[sp].prev_key_len);
+						PyErr_Format(st->decode_error, "non-canonical map key ordering (%R <= %R)", key, tmp);
+						Py_DECREF(tmp);
+						Py_DECREF(key);
+						idx = -1;
+						break;
+					}
+				}
 			}
-			obj = PyDict_GetItem(encoder_stack[sp].dict, key); // borrwed ref
-		}
-
-		
-		PyTypeObject *obj_type = Py_TYPE(obj);
+			parse_stack[sp].prev_key = str;
+			parse_stack[sp].prev_key_len = str_len;
 
-		if (obj_type == &PyUnicode_Type) { // string
-			Py_ssize_t string_len;
-			const char *str = PyUnicode_AsUTF8AndSize(obj, &string_len);
-			if (str == NULL) {
+			res = cbrrr_parse_token(st, &buf[idx], len-idx, &parse_stack[sp+1], cid_ctor, atjson_mode);
+			if (res == (size_t)-1) {
+				Py_DECREF(key);
+				idx = -1;
 				break;
 			}
-			if (cbrrr_write_cbor_varint(buf, DCMT_TEXT_STRING, string_len) < 0) {
-				break;
+			if (stats != NULL) {
+				cbrrr_stats_token(&stats->decode, parse_stack[sp+1].type, res);
 			}
-			if (cbrrr_buf_write(buf, (uint8_t *)str, string_len) < 0) {
-				break;
+			//printf("DEBUG: (map value) token type %u, start=%lu len=%lu\n", parse_stack[sp+1].type, idx, res);
+			idx += res;
+
+			if (schema != NULL) { // stage the item, rather than putting it into a dict
+				DCToken *frame = &parse_stack[sp];
+				frame->staged_keys[frame->staged_count].obj = key;
+				frame->staged_keys[frame->staged_count].str = str;
+				frame->staged_keys[frame->staged_count].len = str_len;
+				frame->staged_values[frame->staged_count] = parse_stack[sp+1].value;
+				frame->keyset_hash = cbrrr_keyset_hash_step(frame->keyset_hash, str, str_len);
+				frame->staged_count++;
+				frame->count -= 1;
+				if (parse_stack[sp+1].type == DCMT_MAP) {
+					// the staged value stays NULL until the map is complete
+					frame->staged_values[frame->staged_count - 1] = NULL;
+					if (cbrrr_schema_open_map(&parse_stack[sp+1], &frame->staged_values[frame->staged_count - 1]) < 0) {
+						idx = -1;
+						break;
+					}
+				}
+			} else {
+				// move ownership of sp+1 into sp
+				if(PyDict_SetItem(parse_stack[sp].value, key, parse_stack[sp+1].value) < 0) {
+					Py_DECREF(key);
+					Py_DECREF(parse_stack[sp+1].value);
+					idx = -1;
+					break;
+				}
+				Py_DECREF(key);
+				Py_DECREF(parse_stack[sp+1].value);
+				parse_stack[sp].count -= 1;
 			}
-			continue;
 		}
-		if (obj_type == &PyBytes_Type) { // bytes
-			if (atjson_mode) {
-				PyErr_SetString(PyExc_TypeError, "unexpected bytes object in atjson mode");
-				break;
-			}
-			Py_ssize_t bytes_len;
-			char *bbuf;
-			if(PyBytes_AsStringAndSize(obj, &bbuf, &bytes_len) != 0) {
-				break;
+
+		/* If the token we just parsed was the start of an array or map,
+		   push a new stack frame, growing the stack if necessary */
+		if ((parse_stack[sp+1].type == DCMT_ARRAY) || (parse_stack[sp+1].type == DCMT_MAP)) {
+			sp += 1;
+			max_sp = sp > max_sp ? sp : max_sp;
+			if ((sp + 1) >= stack_len) {
+				stack_len *= 2; // TODO:PERF: smaller increments?
+				DCToken* new_stack = realloc(parse_stack, stack_len * sizeof(*parse_stack));
+				if (new_stack == NULL) {
+					PyErr_SetString(PyExc_MemoryError, "realloc failed");
+					idx = -1;
+					break;
+				}
+				parse_stack = new_stack;
+				*stack_ptr = parse_stack;
+				*stack_len_ptr = stack_len;
+				if (stats != NULL) {
+					stats->decode.stack_reallocs++;
+				}
 			}
-			if (cbrrr_write_cbor_varint(buf, DCMT_BYTE_STRING, bytes_len) < 0) {
-				break;
-			}
-			if (cbrrr_buf_write(buf, (uint8_t*)bbuf, bytes_len) < 0) {
-				break;
-			}
-			continue;
 		}
-		if (obj_type == (PyTypeObject*)cid_type) { // cid
-			if (atjson_mode) {
-				PyErr_SetString(PyExc_TypeError, "unexpected CID object in atjson mode");
-				break;
-			}
-			PyObject *cidbytes_obj = PyObject_CallMethod(obj, "__bytes__", NULL);
-			if (cidbytes_obj == NULL) {
-				break;
-			}
-			Py_ssize_t bytes_len;
-			char *bbuf;
-			const uint8_t nul = 0;
-			if(PyBytes_AsStringAndSize(cidbytes_obj, &bbuf, &bytes_len) != 0) {
-				Py_DECREF(cidbytes_obj);
-				break;
-			}
-			/*if (bytes_len != 36) {
-				PyErr_SetString(PyExc_ValueError, "Invalid CID length");
-				Py_DECREF(cidbytes_obj);
-				break;
-			}*/
-			if (cbrrr_write_cbor_varint(buf, DCMT_TAG, 42) < 0) {
-				Py_DECREF(cidbytes_obj);
-				break;
+	}
+
+	// under non-error conditions, the final GetItem preserves the refcount of the actual result,
+	// but we still want to free the dummy array of length 1 we initially created
+
+	// under error conditions, this *also* acheives the desired effect
+	Py_DecRef(parse_stack[0].value);
+
+	if (idx == (size_t)-1 && schema != NULL) { // free any maps that were still being staged
+		for (size_t i=1; i<=sp; i++) {
+			if (parse_stack[i].type == DCMT_MAP) {
+				cbrrr_schema_release_frame(&parse_stack[i]);
 			}
-			if (cbrrr_write_cbor_varint(buf, DCMT_BYTE_STRING, bytes_len + 1) < 0) {
-				Py_DECREF(cidbytes_obj);
-				break;
+		}
+	}
+
+	int fail_kind = idx == (size_t)-1 ? (int)cbrrr_fail_kind(st) : -1;
+	if (stats != NULL) {
+		stats->decode.calls++;
+		stats->decode.max_depth = max_sp > stats->decode.max_depth ? max_sp : stats->decode.max_depth;
+		if (fail_kind >= 0) {
+			stats->decode.failures[fail_kind]++;
+		} else {
+			stats->decode.bytes += idx;
+		}
+	}
+	if (max_depth_out != NULL) {
+		*max_depth_out = max_sp;
+	}
+	return idx;
+}
+
+static size_t
+cbrrr_parse_object_with_schema(CbrrrState *st, const uint8_t *buf, size_t len, PyObject **value, PyObject *cid_ctor, int atjson_mode, const SchemaTable *schema, size_t *max_depth_out)
+{
+	DCToken *stack = NULL;
+	size_t stack_len = 0;
+	size_t res = cbrrr_parse_object_scratch(st, buf, len, value, cid_ctor, atjson_mode, schema, &stack, &stack_len, max_depth_out);
+	free(stack);
+	return res;
+}
+
+static size_t
+cbrrr_parse_object(CbrrrState *st, const uint8_t *buf, size_t len, PyObject **value, PyObject *cid_ctor, int atjson_mode)
+{
+	return cbrrr_parse_object_with_schema(st, buf, len, value, cid_ctor, atjson_mode, NULL, NULL);
+}
+
+
+/*
+Builds the python object for a single (non-container) tape entry. If the
+buffer is mutable, its contents may have changed since the tape was recorded
+(the validation happened without the GIL), so nothing that could go on to
+break python's invariants is taken on trust.
+*/
+static PyObject *
+cbrrr_tape_value(CbrrrState *st, const uint8_t *buf, int buf_mutable, const CbrrrTapeEntry *entry, PyObject *cid_ctor, int atjson_mode)
+{
+	switch (entry->kind)
+	{
+	case TAPE_UNSIGNED_INT:
+		return PyLong_FromUnsignedLongLong(entry->value);
+	case TAPE_NEGATIVE_INT:
+		if (entry->value <= INT64_MAX) {
+			return PyLong_FromLongLong(-1 - (long long)entry->value);
+		} else {
+			PyObject *tmp = PyLong_FromUnsignedLongLong(entry->value);
+			if (tmp == NULL) {
+				return NULL;
 			}
-			if (cbrrr_buf_write(buf, &nul, sizeof(nul)) < 0) {
-				Py_DECREF(cidbytes_obj);
+			PyObject *res = PyNumber_Invert(tmp);
+			Py_DECREF(tmp);
+			return res;
+		}
+	case TAPE_BYTE_STRING:
+		if (atjson_mode) {
+			return cbrrr_atjson_wrap(st->string_bytes, cbrrr_bytes_to_b64_string_nopad((uint8_t*)&buf[entry->offset], entry->value));
+		}
+		return PyBytes_FromStringAndSize((const char*)&buf[entry->offset], entry->value);
+	case TAPE_TEXT_STRING:
+		return PyUnicode_DecodeUTF8((const char *)&buf[entry->offset], entry->value, NULL);
+	case TAPE_ASCII_STRING:
+		if (buf_mutable) { // i.e. check it's still ASCII
+			return cbrrr_unicode_from_utf8(&buf[entry->offset], entry->value);
+		}
+		return cbrrr_unicode_from_ascii(&buf[entry->offset], entry->value);
+	case TAPE_CID: // slice off the leading 0
+		if (atjson_mode) {
+			return cbrrr_atjson_wrap(st->string_link, cbrrr_bytes_to_b32_multibase(&buf[entry->offset + 1], entry->value - 1));
+		}
+		return cbrrr_cid_from_raw(st, cid_ctor, &buf[entry->offset + 1], entry->value - 1);
+	case TAPE_FLOAT:
+		return PyFloat_FromDouble(((union {uint64_t num; double dub;}){.num=entry->value}).dub);
+	case TAPE_FALSE:
+		Py_RETURN_FALSE;
+	case TAPE_TRUE:
+		Py_RETURN_TRUE;
+	case TAPE_NULL:
+		Py_RETURN_NONE;
+	case TAPE_ARRAY:
+		return PyList_New(entry->value);
+	case TAPE_MAP:
+		return PyDict_New();
+	default:
+		PyErr_Format(PyExc_AssertionError, "you reached unreachable code??? (kind=%d)", (int)entry->kind);
+		return NULL;
+	}
+}
+
+typedef struct {
+	PyObject *value;
+	uint64_t remaining;
+	int is_map;
+} TapeFrame;
+
+/*
+Builds the python object recorded in a tape (which has already been fully
+validated), with the same stack machine shape as cbrrr_parse_object.
+Returns a new reference, or NULL on error.
+*/
+static PyObject *
+cbrrr_tape_build(CbrrrState *st, const uint8_t *buf, int buf_mutable, const CbrrrTape *tape, PyObject *cid_ctor, int atjson_mode)
+{
+	size_t stack_len = 16;
+	TapeFrame *stack = malloc(stack_len * sizeof(*stack));
+	if (stack == NULL) {
+		PyErr_SetString(PyExc_MemoryError, "malloc failed");
+		return NULL;
+	}
+
+	/* pretend that we're parsing an array of length 1, as usual */
+	stack[0].value = PyList_New(1);
+	stack[0].remaining = 1;
+	stack[0].is_map = 0;
+	if (stack[0].value == NULL) {
+		free(stack);
+		return NULL;
+	}
+
+	size_t sp = 0;
+	size_t i = 0;
+	PyObject *res = NULL;
+
+	for (;;) {
+		TapeFrame *frame = &stack[sp];
+		if (frame->remaining == 0) {
+			if (sp == 0) {
+				res = PyList_GET_ITEM(stack[0].value, 0);
+				Py_INCREF(res);
 				break;
 			}
-			if (cbrrr_buf_write(buf, (uint8_t*)bbuf, bytes_len) < 0) {
-				Py_DECREF(cidbytes_obj);
+			sp -= 1;
+			continue;
+		}
+		frame->remaining -= 1;
+
+		PyObject *key = NULL;
+		if (frame->is_map) {
+			key = cbrrr_key_cache_lookup_hashed(st, &buf[tape->entries[i].offset], tape->entries[i].value, tape->entries[i].key_hash);
+			i++;
+			if (key == NULL) {
 				break;
 			}
-			Py_DECREF(cidbytes_obj);
-			continue;
 		}
-		if (obj_type == &PyDict_Type) { // dict
-			PyObject *keys = PyDict_Keys(obj);
-			if (keys == NULL) {
+
+		const CbrrrTapeEntry *entry = &tape->entries[i++];
+		PyObject *value = cbrrr_tape_value(st, buf, buf_mutable, entry, cid_ctor, atjson_mode);
+		if (value == NULL) {
+			Py_XDECREF(key);
+			break;
+		}
+		if (frame->is_map) {
+			int set_res = PyDict_SetItem(frame->value, key, value);
+			Py_DECREF(key);
+			Py_DECREF(value); // nb: still referenced by the dict, if the insertion succeeded
+			if (set_res < 0) {
 				break;
 			}
-			if (atjson_mode && PySequence_Fast_GET_SIZE(keys) == 1) {// logic for $link, $bytes
-				PyObject *key = PySequence_Fast_GET_ITEM(keys, 0);
-				if (!PyUnicode_CheckExact(key)) {
-					PyErr_SetString(PyExc_TypeError, "map keys must be strings");
-					Py_DECREF(keys);
-					break;
-				}
-				Py_ssize_t string_len;
-				const char *str = PyUnicode_AsUTF8AndSize(key, &string_len); // does this fail gracefully if the item is not a string?
-				if (str == NULL) {
-					Py_DECREF(keys);
+		} else {
+			// move ownership into the list
+			PyList_SET_ITEM(frame->value, PyList_GET_SIZE(frame->value) - frame->remaining - 1, value);
+		}
+
+		if (entry->kind == TAPE_ARRAY || entry->kind == TAPE_MAP) {
+			sp += 1;
+			if (sp >= stack_len) {
+				stack_len *= 2;
+				TapeFrame *new_stack = realloc(stack, stack_len * sizeof(*stack));
+				if (new_stack == NULL) {
+					PyErr_SetString(PyExc_MemoryError, "realloc failed");
 					break;
 				}
-				if (string_len == 5 && strcmp(str, "$link") == 0) { // CID
-					PyObject *cid_str = PyDict_GetItem(obj, key); // borrowed
-					Py_DECREF(keys);
-					if (!PyUnicode_CheckExact(cid_str)) { // also handles the case where b64_str is NULL
-						PyErr_SetString(PyExc_TypeError, "$link field value must be a string");
-						break;
-					}
-					str = PyUnicode_AsUTF8AndSize(cid_str, &string_len); // reusing these variables
-					if (str == NULL) {
-						break;
-					}
-					if (cbrrr_write_cbor_varint(buf, DCMT_TAG, 42) < 0) {
-						break;
-					}
-					if (cbrrr_write_cbor_bytes_from_multibase_b32_nopad(buf, (uint8_t*)str, string_len) < 0) {
-						break;
-					}
-					continue;
-				}
-				if (string_len == 6 && strcmp(str, "$bytes") == 0) { // bytes
-					PyObject *b64_str = PyDict_GetItem(obj, key); // borrowed
-					Py_DECREF(keys);
-					if (!PyUnicode_CheckExact(b64_str)) { // also handles the case where b64_str is NULL
-						PyErr_SetString(PyExc_TypeError, "$bytes field value must be a string");
-						break;
-					}
-					str = PyUnicode_AsUTF8AndSize(b64_str, &string_len); // reusing these variables
-					if (str == NULL) {
-						break;
-					}
-					if (cbrrr_write_cbor_bytes_from_b64(buf, (uint8_t*)str, string_len) < 0) {
-						break;
-					}
-					continue;
-				}
-				// fallthru
-			}
-			if (PySequence_Fast_GET_SIZE(keys) > 1) { /* don't try to sort empty or 1-length lists! */
-				qsort( // it's a bit janky but we can sort the key list in-place, I think?
-					PySequence_Fast_ITEMS(keys),
-					PySequence_Fast_GET_SIZE(keys),
-					sizeof(PyObject*),
-					cbrrr_compare_map_keys
-				);
-			}
-			if (cbrrr_write_cbor_varint(buf, DCMT_MAP, PySequence_Fast_GET_SIZE(keys)) < 0) {
-				Py_DECREF(keys);
-				break;
+				stack = new_stack;
 			}
-			sp++;
-			encoder_stack[sp].dict = obj;
-			encoder_stack[sp].list = keys;
-			encoder_stack[sp].idx = 0;
+			stack[sp].value = value; // borrowed, the parent owns it
+			stack[sp].remaining = entry->value;
+			stack[sp].is_map = entry->kind == TAPE_MAP;
+		}
+	}
+
+	Py_DECREF(stack[0].value);
+	free(stack);
+	return res;
+}
+
+/*
+decode_many: decodes a batch of independent DAG-CBOR buffers.
+
+Phase one validates each buffer into a tape (see above), which doesn't need
+the GIL, so it's spread across worker threads. Phase two builds the python
+objects from the tapes, back on the calling thread, with the GIL held.
+
+The buffers are processed in chunks, so that the tapes are still in cache by
+the time phase two gets to them, and so that the workers can be validating
+the next chunk while the calling thread builds the objects for this one.
+The threads are started via python's own (portable) thread API, and share
+the work within a chunk by atomically claiming the next unprocessed buffer.
+*/
+
+#define CBRRR_DECODE_MANY_CHUNK 1024
+
+/* when picking the number of threads automatically, each one has to have at
+   least this much input to validate to be worth starting */
+#define CBRRR_DECODE_MANY_BYTES_PER_THREAD 0x40000
+
+typedef struct {
+	CbrrrTape tape;
+	size_t length; // consumed length, or -1
+	CbrrrError err;
+	size_t err_offset;
+} DecodeManyResult;
+
+typedef struct {
+	Py_buffer *bufs;
+	DecodeManyResult *results;
+	Py_ssize_t next; // the next buffer to be claimed (atomic)
+	Py_ssize_t end; // end of the current chunk
+	int stop; // tells the workers to exit
+} DecodeManyJob;
+
+typedef struct {
+	DecodeManyJob *job;
+	PyThread_type_lock go; // released to start work on a chunk
+	PyThread_type_lock done; // released when the worker has finished a chunk
+} DecodeManyWorker;
+
+static void
+cbrrr_decode_many_work(DecodeManyJob *job)
+{
+	for (;;) {
+		Py_ssize_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->end) {
+			return;
+		}
+		DecodeManyResult *result = &job->results[i];
+		result->length = cbrrr_validate_object(job->bufs[i].buf, job->bufs[i].len, &result->err, &result->err_offset, &result->tape);
+	}
+}
+
+static void
+cbrrr_decode_many_worker(void *arg)
+{
+	DecodeManyWorker *worker = arg;
+	for (;;) {
+		PyThread_acquire_lock(worker->go, WAIT_LOCK);
+		if (worker->job->stop) {
+			PyThread_release_lock(worker->done);
+			return;
+		}
+		cbrrr_decode_many_work(worker->job);
+		PyThread_release_lock(worker->done);
+	}
+}
+
+// sets up phase one for the chunk starting at `start`, and sets the workers going on it
+static void
+cbrrr_decode_many_start_chunk(DecodeManyJob *job, DecodeManyWorker *workers, Py_ssize_t num_workers, Py_ssize_t start, Py_ssize_t num_bufs)
+{
+	job->next = start;
+	job->end = num_bufs - start > CBRRR_DECODE_MANY_CHUNK ? start + CBRRR_DECODE_MANY_CHUNK : num_bufs;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); // nb: the locks should imply this anyway
+	for (Py_ssize_t i=0; i<num_workers; i++) {
+		PyThread_release_lock(workers[i].go);
+	}
+}
+
+// helps out with the current chunk, and then waits for the workers to finish it (without the GIL)
+static void
+cbrrr_decode_many_finish_chunk(DecodeManyJob *job, DecodeManyWorker *workers, Py_ssize_t num_workers)
+{
+	cbrrr_decode_many_work(job);
+	for (Py_ssize_t i=0; i<num_workers; i++) {
+		PyThread_acquire_lock(workers[i].done, WAIT_LOCK);
+	}
+}
+
+// builds the objects for one chunk of buffers into res. Returns -1 on error
+static int
+cbrrr_decode_many_build_chunk(CbrrrState *st, DecodeManyJob *job, PyObject *res, Py_ssize_t start, Py_ssize_t end, PyObject *cid_ctor, int atjson_mode)
+{
+	for (Py_ssize_t i=start; i<end; i++) {
+		DecodeManyResult *result = &job->results[i];
+		if (result->length == (size_t)-1) {
+			cbrrr_raise_validation_error_in(st, result->err, result->err_offset, i);
+			return -1;
+		}
+		if (result->length != (size_t)job->bufs[i].len) {
+			PyErr_Format(PyExc_ValueError, "did not parse to end of buffer (buffer %zd)", i);
+			return -1;
+		}
+		int buf_mutable = !PyBytes_CheckExact(job->bufs[i].obj); // e.g. a bytearray, which cid_ctor might even modify
+		PyObject *value = cbrrr_tape_build(st, job->bufs[i].buf, buf_mutable, &result->tape, cid_ctor, atjson_mode);
+		if (value == NULL) {
+			return -1;
+		}
+		PyList_SET_ITEM(res, i, value);
+		free(result->tape.entries); // we're done with it, might as well free it early
+		result->tape.entries = NULL;
+	}
+	return 0;
+}
+
+static PyObject *
+cbrrr_decode_many(PyObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	PyObject *buffers;
+	PyObject *cid_ctor;
+	int atjson_mode;
+	Py_ssize_t num_threads;
+	int auto_threads = 0; // if set, num_threads is only an upper limit
+
+	if (!PyArg_ParseTuple(args, "OOpn|p", &buffers, &cid_ctor, &atjson_mode, &num_threads, &auto_threads)) {
+		return NULL;
+	}
+
+	PyObject *bufs_seq = PySequence_Fast(buffers, "buffers must be a sequence");
+	if (bufs_seq == NULL) {
+		return NULL;
+	}
+
+	PyObject *res = NULL;
+	DecodeManyJob job = {NULL, NULL, 0, 0, 0};
+	DecodeManyWorker *workers = NULL;
+	Py_ssize_t num_workers = 0, num_acquired = 0;
+	Py_ssize_t num_bufs = PySequence_Fast_GET_SIZE(bufs_seq);
+
+	job.bufs = PyMem_Calloc(num_bufs ? num_bufs : 1, sizeof(*job.bufs));
+	job.results = PyMem_Calloc(num_bufs ? num_bufs : 1, sizeof(*job.results));
+	res = PyList_New(num_bufs);
+	if (job.bufs == NULL || job.results == NULL || res == NULL) {
+		if (res != NULL) {
+			PyErr_NoMemory();
+		}
+		goto error;
+	}
+	size_t total_len = 0;
+	for (; num_acquired < num_bufs; num_acquired++) {
+		if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(bufs_seq, num_acquired), &job.bufs[num_acquired], PyBUF_SIMPLE) < 0) {
+			goto error;
+		}
+		total_len += job.bufs[num_acquired].len;
+	}
+
+	/* There's no point having more threads than there are buffers in a chunk,
+	   and the calling thread does its share of the work too. If we fail to
+	   start a thread, that's fine, the others will pick up the slack.
+	   Threads are started afresh for each call, so for small batches, it's
+	   cheaper not to bother. */
+	if (auto_threads && (size_t)num_threads > total_len / CBRRR_DECODE_MANY_BYTES_PER_THREAD) {
+		num_threads = total_len / CBRRR_DECODE_MANY_BYTES_PER_THREAD;
+	}
+	if (num_threads > num_bufs) {
+		num_threads = num_bufs;
+	}
+	if (num_threads > CBRRR_DECODE_MANY_CHUNK) {
+		num_threads = CBRRR_DECODE_MANY_CHUNK;
+	}
+	if (num_threads > 1) {
+		workers = PyMem_Calloc(num_threads - 1, sizeof(*workers));
+		if (workers == NULL) {
+			PyErr_NoMemory();
+			goto error;
+		}
+	}
+	for (; num_workers < num_threads - 1; num_workers++) {
+		DecodeManyWorker *worker = &workers[num_workers];
+		worker->job = &job;
+		worker->go = PyThread_allocate_lock();
+		worker->done = PyThread_allocate_lock();
+		if (worker->go == NULL || worker->done == NULL) {
+			goto free_worker;
+		}
+		PyThread_acquire_lock(worker->go, WAIT_LOCK);
+		PyThread_acquire_lock(worker->done, WAIT_LOCK);
+		if (PyThread_start_new_thread(cbrrr_decode_many_worker, worker) != PYTHREAD_INVALID_THREAD_ID) {
 			continue;
 		}
-		if (obj_type ==  &PyLong_Type) { // int
-			// we can't really do the range checks on the C side because the
-			// overflow would happen before we can detect it.
-			if (PyObject_RichCompareBool(obj, PY_ZERO, Py_GE)) {
-				if (PyObject_RichCompareBool(obj, PY_UINT64_MAX, Py_GT)) {
-					PyErr_SetString(PyExc_ValueError, "integer out of range");
-					break;
-				}
-				if (cbrrr_write_cbor_varint(buf, DCMT_UNSIGNED_INT, PyLong_AsUnsignedLongLongMask(obj)) < 0) {
-					break;
-				}
-			} else {
-				if (PyObject_RichCompareBool(obj, PY_UINT64_MAX_INVERTED, Py_LT)) {
-					PyErr_SetString(PyExc_ValueError, "integer out of range");
-					break;
-				}
-				if (cbrrr_write_cbor_varint(buf, DCMT_NEGATIVE_INT, ~PyLong_AsUnsignedLongLongMask(obj)) < 0) {
-					break;
-				}
-			}
-			continue;
+	free_worker:
+		if (worker->go != NULL) {
+			PyThread_free_lock(worker->go);
+		}
+		if (worker->done != NULL) {
+			PyThread_free_lock(worker->done);
+		}
+		break;
+	}
+
+	// phase one for the first chunk
+	cbrrr_decode_many_start_chunk(&job, workers, num_workers, 0, num_bufs);
+	Py_BEGIN_ALLOW_THREADS
+	cbrrr_decode_many_finish_chunk(&job, workers, num_workers);
+	Py_END_ALLOW_THREADS
+
+	int failed = 0;
+	for (Py_ssize_t start=0; start<num_bufs; start+=CBRRR_DECODE_MANY_CHUNK) {
+		Py_ssize_t end = job.end;
+		int more = end < num_bufs;
+		if (more) { // get the workers going on the next chunk...
+			cbrrr_decode_many_start_chunk(&job, workers, num_workers, end, num_bufs);
+		}
+		// ...while we build this one
+		failed = cbrrr_decode_many_build_chunk(st, &job, res, start, end, cid_ctor, atjson_mode) < 0;
+		if (more) {
+			Py_BEGIN_ALLOW_THREADS
+			cbrrr_decode_many_finish_chunk(&job, workers, num_workers);
+			Py_END_ALLOW_THREADS
+		}
+		if (failed) {
+			break;
+		}
+	}
+
+	// tell the workers to exit, and wait for them to do so
+	job.stop = 1;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (Py_ssize_t i=0; i<num_workers; i++) {
+		PyThread_release_lock(workers[i].go);
+	}
+	Py_BEGIN_ALLOW_THREADS
+	for (Py_ssize_t i=0; i<num_workers; i++) {
+		PyThread_acquire_lock(workers[i].done, WAIT_LOCK);
+		PyThread_free_lock(workers[i].go);
+		PyThread_free_lock(workers[i].done);
+	}
+	Py_END_ALLOW_THREADS
+
+	if (failed) {
+		goto error;
+	}
+	goto done;
+
+error:
+	Py_CLEAR(res);
+done:
+	for (Py_ssize_t i=0; i<num_acquired; i++) {
+		PyBuffer_Release(&job.bufs[i]);
+	}
+	if (job.results != NULL) {
+		for (Py_ssize_t i=0; i<num_bufs; i++) {
+			free(job.results[i].tape.entries);
+		}
+	}
+	PyMem_Free(job.bufs);
+	PyMem_Free(job.results);
+	PyMem_Free(workers);
+	Py_DECREF(bufs_seq);
+	return res;
+}
+
+// METH_FASTCALL functions have to check their own argument counts
+static int
+cbrrr_check_nargs(const char *name, Py_ssize_t nargs, Py_ssize_t min, Py_ssize_t max)
+{
+	if (nargs < min || nargs > max) {
+		if (min == max) {
+			PyErr_Format(PyExc_TypeError, "%s() takes exactly %zd arguments (%zd given)", name, min, nargs);
+		} else {
+			PyErr_Format(PyExc_TypeError, "%s() takes %zd to %zd arguments (%zd given)", name, min, max, nargs);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *
+cbrrr_decode_dag_cbor(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	Py_buffer buf;
+	PyObject *cid_ctor;
+	int atjson_mode;
+	PyObject *schema = Py_None;
+
+	if (cbrrr_check_nargs("decode_dag_cbor", nargs, 3, 4) < 0) {
+		return NULL;
+	}
+	cid_ctor = args[1];
+	atjson_mode = PyObject_IsTrue(args[2]);
+	if (atjson_mode < 0) {
+		return NULL;
+	}
+	if (nargs > 3) {
+		schema = args[3];
+	}
+	if (PyObject_GetBuffer(args[0], &buf, PyBUF_SIMPLE) < 0) {
+		return NULL;
+	}
+
+	SchemaTable *table = NULL;
+	if (schema != Py_None) {
+		if (!PyObject_TypeCheck(schema, st->schema_type)) {
+			PyBuffer_Release(&buf);
+			PyErr_SetString(PyExc_TypeError, "schema must be a Schema instance, or None");
+			return NULL;
+		}
+		table = cbrrr_schema_table_acquire((SchemaObject *)schema);
+	}
+
+	PyObject *value = NULL;
+	size_t max_depth = 0;
+
+	CBRRR_PROBE2(decode__start, buf.buf, buf.len);
+	size_t res = cbrrr_parse_object_with_schema(st, buf.buf, buf.len, &value, cid_ctor, atjson_mode, table, &max_depth);
+	CBRRR_PROBE4(decode__done, buf.len, res, max_depth, res == (size_t)-1 ? (int)cbrrr_fail_kind(st) + 1 : 0);
+	PyBuffer_Release(&buf);
+	if (table != NULL) {
+		cbrrr_schema_table_decref(table);
+	}
+
+	if (res == (size_t)-1) {
+		return NULL;
+	}
+
+	PyObject *lenvar = PyLong_FromUnsignedLongLong(res);
+
+	PyObject *restuple = PyTuple_Pack(2, value, lenvar);
+	Py_DECREF(value);
+	Py_DECREF(lenvar);
+
+	return restuple;
+}
+
+/*
+unsigned LEB128, as used by CAR section framing (and within CIDs).
+https://github.com/multiformats/unsigned-varint
+Returns the number of bytes parsed, or -1 on error (setting a python exception)
+*/
+static size_t
+cbrrr_parse_uvarint(CbrrrState *st, const uint8_t *buf, size_t len, uint64_t *value)
+{
+	uint64_t res = 0;
+	for (size_t i=0; i<9; i++) { // the spec limits varints to 9 bytes (63 bits)
+		if (i >= len) {
+			PyErr_SetString(st->decode_error, "not enough bytes left in buffer");
+			return -1;
+		}
+		res |= (uint64_t)(buf[i] & 0x7f) << (i * 7);
+		if (!(buf[i] & 0x80)) {
+			if (i > 0 && buf[i] == 0) {
+				PyErr_SetString(st->decode_error, "varint not minimally encoded");
+				return -1;
+			}
+			*value = res;
+			return i + 1;
+		}
+	}
+	PyErr_SetString(st->decode_error, "varint too long");
+	return -1;
+}
+
+#define CBRRR_MULTICODEC_DAG_PB 0x70
+#define CBRRR_MULTICODEC_DAG_CBOR 0x71
+
+/*
+Figures out how long a binary CID is, without copying it anywhere.
+Returns the length of the CID, or -1 on error (setting a python exception).
+The CID's codec is stored in `codec`.
+*/
+static size_t
+cbrrr_parse_cid_length(CbrrrState *st, const uint8_t *buf, size_t len, uint64_t *codec)
+{
+	uint64_t version, mh_type, mh_len;
+	size_t idx = 0, res;
+
+	if (len >= 2 && buf[0] == 0x12 && buf[1] == 0x20) { // CIDv0 (a bare sha256 multihash)
+		if (len < 34) {
+			PyErr_SetString(st->decode_error, "not enough bytes left in buffer");
+			return -1;
+		}
+		*codec = CBRRR_MULTICODEC_DAG_PB;
+		return 34;
+	}
+
+	if ((res = cbrrr_parse_uvarint(st, buf, len, &version)) == (size_t)-1) {
+		return -1;
+	}
+	idx += res;
+	if (version != 1) {
+		PyErr_Format(st->decode_error, "unsupported CID version (%llu)", (unsigned long long)version);
+		return -1;
+	}
+	if ((res = cbrrr_parse_uvarint(st, &buf[idx], len-idx, codec)) == (size_t)-1) {
+		return -1;
+	}
+	idx += res;
+	if ((res = cbrrr_parse_uvarint(st, &buf[idx], len-idx, &mh_type)) == (size_t)-1) {
+		return -1;
+	}
+	idx += res;
+	if ((res = cbrrr_parse_uvarint(st, &buf[idx], len-idx, &mh_len)) == (size_t)-1) {
+		return -1;
+	}
+	idx += res;
+	if (mh_len > len - idx) {
+		PyErr_SetString(st->decode_error, "not enough bytes left in buffer");
+		return -1;
+	}
+	return idx + mh_len;
+}
+
+/*
+Parses the header at the start of a CAR, which must be a DAG-CBOR map with
+"version": 1. Returns the header's length (including the varint prefix), or
+-1 on error (setting a python exception).
+*/
+static size_t
+cbrrr_car_parse_header(CbrrrState *st, const uint8_t *data, size_t len, PyObject **header, PyObject *cid_ctor, int atjson_mode)
+{
+	uint64_t section_len;
+	size_t idx, res;
+
+	/* varint length prefix followed by a DAG-CBOR map */
+	if ((idx = cbrrr_parse_uvarint(st, data, len, &section_len)) == (size_t)-1) {
+		return -1;
+	}
+	if (section_len > len - idx) {
+		PyErr_SetString(st->decode_error, "not enough bytes left in buffer");
+		return -1;
+	}
+	res = cbrrr_parse_object(st, &data[idx], section_len, header, cid_ctor, atjson_mode);
+	if (res == (size_t)-1) {
+		return -1;
+	}
+	if (res != section_len) {
+		PyErr_SetString(st->decode_error, "did not parse to end of CAR header");
+		goto fail;
+	}
+	if (!PyDict_CheckExact(*header)) {
+		PyErr_SetString(st->decode_error, "CAR header is not a map");
+		goto fail;
+	}
+	PyObject *version = PyDict_GetItemString(*header, "version"); // borrowed
+	if (version == NULL || !PyLong_CheckExact(version) || PyLong_AsLong(version) != 1) {
+		PyErr_SetString(st->decode_error, "unsupported CAR version");
+		goto fail;
+	}
+	return idx + res;
+
+fail:
+	Py_CLEAR(*header);
+	return -1;
+}
+
+/*
+Parses the block section at data[*idx] (a varint length prefix, then a CID,
+then the block data), and advances *idx past it. Returns 0 on success, or -1
+on error (setting a python exception).
+*/
+static int
+cbrrr_car_parse_section(CbrrrState *st, const uint8_t *data, size_t len, size_t *idx, const uint8_t **cid, size_t *cid_len, uint64_t *codec, const uint8_t **block, size_t *block_len)
+{
+	uint64_t section_len;
+	size_t res;
+
+	if ((res = cbrrr_parse_uvarint(st, &data[*idx], len - *idx, &section_len)) == (size_t)-1) {
+		return -1;
+	}
+	*idx += res;
+	if (section_len > len - *idx) {
+		PyErr_SetString(st->decode_error, "not enough bytes left in buffer");
+		return -1;
+	}
+	*cid_len = cbrrr_parse_cid_length(st, &data[*idx], section_len, codec);
+	if (*cid_len == (size_t)-1) {
+		return -1;
+	}
+	*cid = &data[*idx];
+	*block = &data[*idx + *cid_len];
+	*block_len = section_len - *cid_len;
+	*idx += section_len;
+	return 0;
+}
+
+static PyObject *
+cbrrr_decode_car(PyObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	Py_buffer buf;
+	PyObject *cid_ctor;
+	int atjson_mode;
+
+	if (!PyArg_ParseTuple(args, "y*Op", &buf, &cid_ctor, &atjson_mode)) {
+		return NULL;
+	}
+
+	const uint8_t *data = buf.buf;
+	size_t len = buf.len;
+	size_t idx, res;
+	PyObject *header = NULL, *blocks = NULL, *result = NULL;
+
+	if ((idx = cbrrr_car_parse_header(st, data, len, &header, cid_ctor, atjson_mode)) == (size_t)-1) {
+		goto done;
+	}
+
+	blocks = PyDict_New();
+	if (blocks == NULL) {
+		goto done;
+	}
+
+	while (idx < len) {
+		const uint8_t *cid_data, *block_data;
+		size_t cid_len, block_len;
+		uint64_t codec;
+		if (cbrrr_car_parse_section(st, data, len, &idx, &cid_data, &cid_len, &codec, &block_data, &block_len) < 0) {
+			goto done;
+		}
+
+		PyObject *block;
+		if (codec == CBRRR_MULTICODEC_DAG_CBOR) {
+			res = cbrrr_parse_object(st, block_data, block_len, &block, cid_ctor, atjson_mode);
+			if (res == (size_t)-1) {
+				goto done;
+			}
+			if (res != block_len) {
+				Py_DECREF(block);
+				PyErr_SetString(st->decode_error, "did not parse to end of CAR block");
+				goto done;
+			}
+		} else { // raw, or some other codec we don't know how to parse
+			block = PyBytes_FromStringAndSize((const char*)block_data, block_len);
+			if (block == NULL) {
+				goto done;
+			}
+		}
+
+		PyObject *cid = cbrrr_cid_from_raw(st, cid_ctor, cid_data, cid_len);
+		if (cid == NULL) {
+			Py_DECREF(block);
+			goto done;
+		}
+		int set_res = PyDict_SetItem(blocks, cid, block);
+		Py_DECREF(cid);
+		Py_DECREF(block);
+		if (set_res < 0) {
+			goto done;
+		}
+	}
+
+	result = PyTuple_Pack(2, header, blocks);
+
+done:
+	Py_XDECREF(header);
+	Py_XDECREF(blocks);
+	PyBuffer_Release(&buf);
+	return result;
+}
+
+/*
+StreamDecoder: decodes a stream of back-to-back DAG-CBOR objects that arrives
+in arbitrarily-sized chunks.
+
+We don't try to keep half-built python objects (i.e. a DCToken stack) around
+between feed() calls. Instead, a cheap framing scanner keeps track of how many
+items are still outstanding at each nesting level (a stack of integers, which
+is trivially resumable), and once a complete top-level object has been
+buffered, it's handed over to cbrrr_parse_object() for strict decoding. So each
+byte is looked at twice (once by each), and the current (incomplete) object is
+buffered in full: peak memory is the largest object, plus a chunk.
+
+Since the framing scanner would otherwise happily wait forever for a string or
+container whose header claims to be enormous, objects are limited to
+max_object_size bytes, and we raise as soon as we know one will be bigger.
+*/
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *cid_ctor;
+	int atjson_mode;
+	int failed; // set once we've raised a decode error, since we can't resync after that
+	size_t max_object_size; // SIZE_MAX for no limit
+
+	uint8_t *buf; // buffered input. buf[0] is always the start of the next object
+	size_t buf_len;
+	size_t buf_cap;
+	size_t scan_idx; // how far into buf the framing scanner has got
+
+	uint64_t *pending; // number of items still expected at each nesting level
+	size_t depth;
+	size_t pending_cap;
+} StreamDecoderObject;
+
+// number of additional bytes following a CBOR head, or -1 if the extra info is invalid
+static int
+cbrrr_head_extra_len(uint8_t info)
+{
+	if (info < 24) {
+		return 0;
+	}
+	if (info <= 27) {
+		return 1 << (info - 24);
+	}
+	return -1;
+}
+
+/*
+Advances the framing scanner as far as the buffered data allows, for the
+object that starts at obj_start.
+Returns 1 if a complete top-level object ends at scan_idx, 0 if we need more
+data, -1 if the framing is invalid (in which case the strict parser will
+produce a more helpful error message), -2 on allocation failure, or -3 if the
+object would be larger than max_object_size.
+*/
+static int
+cbrrr_stream_scan(StreamDecoderObject *self, size_t obj_start)
+{
+	if (self->depth == 0) { /* pretend we're parsing an array of length 1 */
+		self->pending[0] = 1;
+		self->depth = 1;
+	}
+
+	while (self->scan_idx < self->buf_len) {
+		size_t avail = self->buf_len - self->scan_idx;
+		const uint8_t *head = &self->buf[self->scan_idx];
+		DCMajorType type = head[0] >> 5;
+		int extra = cbrrr_head_extra_len(head[0] & 0x1f);
+		uint64_t value = head[0] & 0x1f;
+
+		if (extra < 0) {
+			return -1;
+		}
+		if (avail < (size_t)extra + 1) {
+			return 0;
+		}
+		if (extra > 0) {
+			value = 0;
+			for (int i=0; i<extra; i++) {
+				value = value << 8 | head[1 + i];
+			}
+		}
+
+		size_t item_len = 1 + extra;
+		uint64_t children = 0;
+		size_t allowance = self->max_object_size - (self->scan_idx - obj_start); // how much more this object may grow
+		if (item_len > allowance) {
+			return -3;
+		}
+		allowance -= item_len;
+
+		switch (type)
+		{
+		case DCMT_BYTE_STRING:
+		case DCMT_TEXT_STRING:
+			if (value > allowance) {
+				return -3;
+			}
+			if (value > avail - item_len) {
+				return 0;
+			}
+			item_len += value;
+			break;
+		case DCMT_ARRAY:
+			children = value;
+			break;
+		case DCMT_MAP:
+			if (value > UINT64_MAX / 2) {
+				return -1;
+			}
+			children = value * 2;
+			break;
+		case DCMT_TAG:
+			/* the tagged item follows, and completes the current item on our behalf */
+			self->scan_idx += item_len;
+			continue;
+		default: // ints, floats and simple values have nothing more to them
+			break;
+		}
+
+		self->scan_idx += item_len;
+		self->pending[self->depth - 1] -= 1;
+
+		if (children > 0) {
+			if (children > allowance) { // every child takes at least a byte
+				return -3;
+			}
+			if (self->depth == self->pending_cap) {
+				uint64_t *new_pending = realloc(self->pending, self->pending_cap * 2 * sizeof(*self->pending));
+				if (new_pending == NULL) {
+					PyErr_SetString(PyExc_MemoryError, "realloc failed");
+					return -2;
+				}
+				self->pending = new_pending;
+				self->pending_cap *= 2;
+			}
+			self->pending[self->depth++] = children;
+			continue;
+		}
+
+		while (self->depth > 0 && self->pending[self->depth - 1] == 0) {
+			self->depth--;
+		}
+		if (self->depth == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int
+StreamDecoder_init_locked(StreamDecoderObject *self, PyObject *cid_ctor, int atjson_mode, Py_ssize_t max_object_size)
+{
+	if (self->pending == NULL) {
+		self->pending_cap = 16;
+		self->pending = malloc(self->pending_cap * sizeof(*self->pending));
+		if (self->pending == NULL) {
+			PyErr_SetString(PyExc_MemoryError, "malloc failed");
+			return -1;
+		}
+	}
+
+	Py_INCREF(cid_ctor);
+	Py_XSETREF(self->cid_ctor, cid_ctor);
+	self->atjson_mode = atjson_mode;
+	self->max_object_size = max_object_size < 0 ? SIZE_MAX : (size_t)max_object_size;
+	self->failed = 0;
+	self->buf_len = 0;
+	self->scan_idx = 0;
+	self->depth = 0;
+	return 0;
+}
+
+static int
+StreamDecoder_init(StreamDecoderObject *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *cid_ctor;
+	int atjson_mode, res;
+	Py_ssize_t max_object_size = -1;
+
+	(void)kwds; // unused
+
+	if (!PyArg_ParseTuple(args, "Op|n", &cid_ctor, &atjson_mode, &max_object_size)) {
+		return -1;
+	}
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	res = StreamDecoder_init_locked(self, cid_ctor, atjson_mode, max_object_size);
+	CBRRR_END_CRITICAL_SECTION();
+	return res;
+}
+
+static int
+StreamDecoder_traverse(StreamDecoderObject *self, visitproc visit, void *arg)
+{
+#if PY_VERSION_HEX >= 0x03090000
+	Py_VISIT(Py_TYPE(self));
+#endif
+	Py_VISIT(self->cid_ctor);
+	return 0;
+}
+
+static int
+StreamDecoder_clear(StreamDecoderObject *self)
+{
+	Py_CLEAR(self->cid_ctor);
+	return 0;
+}
+
+static void
+StreamDecoder_dealloc(StreamDecoderObject *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+	PyObject_GC_UnTrack(self);
+	StreamDecoder_clear(self);
+	free(self->buf);
+	free(self->pending);
+	tp->tp_free((PyObject *)self);
+	CBRRR_RELEASE_TYPE(tp, StreamDecoder_dealloc);
+}
+
+static PyObject *
+StreamDecoder_feed_locked(StreamDecoderObject *self, Py_buffer chunk)
+{
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	if (self->cid_ctor == NULL) {
+		PyBuffer_Release(&chunk);
+		PyErr_SetString(PyExc_RuntimeError, "StreamDecoder has not been initialised");
+		return NULL;
+	}
+	if (self->failed) {
+		PyBuffer_Release(&chunk);
+		PyErr_SetString(st->decode_error, "StreamDecoder previously encountered an error");
+		return NULL;
+	}
+
+	if ((size_t)chunk.len > self->buf_cap - self->buf_len) {
+		size_t new_cap = self->buf_cap ? self->buf_cap : 0x400;
+		while (new_cap - self->buf_len < (size_t)chunk.len) {
+			new_cap *= 2;
+		}
+		uint8_t *new_buf = realloc(self->buf, new_cap);
+		if (new_buf == NULL) {
+			PyBuffer_Release(&chunk);
+			PyErr_SetString(PyExc_MemoryError, "realloc failed");
+			return NULL;
+		}
+		self->buf = new_buf;
+		self->buf_cap = new_cap;
+	}
+	memcpy(self->buf + self->buf_len, chunk.buf, chunk.len);
+	self->buf_len += chunk.len;
+	PyBuffer_Release(&chunk);
+
+	PyObject *results = PyList_New(0);
+	if (results == NULL) {
+		return NULL;
+	}
+
+	size_t start = 0; // start of the current object within buf
+	for (;;) {
+		int scan_res = cbrrr_stream_scan(self, start);
+		if (scan_res == 0) {
+			break;
+		}
+		if (scan_res == -3) {
+			self->failed = 1;
+			Py_DECREF(results);
+			PyErr_Format(st->decode_error, "object is larger than max_object_size (%zu bytes)", self->max_object_size);
+			return NULL;
+		}
+		if (scan_res == -2) {
+			/* The scan state has moved on, and the objects before this one
+			   are lost with results, so there's no picking up from here */
+			self->failed = 1;
+			Py_DECREF(results);
+			return NULL;
+		}
+
+		/* either we have a complete object, or something we know is invalid.
+		   Either way, the strict parser will tell us what to do next. */
+		size_t end = scan_res == 1 ? self->scan_idx : self->buf_len;
+		PyObject *value;
+		size_t res = cbrrr_parse_object(st, &self->buf[start], end - start, &value, self->cid_ctor, self->atjson_mode);
+		if (res == (size_t)-1) {
+			self->failed = 1;
+			Py_DECREF(results);
+			return NULL;
+		}
+		if (res != end - start || scan_res != 1) { // should be unreachable, but let's not assume that
+			Py_DECREF(value);
+			self->failed = 1;
+			Py_DECREF(results);
+			PyErr_SetString(st->decode_error, "object framing error");
+			return NULL;
+		}
+		if (PyList_Append(results, value) < 0) {
+			Py_DECREF(value);
+			self->failed = 1; // ditto
+			Py_DECREF(results);
+			return NULL;
+		}
+		Py_DECREF(value);
+		start = end;
+	}
+
+	/* discard whatever we've finished with */
+	memmove(self->buf, self->buf + start, self->buf_len - start);
+	self->buf_len -= start;
+	self->scan_idx -= start;
+
+	return results;
+}
+
+static PyObject *
+StreamDecoder_feed(StreamDecoderObject *self, PyObject *args)
+{
+	Py_buffer chunk;
+	PyObject *res;
+
+	if (!PyArg_ParseTuple(args, "y*", &chunk)) {
+		return NULL;
+	}
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	res = StreamDecoder_feed_locked(self, chunk); // releases chunk
+	CBRRR_END_CRITICAL_SECTION();
+	return res;
+}
+
+static PyObject *
+StreamDecoder_finish(StreamDecoderObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	size_t buffered;
+
+	(void)args; // unused
+
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	buffered = self->buf_len;
+	CBRRR_END_CRITICAL_SECTION();
+	if (buffered != 0) {
+		PyErr_Format(st->decode_error, "stream ended part-way through an object (%zu bytes buffered)", buffered);
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+StreamDecoder_get_buffered(StreamDecoderObject *self, void *closure)
+{
+	size_t buffered;
+
+	(void)closure; // unused
+
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	buffered = self->buf_len;
+	CBRRR_END_CRITICAL_SECTION();
+	return PyLong_FromSize_t(buffered);
+}
+
+static PyMethodDef StreamDecoder_methods[] = {
+	{"feed", (PyCFunction)StreamDecoder_feed, METH_VARARGS,
+		"buffer a chunk of input, returning a list of any objects it completed"},
+	{"finish", (PyCFunction)StreamDecoder_finish, METH_NOARGS,
+		"raise an error if the stream ended part-way through an object"},
+	{NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyGetSetDef StreamDecoder_getset[] = {
+	{"buffered", (getter)StreamDecoder_get_buffered, NULL,
+		"number of bytes buffered towards the next (incomplete) object", NULL},
+	{NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+static PyType_Slot StreamDecoder_slots[] = {
+	{Py_tp_doc, "incrementally decode back-to-back DAG-CBOR objects from chunked input"},
+	{Py_tp_new, CBRRR_SLOT(PyType_GenericNew)},
+	{Py_tp_init, CBRRR_SLOT(StreamDecoder_init)},
+	{Py_tp_dealloc, CBRRR_SLOT(StreamDecoder_dealloc)},
+	{Py_tp_traverse, CBRRR_SLOT(StreamDecoder_traverse)},
+	{Py_tp_clear, CBRRR_SLOT(StreamDecoder_clear)},
+	{Py_tp_methods, StreamDecoder_methods},
+	{Py_tp_getset, StreamDecoder_getset},
+	{0, NULL}
+};
+
+static PyType_Spec StreamDecoder_spec = {
+	.name = "cbrrr._cbrrr.StreamDecoder",
+	.basicsize = sizeof(StreamDecoderObject),
+	.itemsize = 0,
+	.flags = Py_TPFLAGS_DEFAULT | CBRRR_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC,
+	.slots = StreamDecoder_slots,
+};
+
+/*
+MultiDecoder: iterates over back-to-back DAG-CBOR objects in a single buffer
+(in violation of the spec, see decode_multi_dag_cbor_in_violation_of_the_spec
+in __init__.py), decoding each one directly from its offset.
+*/
+
+typedef struct {
+	PyObject_HEAD
+	Py_buffer buf; // held for the lifetime of the iterator
+	PyObject *cid_ctor;
+	int atjson_mode;
+	size_t offset; // start of the next object
+	Py_ssize_t remaining; // items left before we stop early, or -1 for no limit
+} MultiDecoderObject;
+
+static PyObject *
+MultiDecoder_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	Py_buffer buf;
+	PyObject *cid_ctor;
+	int atjson_mode;
+	Py_ssize_t max_items = -1;
+
+	(void)kwds; // unused
+
+	if (!PyArg_ParseTuple(args, "y*Op|n", &buf, &cid_ctor, &atjson_mode, &max_items)) {
+		return NULL;
+	}
+
+	MultiDecoderObject *self = (MultiDecoderObject *)type->tp_alloc(type, 0);
+	if (self == NULL) {
+		PyBuffer_Release(&buf);
+		return NULL;
+	}
+	self->buf = buf; // moved
+	Py_INCREF(cid_ctor);
+	self->cid_ctor = cid_ctor;
+	self->atjson_mode = atjson_mode;
+	self->offset = 0;
+	self->remaining = max_items < 0 ? -1 : max_items;
+	return (PyObject *)self;
+}
+
+static int
+MultiDecoder_traverse(MultiDecoderObject *self, visitproc visit, void *arg)
+{
+#if PY_VERSION_HEX >= 0x03090000
+	Py_VISIT(Py_TYPE(self));
+#endif
+	Py_VISIT(self->cid_ctor);
+	Py_VISIT(self->buf.obj);
+	return 0;
+}
+
+static int
+MultiDecoder_clear(MultiDecoderObject *self)
+{
+	Py_CLEAR(self->cid_ctor);
+	if (self->buf.obj != NULL) {
+		PyBuffer_Release(&self->buf);
+	}
+	self->remaining = 0;
+	return 0;
+}
+
+static void
+MultiDecoder_dealloc(MultiDecoderObject *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+	PyObject_GC_UnTrack(self);
+	MultiDecoder_clear(self);
+	tp->tp_free((PyObject *)self);
+	CBRRR_RELEASE_TYPE(tp, MultiDecoder_dealloc);
+}
+
+static PyObject *
+MultiDecoder_iternext_locked(MultiDecoderObject *self)
+{
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	if (self->remaining == 0 || self->buf.obj == NULL || self->offset >= (size_t)self->buf.len) {
+		return NULL; // StopIteration
+	}
+
+	PyObject *value;
+	size_t res = cbrrr_parse_object(
+		st, (const uint8_t *)self->buf.buf + self->offset, self->buf.len - self->offset,
+		&value, self->cid_ctor, self->atjson_mode
+	);
+	if (res == (size_t)-1) {
+		self->remaining = 0; // like a generator, we're finished once we've raised
+		return NULL;
+	}
+	self->offset += res;
+	if (self->remaining > 0) {
+		self->remaining--;
+	}
+	return value;
+}
+
+static PyObject *
+MultiDecoder_iternext(MultiDecoderObject *self)
+{
+	PyObject *res;
+
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	res = MultiDecoder_iternext_locked(self);
+	CBRRR_END_CRITICAL_SECTION();
+	return res;
+}
+
+static PyObject *
+MultiDecoder_get_offset(MultiDecoderObject *self, void *closure)
+{
+	size_t offset;
+
+	(void)closure; // unused
+
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	offset = self->offset;
+	CBRRR_END_CRITICAL_SECTION();
+	return PyLong_FromSize_t(offset);
+}
+
+static PyGetSetDef MultiDecoder_getset[] = {
+	{"offset", (getter)MultiDecoder_get_offset, NULL,
+		"offset of the next object in the buffer (i.e. the number of bytes consumed so far)", NULL},
+	{NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+static PyType_Slot MultiDecoder_slots[] = {
+	{Py_tp_doc, "iterate over back-to-back DAG-CBOR objects in a buffer"},
+	{Py_tp_new, CBRRR_SLOT(MultiDecoder_new)},
+	{Py_tp_dealloc, CBRRR_SLOT(MultiDecoder_dealloc)},
+	{Py_tp_traverse, CBRRR_SLOT(MultiDecoder_traverse)},
+	{Py_tp_clear, CBRRR_SLOT(MultiDecoder_clear)},
+	{Py_tp_iter, CBRRR_SLOT(PyObject_SelfIter)},
+	{Py_tp_iternext, CBRRR_SLOT(MultiDecoder_iternext)},
+	{Py_tp_getset, MultiDecoder_getset},
+	{0, NULL}
+};
+
+static PyType_Spec MultiDecoder_spec = {
+	.name = "cbrrr._cbrrr.MultiDecoder",
+	.basicsize = sizeof(MultiDecoderObject),
+	.itemsize = 0,
+	.flags = Py_TPFLAGS_DEFAULT | CBRRR_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+	.slots = MultiDecoder_slots,
+};
+
+/*
+The companion to MultiDecoder, which only finds the object boundaries. Each
+object is still validated (without the GIL), but nothing is decoded.
+Returns [0, end_0, end_1, ...], so that object i is buf[b[i]:b[i+1]].
+*/
+static PyObject *
+cbrrr_multi_offsets(PyObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	Py_buffer buf;
+	Py_ssize_t max_items = -1;
+
+	if (!PyArg_ParseTuple(args, "y*|n", &buf, &max_items)) {
+		return NULL;
+	}
+
+	size_t cap = 64, num = 0;
+	size_t *ends = malloc(cap * sizeof(*ends));
+	if (ends == NULL) {
+		PyBuffer_Release(&buf);
+		return PyErr_NoMemory();
+	}
+
+	const uint8_t *data = buf.buf;
+	size_t len = buf.len, offset = 0, err_offset = 0;
+	CbrrrError err = CBRRR_ERR_NONE;
+
+	Py_BEGIN_ALLOW_THREADS
+	while (offset < len && (max_items < 0 || num < (size_t)max_items)) {
+		size_t res = cbrrr_validate_object(&data[offset], len - offset, &err, &err_offset, NULL);
+		if (res == (size_t)-1) {
+			err_offset += offset;
+			break;
+		}
+		offset += res;
+		if (num == cap) {
+			size_t *new_ends = realloc(ends, cap * 2 * sizeof(*ends));
+			if (new_ends == NULL) {
+				err = CBRRR_ERR_NO_MEMORY;
+				break;
+			}
+			ends = new_ends;
+			cap *= 2;
+		}
+		ends[num++] = offset;
+	}
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buf);
+
+	if (err != CBRRR_ERR_NONE) {
+		free(ends);
+		cbrrr_raise_validation_error(st, err, err_offset);
+		return NULL;
+	}
+
+	PyObject *res = PyList_New(num + 1);
+	if (res == NULL) {
+		free(ends);
+		return NULL;
+	}
+	for (size_t i=0; i<=num; i++) {
+		PyObject *boundary = PyLong_FromSize_t(i == 0 ? 0 : ends[i - 1]);
+		if (boundary == NULL) {
+			Py_DECREF(res);
+			free(ends);
+			return NULL;
+		}
+		PyList_SET_ITEM(res, i, boundary);
+	}
+	free(ends);
+	return res;
+}
+
+/*
+Lazy decoding: LazyMap and LazyList are read-only views over a (validated)
+buffer of DAG-CBOR. Members are only turned into python objects when they're
+accessed, and nested maps/lists are themselves returned as lazy views.
+
+The whole buffer is validated up front by cbrrr_validate_object, so that
+malformed or non-canonical inputs are still rejected immediately, and so that
+the views can walk the buffer without repeating any bounds checks.
+*/
+
+// parses the head of an already-validated item, returning the length of the head
+static size_t
+cbrrr_trusted_head(const uint8_t *buf, DCMajorType *type, uint64_t *value)
+{
+	uint8_t info = buf[0] & 0x1f;
+	*type = buf[0] >> 5;
+	if (info < 24) {
+		*value = info;
+		return 1;
+	}
+	size_t n = (size_t)1 << (info - 24); // can't be more than 8, since it's been validated
+	uint64_t res = 0;
+	for (size_t i=0; i<n; i++) {
+		res = res << 8 | buf[1 + i];
+	}
+	*value = res;
+	return 1 + n;
+}
+
+// returns the total length of an already-validated item, including all of its members
+static size_t
+cbrrr_trusted_skip(const uint8_t *buf)
+{
+	size_t idx = 0;
+	uint64_t remaining = 1;
+
+	/* since the total length is all we care about, we don't need a stack,
+	   just a count of how many items we still have to skip over */
+	while (remaining) {
+		DCMajorType type;
+		uint64_t value;
+		remaining -= 1;
+		idx += cbrrr_trusted_head(&buf[idx], &type, &value);
+		switch (type)
+		{
+		case DCMT_BYTE_STRING:
+		case DCMT_TEXT_STRING:
+			idx += value;
+			break;
+		case DCMT_ARRAY:
+			remaining += value;
+			break;
+		case DCMT_MAP:
+			remaining += value * 2;
+			break;
+		case DCMT_TAG:
+			remaining += 1; // the tagged item
+			break;
+		default: // the head was all there was to it
+			break;
+		}
+	}
+	return idx;
+}
+
+typedef struct {
+	const uint8_t *key; // NULL for list members
+	size_t key_len;
+	const uint8_t *value;
+	size_t value_len;
+} LazyEntry;
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *source; // the bytes object that owns the underlying buffer
+	PyObject *cid_ctor;
+	int atjson_mode;
+	int is_map; // i.e. it's a LazyMap, rather than a LazyList
+	const uint8_t *start; // start of this map/list, including its head
+	size_t len; // total encoded length
+	const uint8_t *members; // start of the first member
+	size_t count; // number of members
+	LazyEntry *entries; // index of members, built on first access
+	PyObject **values; // members that have already been materialized (NULL until then)
+} LazyObject;
+
+static void Lazy_dealloc(LazyObject *self);
+
+// neither type can be subclassed, and they're the only ones with this dealloc
+#define Lazy_Check(op) (Py_TYPE(op)->tp_dealloc == (destructor)Lazy_dealloc)
+
+// returns a new reference to a python object (possibly a lazy view) representing the item at `buf`
+static PyObject *
+cbrrr_lazy_value(CbrrrState *st, PyObject *source, PyObject *cid_ctor, int atjson_mode, const uint8_t *buf, size_t len)
+{
+	DCMajorType type;
+	uint64_t count;
+	size_t head_len = cbrrr_trusted_head(buf, &type, &count);
+
+	if (type != DCMT_ARRAY && type != DCMT_MAP) {
+		PyObject *value;
+		if (cbrrr_parse_object(st, buf, len, &value, cid_ctor, atjson_mode) == (size_t)-1) {
+			return NULL;
+		}
+		return value;
+	}
+
+	PyTypeObject *view_type = type == DCMT_MAP ? st->lazy_map_type : st->lazy_list_type;
+	LazyObject *self = (LazyObject *)view_type->tp_alloc(view_type, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+	Py_INCREF(source);
+	self->source = source;
+	Py_INCREF(cid_ctor);
+	self->cid_ctor = cid_ctor;
+	self->atjson_mode = atjson_mode;
+	self->is_map = type == DCMT_MAP;
+	self->start = buf;
+	self->len = len;
+	self->members = buf + head_len;
+	self->count = count;
+	self->entries = NULL;
+	self->values = NULL;
+	return (PyObject *)self;
+}
+
+/* The index, and the memoized members, are filled in on demand by whichever
+   thread gets there first. Without a GIL, that needs the object's lock. */
+static int
+Lazy_build_index_locked(LazyObject *self)
+{
+	if (self->entries != NULL) {
+		return 0;
+	}
+
+	/* nb: count can't be unreasonably large, since each member takes up at
+	   least one byte of the (validated) buffer */
+	LazyEntry *entries = malloc((self->count ? self->count : 1) * sizeof(*entries));
+	PyObject **values = calloc(self->count ? self->count : 1, sizeof(*values));
+	if (entries == NULL || values == NULL) {
+		free(entries);
+		free(values);
+		PyErr_SetString(PyExc_MemoryError, "malloc failed");
+		return -1;
+	}
+
+	const uint8_t *ptr = self->members;
+	for (size_t i=0; i<self->count; i++) {
+		if (self->is_map) {
+			DCMajorType type;
+			uint64_t key_len;
+			ptr += cbrrr_trusted_head(ptr, &type, &key_len);
+			entries[i].key = ptr;
+			entries[i].key_len = key_len;
+			ptr += key_len;
+		} else {
+			entries[i].key = NULL;
+			entries[i].key_len = 0;
+		}
+		entries[i].value = ptr;
+		entries[i].value_len = cbrrr_trusted_skip(ptr);
+		ptr += entries[i].value_len;
+	}
+
+	self->entries = entries;
+	self->values = values;
+	return 0;
+}
+
+static int
+Lazy_build_index(LazyObject *self)
+{
+	int res;
+
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	res = Lazy_build_index_locked(self);
+	CBRRR_END_CRITICAL_SECTION();
+	return res;
+}
+
+// returns a new reference to the i'th member (which must be in range)
+static PyObject *
+Lazy_get_member(LazyObject *self, size_t i)
+{
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	PyObject *value;
+
+	if (Lazy_build_index(self) < 0) {
+		return NULL;
+	}
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	value = self->values[i];
+	if (value == NULL) {
+		value = cbrrr_lazy_value(st, self->source, self->cid_ctor, self->atjson_mode, self->entries[i].value, self->entries[i].value_len);
+		self->values[i] = value;
+	}
+	Py_XINCREF(value);
+	CBRRR_END_CRITICAL_SECTION();
+	return value;
+}
+
+// returns a new reference to the i'th map key (which must be in range)
+static PyObject *
+LazyMap_get_key(LazyObject *self, size_t i)
+{
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	if (Lazy_build_index(self) < 0) {
+		return NULL;
+	}
+	return cbrrr_key_cache_lookup(st, self->entries[i].key, self->entries[i].key_len);
+}
+
+// returns the index of the given key, -1 if not found, or -2 on error
+static Py_ssize_t
+LazyMap_find(LazyObject *self, PyObject *key)
+{
+	if (!PyUnicode_Check(key)) {
+		return -1;
+	}
+	Py_ssize_t key_len;
+	const char *key_str = PyUnicode_AsUTF8AndSize(key, &key_len);
+	if (key_str == NULL) {
+		if (!PyErr_ExceptionMatches(PyExc_UnicodeEncodeError)) {
+			return -2;
+		}
+		// e.g. a lone surrogate, which can't be a key in valid DAG-CBOR
+		PyErr_Clear();
+		return -1;
+	}
+	if (Lazy_build_index(self) < 0) {
+		return -2;
+	}
+
+	/* the keys are canonically sorted, so we can binary search them */
+	size_t lo = 0, hi = self->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		LazyEntry *entry = &self->entries[mid];
+		int cmp;
+		if (entry->key_len != (size_t)key_len) {
+			cmp = entry->key_len < (size_t)key_len ? -1 : 1;
+		} else {
+			cmp = memcmp(entry->key, key_str, key_len);
+		}
+		if (cmp == 0) {
+			return mid;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return -1;
+}
+
+static PyObject *
+Lazy_materialize(LazyObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	PyObject *value;
+
+	(void)args; // unused
+
+	if (cbrrr_parse_object(st, self->start, self->len, &value, self->cid_ctor, self->atjson_mode) == (size_t)-1) {
+		return NULL;
+	}
+	return value;
+}
+
+static Py_ssize_t
+Lazy_length(LazyObject *self)
+{
+	return self->count;
+}
+
+static PyObject *
+Lazy_richcompare(PyObject *self, PyObject *other, int op)
+{
+	if (op != Py_EQ && op != Py_NE) {
+		Py_RETURN_NOTIMPLEMENTED;
+	}
+	PyObject *a = Lazy_materialize((LazyObject *)self, NULL);
+	if (a == NULL) {
+		return NULL;
+	}
+	PyObject *b;
+	if (Lazy_Check(other)) {
+		b = Lazy_materialize((LazyObject *)other, NULL);
+		if (b == NULL) {
+			Py_DECREF(a);
+			return NULL;
+		}
+	} else {
+		Py_INCREF(other);
+		b = other;
+	}
+	PyObject *res = PyObject_RichCompare(a, b, op);
+	Py_DECREF(a);
+	Py_DECREF(b);
+	return res;
+}
+
+static PyObject *
+Lazy_repr(LazyObject *self)
+{
+	return PyUnicode_FromFormat("<%s of %zu %s>", Py_TYPE(self)->tp_name, self->count, self->is_map ? "entries" : "items");
+}
+
+// the views are only ever created by decode_dag_cbor_lazy
+static PyObject *
+Lazy_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	(void)args; // unused
+	(void)kwds; // unused
+	PyErr_Format(PyExc_TypeError, "cannot create '%s' instances", type->tp_name);
+	return NULL;
+}
+
+static int
+Lazy_traverse(LazyObject *self, visitproc visit, void *arg)
+{
+#if PY_VERSION_HEX >= 0x03090000
+	Py_VISIT(Py_TYPE(self));
+#endif
+	Py_VISIT(self->source);
+	Py_VISIT(self->cid_ctor);
+	if (self->values != NULL) {
+		for (size_t i=0; i<self->count; i++) {
+			Py_VISIT(self->values[i]);
+		}
+	}
+	return 0;
+}
+
+static int
+Lazy_clear(LazyObject *self)
+{
+	if (self->values != NULL) {
+		for (size_t i=0; i<self->count; i++) {
+			Py_CLEAR(self->values[i]);
+		}
+	}
+	Py_CLEAR(self->cid_ctor);
+	/* nb: we can't drop self->source here, the buffer it owns might still be in use */
+	return 0;
+}
+
+static void
+Lazy_dealloc(LazyObject *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+	PyObject_GC_UnTrack(self);
+	Lazy_clear(self);
+	Py_XDECREF(self->source);
+	free(self->entries);
+	free(self->values);
+	tp->tp_free((PyObject *)self);
+	CBRRR_RELEASE_TYPE(tp, Lazy_dealloc);
+}
+
+static PyObject *
+LazyMap_subscript(LazyObject *self, PyObject *key)
+{
+	Py_ssize_t i = LazyMap_find(self, key);
+	if (i == -2) {
+		return NULL;
+	}
+	if (i == -1) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+	return Lazy_get_member(self, i);
+}
+
+static int
+LazyMap_contains(LazyObject *self, PyObject *key)
+{
+	Py_ssize_t i = LazyMap_find(self, key);
+	if (i == -2) {
+		return -1;
+	}
+	return i >= 0;
+}
+
+static PyObject *
+LazyMap_get(LazyObject *self, PyObject *args)
+{
+	PyObject *key, *default_value = Py_None;
+
+	if (!PyArg_ParseTuple(args, "O|O", &key, &default_value)) {
+		return NULL;
+	}
+	Py_ssize_t i = LazyMap_find(self, key);
+	if (i == -2) {
+		return NULL;
+	}
+	if (i == -1) {
+		Py_INCREF(default_value);
+		return default_value;
+	}
+	return Lazy_get_member(self, i);
+}
+
+static PyObject *
+LazyMap_iter(LazyObject *self)
+{
+	PyObject *keys = PyList_New(self->count);
+	if (keys == NULL) {
+		return NULL;
+	}
+	for (size_t i=0; i<self->count; i++) {
+		PyObject *key = LazyMap_get_key(self, i);
+		if (key == NULL) {
+			Py_DECREF(keys);
+			return NULL;
+		}
+		PyList_SET_ITEM(keys, i, key);
+	}
+	PyObject *res = PyObject_GetIter(keys);
+	Py_DECREF(keys);
+	return res;
+}
+
+/* Same views as any other collections.abc.Mapping gets, which are built on
+   __iter__, __getitem__ etc. (so they're as lazy as the map itself) */
+static PyObject *
+LazyMap_keys(LazyObject *self, PyObject *args)
+{
+	(void)args; // unused
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	return PyObject_CallFunctionObjArgs(st->keys_view, (PyObject *)self, NULL);
+}
+
+static PyObject *
+LazyMap_values(LazyObject *self, PyObject *args)
+{
+	(void)args; // unused
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	return PyObject_CallFunctionObjArgs(st->values_view, (PyObject *)self, NULL);
+}
+
+static PyObject *
+LazyMap_items(LazyObject *self, PyObject *args)
+{
+	(void)args; // unused
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	return PyObject_CallFunctionObjArgs(st->items_view, (PyObject *)self, NULL);
+}
+
+static PyObject *
+LazyList_item(LazyObject *self, Py_ssize_t i)
+{
+	if (i < 0 || (size_t)i >= self->count) {
+		PyErr_SetString(PyExc_IndexError, "LazyList index out of range");
+		return NULL;
+	}
+	return Lazy_get_member(self, i);
+}
+
+static PyObject *
+LazyList_subscript(LazyObject *self, PyObject *item)
+{
+	if (PyIndex_Check(item)) {
+		Py_ssize_t i = PyNumber_AsSsize_t(item, PyExc_IndexError);
+		if (i == -1 && PyErr_Occurred()) {
+			return NULL;
+		}
+		if (i < 0) {
+			i += self->count;
+		}
+		return LazyList_item(self, i);
+	}
+	if (PySlice_Check(item)) {
+		Py_ssize_t start, stop, step, slicelength;
+		if (PySlice_Unpack(item, &start, &stop, &step) < 0) {
+			return NULL;
+		}
+		slicelength = PySlice_AdjustIndices(self->count, &start, &stop, step);
+		PyObject *res = PyList_New(slicelength);
+		if (res == NULL) {
+			return NULL;
+		}
+		for (Py_ssize_t i=0; i<slicelength; i++) {
+			PyObject *value = Lazy_get_member(self, start + i * step);
+			if (value == NULL) {
+				Py_DECREF(res);
+				return NULL;
+			}
+			PyList_SET_ITEM(res, i, value);
+		}
+		return res;
+	}
+	PyErr_Format(PyExc_TypeError, "LazyList indices must be integers or slices, not %.200s", Py_TYPE(item)->tp_name);
+	return NULL;
+}
+
+static PyObject *
+LazyList_iter(LazyObject *self)
+{
+	return PySeqIter_New((PyObject *)self);
+}
+
+static PyMethodDef LazyMap_methods[] = {
+	{"get", (PyCFunction)LazyMap_get, METH_VARARGS,
+		"look up a key, returning a default value if it isn't present"},
+	{"keys", (PyCFunction)LazyMap_keys, METH_NOARGS,
+		"view of the keys, in canonical order"},
+	{"values", (PyCFunction)LazyMap_values, METH_NOARGS,
+		"view of the values, in canonical key order"},
+	{"items", (PyCFunction)LazyMap_items, METH_NOARGS,
+		"view of the (key, value) pairs, in canonical key order"},
+	{"materialize", (PyCFunction)Lazy_materialize, METH_NOARGS,
+		"fully decode this map into a dict"},
+	{NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyMethodDef LazyList_methods[] = {
+	{"materialize", (PyCFunction)Lazy_materialize, METH_NOARGS,
+		"fully decode this array into a list"},
+	{NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyType_Slot LazyMap_slots[] = {
+	{Py_tp_doc, "read-only view of a DAG-CBOR map, decoded on demand"},
+	{Py_tp_new, CBRRR_SLOT(Lazy_new)},
+	{Py_tp_dealloc, CBRRR_SLOT(Lazy_dealloc)},
+	{Py_tp_traverse, CBRRR_SLOT(Lazy_traverse)},
+	{Py_tp_clear, CBRRR_SLOT(Lazy_clear)},
+	{Py_tp_repr, CBRRR_SLOT(Lazy_repr)},
+	{Py_tp_richcompare, CBRRR_SLOT(Lazy_richcompare)},
+	{Py_tp_hash, CBRRR_SLOT(PyObject_HashNotImplemented)},
+	{Py_tp_iter, CBRRR_SLOT(LazyMap_iter)},
+	{Py_mp_length, CBRRR_SLOT(Lazy_length)},
+	{Py_mp_subscript, CBRRR_SLOT(LazyMap_subscript)},
+	{Py_sq_contains, CBRRR_SLOT(LazyMap_contains)},
+	{Py_tp_methods, LazyMap_methods},
+	{0, NULL}
+};
+
+static PyType_Slot LazyList_slots[] = {
+	{Py_tp_doc, "read-only view of a DAG-CBOR array, decoded on demand"},
+	{Py_tp_new, CBRRR_SLOT(Lazy_new)},
+	{Py_tp_dealloc, CBRRR_SLOT(Lazy_dealloc)},
+	{Py_tp_traverse, CBRRR_SLOT(Lazy_traverse)},
+	{Py_tp_clear, CBRRR_SLOT(Lazy_clear)},
+	{Py_tp_repr, CBRRR_SLOT(Lazy_repr)},
+	{Py_tp_richcompare, CBRRR_SLOT(Lazy_richcompare)},
+	{Py_tp_hash, CBRRR_SLOT(PyObject_HashNotImplemented)},
+	{Py_tp_iter, CBRRR_SLOT(LazyList_iter)},
+	{Py_mp_length, CBRRR_SLOT(Lazy_length)},
+	{Py_mp_subscript, CBRRR_SLOT(LazyList_subscript)},
+	{Py_sq_length, CBRRR_SLOT(Lazy_length)},
+	{Py_sq_item, CBRRR_SLOT(LazyList_item)},
+	{Py_tp_methods, LazyList_methods},
+	{0, NULL}
+};
+
+static PyType_Spec LazyMap_spec = {
+	.name = "cbrrr._cbrrr.LazyMap",
+	.basicsize = sizeof(LazyObject),
+	.itemsize = 0,
+	.flags = Py_TPFLAGS_DEFAULT | CBRRR_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+	.slots = LazyMap_slots,
+};
+
+static PyType_Spec LazyList_spec = {
+	.name = "cbrrr._cbrrr.LazyList",
+	.basicsize = sizeof(LazyObject),
+	.itemsize = 0,
+	.flags = Py_TPFLAGS_DEFAULT | CBRRR_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+	.slots = LazyList_slots,
+};
+
+static PyObject *
+cbrrr_decode_dag_cbor_lazy(PyObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	PyObject *data;
+	PyObject *cid_ctor;
+	int atjson_mode;
+
+		if (!PyArg_ParseTuple(args, "OOp", &data, &cid_ctor, &atjson_mode)) {
+		return NULL;
+	}
+
+	/* The views need a buffer that can't change underneath them, so anything
+	   other than bytes gets copied. */
+	PyObject *source;
+	if (PyBytes_CheckExact(data)) {
+		Py_INCREF(data);
+		source = data;
+	} else {
+		source = PyBytes_FromObject(data);
+		if (source == NULL) {
+			return NULL;
+		}
+	}
+
+	const uint8_t *buf = (const uint8_t *)PyBytes_AS_STRING(source);
+	CbrrrError err;
+	size_t err_offset;
+	size_t len = cbrrr_validate_object(buf, PyBytes_GET_SIZE(source), &err, &err_offset, NULL);
+	if (len == (size_t)-1) {
+		Py_DECREF(source);
+		cbrrr_raise_validation_error(st, err, err_offset);
+		return NULL;
+	}
+
+	PyObject *value = cbrrr_lazy_value(st, source, cid_ctor, atjson_mode, buf, len);
+	Py_DECREF(source);
+	if (value == NULL) {
+		return NULL;
+	}
+
+	PyObject *lenvar = PyLong_FromSize_t(len);
+	if (lenvar == NULL) {
+		Py_DECREF(value);
+		return NULL;
+	}
+	PyObject *restuple = PyTuple_Pack(2, value, lenvar);
+	Py_DECREF(value);
+	Py_DECREF(lenvar);
+	return restuple;
+}
+
+static PyObject *
+cbrrr_validate_dag_cbor(PyObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	Py_buffer buf;
+
+	if (!PyArg_ParseTuple(args, "y*", &buf)) {
+		return NULL;
+	}
+
+	/* the buffer is pinned by the Py_buffer, and the validator doesn't touch
+	   any python objects, so other threads can run in the meantime */
+	CbrrrError err;
+	size_t err_offset;
+	size_t len;
+	Py_BEGIN_ALLOW_THREADS
+	len = cbrrr_validate_object(buf.buf, buf.len, &err, &err_offset, NULL);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buf);
+
+	if (len == (size_t)-1) {
+		cbrrr_raise_validation_error(st, err, err_offset);
+		return NULL;
+	}
+	return PyLong_FromSize_t(len);
+}
+
+/*
+Path-selective extraction. Paths are sequences of map keys (str), array
+indices (int, negative ones count from the end), and wildcards (Ellipsis),
+which match any key or index.
+
+We walk the encoding with the same stack machine as the validator, tracking
+which paths are still "live" (i.e. match the keys/indices on the way down to
+the current position) as a bitmask in each stack frame. Values at the end of
+a path get decoded by cbrrr_parse_object, and subtrees that no path cares
+about get passed to cbrrr_validate_object, which skips over them without
+allocating. Either way, the whole buffer is validated just as strictly as
+decode_dag_cbor would.
+*/
+
+#define CBRRR_EXTRACT_MAX_PATHS 64
+
+typedef enum {
+	EXTRACT_KEY,
+	EXTRACT_INDEX,
+	EXTRACT_ANY,
+} ExtractStepKind;
+
+typedef struct {
+	ExtractStepKind kind;
+	const char *key; // borrowed from a str object
+	Py_ssize_t key_len;
+	Py_ssize_t index;
+} ExtractStep;
+
+typedef struct {
+	ExtractStep *steps;
+	size_t len;
+	PyObject *results; // list of matched values
+} ExtractPath;
+
+typedef struct {
+	uint64_t remaining;
+	uint64_t count;
+	int is_map;
+	const uint8_t *prev_key; // nb: also the current key
+	size_t prev_key_len;
+	uint64_t live; // bitmask of paths that match everything leading up to here
+} ExtractFrame;
+
+// does the step match the item we're currently looking at within frame?
+static int
+cbrrr_extract_step_matches(const ExtractStep *step, const ExtractFrame *frame)
+{
+	if (step->kind == EXTRACT_ANY) {
+		return 1;
+	}
+	if (frame->is_map) {
+		return step->kind == EXTRACT_KEY
+			&& (size_t)step->key_len == frame->prev_key_len
+			&& memcmp(step->key, frame->prev_key, step->key_len) == 0;
+	}
+	if (step->kind != EXTRACT_INDEX) {
+		return 0;
+	}
+	uint64_t idx = frame->count - frame->remaining - 1;
+	if (step->index < 0) {
+		return (uint64_t)-step->index <= frame->count && frame->count - (uint64_t)-step->index == idx;
+	}
+	return (uint64_t)step->index == idx;
+}
+
+/*
+Walks one object, appending matches to the results of the paths in `live`,
+whose first `depth` steps have already been matched. base is the offset of buf
+within the whole input, for error reporting.
+Returns the length of the object, or -1 on error (setting a python exception).
+*/
+static size_t
+cbrrr_extract_walk(CbrrrState *st, const uint8_t *buf, size_t len, size_t base, ExtractPath *paths, uint64_t live, size_t depth, PyObject *cid_ctor, int atjson_mode)
+{
+	size_t stack_len = 16;
+	ExtractFrame *stack = malloc(stack_len * sizeof(*stack));
+	if (stack == NULL) {
+		PyErr_SetString(PyExc_MemoryError, "malloc failed");
+		return -1;
+	}
+
+	// as in cbrrr_parse_object, pretend that we're parsing an array of length 1
+	stack[0].remaining = 1;
+	stack[0].count = 1;
+	stack[0].is_map = 0;
+	stack[0].live = live;
+
+	size_t sp = 0;
+	size_t idx = 0, res;
+	CbrrrError err;
+	int ok = 0;
+
+	for (;;) {
+		ExtractFrame *frame = &stack[sp];
+		if (frame->remaining == 0) {
+			if (sp == 0) {
+				ok = 1;
+				break;
+			}
+			sp -= 1;
+			continue;
+		}
+		frame->remaining -= 1;
+
+		if (frame->is_map) {
+			res = cbrrr_validate_map_key(&buf[idx], len-idx, &frame->prev_key, &frame->prev_key_len, &err);
+			if (res == (size_t)-1) {
+				cbrrr_raise_validation_error(st, err, base + idx);
+				break;
+			}
+			idx += res;
+		}
+
+		// work out which paths end here, and which continue further down
+		uint64_t ending = 0, continuing = 0;
+		for (uint64_t m = frame->live; m; m &= m - 1) {
+			int i = cbrrr_ctzll(m);
+			if (sp > 0 && !cbrrr_extract_step_matches(&paths[i].steps[depth + sp - 1], frame)) {
+				continue;
+			}
+			if (paths[i].len == depth + sp) {
+				ending |= 1ULL << i;
+			} else {
+				continuing |= 1ULL << i;
+			}
+		}
+
+		if (ending) {
+			if (continuing) { // e.g. ["a"] and ["a", "b"], so the deeper paths need their own walk
+				if (cbrrr_extract_walk(st, &buf[idx], len-idx, base + idx, paths, continuing, depth + sp, cid_ctor, atjson_mode) == (size_t)-1) {
+					break;
+				}
+			}
+			PyObject *value;
+			res = cbrrr_parse_object(st, &buf[idx], len-idx, &value, cid_ctor, atjson_mode);
+			if (res == (size_t)-1) {
+				/* the parser's errors don't say where they happened, so for
+				   invalid input, find out (and report it) the same way as for
+				   skipped subtrees */
+				size_t err_offset;
+				if (PyErr_ExceptionMatches(st->decode_error)
+				 && cbrrr_validate_object(&buf[idx], len-idx, &err, &err_offset, NULL) == (size_t)-1) {
+					PyErr_Clear();
+					cbrrr_raise_validation_error(st, err, base + idx + err_offset);
+				}
+				break;
+			}
+			int append_failed = 0;
+			for (uint64_t m = ending; m; m &= m - 1) {
+				if (PyList_Append(paths[cbrrr_ctzll(m)].results, value) < 0) {
+					append_failed = 1;
+					break;
+				}
+			}
+			Py_DECREF(value);
+			if (append_failed) {
+				break;
+			}
+			idx += res;
+			continue;
+		}
+
+		if (!continuing) { // nobody's interested, skip the whole thing
+			size_t err_offset;
+			res = cbrrr_validate_object(&buf[idx], len-idx, &err, &err_offset, NULL);
+			if (res == (size_t)-1) {
+				cbrrr_raise_validation_error(st, err, base + idx + err_offset);
+				break;
+			}
+			idx += res;
+			continue;
+		}
+
+		DCMajorType type;
+		uint64_t count;
+		res = cbrrr_validate_token(&buf[idx], len-idx, &type, &count, &err);
+		if (res == (size_t)-1) {
+			cbrrr_raise_validation_error(st, err, base + idx);
+			break;
+		}
+		idx += res;
+
+		if (type == DCMT_ARRAY || type == DCMT_MAP) {
+			sp += 1;
+			if (sp >= stack_len) {
+				stack_len *= 2;
+				ExtractFrame *new_stack = realloc(stack, stack_len * sizeof(*stack));
+				if (new_stack == NULL) {
+					PyErr_SetString(PyExc_MemoryError, "realloc failed");
+					break;
+				}
+				stack = new_stack;
+			}
+			stack[sp].remaining = count;
+			stack[sp].count = count;
+			stack[sp].is_map = type == DCMT_MAP;
+			stack[sp].prev_key = NULL;
+			stack[sp].prev_key_len = 0;
+			stack[sp].live = continuing;
+		}
+	}
+
+	free(stack);
+	return ok ? idx : (size_t)-1;
+}
+
+static PyObject *
+cbrrr_extract(PyObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	Py_buffer buf;
+	PyObject *paths_arg;
+	PyObject *cid_ctor;
+	int atjson_mode;
+
+	if (!PyArg_ParseTuple(args, "y*OOp", &buf, &paths_arg, &cid_ctor, &atjson_mode)) {
+		return NULL;
+	}
+
+	PyObject *res = NULL;
+	PyObject *path_seqs = NULL; // keeps the path elements (and thus the key strings) alive
+	ExtractPath *paths = NULL;
+	Py_ssize_t num_paths = 0;
+
+	PyObject *paths_seq = PySequence_Fast(paths_arg, "paths must be a sequence");
+	if (paths_seq == NULL) {
+		goto done;
+	}
+	num_paths = PySequence_Fast_GET_SIZE(paths_seq);
+	if (num_paths > CBRRR_EXTRACT_MAX_PATHS) {
+		PyErr_Format(PyExc_ValueError, "too many paths (max %d)", CBRRR_EXTRACT_MAX_PATHS);
+		goto done;
+	}
+	path_seqs = PyList_New(0);
+	paths = PyMem_Calloc(num_paths ? num_paths : 1, sizeof(*paths));
+	if (path_seqs == NULL || paths == NULL) {
+		if (paths == NULL) {
+			PyErr_NoMemory();
+		}
+		goto done;
+	}
+
+	for (Py_ssize_t i=0; i<num_paths; i++) {
+		PyObject *path_seq = PySequence_Fast(PySequence_Fast_GET_ITEM(paths_seq, i), "each path must be a sequence");
+		if (path_seq == NULL) {
+			goto done;
+		}
+		int append_res = PyList_Append(path_seqs, path_seq);
+		Py_DECREF(path_seq); // now owned by path_seqs
+		if (append_res < 0) {
+			goto done;
+		}
+		ExtractPath *path = &paths[i];
+		path->len = PySequence_Fast_GET_SIZE(path_seq);
+		path->steps = PyMem_Malloc((path->len ? path->len : 1) * sizeof(*path->steps));
+		path->results = PyList_New(0);
+		if (path->steps == NULL || path->results == NULL) {
+			if (path->steps == NULL) {
+				PyErr_NoMemory();
+			}
+			goto done;
+		}
+		for (size_t j=0; j<path->len; j++) {
+			PyObject *elem = PySequence_Fast_GET_ITEM(path_seq, j);
+			ExtractStep *step = &path->steps[j];
+			if (elem == Py_Ellipsis) {
+				step->kind = EXTRACT_ANY;
+			} else if (PyUnicode_Check(elem)) {
+				step->kind = EXTRACT_KEY;
+				step->key = PyUnicode_AsUTF8AndSize(elem, &step->key_len);
+				if (step->key == NULL) {
+					goto done;
+				}
+			} else if (PyLong_Check(elem)) {
+				step->kind = EXTRACT_INDEX;
+				step->index = PyLong_AsSsize_t(elem);
+				if (step->index == -1 && PyErr_Occurred()) {
+					goto done;
+				}
+			} else {
+				PyErr_Format(PyExc_TypeError, "path elements must be str, int, or ..., not %.200s", Py_TYPE(elem)->tp_name);
+				goto done;
+			}
+		}
+	}
+
+	uint64_t all_paths = num_paths == 64 ? ~0ULL : (1ULL << num_paths) - 1;
+	size_t length = cbrrr_extract_walk(st, buf.buf, buf.len, 0, paths, all_paths, 0, cid_ctor, atjson_mode);
+	if (length == (size_t)-1) {
+		goto done;
+	}
+
+	PyObject *results = PyList_New(num_paths);
+	if (results == NULL) {
+		goto done;
+	}
+	for (Py_ssize_t i=0; i<num_paths; i++) {
+		PyList_SET_ITEM(results, i, paths[i].results);
+		paths[i].results = NULL; // moved
+	}
+	res = Py_BuildValue("(Nn)", results, (Py_ssize_t)length);
+
+done:
+	if (paths != NULL) {
+		for (Py_ssize_t i=0; i<num_paths; i++) {
+			PyMem_Free(paths[i].steps);
+			Py_XDECREF(paths[i].results);
+		}
+		PyMem_Free(paths);
+	}
+	Py_XDECREF(path_seqs);
+	Py_XDECREF(paths_seq);
+	PyBuffer_Release(&buf);
+	return res;
+}
+
+static PyObject *
+cbrrr_set_key_cache_size(PyObject *self, PyObject *args)
+{
+	Py_ssize_t size;
+
+	if (!PyArg_ParseTuple(args, "n", &size)) {
+		return NULL;
+	}
+	if (size < 0) {
+		PyErr_SetString(PyExc_ValueError, "key cache size must not be negative");
+		return NULL;
+	}
+	if (cbrrr_key_cache_resize(cbrrr_module_state(self), size) < 0) {
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+cbrrr_key_cache_info(PyObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+
+	(void)args; // unused
+
+	cbrrr_lock_blocking(&st->key_cache_lock);
+	unsigned long long hits = st->key_cache_hits, misses = st->key_cache_misses;
+	Py_ssize_t size = st->key_cache_size;
+	CBRRR_UNLOCK(&st->key_cache_lock);
+
+	return Py_BuildValue(
+		"{s:K,s:K,s:n,s:n}",
+		"hits", hits,
+		"misses", misses,
+		"size", size,
+		"max_key_len", (Py_ssize_t)CBRRR_KEY_CACHE_MAX_KEY_LEN
+	);
+}
+
+static PyObject *
+cbrrr_set_stats_enabled(PyObject *self, PyObject *args)
+{
+	int enabled;
+
+	(void)self; // unused
+
+	if (!PyArg_ParseTuple(args, "p", &enabled)) {
+		return NULL;
+	}
+#if CBRRR_STATS
+	CBRRR_STORE_RELAXED(CBRRR_STATS_ENABLED, (char)enabled);
+#else
+	if (enabled) {
+		PyErr_SetString(PyExc_RuntimeError, "cbrrr was built without stats support (CBRRR_STATS=0)");
+		return NULL;
+	}
+#endif
+	Py_RETURN_NONE;
+}
+
+static const char *CBRRR_STATS_TYPE_NAMES[8] = {
+	"unsigned_int", "negative_int", "byte_string", "text_string",
+	"array", "map", "tag", "float", // (float includes null and bools)
+};
+
+static const char *CBRRR_STATS_FAIL_NAMES[CBRRR_FAIL_KINDS] = {
+	"decode_error", "type_error", "value_error", "overflow_error", "memory_error", "other",
+};
+
+// builds a {name: count} dict
+static PyObject *
+cbrrr_stats_counts(const char **names, const uint64_t *counts, size_t n)
+{
+	PyObject *res = PyDict_New();
+	if (res == NULL) {
+		return NULL;
+	}
+	for (size_t i=0; i<n; i++) {
+		PyObject *count = PyLong_FromUnsignedLongLong(counts[i]);
+		if (count == NULL || PyDict_SetItemString(res, names[i], count) < 0) {
+			Py_XDECREF(count);
+			Py_DECREF(res);
+			return NULL;
+		}
+		Py_DECREF(count);
+	}
+	return res;
+}
+
+static PyObject *
+cbrrr_stats_dir_dict(const CbrrrStatsDir *dir)
+{
+	return Py_BuildValue(
+		"{s:K,s:K,s:N,s:N,s:K,s:K,s:N}",
+		"calls", (unsigned long long)dir->calls,
+		"bytes", (unsigned long long)dir->bytes,
+		"tokens", cbrrr_stats_counts(CBRRR_STATS_TYPE_NAMES, dir->tokens, 8),
+		"token_bytes", cbrrr_stats_counts(CBRRR_STATS_TYPE_NAMES, dir->token_bytes, 8),
+		"max_depth", (unsigned long long)dir->max_depth,
+		"stack_reallocs", (unsigned long long)dir->stack_reallocs,
+		"failures", cbrrr_stats_counts(CBRRR_STATS_FAIL_NAMES, dir->failures, CBRRR_FAIL_KINDS)
+	);
+}
+
+static PyObject *
+cbrrr_get_stats(PyObject *self, PyObject *args)
+{
+	(void)self; // unused
+	(void)args; // unused
+
+#if CBRRR_STATS
+	// copied out first, since building the result can run arbitrary code (via the gc)
+	CbrrrStats stats = CBRRR_THREAD_STATS;
+	int enabled = CBRRR_LOAD_RELAXED(CBRRR_STATS_ENABLED);
+#else
+	CbrrrStats stats = {0};
+	int enabled = 0;
+#endif
+
+	return Py_BuildValue(
+		"{s:O,s:N,s:N,s:K,s:K,s:K,s:K,s:K}",
+		"enabled", enabled ? Py_True : Py_False,
+		"decode", cbrrr_stats_dir_dict(&stats.decode),
+		"encode", cbrrr_stats_dir_dict(&stats.encode),
+		"cids", (unsigned long long)stats.cids,
+		"cid_ctor_calls", (unsigned long long)stats.cid_ctor_calls,
+		"buf_grows", (unsigned long long)stats.buf_grows,
+		"sorts", (unsigned long long)stats.sorts,
+		"sort_comparisons", (unsigned long long)stats.sort_comparisons
+	);
+}
+
+static PyObject *
+cbrrr_reset_stats(PyObject *self, PyObject *args)
+{
+	(void)self; // unused
+	(void)args; // unused
+
+#if CBRRR_STATS
+	memset(&CBRRR_THREAD_STATS, 0, sizeof(CBRRR_THREAD_STATS));
+#endif
+	Py_RETURN_NONE;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+/*
+SHA-256, used for computing CIDs natively.
+
+There's a portable implementation, plus hardware-accelerated ones using the
+x86 SHA extensions (selected at runtime, since they're not part of the x86-64
+baseline) and the ARMv8 crypto extensions (selected at compile time, if the
+compiler has been told they're available - which is the default on e.g. Apple
+silicon).
+*/
+
+static const uint32_t SHA256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+cbrrr_sha256_blocks_portable(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+	uint32_t w[64];
+
+	while (nblocks--) {
+		for (int i=0; i<16; i++) {
+			w[i] = (uint32_t)data[i*4] << 24 | (uint32_t)data[i*4+1] << 16
+			     | (uint32_t)data[i*4+2] << 8 | (uint32_t)data[i*4+3];
+		}
+		for (int i=16; i<64; i++) {
+			uint32_t s0 = SHA256_ROTR(w[i-15], 7) ^ SHA256_ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+			uint32_t s1 = SHA256_ROTR(w[i-2], 17) ^ SHA256_ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int i=0; i<64; i++) {
+			uint32_t t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25))
+			            + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+			uint32_t t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22))
+			            + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+
+		data += 64;
+	}
+}
+
+#if CBRRR_HAVE_X86_SHA
+__attribute__((target("sha,sse4.1")))
+static void
+cbrrr_sha256_blocks_x86(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+	const __m128i byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, tmp, msg[4];
+
+	/* the sha256rnds2 instruction wants the state as ABEF/CDGH */
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1); // CDAB
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b); // EFGH
+	state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0); // CDGH
+
+	while (nblocks--) {
+		__m128i abef_save = state0, cdgh_save = state1;
+
+		for (int i=0; i<4; i++) {
+			msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i*16)), byteswap);
+		}
+		for (int i=0; i<16; i++) { // 4 rounds per iteration
+			tmp = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i *)&SHA256_K[i*4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, tmp);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(tmp, 0x0e));
+			if (i < 12) { // compute the message schedule for 4 iterations' time
+				tmp = _mm_sha256msg1_epu32(msg[i & 3], msg[(i+1) & 3]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(msg[(i+3) & 3], msg[(i+2) & 3], 4));
+				msg[i & 3] = _mm_sha256msg2_epu32(tmp, msg[(i+3) & 3]);
+			}
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b); // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xb1); // DCHG
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0)); // DCBA
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+}
+#endif
+
+#if CBRRR_HAVE_ARM_SHA
+CBRRR_ARM_SHA_TARGET
+static void
+cbrrr_sha256_blocks_arm(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+	uint32x4_t abcd = vld1q_u32(&state[0]);
+	uint32x4_t efgh = vld1q_u32(&state[4]);
+	uint32x4_t msg[4];
+
+	while (nblocks--) {
+		uint32x4_t abcd_save = abcd, efgh_save = efgh;
+
+		for (int i=0; i<4; i++) {
+			msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i*16)));
+		}
+		for (int i=0; i<16; i++) { // 4 rounds per iteration
+			uint32x4_t wk = vaddq_u32(msg[i & 3], vld1q_u32(&SHA256_K[i*4]));
+			uint32x4_t abcd_prev = abcd;
+			abcd = vsha256hq_u32(abcd, efgh, wk);
+			efgh = vsha256h2q_u32(efgh, abcd_prev, wk);
+			if (i < 12) { // compute the message schedule for 4 iterations' time
+				msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i+1) & 3]), msg[(i+2) & 3], msg[(i+3) & 3]);
+			}
+		}
+
+		abcd = vaddq_u32(abcd, abcd_save);
+		efgh = vaddq_u32(efgh, efgh_save);
+		data += 64;
+	}
+
+	vst1q_u32(&state[0], abcd);
+	vst1q_u32(&state[4], efgh);
+}
+#endif
+
+// the first one that's usable on this CPU (working backwards) is selected at init
+static const struct {
+	const char *name;
+	CbrrrSha256BlocksFn blocks;
+} CBRRR_SHA256_IMPLS[] = {
+	{"portable", cbrrr_sha256_blocks_portable},
+#if CBRRR_HAVE_X86_SHA
+	{"x86-sha", cbrrr_sha256_blocks_x86},
+#endif
+#if CBRRR_HAVE_ARM_SHA
+	{"arm-sha", cbrrr_sha256_blocks_arm},
+#endif
+};
+
+#define CBRRR_SHA256_NUM_IMPLS (sizeof(CBRRR_SHA256_IMPLS) / sizeof(CBRRR_SHA256_IMPLS[0]))
+
+// only changed at init
+static CbrrrSha256BlocksFn cbrrr_sha256_blocks = cbrrr_sha256_blocks_portable;
+
+static int
+cbrrr_sha256_impl_usable(CbrrrSha256BlocksFn blocks)
+{
+#if CBRRR_HAVE_X86_SHA
+	if (blocks == cbrrr_sha256_blocks_x86) {
+		return CBRRR_CPU_HAS_SHA;
+	}
+#endif
+#if CBRRR_ARM_SHA_RUNTIME
+	if (blocks == cbrrr_sha256_blocks_arm) {
+		return CBRRR_CPU_HAS_SHA;
+	}
+#endif
+	(void)blocks; // unused (on some platforms)
+	return 1; // the rest are either portable, or part of the compile-time target
+}
+
+static void
+cbrrr_sha256_select_impl(void)
+{
+	size_t i = CBRRR_SHA256_NUM_IMPLS;
+	while (i-- > 1 && !cbrrr_sha256_impl_usable(CBRRR_SHA256_IMPLS[i].blocks)) {
+	}
+	cbrrr_sha256_blocks = CBRRR_SHA256_IMPLS[i].blocks;
+}
+
+static void
+cbrrr_sha256_init(CbrrrSha256 *ctx)
+{
+	static const uint32_t initial_state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(ctx->state, initial_state, sizeof(initial_state));
+	ctx->length = 0;
+	ctx->block_len = 0;
+	ctx->blocks = cbrrr_sha256_blocks;
+}
+
+static void
+cbrrr_sha256_update(CbrrrSha256 *ctx, const uint8_t *data, size_t len)
+{
+	ctx->length += len;
+	if (ctx->block_len) { // top up the partial block first
+		size_t n = 64 - ctx->block_len < len ? 64 - ctx->block_len : len;
+		memcpy(ctx->block + ctx->block_len, data, n);
+		ctx->block_len += n;
+		data += n;
+		len -= n;
+		if (ctx->block_len < 64) {
+			return;
+		}
+		ctx->blocks(ctx->state, ctx->block, 1);
+		ctx->block_len = 0;
+	}
+	if (len >= 64) {
+		ctx->blocks(ctx->state, data, len / 64);
+		data += len & ~(size_t)63;
+		len &= 63;
+	}
+	memcpy(ctx->block, data, len);
+	ctx->block_len = len;
+}
+
+static void
+cbrrr_sha256_final(CbrrrSha256 *ctx, uint8_t digest[32])
+{
+	uint64_t bit_len = ctx->length * 8;
+	uint8_t pad[72] = {0x80};
+	size_t pad_len = (ctx->block_len < 56 ? 56 : 120) - ctx->block_len;
+	for (int i=0; i<8; i++) {
+		pad[pad_len + i] = bit_len >> (56 - i*8);
+	}
+	cbrrr_sha256_update(ctx, pad, pad_len + 8);
+	for (int i=0; i<8; i++) {
+		digest[i*4+0] = ctx->state[i] >> 24;
+		digest[i*4+1] = ctx->state[i] >> 16;
+		digest[i*4+2] = ctx->state[i] >> 8;
+		digest[i*4+3] = ctx->state[i];
+	}
+}
+
+/*
+For testing: the names of the sha256 implementations that are usable on this
+machine, the last of which is the one that gets used.
+*/
+static PyObject *
+cbrrr_sha256_impls(PyObject *self, PyObject *args)
+{
+	(void)self; // unused
+	(void)args; // unused
+
+	PyObject *res = PyList_New(0);
+	if (res == NULL) {
+		return NULL;
+	}
+	for (size_t i=0; i<CBRRR_SHA256_NUM_IMPLS; i++) {
+		if (!cbrrr_sha256_impl_usable(CBRRR_SHA256_IMPLS[i].blocks)) {
+			continue;
+		}
+		PyObject *name = PyUnicode_FromString(CBRRR_SHA256_IMPLS[i].name);
+		if (name == NULL || PyList_Append(res, name) < 0) {
+			Py_XDECREF(name);
+			Py_DECREF(res);
+			return NULL;
+		}
+		Py_DECREF(name);
+	}
+	return res;
+}
+
+/*
+For testing: hashes a sequence of chunks (fed in one at a time) using the
+named implementation, which only applies to this call.
+*/
+static PyObject *
+cbrrr_sha256_with_impl(PyObject *self, PyObject *args)
+{
+	PyObject *chunks;
+	const char *name;
+	size_t i;
+
+	(void)self; // unused
+
+	if (!PyArg_ParseTuple(args, "Os", &chunks, &name)) {
+		return NULL;
+	}
+	for (i=0; i<CBRRR_SHA256_NUM_IMPLS; i++) {
+		if (strcmp(CBRRR_SHA256_IMPLS[i].name, name) == 0) {
+			break;
+		}
+	}
+	if (i == CBRRR_SHA256_NUM_IMPLS || !cbrrr_sha256_impl_usable(CBRRR_SHA256_IMPLS[i].blocks)) {
+		PyErr_Format(PyExc_ValueError, "sha256 implementation %s is not available", name);
+		return NULL;
+	}
+	PyObject *chunks_seq = PySequence_Fast(chunks, "chunks must be a sequence");
+	if (chunks_seq == NULL) {
+		return NULL;
+	}
+
+	CbrrrSha256 hash;
+	cbrrr_sha256_init(&hash);
+	hash.blocks = CBRRR_SHA256_IMPLS[i].blocks;
+	for (Py_ssize_t j=0; j<PySequence_Fast_GET_SIZE(chunks_seq); j++) {
+		Py_buffer chunk;
+		if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(chunks_seq, j), &chunk, PyBUF_SIMPLE) < 0) {
+			Py_DECREF(chunks_seq);
+			return NULL;
+		}
+		cbrrr_sha256_update(&hash, chunk.buf, chunk.len);
+		PyBuffer_Release(&chunk);
+	}
+	Py_DECREF(chunks_seq);
+
+	uint8_t digest[32];
+	cbrrr_sha256_final(&hash, digest);
+	return PyBytes_FromStringAndSize((const char *)digest, sizeof(digest));
+}
+
+// hash whatever has been written since we last checked
+static void
+cbrrr_buf_update_hash(CbrrrBuf *buf)
+{
+	if (buf->hash != NULL) {
+		cbrrr_sha256_update(buf->hash, buf->buf + buf->hashed, buf->length - buf->hashed);
+		buf->hashed = buf->length;
+	}
+}
+
+// for chunked buffers, pass the current contents on to wherever they're going
+static int
+cbrrr_buf_flush(CbrrrBuf *buf) // sets python exception on fail
+{
+	cbrrr_buf_update_hash(buf);
+	if (buf->flush != NULL && buf->length > 0) {
+		if (buf->flush(buf, buf->buf, buf->length) < 0) {
+			return -1;
+		}
+	}
+	buf->flushed += buf->length;
+	buf->length = 0;
+	buf->hashed = 0;
+	return 0;
+}
+
+static int
+cbrrr_buf_make_room(CbrrrBuf *buf, size_t len) // sets python exception on fail
+{
+	if (buf->capacity - buf->length >= len) {
+		return 0;
+	}
+	if (buf->fixed) {
+		PyErr_SetString(PyExc_ValueError, "output buffer too small");
+		return -1;
+	}
+	if (buf->chunked && buf->flush == NULL) {
+		if (cbrrr_buf_flush(buf) < 0) {
+			return -1;
+		}
+		if (buf->capacity >= len) {
+			return 0;
+		}
+		// else, this single write is bigger than a whole chunk, so we need to grow after all
+	}
+	/* we're about to (potentially) move everything, so this is a good time to
+	   catch up on hashing, while the data is still warm in the cache */
+	cbrrr_buf_update_hash(buf);
+	CbrrrStats *stats = cbrrr_stats();
+	if (stats != NULL) {
+		stats->buf_grows++;
+	}
+	size_t new_capacity = buf->capacity;
+	while (new_capacity - buf->length < len) {
+		new_capacity *= 2;
+	}
+	if (buf->limit != 0 && new_capacity > buf->limit) {
+		if (buf->length + len < (buf->writes + 1) * CBRRR_PRESIZE_MIN_AVG_WRITE) {
+			buf->limit = 0; // lots of small items, see cbrrr_encode_to_bytes
+		} else {
+			buf->overflowed = 1;
+			return -1;
+		}
+	}
+	if (buf->bytes != NULL) {
+		/* the expected size was wrong (the object must have changed since
+		   it was measured), so carry on in a malloc'd buffer instead */
+		uint8_t *new_buf = malloc(new_capacity);
+		if (new_buf == NULL) {
+			PyErr_SetString(PyExc_MemoryError, "malloc failed");
+			return -1;
+		}
+		memcpy(new_buf, buf->buf, buf->length);
+		Py_CLEAR(buf->bytes);
+		buf->buf = new_buf;
+	} else {
+		uint8_t *new_buf = realloc(buf->buf, new_capacity);
+		if (new_buf == NULL) {
+			PyErr_SetString(PyExc_MemoryError, "realloc failed");
+			return -1;
+		}
+		buf->buf = new_buf;
+	}
+	buf->capacity = new_capacity;
+	return 0;
+}
+
+/*
+Set up a malloc-backed CbrrrBuf whose contents end up as a bytes object. Call
+cbrrr_buf_finish_bytes to get the result, or cbrrr_buf_free to clean up.
+
+If exact is set, capacity is the known size of the output, so we write
+directly into a new bytes object of that size and it doesn't need to be copied
+out at the end. (There's no public API for shrinking a bytes object in place,
+so that's only worth doing when the size is known up front.)
+*/
+static int
+cbrrr_buf_init_bytes(CbrrrBuf *buf, size_t capacity, int exact)
+{
+	if (exact) {
+		buf->bytes = PyBytes_FromStringAndSize(NULL, capacity);
+		if (buf->bytes == NULL) {
+			return -1;
+		}
+		buf->buf = (uint8_t *)PyBytes_AS_STRING(buf->bytes);
+	} else {
+		buf->bytes = NULL;
+		buf->buf = malloc(capacity);
+		if (buf->buf == NULL) {
+			PyErr_SetString(PyExc_MemoryError, "malloc failed");
+			return -1;
+		}
+	}
+	buf->length = 0;
+	buf->capacity = capacity;
+	buf->fixed = 0;
+	buf->chunked = 0;
+	buf->flush = NULL;
+	buf->flushed = 0;
+	buf->flush_at = SIZE_MAX;
+	buf->hash = NULL;
+	buf->hashed = 0;
+	buf->count_only = 0;
+	buf->writes = 0;
+	buf->limit = 0;
+	buf->overflowed = 0;
+	buf->internal = 0;
+	return 0;
+}
+
+/*
+Set up a malloc-backed CbrrrBuf that gets flushed in chunks of (approximately)
+chunk_size, via the flush callback (which may be NULL to discard the data).
+Call cbrrr_buf_flush once you're done, and then cbrrr_buf_free.
+
+If there is a flush callback, only the encoder's main loop and
+cbrrr_buf_write_payload flush it, so other writes just grow the buffer.
+*/
+static int
+cbrrr_buf_init_chunked(CbrrrBuf *buf, size_t chunk_size, int (*flush)(CbrrrBuf *buf, const uint8_t *data, size_t len))
+{
+	buf->buf = malloc(chunk_size);
+	if (buf->buf == NULL) {
+		PyErr_SetString(PyExc_MemoryError, "malloc failed");
+		return -1;
+	}
+	buf->length = 0;
+	buf->capacity = chunk_size;
+	buf->bytes = NULL;
+	buf->fixed = 0;
+	buf->chunked = 1;
+	buf->flush = flush;
+	buf->flushed = 0;
+	buf->flush_at = flush == NULL ? SIZE_MAX : chunk_size;
+	buf->hash = NULL;
+	buf->hashed = 0;
+	buf->count_only = 0;
+	buf->writes = 0;
+	buf->limit = 0;
+	buf->overflowed = 0;
+	buf->internal = 0;
+	return 0;
+}
+
+/*
+Set up a CbrrrBuf over a caller-owned malloc'd scratch area (of non-zero
+capacity), which grows via realloc as needed. Afterwards, buf->buf and
+buf->capacity describe the (possibly moved) scratch area, which still belongs
+to the caller, so don't call cbrrr_buf_free on it.
+*/
+static void
+cbrrr_buf_init_scratch(CbrrrBuf *buf, uint8_t *scratch, size_t capacity)
+{
+	buf->buf = scratch;
+	buf->length = 0;
+	buf->capacity = capacity;
+	buf->bytes = NULL;
+	buf->fixed = 0;
+	buf->chunked = 0;
+	buf->flush = NULL;
+	buf->flushed = 0;
+	buf->flush_at = SIZE_MAX;
+	buf->hash = NULL;
+	buf->hashed = 0;
+	buf->count_only = 0;
+	buf->writes = 0;
+	buf->limit = 0;
+	buf->overflowed = 0;
+	buf->internal = 0;
+}
+
+static void
+cbrrr_buf_free(CbrrrBuf *buf)
+{
+	if (buf->bytes != NULL) {
+		Py_CLEAR(buf->bytes);
+	} else if (!buf->fixed) {
+		free(buf->buf);
+	}
+	buf->buf = NULL;
+}
+
+// returns the contents as a bytes object (and consumes buf)
+static PyObject *
+cbrrr_buf_finish_bytes(CbrrrBuf *buf)
+{
+	PyObject *res;
+	if (buf->bytes != NULL && buf->length == buf->capacity) {
+		res = buf->bytes; // filled exactly, as expected
+		buf->bytes = NULL;
+		buf->buf = NULL;
+		return res;
+	}
+	res = PyBytes_FromStringAndSize((const char *)buf->buf, buf->length);
+	cbrrr_buf_free(buf);
+	return res;
+}
+
+static int
+cbrrr_buf_write(CbrrrBuf *buf, const uint8_t *data, size_t len)
+{
+	if (cbrrr_buf_make_room(buf, len) < 0) {
+		return -1;
+	}
+	buf->writes++;
+	memcpy(buf->buf+buf->length, data, len);
+	buf->length += len;
+	return 0;
+}
+
+/*
+For string/bytes payloads (which can be big), which count_only buffers don't
+need to copy anywhere. Everything else still goes through the scratch area,
+but that's only ever a few bytes at a time.
+
+Likewise, payloads bigger than a whole chunk get passed straight to the flush
+callback. That can run arbitrary python code, so we hold a reference to owner
+(the object that data belongs to) in the meantime.
+*/
+static int
+cbrrr_buf_write_payload(CbrrrBuf *buf, PyObject *owner, const uint8_t *data, size_t len)
+{
+	if (buf->count_only) {
+		buf->flushed += len;
+		return 0;
+	}
+	if (len >= buf->flush_at) {
+		int res;
+		Py_INCREF(owner);
+		res = cbrrr_buf_flush(buf);
+		if (res == 0) {
+			if (buf->hash != NULL) {
+				cbrrr_sha256_update(buf->hash, data, len);
+			}
+			res = buf->flush(buf, data, len);
+			buf->flushed += len;
+		}
+		Py_DECREF(owner);
+		return res;
+	}
+	return cbrrr_buf_write(buf, data, len);
+}
+
+static int
+cbrrr_write_cbor_varint(CbrrrBuf *buf, DCMajorType type, uint64_t value)
+{
+	uint8_t tmp[9];
+	/*
+	In theory, small values are more likely, so this if-chain order is probably
+	optimal. However, the compiler might try to be clever and turn it into a
+	binary tree. I haven't checked. It probably doesn't meaningfully matter.
+	*/
+	if (value < 24) {
+		tmp[0] = type << 5 | value;
+		return cbrrr_buf_write(buf, tmp, 1);
+	}
+	if (value < 0x100) {
+		tmp[0] = type << 5 | 24;
+		tmp[1] = value;
+		return cbrrr_buf_write(buf, tmp, 2);
+	}
+	if (value < 0x10000) {
+		tmp[0] = type << 5 | 25;
+		tmp[1] = value >> 8;
+		tmp[2] = value;
+		return cbrrr_buf_write(buf, tmp, 3);
+	}
+	if (value < 0x100000000L) {
+		tmp[0] = type << 5 | 26;
+		tmp[1] = value >> 24;
+		tmp[2] = value >> 16;
+		tmp[3] = value >> 8;
+		tmp[4] = value;
+		return cbrrr_buf_write(buf, tmp, 5);
+	}
+	tmp[0] = type << 5 | 27;
+	tmp[1] = value >> 56;
+	tmp[2] = value >> 48;
+	tmp[3] = value >> 40;
+	tmp[4] = value >> 32;
+	tmp[5] = value >> 24;
+	tmp[6] = value >> 16;
+	tmp[7] = value >> 8;
+	tmp[8] = value;
+	return cbrrr_buf_write(buf, tmp, 9);
+}
+
+
+
+/*
+Decodes maybe-padded base64 according to https://atproto.com/specs/data-model#bytes (RFC-4648, section 4)
+Returns 0 on success, -1 on failure (setting a python exception).
+*/
+
+static const uint8_t B64_DECODE_LUT[] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+STATIC_ASSERT(sizeof(B64_DECODE_LUT) == 256, b64_lut_covers_all_bytes);
+
+#if CBRRR_HAVE_X86_AVX2
+/* decodes 32-byte blocks of input into 24-byte blocks of output, returning
+   the number of input bytes consumed. Stops early at any block that contains
+   a non-base64 character (including padding) */
+__attribute__((target("avx2")))
+static size_t
+cbrrr_b64_decode_avx2(uint8_t *out, const uint8_t *str, size_t str_len)
+{
+	// these classify each character by its high and low nibbles
+	const __m256i lut_lo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lut_hi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lut_roll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+	size_t i = 0;
+
+	while (i + 32 <= str_len) {
+		__m256i in = _mm256_loadu_si256((const __m256i *)&str[i]);
+		__m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_2f);
+		__m256i lo_nibbles = _mm256_and_si256(in, mask_2f);
+		if (!_mm256_testz_si256(_mm256_shuffle_epi8(lut_lo, lo_nibbles), _mm256_shuffle_epi8(lut_hi, hi_nibbles))) {
+			break; // invalid character, let the scalar code deal with it
+		}
+
+		// translate characters into 6-bit values
+		__m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(in, mask_2f), hi_nibbles));
+		in = _mm256_add_epi8(in, roll);
+
+		// pack each 4 6-bit values into 3 bytes
+		in = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+		in = _mm256_madd_epi16(in, _mm256_set1_epi32(0x00011000));
+		in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		in = _mm256_permutevar8x32_epi32(in, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+		_mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(in));
+		_mm_storel_epi64((__m128i *)(out + 16), _mm256_extracti128_si256(in, 1));
+		out += 24;
+		i += 32;
+	}
+	return i;
+}
+#endif
+
+#if CBRRR_HAVE_NEON
+/* decodes 64-byte blocks of input into 48-byte blocks of output, returning
+   the number of input bytes consumed. Stops early at any block that contains
+   a non-base64 character (including padding) */
+static size_t
+cbrrr_b64_decode_neon(uint8_t *out, const uint8_t *str, size_t str_len)
+{
+	// B64_DECODE_LUT is 0xff for invalid characters, and we only need the ASCII half of it
+	const uint8x16x4_t lut_lo = cbrrr_neon_load_table(B64_DECODE_LUT);
+	const uint8x16x4_t lut_hi = cbrrr_neon_load_table(B64_DECODE_LUT + 64);
+	const uint8x16_t offset_40 = vdupq_n_u8(0x40);
+	size_t i = 0;
+
+	while (i + 64 <= str_len) {
+		uint8x16x4_t in = vld4q_u8(&str[i]);
+		uint8x16_t invalid = vdupq_n_u8(0);
+		for (int j=0; j<4; j++) {
+			// non-ASCII characters look up 0 in both tables, so need to be flagged separately
+			invalid = vorrq_u8(invalid, in.val[j]);
+			in.val[j] = vqtbx4q_u8(vqtbl4q_u8(lut_lo, in.val[j]), lut_hi, vsubq_u8(in.val[j], offset_40));
+			invalid = vorrq_u8(invalid, in.val[j]);
+		}
+		if (vmaxvq_u8(invalid) & 0x80) {
+			break; // let the scalar code deal with it
+		}
+		uint8x16x3_t res;
+		res.val[0] = vorrq_u8(vshlq_n_u8(in.val[0], 2), vshrq_n_u8(in.val[1], 4));
+		res.val[1] = vorrq_u8(vshlq_n_u8(in.val[1], 4), vshrq_n_u8(in.val[2], 2));
+		res.val[2] = vorrq_u8(vshlq_n_u8(in.val[2], 6), in.val[3]);
+		vst3q_u8(out, res);
+		out += 48;
+		i += 64;
+	}
+	return i;
+}
+#endif
+
+static int
+cbrrr_write_cbor_bytes_from_b64(CbrrrBuf *buf, const uint8_t *b64_str, size_t str_len)
+{
+	// strip padding
+	while (str_len && b64_str[str_len - 1] == '=') str_len--;
+	if ((str_len % 4) == 1) {
+		PyErr_SetString(PyExc_ValueError, "invalid b64 length");
+		return -1;
+	}
+
+	/* nb: this length integer could overflow, but it comes from a python string,
+	   so it should be < PY_SSIZE_T_MAX. Unless you have close to 2^63 bytes of
+	   RAM, you're safe. I think the uint64 cast should make it safe
+	   on 32-bit platforms too. (decoded_length is always < str_len) */
+	size_t decoded_length = ((uint64_t)str_len*3)/4;
+	if (cbrrr_write_cbor_varint(buf, DCMT_BYTE_STRING, decoded_length) < 0) {
+		return -1;
+	}
+	if (cbrrr_buf_make_room(buf, decoded_length) < 0) {
+		return -1;
+	}
+	uint8_t *bufptr = buf->buf + buf->length;
+	buf->length += decoded_length;
+
+	size_t str_i = 0;
+	uint8_t a, b, c, d;
+#if CBRRR_HAVE_X86_AVX2
+	if (CBRRR_CPU_HAS_AVX2) {
+		str_i = cbrrr_b64_decode_avx2(bufptr, b64_str, str_len);
+		bufptr += str_i / 4 * 3;
+	}
+#elif CBRRR_HAVE_NEON
+	str_i = cbrrr_b64_decode_neon(bufptr, b64_str, str_len);
+	bufptr += str_i / 4 * 3;
+#endif
+	while (str_i+3 < str_len) {
+		a = B64_DECODE_LUT[b64_str[str_i++]];
+		b = B64_DECODE_LUT[b64_str[str_i++]];
+		c = B64_DECODE_LUT[b64_str[str_i++]];
+		d = B64_DECODE_LUT[b64_str[str_i++]];
+		if ((a | b | c | d) & 0x80) {
+			PyErr_SetString(PyExc_ValueError, "invalid b64 character");
+			return -1;
+		}
+		*bufptr++ = (a << 2) | (b >> 4);
+		*bufptr++ = (b << 4) | (c >> 2);
+		*bufptr++ = (c << 6) | (d >> 0);
+	}
+	switch (str_len - str_i)
+	{
+	case 3:
+		a = B64_DECODE_LUT[b64_str[str_i++]];
+		b = B64_DECODE_LUT[b64_str[str_i++]];
+		c = B64_DECODE_LUT[b64_str[str_i++]];
+		if ((a | b | c) & 0x80) {
+			PyErr_SetString(PyExc_ValueError, "invalid b64 character");
+			return -1;
+		}
+		*bufptr++ = (a << 2) | (b >> 4);
+		*bufptr++ = (b << 4) | (c >> 2);
+		// should we check (c << 6) & 0xff == 0?
+		break;
+	
+	case 2:
+		a = B64_DECODE_LUT[b64_str[str_i++]];
+		b = B64_DECODE_LUT[b64_str[str_i++]];
+		if ((a | b) & 0x80) {
+			PyErr_SetString(PyExc_ValueError, "invalid b64 character");
+			return -1;
+		}
+		*bufptr++ = (a << 2) | (b >> 4);
+		// should we check (b << 4) & 0xff == 0?
+		break;
+	
+	case 0:
+		break;
+
+	default:
+		PyErr_SetString(PyExc_AssertionError, "unreachable!?");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+// nb: case insensitive
+static const uint8_t B32_DECODE_LUT[] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, 26, 27, 28, 29, 30, 31, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+
+/*
+Decode unpadded base32 (case-insensitive) into out, which must have room for
+(str_len*5)/8 bytes. Non-canonical encodings (i.e. with nonzero trailing bits)
+are rejected.
+
+Returns NULL on success, or an error message on failure (doesn't touch python
+exception state, so it's safe to call without the GIL)
+*/
+static const char *
+cbrrr_b32_decode_nopad(uint8_t *bufptr, const uint8_t *b32_str, size_t str_len)
+{
+	size_t str_i = 0;
+	uint8_t a, b, c, d, e, f, g, h;
+	while (str_i+7 < str_len) {
+		a = B32_DECODE_LUT[b32_str[str_i++]];
+		b = B32_DECODE_LUT[b32_str[str_i++]];
+		c = B32_DECODE_LUT[b32_str[str_i++]];
+		d = B32_DECODE_LUT[b32_str[str_i++]];
+		e = B32_DECODE_LUT[b32_str[str_i++]];
+		f = B32_DECODE_LUT[b32_str[str_i++]];
+		g = B32_DECODE_LUT[b32_str[str_i++]];
+		h = B32_DECODE_LUT[b32_str[str_i++]];
+		if ((a | b | c | d | e | f | g | h) & 0x80) {
+			return "invalid b32 character";
+		}
+		// 43210432 10432104 32104321 04321043 21043210
+		// aaaaabbb bbcccccd ddddeeee efffffgg ggghhhhh
+		// 76543210 76543210 76543210 76543210 76543210
+		*bufptr++ =            (a << 3) | (b >> 2);
+		*bufptr++ = (b << 6) | (c << 1) | (d >> 4);
+		*bufptr++ = (d << 4) |            (e >> 1);
+		*bufptr++ = (e << 7) | (f << 2) | (g >> 3);
+		*bufptr++ = (g << 5) | (h << 0)           ;
+	}
+	switch (str_len - str_i)
+	{
+	case 7:
+		a = B32_DECODE_LUT[b32_str[str_i++]];
+		b = B32_DECODE_LUT[b32_str[str_i++]];
+		c = B32_DECODE_LUT[b32_str[str_i++]];
+		d = B32_DECODE_LUT[b32_str[str_i++]];
+		e = B32_DECODE_LUT[b32_str[str_i++]];
+		f = B32_DECODE_LUT[b32_str[str_i++]];
+		g = B32_DECODE_LUT[b32_str[str_i++]];
+		if ((a | b | c | d | e | f | g) & 0x80) {
+			return "invalid b32 character";
+		}
+		*bufptr++ =            (a << 3) | (b >> 2);
+		*bufptr++ = (b << 6) | (c << 1) | (d >> 4);
+		*bufptr++ = (d << 4) |            (e >> 1);
+		*bufptr++ = (e << 7) | (f << 2) | (g >> 3);
+		if (g & 0x07) {
+			return "non-canonical b32 encoding";
+		}
+		break;
+	case 5:
+		a = B32_DECODE_LUT[b32_str[str_i++]];
+		b = B32_DECODE_LUT[b32_str[str_i++]];
+		c = B32_DECODE_LUT[b32_str[str_i++]];
+		d = B32_DECODE_LUT[b32_str[str_i++]];
+		e = B32_DECODE_LUT[b32_str[str_i++]];
+		if ((a | b | c | d | e) & 0x80) {
+			return "invalid b32 character";
+		}
+		*bufptr++ =            (a << 3) | (b >> 2);
+		*bufptr++ = (b << 6) | (c << 1) | (d >> 4);
+		*bufptr++ = (d << 4) |            (e >> 1);
+		if (e & 0x01) {
+			return "non-canonical b32 encoding";
+		}
+		break;
+	case 4:
+		a = B32_DECODE_LUT[b32_str[str_i++]];
+		b = B32_DECODE_LUT[b32_str[str_i++]];
+		c = B32_DECODE_LUT[b32_str[str_i++]];
+		d = B32_DECODE_LUT[b32_str[str_i++]];
+		if ((a | b | c | d) & 0x80) {
+			return "invalid b32 character";
+		}
+		*bufptr++ =            (a << 3) | (b >> 2);
+		*bufptr++ = (b << 6) | (c << 1) | (d >> 4);
+		if (d & 0x0f) {
+			return "non-canonical b32 encoding";
+		}
+		break;
+	case 2:
+		a = B32_DECODE_LUT[b32_str[str_i++]];
+		b = B32_DECODE_LUT[b32_str[str_i++]];
+		if ((a | b) & 0x80) {
+			return "invalid b32 character";
+		}
+		*bufptr++ =            (a << 3) | (b >> 2);
+		if (b & 0x03) {
+			return "non-canonical b32 encoding";
+		}
+		break;
+	
+	case 0:
+		// nothing to do here
+		break;
+
+	case 1:
+	case 3:
+	case 6:
+		return "invalid b32 length";
+
+	default:
+		return "unreachable!?";
+	}
+
+	return NULL;
+}
+
+static int
+cbrrr_write_cbor_bytes_from_multibase_b32_nopad(CbrrrBuf *buf, const uint8_t *b32_str, size_t str_len)
+{
+	if (str_len == 0 || b32_str[0] != 'b') {
+		PyErr_SetString(PyExc_ValueError, "invalid/unsupported multibase prefix");
+		return -1; // multibase prefix
+	}
+	b32_str++;
+	str_len--;
+
+	/* nb: see comment in b64 fn above re: integer overflow */
+	size_t decoded_length = ((uint64_t)str_len*5)/8;
+	if (cbrrr_write_cbor_varint(buf, DCMT_BYTE_STRING, decoded_length + 1) < 0) {
+		return -1;
+	}
+	if (cbrrr_buf_make_room(buf, decoded_length + 1) < 0) {
+		return -1;
+	}
+	uint8_t *bufptr = buf->buf + buf->length;
+	buf->length += decoded_length + 1;
+
+	*bufptr++ = 0; // multibase raw
+
+	const char *err = cbrrr_b32_decode_nopad(bufptr, b32_str, str_len);
+	if (err != NULL) {
+		PyErr_SetString(PyExc_ValueError, err);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+Native CID type. This is very minimal, intended to support atproto use cases
+and not much else.
+
+The raw CID bytes are stored inline (it's a var-sized object, like bytes), so
+the codecs can read and write them directly without going via __bytes__ or
+calling the constructor. The hash is cached, and matches hash(cid_bytes).
+*/
+
+static const uint8_t CIDV1_DAG_CBOR_SHA256_32_PFX[] = {0x01, CBRRR_MULTICODEC_DAG_CBOR, 0x12, 0x20};
+static const uint8_t CIDV1_RAW_SHA256_32_PFX[] = {0x01, 0x55, 0x12, 0x20};
+
+static PyObject *
+cbrrr_cid_alloc(PyTypeObject *type, const uint8_t *data, size_t len)
+{
+	CIDObject *self = (CIDObject *)type->tp_alloc(type, len);
+	if (self == NULL) {
+		return NULL;
+	}
+	self->hash = -1;
+	memcpy(self->cid_bytes, data, len);
+	return (PyObject *)self;
+}
+
+/*
+Construct a CID from its raw bytes, via cid_ctor - which gets skipped entirely
+if it's the native CID type.
+*/
+static PyObject *
+cbrrr_cid_from_raw(CbrrrState *st, PyObject *cid_ctor, const uint8_t *data, size_t len)
+{
+	CbrrrStats *stats = cbrrr_stats();
+	if (stats != NULL) {
+		stats->cids++;
+		stats->cid_ctor_calls += cid_ctor != (PyObject *)st->cid_type;
+	}
+	if (cid_ctor == (PyObject *)st->cid_type) {
+		return cbrrr_cid_alloc(st->cid_type, data, len);
+	}
+	PyObject *cid_bytes = PyBytes_FromStringAndSize((const char *)data, len);
+	if (cid_bytes == NULL) {
+		return NULL;
+	}
+	CBRRR_PROBE1(cid__ctor__start, len);
+	PyObject *res = PyObject_CallFunctionObjArgs(cid_ctor, cid_bytes, NULL);
+	CBRRR_PROBE1(cid__ctor__done, res == NULL ? (int)cbrrr_fail_kind(st) + 1 : 0);
+	Py_DECREF(cid_bytes);
+	return res;
+}
+
+static PyObject *
+CID_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"cid_bytes", NULL};
+	Py_buffer data;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*:CID", kwlist, &data)) {
+		return NULL;
+	}
+	PyObject *res = cbrrr_cid_alloc(type, data.buf, data.len);
+	PyBuffer_Release(&data);
+	return res;
+}
+
+static PyObject *
+CID_decode(PyObject *cls, PyObject *data)
+{
+	CbrrrState *st = cbrrr_type_state((PyTypeObject *)cls);
+	const uint8_t *str;
+	Py_ssize_t str_len;
+	Py_buffer view;
+	PyObject *res = NULL;
+
+	view.obj = NULL;
+	if (PyUnicode_Check(data)) {
+		str = (const uint8_t *)PyUnicode_AsUTF8AndSize(data, &str_len);
+		if (str == NULL) {
+			return NULL;
+		}
+	} else {
+		if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) < 0) {
+			return NULL;
+		}
+		str = view.buf;
+		str_len = view.len;
+	}
+
+	if (str_len > 0 && str[0] == 0x00) { // identity multibase codec
+		res = cbrrr_cid_from_raw(st, cls, str + 1, str_len - 1);
+	} else if (str_len > 0 && str[0] == 'b') { // base32 multibase codec
+		if (str[str_len - 1] == '=') {
+			PyErr_SetString(PyExc_ValueError, "unexpected base32 padding");
+			goto done;
+		}
+		size_t decoded_len = ((uint64_t)(str_len - 1) * 5) / 8;
+		uint8_t *decoded = PyMem_Malloc(decoded_len + 1); // +1 so it's never a 0-byte malloc
+		if (decoded == NULL) {
+			PyErr_NoMemory();
+			goto done;
+		}
+		const char *err = cbrrr_b32_decode_nopad(decoded, str + 1, str_len - 1);
+		if (err != NULL) {
+			PyErr_SetString(PyExc_ValueError, err);
+		} else {
+			res = cbrrr_cid_from_raw(st, cls, decoded, decoded_len);
+		}
+		PyMem_Free(decoded);
+	} else {
+		PyErr_SetString(PyExc_ValueError, "I don't know how to decode this CID");
+	}
+
+done:
+	if (view.obj != NULL) {
+		PyBuffer_Release(&view);
+	}
+	return res;
+}
+
+static PyObject *
+CID_encode(CIDObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"base", NULL};
+	const char *base = "base32";
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|s:encode", kwlist, &base)) {
+		return NULL;
+	}
+	if (strcmp(base, "base32") != 0) {
+		// this function might support other encodings in the future
+		PyErr_SetString(PyExc_ValueError, "unsupported base encoding");
+		return NULL;
+	}
+	return cbrrr_bytes_to_b32_multibase(self->cid_bytes, Py_SIZE(self));
+}
+
+static PyObject *
+cbrrr_cid_sha256_from(PyObject *cls, PyObject *args, const uint8_t prefix[4])
+{
+	CbrrrState *st = cbrrr_type_state((PyTypeObject *)cls);
+	Py_buffer data;
+	CbrrrSha256 ctx;
+	uint8_t cid_bytes[4 + 32];
+
+	if (!PyArg_ParseTuple(args, "y*", &data)) {
+		return NULL;
+	}
+	cbrrr_sha256_init(&ctx);
+	cbrrr_sha256_update(&ctx, data.buf, data.len);
+	PyBuffer_Release(&data);
+
+	memcpy(cid_bytes, prefix, 4);
+	cbrrr_sha256_final(&ctx, cid_bytes + 4);
+	return cbrrr_cid_from_raw(st, cls, cid_bytes, sizeof(cid_bytes));
+}
+
+static PyObject *
+CID_cidv1_dag_cbor_sha256_32_from(PyObject *cls, PyObject *args)
+{
+	return cbrrr_cid_sha256_from(cls, args, CIDV1_DAG_CBOR_SHA256_32_PFX);
+}
+
+static PyObject *
+CID_cidv1_raw_sha256_32_from(PyObject *cls, PyObject *args)
+{
+	return cbrrr_cid_sha256_from(cls, args, CIDV1_RAW_SHA256_32_PFX);
+}
+
+static PyObject *
+CID_is_cidv1_dag_cbor_sha256_32(CIDObject *self, PyObject *Py_UNUSED(ignored))
+{
+	return PyBool_FromLong(Py_SIZE(self) == 36 && memcmp(self->cid_bytes, CIDV1_DAG_CBOR_SHA256_32_PFX, 4) == 0);
+}
+
+static PyObject *
+CID_is_cidv1_raw_sha256_32(CIDObject *self, PyObject *Py_UNUSED(ignored))
+{
+	return PyBool_FromLong(Py_SIZE(self) == 36 && memcmp(self->cid_bytes, CIDV1_RAW_SHA256_32_PFX, 4) == 0);
+}
+
+static PyObject *
+CID_bytes(CIDObject *self, PyObject *Py_UNUSED(ignored))
+{
+	return PyBytes_FromStringAndSize((const char *)self->cid_bytes, Py_SIZE(self));
+}
+
+static PyObject *
+CID_reduce(CIDObject *self, PyObject *Py_UNUSED(ignored))
+{
+	return Py_BuildValue("(O(y#))", Py_TYPE(self), self->cid_bytes, Py_SIZE(self));
+}
+
+static PyObject *
+CID_repr(CIDObject *self)
+{
+	PyObject *encoded = cbrrr_bytes_to_b32_multibase(self->cid_bytes, Py_SIZE(self));
+	if (encoded == NULL) {
+		return NULL;
+	}
+	PyObject *res = PyUnicode_FromFormat("CID(%U)", encoded);
+	Py_DECREF(encoded);
+	return res;
+}
+
+static Py_hash_t
+CID_hash(CIDObject *self)
+{
+	// racing threads will compute the same value, so there's no need for a lock
+	Py_hash_t hash = CBRRR_LOAD_RELAXED(self->hash);
+	if (hash == -1) {
+#if PY_VERSION_HEX >= 0x030E0000
+		hash = Py_HashBuffer(self->cid_bytes, Py_SIZE(self));
+#elif PY_VERSION_HEX >= 0x030D0000
+		// 3.13 made _Py_HashBytes private, and Py_HashBuffer didn't exist yet
+		PyObject *tmp = PyBytes_FromStringAndSize((const char *)self->cid_bytes, Py_SIZE(self));
+		if (tmp == NULL) {
+			return -1;
+		}
+		hash = PyObject_Hash(tmp);
+		Py_DECREF(tmp);
+#else
+		hash = _Py_HashBytes(self->cid_bytes, Py_SIZE(self));
+#endif
+		CBRRR_STORE_RELAXED(self->hash, hash);
+	}
+	return hash;
+}
+
+static PyObject *
+CID_richcompare(CIDObject *self, PyObject *other, int op)
+{
+	if ((op != Py_EQ && op != Py_NE) || !PyObject_TypeCheck(other, cbrrr_type_state(Py_TYPE(self))->cid_type)) {
+		Py_RETURN_NOTIMPLEMENTED;
+	}
+	CIDObject *other_cid = (CIDObject *)other;
+	Py_hash_t hash = CBRRR_LOAD_RELAXED(self->hash), other_hash = CBRRR_LOAD_RELAXED(other_cid->hash);
+	int eq = Py_SIZE(self) == Py_SIZE(other_cid)
+		&& (hash == -1 || other_hash == -1 || hash == other_hash)
+		&& memcmp(self->cid_bytes, other_cid->cid_bytes, Py_SIZE(self)) == 0;
+	return PyBool_FromLong(op == Py_EQ ? eq : !eq);
+}
+
+static PyMethodDef CID_methods[] = {
+	{"decode", (PyCFunction)CID_decode, METH_O | METH_CLASS,
+		"decode a multibase-encoded CID string (currently supported codecs: identity/raw, base32)"},
+	{"encode", (PyCFunction)(void(*)(void))CID_encode, METH_VARARGS | METH_KEYWORDS,
+		"encode as a multibase string (currently only base32 is supported)"},
+	{"cidv1_dag_cbor_sha256_32_from", CID_cidv1_dag_cbor_sha256_32_from, METH_VARARGS | METH_CLASS,
+		"CIDv1 of some DAG-CBOR bytes, using sha256"},
+	{"cidv1_raw_sha256_32_from", CID_cidv1_raw_sha256_32_from, METH_VARARGS | METH_CLASS,
+		"CIDv1 of some raw bytes, using sha256"},
+	{"is_cidv1_dag_cbor_sha256_32", (PyCFunction)CID_is_cidv1_dag_cbor_sha256_32, METH_NOARGS, NULL},
+	{"is_cidv1_raw_sha256_32", (PyCFunction)CID_is_cidv1_raw_sha256_32, METH_NOARGS, NULL},
+	{"__bytes__", (PyCFunction)CID_bytes, METH_NOARGS, NULL},
+	{"__reduce__", (PyCFunction)CID_reduce, METH_NOARGS, NULL},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef CID_getset[] = {
+	{"cid_bytes", (getter)CID_bytes, NULL, "the raw CID bytes, without a multibase prefix", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyType_Slot CID_slots[] = {
+	{Py_tp_doc,
+		"CID(cid_bytes)\n\n"
+		"Expects raw bytes, without a multibase prefix.\n\n"
+		"If you don't have raw bytes, you probably want CID.decode()\n\n"
+		"NOTE: No validation is performed here! You're responsible for ensuring\n"
+		"the CID has a format you recognise. the is_cidv1_dag_cbor_sha256_32()\n"
+		"and is_cidv1_raw_sha256_32() methods may be useful for this."},
+	{Py_tp_new, CBRRR_SLOT(CID_new)},
+	{Py_tp_repr, CBRRR_SLOT(CID_repr)},
+	{Py_tp_hash, CBRRR_SLOT(CID_hash)},
+	{Py_tp_richcompare, CBRRR_SLOT(CID_richcompare)},
+	{Py_tp_methods, CID_methods},
+	{Py_tp_getset, CID_getset},
+	{0, NULL}
+};
+
+static PyType_Spec CID_spec = {
+	.name = "cbrrr.CID",
+	.basicsize = offsetof(CIDObject, cid_bytes),
+	.itemsize = 1,
+	.flags = Py_TPFLAGS_DEFAULT | CBRRR_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_BASETYPE,
+	.slots = CID_slots,
+};
+
+static int
+cbrrr_cid_type_init(PyTypeObject *type)
+{
+	PyObject *pfx = PyBytes_FromStringAndSize((const char *)CIDV1_DAG_CBOR_SHA256_32_PFX, 4);
+	if (pfx == NULL || PyDict_SetItemString(type->tp_dict, "CIDV1_DAG_CBOR_SHA256_32_PFX", pfx) < 0) {
+		Py_XDECREF(pfx);
+		return -1;
+	}
+	Py_DECREF(pfx);
+	pfx = PyBytes_FromStringAndSize((const char *)CIDV1_RAW_SHA256_32_PFX, 4);
+	if (pfx == NULL || PyDict_SetItemString(type->tp_dict, "CIDV1_RAW_SHA256_32_PFX", pfx) < 0) {
+		Py_XDECREF(pfx);
+		return -1;
+	}
+	Py_DECREF(pfx);
+	PyType_Modified(type);
+	return 0;
+}
+
+static int
+cbrrr_compare_map_keys(const void *a, const void *b)
+{
+	// nb: the comparison needs to be performed on the byte representations of the strings
+
+	PyObject *obj_a = *(PyObject**)a;
+	PyObject *obj_b = *(PyObject**)b;
+	Py_ssize_t len_a, len_b;
+	const char *str_a = PyUnicode_AsUTF8AndSize(obj_a, &len_a);
+	const char *str_b = PyUnicode_AsUTF8AndSize(obj_b, &len_b);
+
+	/* Handle the (invalid!) case where one or both args are not strings
+	   (they'll get properly type-checked later, we don't have a good way
+	   to raise an exception from within qsort) */
+	if (str_a == NULL || str_b == NULL) {
+		/* this logic is here to make sure the comparison fn is transitive,
+		   lest we invoke UB, as in
+		   https://www.openwall.com/lists/oss-security/2024/01/30/7 */
+		if (str_a == NULL && str_b == NULL) {
+			return 0;
+		}
+		return str_a == NULL ? -1 : 1; /* non-strings sort first */
+	}
+
+	/* shorter strings sort first */
+	if (len_a < len_b) {
+		return -1;
+	}
+	if (len_a > len_b) {
+		return 1;
+	}
+	
+	/* do byte-wise comparision for equal-length strings */
+	return memcmp(str_a, str_b, len_a);
+}
+
+// (only used when stats are enabled, so that the plain version stays lean)
+static int
+cbrrr_compare_map_keys_counted(const void *a, const void *b)
+{
+	CbrrrStats *stats = cbrrr_stats();
+	if (stats != NULL) { // (stats could have been disabled in the meantime)
+		stats->sort_comparisons++;
+	}
+	return cbrrr_compare_map_keys(a, b);
+}
+
+
+// tag 42, wrapping the raw cid bytes with a leading 0 (multibase identity prefix)
+static int
+cbrrr_write_cbor_cid(CbrrrBuf *buf, const uint8_t *cid_bytes, size_t cid_len)
+{
+	const uint8_t nul = 0;
+	if (cbrrr_write_cbor_varint(buf, DCMT_TAG, 42) < 0) {
+		return -1;
+	}
+	if (cbrrr_write_cbor_varint(buf, DCMT_BYTE_STRING, cid_len + 1) < 0) {
+		return -1;
+	}
+	if (cbrrr_buf_write(buf, &nul, sizeof(nul)) < 0) {
+		return -1;
+	}
+	return cbrrr_buf_write(buf, cid_bytes, cid_len);
+}
+
+/*
+Dict shape cache.
+
+Records tend to come in a handful of shapes (i.e. key sets), and dicts of the
+same shape usually share the same key objects, in the same insertion order:
+keys from the decoder come out of the key cache, and keys written in python
+source are interned. So we can identify a shape cheaply by the identities of
+its keys (in iteration order), and remember the canonical order along with
+the pre-encoded CBOR for each key. Known shapes then need no sorting, and no
+re-encoding of key strings.
+
+Entries hold strong references to their keys, so the pointers can't be
+reused by other objects while the entry is alive. Entries are themselves
+refcounted, because a nested dict might evict an entry that an outer encoder
+stack frame is still using.
+
+To avoid churning through allocations on dicts with one-off key sets (e.g.
+maps keyed by arbitrary IDs), a shape is only cached the second time it's
+seen in a given slot.
+
+The cache itself lives in the module state (see CBRRR_SHAPE_CACHE_SIZE).
+Without a GIL, it's guarded by a lock which the encoder only ever tries to
+take, running uncached if it can't.
+*/
+
+#define CBRRR_SHAPE_MAX_KEYS 32 // dicts with more keys than this don't get cached
+
+typedef struct ShapeCacheEntry {
+	size_t refcnt; // only modified atomically, when free-threaded
+	uint64_t hash;
+	Py_ssize_t num_keys;
+	PyObject **order; // keys in dict iteration order (strong refs)
+	PyObject **keys; // the same keys, in canonical order (borrowed from order)
+	size_t *offsets; // offsets[i]..offsets[i+1] is the span of encoded for keys[i]
+	uint8_t *encoded; // CBOR-encoded keys, in canonical order
+} ShapeCacheEntry;
+
+static void
+cbrrr_shape_decref(ShapeCacheEntry *entry)
+{
+#ifdef Py_GIL_DISABLED
+	if (__atomic_sub_fetch(&entry->refcnt, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+#else
+	if (--entry->refcnt) {
+		return;
+	}
+#endif
+	for (Py_ssize_t i=0; i<entry->num_keys; i++) {
+		Py_DECREF(entry->order[i]);
+	}
+	free(entry);
+}
+
+/*
+Fills order with the dict's keys, and returns the hash of their identities,
+or 0 if the dict isn't eligible for caching
+*/
+static uint64_t
+cbrrr_shape_hash(PyObject *dict, PyObject **order)
+{
+	Py_ssize_t n = PyDict_GET_SIZE(dict);
+	if (n < 2 || n > CBRRR_SHAPE_MAX_KEYS) {
+		return 0;
+	}
+	uint64_t hash = n;
+	Py_ssize_t pos = 0, i = 0;
+	PyObject *key, *value;
+	while (PyDict_Next(dict, &pos, &key, &value)) {
+		order[i++] = key;
+		hash = (hash ^ (uintptr_t)key) * 0x9e3779b97f4a7c15ULL;
+	}
+	hash ^= hash >> 29;
+	return hash | 1; // never 0
+}
+
+// returns a new reference to the matching entry, if any
+static ShapeCacheEntry *
+cbrrr_shape_lookup(CbrrrState *st, uint64_t hash, PyObject **order, Py_ssize_t num_keys)
+{
+	if (!CBRRR_TRYLOCK(&st->shape_cache_lock)) {
+		return NULL;
+	}
+	ShapeCacheEntry *entry = st->shape_cache[hash & (CBRRR_SHAPE_CACHE_SIZE - 1)];
+	if (entry != NULL && entry->hash == hash && entry->num_keys == num_keys
+	 && memcmp(entry->order, order, num_keys * sizeof(*order)) == 0) {
+#ifdef Py_GIL_DISABLED
+		__atomic_add_fetch(&entry->refcnt, 1, __ATOMIC_RELAXED);
+#else
+		entry->refcnt++;
+#endif
+	} else {
+		entry = NULL;
+	}
+	CBRRR_UNLOCK(&st->shape_cache_lock);
+	return entry;
+}
+
+/*
+Called on a cache miss, with the keys already sorted into canonical order.
+Failure to insert isn't an error (we just don't cache it), so this never
+sets an exception.
+*/
+static void
+cbrrr_shape_insert(CbrrrState *st, uint64_t hash, PyObject **order, PyObject **sorted_keys, Py_ssize_t num_keys)
+{
+	size_t slot = hash & (CBRRR_SHAPE_CACHE_SIZE - 1);
+	if (!CBRRR_TRYLOCK(&st->shape_cache_lock)) {
+		return;
+	}
+	if (st->shape_cache_pending[slot] != hash) {
+		st->shape_cache_pending[slot] = hash; // maybe next time
+		CBRRR_UNLOCK(&st->shape_cache_lock);
+		return;
+	}
+	CBRRR_UNLOCK(&st->shape_cache_lock);
+
+	size_t encoded_len = 0;
+	for (Py_ssize_t i=0; i<num_keys; i++) {
+		if (!PyUnicode_CheckExact(sorted_keys[i])) {
+			return; // this'll be reported as an error later
+		}
+		Py_ssize_t key_len;
+		if (PyUnicode_AsUTF8AndSize(sorted_keys[i], &key_len) == NULL) {
+			PyErr_Clear(); // ditto
+			return;
+		}
+		encoded_len += 9 + key_len; // 9 is the max size of a CBOR header
+	}
+
+	ShapeCacheEntry *entry = malloc(
+		sizeof(ShapeCacheEntry)
+		+ num_keys * 2 * sizeof(PyObject *)
+		+ (num_keys + 1) * sizeof(size_t)
+		+ encoded_len
+	);
+	if (entry == NULL) {
+		return;
+	}
+	entry->refcnt = 1;
+	entry->hash = hash;
+	entry->num_keys = num_keys;
+	entry->order = (PyObject **)(entry + 1);
+	entry->keys = entry->order + num_keys;
+	entry->offsets = (size_t *)(entry->keys + num_keys);
+	entry->encoded = (uint8_t *)(entry->offsets + num_keys + 1);
+
+	CbrrrBuf buf = {
+		.buf = entry->encoded,
+		.capacity = encoded_len,
+		.fixed = 1,
+	};
+	for (Py_ssize_t i=0; i<num_keys; i++) {
+		Py_ssize_t key_len;
+		const char *key_str = PyUnicode_AsUTF8AndSize(sorted_keys[i], &key_len); // can't fail, we already checked
+		entry->offsets[i] = buf.length;
+		// can't fail either, there's enough room
+		cbrrr_write_cbor_varint(&buf, DCMT_TEXT_STRING, key_len);
+		cbrrr_buf_write(&buf, (const uint8_t *)key_str, key_len);
+		entry->keys[i] = sorted_keys[i];
+	}
+	entry->offsets[num_keys] = buf.length;
+	for (Py_ssize_t i=0; i<num_keys; i++) {
+		Py_INCREF(order[i]);
+		entry->order[i] = order[i];
+	}
+
+	if (!CBRRR_TRYLOCK(&st->shape_cache_lock)) {
+		cbrrr_shape_decref(entry);
+		return;
+	}
+	ShapeCacheEntry *evicted = st->shape_cache[slot];
+	st->shape_cache[slot] = entry;
+	st->shape_cache_pending[slot] = 0;
+	CBRRR_UNLOCK(&st->shape_cache_lock);
+	if (evicted != NULL) {
+		cbrrr_shape_decref(evicted); // outside the lock, since it might run arbitrary code (via the keys' deallocators)
+	}
+}
+
+// returns 1 if the keys are already in canonical order
+static int
+cbrrr_keys_are_sorted(PyObject **keys, Py_ssize_t num_keys)
+{
+	for (Py_ssize_t i=1; i<num_keys; i++) {
+		if (cbrrr_compare_map_keys(&keys[i-1], &keys[i]) > 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// the major type that obj will be encoded as (assuming it's encodable at all), or -1
+static int
+cbrrr_stats_major_type(CbrrrState *st, PyObject *obj, PyObject *cid_type, int atjson_mode)
+{
+	PyTypeObject *obj_type = Py_TYPE(obj);
+	if (obj_type == &PyUnicode_Type) {
+		return DCMT_TEXT_STRING;
+	}
+	if (obj_type == &PyBytes_Type) {
+		return DCMT_BYTE_STRING;
+	}
+	if (obj_type == (PyTypeObject*)cid_type) {
+		return DCMT_TAG;
+	}
+	if (obj_type == &PyDict_Type) {
+		if (atjson_mode && PyDict_GET_SIZE(obj) == 1) {
+			if (PyDict_GetItem(obj, st->string_link) != NULL) {
+				return DCMT_TAG;
+			}
+			if (PyDict_GetItem(obj, st->string_bytes) != NULL) {
+				return DCMT_BYTE_STRING;
+			}
+		}
+		return DCMT_MAP;
+	}
+	if (obj_type == &PyLong_Type) {
+		int overflow;
+		long long intval = PyLong_AsLongLongAndOverflow(obj, &overflow);
+		return (overflow ? overflow < 0 : intval < 0) ? DCMT_NEGATIVE_INT : DCMT_UNSIGNED_INT;
+	}
+	if (obj_type == &PyList_Type) {
+		return DCMT_ARRAY;
+	}
+	if (obj == Py_None || obj_type == &PyBool_Type || obj_type == &PyFloat_Type) {
+		return DCMT_FLOAT;
+	}
+	return -1;
+}
+
+// per-call stats and probes, for when an encode is finished (res < 0 on failure, with an exception set)
+static void
+cbrrr_encode_done(CbrrrState *st, CbrrrStats *stats, int res, size_t written, size_t max_depth)
+{
+	int fail_kind = res < 0 ? (int)cbrrr_fail_kind(st) : -1;
+	if (stats != NULL) {
+		stats->encode.calls++;
+		stats->encode.max_depth = max_depth > stats->encode.max_depth ? max_depth : stats->encode.max_depth;
+		if (fail_kind >= 0) {
+			stats->encode.failures[fail_kind]++;
+		} else {
+			stats->encode.bytes += written;
+		}
+	}
+	CBRRR_PROBE3(encode__done, written, max_depth, fail_kind + 1);
+}
+
+/*
+As with cbrrr_parse_object_scratch, the stack is passed in (and handed back)
+via *stack_ptr, so that it can be kept around between calls (see Encoder).
+*/
+static int
+cbrrr_encode_object_scratch(CbrrrState *st, CbrrrBuf *buf, PyObject *obj_in, PyObject* cid_type, int atjson_mode, EncoderStackFrame **stack_ptr, size_t *stack_len_ptr)
+{
+	CbrrrStats *stats = cbrrr_stats();
+
+	if (!buf->internal) {
+		CBRRR_PROBE0(encode__start);
+	}
+
+	/*
+	in a slightly unscientific test, frequency counts for each type
+	in an atproto repo looked like this:
+
+	233805 str
+	135608 bytes
+	88726 cid
+	61775 dict
+	49079 int
+	36341 list
+	12585 none
+	2 bool
+	0 float
+	*/
+
+	size_t stack_len = *stack_len_ptr;
+	EncoderStackFrame *encoder_stack = *stack_ptr;
+
+	if (encoder_stack == NULL) {
+		stack_len = 16;
+		encoder_stack = malloc(stack_len * sizeof(*encoder_stack));
+		if (encoder_stack == NULL) {
+			PyErr_SetString(PyExc_MemoryError, "malloc failed");
+			return -1;
+		}
+		*stack_ptr = encoder_stack;
+		*stack_len_ptr = stack_len;
+	}
+
+	encoder_stack[0].dict = NULL;
+	encoder_stack[0].list = NULL;
+	encoder_stack[0].shape = NULL;
+	encoder_stack[0].idx = 0;
+
+	size_t sp = 0;
+	size_t max_sp = 0; // (just for stats/tracing)
+
+	int res = -1; // assume failure by default
+
+	/* for stats: the output position at the start of the item currently
+	   being encoded, and its major type (or -1 if there isn't one) */
+	size_t stat_start = buf->flushed + buf->length;
+	size_t stat_mark = stat_start;
+	int stat_type = -1;
+
+	for (;;) {
+		// make sure there's always at least 1 free slot at the top of the stack
+		if ((sp + 1) >= stack_len) {
+			stack_len *= 2; // TODO:PERF: smaller increments?
+			EncoderStackFrame *new_stack = realloc(encoder_stack, stack_len * sizeof(*encoder_stack));
+			if (new_stack == NULL) {
+				PyErr_SetString(PyExc_MemoryError, "realloc failed");
+				break;
+			}
+			encoder_stack = new_stack;
+			*stack_ptr = encoder_stack;
+			*stack_len_ptr = stack_len;
+			if (stats != NULL) {
+				stats->encode.stack_reallocs++;
+			}
+		}
+
+		// every item ends up back here once it's been (shallowly) written out
+		max_sp = sp > max_sp ? sp : max_sp;
+		if (stats != NULL) {
+			size_t pos = buf->flushed + buf->length;
+			if (stat_type >= 0) {
+				cbrrr_stats_token(&stats->encode, stat_type, pos - stat_mark);
+			}
+			stat_mark = pos;
+			stat_type = -1;
+		}
+
+		/* buffers with somewhere to flush to only do so here, where we're not
+		   holding any borrowed references (other than via the stack) */
+		if (buf->length >= buf->flush_at && cbrrr_buf_flush(buf) < 0) {
+			break;
+		}
+
+		PyObject *obj;
+		if (sp == 0) { // we're at the root level
+			if (encoder_stack[sp].idx > 0) {
+				res = 0;
+				break; // we're done!
+			}
+			encoder_stack[sp].idx++;
+			obj = obj_in;
+		} else if (encoder_stack[sp].dict == NULL) { // we're working on a list
+			if (encoder_stack[sp].idx >= PySequence_Fast_GET_SIZE(encoder_stack[sp].list)) {
+				if (encoder_stack[sp].idx != encoder_stack[sp].len) {
+					PyErr_SetString(PyExc_RuntimeError, "list changed size during encoding");
+					break;
+				}
+				Py_DECREF(encoder_stack[sp].list);
+				sp--;
+				continue;
+			}
+			obj = PySequence_Fast_GET_ITEM(encoder_stack[sp].list, encoder_stack[sp].idx++); // borrowed ref
+		} else if (encoder_stack[sp].shape != NULL) { // we're working on a dict of a known shape
+			ShapeCacheEntry *shape = encoder_stack[sp].shape;
+			Py_ssize_t idx = encoder_stack[sp].idx++;
+			if (idx >= shape->num_keys) {
+				cbrrr_shape_decref(shape);
+				Py_DECREF(encoder_stack[sp].dict);
+				sp--;
+				continue;
+			}
+			if (cbrrr_buf_write(buf, shape->encoded + shape->offsets[idx], shape->offsets[idx+1] - shape->offsets[idx]) < 0) {
+				break;
+			}
+			obj = PyDict_GetItem(encoder_stack[sp].dict, shape->keys[idx]); // borrowed ref
+			if (obj == NULL) {
+				PyErr_SetString(PyExc_RuntimeError, "dict changed size during encoding");
+				break;
+			}
+		} else { // we're working on a dict
+			if (encoder_stack[sp].idx >= PySequence_Fast_GET_SIZE(encoder_stack[sp].list)) {
+				Py_DECREF(encoder_stack[sp].list);
+				Py_DECREF(encoder_stack[sp].dict);
+				sp--;
+				continue;
+			}
+			PyObject *key = PySequence_Fast_GET_ITEM(encoder_stack[sp].list, encoder_stack[sp].idx++); // borrowed ref
+			if (!PyUnicode_CheckExact(key)) {
+				PyErr_SetString(PyExc_TypeError, "map keys must be strings");
+				break;
+			}
+			Py_ssize_t key_len;
+			const char *key_str = PyUnicode_AsUTF8AndSize(key, &key_len);
+			if (key_str == NULL) {
+				break;
+			}
+			if (cbrrr_write_cbor_varint(buf, DCMT_TEXT_STRING, key_len) < 0) {
+				break;
+			}
+			if (cbrrr_buf_write(buf, (uint8_t *)key_str, key_len) < 0) {
+				break;
+			}
+			obj = PyDict_GetItem(encoder_stack[sp].dict, key); // borrwed ref
+			if (obj == NULL) {
+				PyErr_SetString(PyExc_RuntimeError, "dict changed size during encoding");
+				break;
+			}
+		}
+
+		if (stats != NULL) {
+			size_t pos = buf->flushed + buf->length;
+			if (encoder_stack[sp].dict != NULL) { // we just wrote a map key
+				cbrrr_stats_token(&stats->encode, DCMT_TEXT_STRING, pos - stat_mark);
+			}
+			stat_mark = pos;
+			stat_type = cbrrr_stats_major_type(st, obj, cid_type, atjson_mode);
+		}
+
+		PyTypeObject *obj_type = Py_TYPE(obj);
+
+		if (obj_type == &PyUnicode_Type) { // string
+			Py_ssize_t string_len;
+			const char *str = PyUnicode_AsUTF8AndSize(obj, &string_len);
+			if (str == NULL) {
+				break;
+			}
+			if (cbrrr_write_cbor_varint(buf, DCMT_TEXT_STRING, string_len) < 0) {
+				break;
+			}
+			if (cbrrr_buf_write_payload(buf, obj, (uint8_t *)str, string_len) < 0) {
+				break;
+			}
+			continue;
+		}
+		if (obj_type == &PyBytes_Type) { // bytes
+			if (atjson_mode) {
+				PyErr_SetString(PyExc_TypeError, "unexpected bytes object in atjson mode");
+				break;
+			}
+			Py_ssize_t bytes_len;
+			char *bbuf;
+			if(PyBytes_AsStringAndSize(obj, &bbuf, &bytes_len) != 0) {
+				break;
+			}
+			if (cbrrr_write_cbor_varint(buf, DCMT_BYTE_STRING, bytes_len) < 0) {
+				break;
+			}
+			if (cbrrr_buf_write_payload(buf, obj, (uint8_t*)bbuf, bytes_len) < 0) {
+				break;
+			}
+			continue;
+		}
+		if (obj_type == (PyTypeObject*)cid_type) { // cid
+			if (atjson_mode) {
+				PyErr_SetString(PyExc_TypeError, "unexpected CID object in atjson mode");
+				break;
+			}
+			if (obj_type == st->cid_type) { // native CID, we can read its bytes directly
+				if (cbrrr_write_cbor_cid(buf, ((CIDObject *)obj)->cid_bytes, Py_SIZE(obj)) < 0) {
+					break;
+				}
+				continue;
+			}
+			PyObject *cidbytes_obj = PyObject_CallMethod(obj, "__bytes__", NULL);
+			if (cidbytes_obj == NULL) {
+				break;
+			}
+			Py_ssize_t bytes_len;
+			char *bbuf;
+			if(PyBytes_AsStringAndSize(cidbytes_obj, &bbuf, &bytes_len) != 0) {
+				Py_DECREF(cidbytes_obj);
+				break;
+			}
+			/*if (bytes_len != 36) {
+				PyErr_SetString(PyExc_ValueError, "Invalid CID length");
+				Py_DECREF(cidbytes_obj);
+				break;
+			}*/
+			int res = cbrrr_write_cbor_cid(buf, (uint8_t*)bbuf, bytes_len);
+			Py_DECREF(cidbytes_obj);
+			if (res < 0) {
+				break;
+			}
+			continue;
+		}
+		if (obj_type == &PyDict_Type) { // dict
+			PyObject *order[CBRRR_SHAPE_MAX_KEYS];
+			uint64_t shape_hash = cbrrr_shape_hash(obj, order);
+			if (shape_hash) {
+				ShapeCacheEntry *shape = cbrrr_shape_lookup(st, shape_hash, order, PyDict_GET_SIZE(obj));
+				if (shape != NULL) {
+					if (cbrrr_write_cbor_varint(buf, DCMT_MAP, shape->num_keys) < 0) {
+						cbrrr_shape_decref(shape);
+						break;
+					}
+					sp++;
+					Py_INCREF(obj);
+					encoder_stack[sp].dict = obj;
+					encoder_stack[sp].list = NULL;
+					encoder_stack[sp].shape = shape;
+					encoder_stack[sp].idx = 0;
+					continue;
+				}
+			}
+			PyObject *keys = PyDict_Keys(obj);
+			if (keys == NULL) {
+				break;
+			}
+			if (atjson_mode && PySequence_Fast_GET_SIZE(keys) == 1) {// logic for $link, $bytes
+				PyObject *key = PySequence_Fast_GET_ITEM(keys, 0);
+				if (!PyUnicode_CheckExact(key)) {
+					PyErr_SetString(PyExc_TypeError, "map keys must be strings");
+					Py_DECREF(keys);
+					break;
+				}
+				Py_ssize_t string_len;
+				const char *str = PyUnicode_AsUTF8AndSize(key, &string_len); // does this fail gracefully if the item is not a string?
+				if (str == NULL) {
+					Py_DECREF(keys);
+					break;
+				}
+				if (string_len == 5 && strcmp(str, "$link") == 0) { // CID
+					PyObject *cid_str = PyDict_GetItem(obj, key); // borrowed
+					Py_DECREF(keys);
+					if (!PyUnicode_CheckExact(cid_str)) { // also handles the case where b64_str is NULL
+						PyErr_SetString(PyExc_TypeError, "$link field value must be a string");
+						break;
+					}
+					str = PyUnicode_AsUTF8AndSize(cid_str, &string_len); // reusing these variables
+					if (str == NULL) {
+						break;
+					}
+					if (cbrrr_write_cbor_varint(buf, DCMT_TAG, 42) < 0) {
+						break;
+					}
+					if (cbrrr_write_cbor_bytes_from_multibase_b32_nopad(buf, (uint8_t*)str, string_len) < 0) {
+						break;
+					}
+					continue;
+				}
+				if (string_len == 6 && strcmp(str, "$bytes") == 0) { // bytes
+					PyObject *b64_str = PyDict_GetItem(obj, key); // borrowed
+					Py_DECREF(keys);
+					if (!PyUnicode_CheckExact(b64_str)) { // also handles the case where b64_str is NULL
+						PyErr_SetString(PyExc_TypeError, "$bytes field value must be a string");
+						break;
+					}
+					str = PyUnicode_AsUTF8AndSize(b64_str, &string_len); // reusing these variables
+					if (str == NULL) {
+						break;
+					}
+					if (cbrrr_write_cbor_bytes_from_b64(buf, (uint8_t*)str, string_len) < 0) {
+						break;
+					}
+					continue;
+				}
+				// fallthru
+			}
+			if (PySequence_Fast_GET_SIZE(keys) > 1 /* don't try to sort empty or 1-length lists! */
+			 && !cbrrr_keys_are_sorted(PySequence_Fast_ITEMS(keys), PySequence_Fast_GET_SIZE(keys))) { // e.g. it came from the decoder
+				if (stats != NULL) {
+					stats->sorts++;
+				}
+				CBRRR_PROBE1(sort__start, PySequence_Fast_GET_SIZE(keys));
+				qsort( // it's a bit janky but we can sort the key list in-place, I think?
+					PySequence_Fast_ITEMS(keys),
+					PySequence_Fast_GET_SIZE(keys),
+					sizeof(PyObject*),
+					stats != NULL ? cbrrr_compare_map_keys_counted : cbrrr_compare_map_keys
+				);
+				CBRRR_PROBE1(sort__done, PySequence_Fast_GET_SIZE(keys));
+			}
+			if (shape_hash) {
+				cbrrr_shape_insert(st, shape_hash, order, PySequence_Fast_ITEMS(keys), PySequence_Fast_GET_SIZE(keys));
+			}
+			if (cbrrr_write_cbor_varint(buf, DCMT_MAP, PySequence_Fast_GET_SIZE(keys)) < 0) {
+				Py_DECREF(keys);
+				break;
+			}
+			sp++;
+			Py_INCREF(obj);
+			encoder_stack[sp].dict = obj;
+			encoder_stack[sp].list = keys;
+			encoder_stack[sp].shape = NULL;
+			encoder_stack[sp].idx = 0;
+			continue;
+		}
+		if (obj_type ==  &PyLong_Type) { // int
+			// fast path, for anything that fits in an int64 (i.e. almost everything)
+			int overflow;
+			long long intval = PyLong_AsLongLongAndOverflow(obj, &overflow);
+			if (!overflow) {
+				if (intval == -1 && PyErr_Occurred()) {
+					break;
+				}
+				if (intval >= 0) {
+					if (cbrrr_write_cbor_varint(buf, DCMT_UNSIGNED_INT, intval) < 0) {
+						break;
+					}
+				} else {
+					if (cbrrr_write_cbor_varint(buf, DCMT_NEGATIVE_INT, ~(uint64_t)intval) < 0) {
+						break;
+					}
+				}
+				continue;
+			}
+			// for everything else, we can't really do the range checks on the C side
+			// because the overflow would happen before we can detect it.
+			if (PyObject_RichCompareBool(obj, st->zero, Py_GE)) {
+				if (PyObject_RichCompareBool(obj, st->uint64_max, Py_GT)) {
+					PyErr_SetString(PyExc_ValueError, "integer out of range");
+					break;
+				}
+				if (cbrrr_write_cbor_varint(buf, DCMT_UNSIGNED_INT, PyLong_AsUnsignedLongLongMask(obj)) < 0) {
+					break;
+				}
+			} else {
+				if (PyObject_RichCompareBool(obj, st->uint64_max_inverted, Py_LT)) {
+					PyErr_SetString(PyExc_ValueError, "integer out of range");
+					break;
+				}
+				if (cbrrr_write_cbor_varint(buf, DCMT_NEGATIVE_INT, ~PyLong_AsUnsignedLongLongMask(obj)) < 0) {
+					break;
+				}
+			}
+			continue;
+		}
+		if (obj_type == &PyList_Type) {
+			if (cbrrr_write_cbor_varint(buf, DCMT_ARRAY, PySequence_Fast_GET_SIZE(obj)) < 0) {
+				break;
+			}
+			sp++;
+			Py_INCREF(obj);
+			encoder_stack[sp].dict = NULL;
+			encoder_stack[sp].list = obj;
+			encoder_stack[sp].shape = NULL;
+			encoder_stack[sp].idx = 0;
+			encoder_stack[sp].len = PySequence_Fast_GET_SIZE(obj);
+			continue;
+		}
+		if (obj == Py_None) { // none/null
+			if (cbrrr_write_cbor_varint(buf, DCMT_FLOAT, 22) < 0) {
+				break;
+			}
+			continue;
+		}
+		if (obj_type == &PyBool_Type) { // bool
+			if (cbrrr_write_cbor_varint(buf, DCMT_FLOAT, 20 + (obj == Py_True)) < 0) {
+				break;
+			}
+			continue;
+		}
+		if (obj_type == &PyFloat_Type) {
+			double doubleval = PyFloat_AS_DOUBLE(obj);
+			if (isnan(doubleval)) {
+				PyErr_SetString(PyExc_ValueError, "NaNs are not allowed");
+				break;
+			}
+			if (isinf(doubleval)) {
+				PyErr_SetString(PyExc_ValueError, "+/-Infinities are not allowed");
+				break;
+			}
+
+			// we can't use cbrrr_write_cbor_varint because it'd use the wrong sizes
+			uint8_t tmp = DCMT_FLOAT << 5 | 27;
+			if (cbrrr_buf_write(buf, &tmp, sizeof(tmp)) < 0) {
+				break;
+			}
+			uint64_t dub_int = ((union {uint64_t num; double dub;}){.dub=doubleval}).num;
+			uint8_t dub_be[8];
+
+			/* the compiler should be smart about emitting an endian swap if necessary */
+			dub_be[0] = (dub_int >> 56) & 0xff;
+			dub_be[1] = (dub_int >> 48) & 0xff;
+			dub_be[2] = (dub_int >> 40) & 0xff;
+			dub_be[3] = (dub_int >> 32) & 0xff;
+			dub_be[4] = (dub_int >> 24) & 0xff;
+			dub_be[5] = (dub_int >> 16) & 0xff;
+			dub_be[6] = (dub_int >>  8) & 0xff;
+			dub_be[7] = (dub_int >>  0) & 0xff;
+
+			if (cbrrr_buf_write(buf, dub_be, sizeof(dub_be)) < 0) {
+				break;
+			}
+			continue;
+		}
+
+		PyErr_Format(PyExc_TypeError, "I don't know how to encode type %R", obj_type);
+		break;
+	}
+
+	// if we bailed out due to error, there might be some frames left over on the stack
+	for (size_t i=1; i<=sp; i++) {
+		if (encoder_stack[i].shape != NULL) {
+			cbrrr_shape_decref(encoder_stack[i].shape);
+		} else {
+			Py_DECREF(encoder_stack[i].list);
+		}
+		Py_XDECREF(encoder_stack[i].dict);
+	}
+
+	buf->max_depth = max_sp;
+	if (!buf->internal) {
+		cbrrr_encode_done(st, stats, res, buf->flushed + buf->length - stat_start, max_sp);
+	}
+
+	return res;
+}
+
+static int
+cbrrr_encode_object(CbrrrState *st, CbrrrBuf *buf, PyObject *obj_in, PyObject* cid_type, int atjson_mode)
+{
+	EncoderStackFrame *stack = NULL;
+	size_t stack_len = 0;
+	int res = cbrrr_encode_object_scratch(st, buf, obj_in, cid_type, atjson_mode, &stack, &stack_len);
+	free(stack);
+	return res;
+}
+
+
+
+
+/*
+Works out the exact length of obj's DAG-CBOR encoding, by running the encoder
+over it without keeping (or even copying) the output. Since it's the same
+code, it fails if and only if encoding would.
+*/
+static int
+cbrrr_encoded_size(CbrrrState *st, PyObject *obj, PyObject *cid_type, int atjson_mode, int internal, size_t *size)
+{
+	CbrrrBuf buf;
+
+	// the buffer itself is only used by the atjson b64/b32 decoders, which write into it directly
+	if (cbrrr_buf_init_chunked(&buf, 0x400, NULL) < 0) {
+		return -1;
+	}
+	buf.count_only = 1;
+	buf.internal = internal;
+
+	int res = cbrrr_encode_object(st, &buf, obj, cid_type, atjson_mode);
+	*size = buf.flushed + buf.length;
+	cbrrr_buf_free(&buf);
+	return res;
+}
+
+/*
+Growing the output buffer gets expensive for large objects, since every
+doubling means another realloc (and a copy, and fresh pages to fault in).
+For objects made of lots of small items, that's still cheaper than walking the
+object twice. But if the output is mostly big strings or bytes, the size
+pre-pass is almost free, so once the output passes CBRRR_PRESIZE_THRESHOLD,
+we start over with a buffer of exactly the right size.
+
+So a large object costs a size pass plus an encoding pass, on top of the
+abandoned first attempt (which stops after CBRRR_PRESIZE_THRESHOLD bytes of
+output, so it's cheap next to the other two). The final pass can still grow
+its buffer, in case the object changed in between (e.g. a list got appended
+to, or a cid_type's __bytes__ returned something different), so that just
+costs a realloc rather than being an error.
+
+As far as stats and probes are concerned, that's all one call, and only the
+final pass happened.
+*/
+static PyObject *
+cbrrr_encode_to_bytes(CbrrrState *st, PyObject *obj, PyObject *cid_type, int atjson_mode)
+{
+	CbrrrStats *stats = cbrrr_stats();
+	CbrrrStats saved, *saved_ptr = NULL; // (only copied when stats are enabled)
+	CbrrrBuf buf;
+	size_t size;
+
+	if (stats != NULL) {
+		saved = *stats;
+		saved_ptr = &saved;
+	}
+	CBRRR_PROBE0(encode__start);
+
+	if (cbrrr_buf_init_bytes(&buf, 0x400, 0) < 0) { // TODO:PERF: tune this?
+		cbrrr_encode_done(st, stats, -1, 0, 0);
+		return NULL;
+	}
+	buf.limit = CBRRR_PRESIZE_THRESHOLD;
+	buf.internal = 1;
+
+	if (cbrrr_encode_object(st, &buf, obj, cid_type, atjson_mode) == 0) {
+		cbrrr_encode_done(st, stats, 0, buf.length, buf.max_depth);
+		return cbrrr_buf_finish_bytes(&buf);
+	}
+	cbrrr_buf_free(&buf);
+	if (!buf.overflowed) {
+		cbrrr_encode_done(st, stats, -1, 0, buf.max_depth);
+		return NULL;
+	}
+
+	if (cbrrr_encoded_size(st, obj, cid_type, atjson_mode, 1, &size) < 0) {
+		cbrrr_encode_done(st, stats, -1, 0, 0);
+		return NULL;
+	}
+	if (saved_ptr != NULL) { // forget about the passes so far
+		stats->encode = saved_ptr->encode;
+		stats->buf_grows = saved_ptr->buf_grows;
+		stats->sorts = saved_ptr->sorts;
+		stats->sort_comparisons = saved_ptr->sort_comparisons;
+	}
+	if (cbrrr_buf_init_bytes(&buf, size, 1) < 0) {
+		cbrrr_encode_done(st, stats, -1, 0, 0);
+		return NULL;
+	}
+	buf.internal = 1;
+	if (cbrrr_encode_object(st, &buf, obj, cid_type, atjson_mode) < 0) {
+		cbrrr_encode_done(st, stats, -1, 0, buf.max_depth);
+		cbrrr_buf_free(&buf);
+		return NULL;
+	}
+	cbrrr_encode_done(st, stats, 0, buf.length, buf.max_depth);
+	return cbrrr_buf_finish_bytes(&buf);
+}
+
+static PyObject *
+cbrrr_encode_dag_cbor(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	if (cbrrr_check_nargs("encode_dag_cbor", nargs, 3, 3) < 0) {
+		return NULL;
+	}
+	int atjson_mode = PyObject_IsTrue(args[2]);
+	if (atjson_mode < 0) {
+		return NULL;
+	}
+
+	return cbrrr_encode_to_bytes(st, args[0], args[1], atjson_mode);
+}
+
+static PyObject *
+cbrrr_encoded_size_py(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	size_t size;
+
+	if (cbrrr_check_nargs("encoded_size", nargs, 3, 3) < 0) {
+		return NULL;
+	}
+	int atjson_mode = PyObject_IsTrue(args[2]);
+	if (atjson_mode < 0) {
+		return NULL;
+	}
+
+	if (cbrrr_encoded_size(st, args[0], args[1], atjson_mode, 0, &size) < 0) {
+		return NULL;
+	}
+	return PyLong_FromSize_t(size);
+}
+
+static PyObject *
+cbrrr_encode_dag_cbor_into(PyObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	PyObject *obj;
+	Py_buffer out;
+	Py_ssize_t offset;
+	PyObject *cid_type;
+	int atjson_mode;
+	CbrrrBuf buf;
+
+	if (!PyArg_ParseTuple(args, "Ow*nOp", &obj, &out, &offset, &cid_type, &atjson_mode)) {
+		return NULL;
+	}
+
+	if (offset < 0 || offset > out.len) {
+		PyBuffer_Release(&out);
+		PyErr_SetString(PyExc_ValueError, "offset out of range");
+		return NULL;
+	}
+
+	buf.buf = (uint8_t *)out.buf + offset;
+	buf.length = 0;
+	buf.capacity = out.len - offset;
+	buf.bytes = NULL;
+	buf.fixed = 1;
+	buf.chunked = 0;
+	buf.flush = NULL;
+	buf.flushed = 0;
+	buf.flush_at = SIZE_MAX;
+	buf.hash = NULL;
+	buf.hashed = 0;
+	buf.count_only = 0;
+	buf.writes = 0;
+	buf.limit = 0;
+	buf.overflowed = 0;
+	buf.internal = 0;
+
+	int res = cbrrr_encode_object(st, &buf, obj, cid_type, atjson_mode);
+	PyBuffer_Release(&out);
+	if (res < 0) {
+		return NULL;
+	}
+
+	return PyLong_FromSize_t(buf.length);
+}
+
+
+// build a CIDv1 (dag-cbor, sha256) from a finished hash context
+static PyObject *
+cbrrr_cid_from_sha256(CbrrrState *st, CbrrrSha256 *ctx, PyObject *cid_ctor)
+{
+	uint8_t cid_bytes[4 + 32];
+	memcpy(cid_bytes, CIDV1_DAG_CBOR_SHA256_32_PFX, 4);
+	cbrrr_sha256_final(ctx, cid_bytes + 4);
+	return cbrrr_cid_from_raw(st, cid_ctor, cid_bytes, sizeof(cid_bytes));
+}
+
+static PyObject *
+cbrrr_encode_dag_cbor_with_cid(PyObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	PyObject *obj;
+	PyObject *cid_type;
+	int atjson_mode;
+	PyObject *cid_ctor;
+	CbrrrBuf buf;
+	CbrrrSha256 hash;
+
+	if (!PyArg_ParseTuple(args, "OOpO", &obj, &cid_type, &atjson_mode, &cid_ctor)) {
+		return NULL;
+	}
+
+	if (cbrrr_buf_init_bytes(&buf, 0x400, 0) < 0) {
+		return NULL;
+	}
+	cbrrr_sha256_init(&hash);
+	buf.hash = &hash;
+
+	if (cbrrr_encode_object(st, &buf, obj, cid_type, atjson_mode) < 0) {
+		cbrrr_buf_free(&buf);
+		return NULL;
+	}
+	cbrrr_buf_update_hash(&buf);
+
+	PyObject *res_bytes = cbrrr_buf_finish_bytes(&buf);
+	if (res_bytes == NULL) {
+		return NULL;
+	}
+	PyObject *cid = cbrrr_cid_from_sha256(st, &hash, cid_ctor);
+	if (cid == NULL) {
+		Py_DECREF(res_bytes);
+		return NULL;
+	}
+
+	PyObject *res = PyTuple_Pack(2, res_bytes, cid);
+	Py_DECREF(res_bytes);
+	Py_DECREF(cid);
+	return res;
+}
+
+static PyObject *
+cbrrr_hash_dag_cbor(PyObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	PyObject *obj;
+	PyObject *cid_type;
+	int atjson_mode;
+	PyObject *cid_ctor;
+	CbrrrBuf buf;
+	CbrrrSha256 hash;
+
+	if (!PyArg_ParseTuple(args, "OOpO", &obj, &cid_type, &atjson_mode, &cid_ctor)) {
+		return NULL;
+	}
+
+	// the encoded bytes only need to live long enough to be hashed
+	if (cbrrr_buf_init_chunked(&buf, 0x1000, NULL) < 0) {
+		return NULL;
+	}
+	cbrrr_sha256_init(&hash);
+	buf.hash = &hash;
+
+	int res = cbrrr_encode_object(st, &buf, obj, cid_type, atjson_mode);
+	if (res == 0) {
+		res = cbrrr_buf_flush(&buf);
+	}
+	cbrrr_buf_free(&buf);
+	if (res < 0) {
+		return NULL;
+	}
+
+	return cbrrr_cid_from_sha256(st, &hash, cid_ctor);
+}
+
+/*
+A chunked CbrrrBuf that flushes to a python file-like object (via its write
+method), or directly to a file descriptor, with the GIL released.
+*/
+typedef struct {
+	CbrrrBuf buf; // must come first, so that the flush callback can find the rest
+	PyObject *write; // bound write method, or NULL to use fd
+	int fd;
+} CbrrrWriterBuf;
+
+#define CBRRR_MAX_FD_WRITE 0x40000000 // keeps the length within an int, for _write on windows
+
+static int
+cbrrr_writer_flush(CbrrrBuf *buf, const uint8_t *data, size_t len)
+{
+	CbrrrWriterBuf *writer = (CbrrrWriterBuf *)buf;
+
+	while (len > 0) {
+		size_t written;
+		if (writer->write == NULL) {
+			size_t want = len < CBRRR_MAX_FD_WRITE ? len : CBRRR_MAX_FD_WRITE;
+			Py_ssize_t res;
+			Py_BEGIN_ALLOW_THREADS
+#ifdef _WIN32
+			res = _write(writer->fd, data, (unsigned int)want);
+#else
+			res = write(writer->fd, data, want);
+#endif
+			Py_END_ALLOW_THREADS
+			if (res < 0) {
+				if (errno == EINTR) { // as per PEP 475, retry unless a signal handler raised
+					if (PyErr_CheckSignals() < 0) {
+						return -1;
+					}
+					continue;
+				}
+				PyErr_SetFromErrno(PyExc_OSError);
+				return -1;
+			}
+			written = res;
+		} else {
+			/* nb: the writer might hang onto whatever we pass it, so it gets a
+			   copy rather than a view of our buffer. Big payloads get split into
+			   chunk-sized pieces, to keep the size of those copies bounded */
+			size_t want = len < buf->flush_at ? len : buf->flush_at;
+			PyObject *chunk = PyBytes_FromStringAndSize((const char *)data, want);
+			if (chunk == NULL) {
+				return -1;
+			}
+			PyObject *res = PyObject_CallFunctionObjArgs(writer->write, chunk, NULL);
+			Py_DECREF(chunk);
+			if (res == NULL) {
+				return -1;
+			}
+			written = want;
+			if (PyLong_Check(res)) { // e.g. raw (unbuffered) files can do partial writes
+				Py_ssize_t n = PyLong_AsSsize_t(res);
+				if (n <= 0 || (size_t)n > want) {
+					Py_DECREF(res);
+					if (!PyErr_Occurred()) {
+						PyErr_Format(PyExc_OSError, "write() returned %zd (expected 1 to %zu)", n, want);
+					}
+					return -1;
+				}
+				written = n;
+			} // otherwise (e.g. None), assume it wrote everything
+			Py_DECREF(res);
+		}
+		data += written;
+		len -= written;
+	}
+	return 0;
+}
+
+/*
+Points writer at dest, which is either a raw file descriptor (an int), or
+something with a write method. Call this before cbrrr_buf_init_chunked, and
+Py_XDECREF(writer->write) once you're done.
+*/
+static int
+cbrrr_writer_set_dest(CbrrrWriterBuf *writer, PyObject *dest)
+{
+	writer->write = NULL;
+	writer->fd = -1;
+	if (PyLong_Check(dest)) {
+		long fd = PyLong_AsLong(dest);
+		if (fd == -1 && PyErr_Occurred()) {
+			return -1;
+		}
+		if (fd < 0 || fd > INT_MAX) {
+			PyErr_SetString(PyExc_ValueError, "invalid file descriptor");
+			return -1;
+		}
+		writer->fd = (int)fd;
+		return 0;
+	}
+	writer->write = PyObject_GetAttrString(dest, "write");
+	return writer->write == NULL ? -1 : 0;
+}
+
+static PyObject *
+cbrrr_encode_dag_cbor_to(PyObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	PyObject *obj;
+	PyObject *dest;
+	Py_ssize_t chunk_size;
+	PyObject *cid_type;
+	int atjson_mode;
+	CbrrrWriterBuf writer;
+
+	if (!PyArg_ParseTuple(args, "OOnOp", &obj, &dest, &chunk_size, &cid_type, &atjson_mode)) {
+		return NULL;
+	}
+	if (chunk_size <= 0) {
+		PyErr_SetString(PyExc_ValueError, "chunk_size must be positive");
+		return NULL;
+	}
+	if (cbrrr_writer_set_dest(&writer, dest) < 0) {
+		return NULL;
+	}
+
+	if (cbrrr_buf_init_chunked(&writer.buf, chunk_size, cbrrr_writer_flush) < 0) {
+		Py_XDECREF(writer.write);
+		return NULL;
+	}
+
+	int res = cbrrr_encode_object(st, &writer.buf, obj, cid_type, atjson_mode);
+	if (res == 0) {
+		res = cbrrr_buf_flush(&writer.buf);
+	}
+	cbrrr_buf_free(&writer.buf);
+	Py_XDECREF(writer.write);
+	if (res < 0) {
+		return NULL;
+	}
+
+	return PyLong_FromSize_t(writer.buf.flushed);
+}
+
+// the inverse of cbrrr_parse_uvarint. out needs room for up to 10 bytes
+static size_t
+cbrrr_write_uvarint(uint8_t *out, uint64_t value)
+{
+	size_t i = 0;
+	while (value >= 0x80) {
+		out[i++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	out[i++] = value;
+	return i;
+}
+
+/*
+A set of sha256 digests, for CAR block deduplication. It's a plain
+open-addressing hash table, and since the keys are already hashes, their first
+8 bytes make a perfectly good index.
+*/
+typedef struct {
+	uint8_t (*slots)[32]; // all-zero means empty (sha256 isn't going to give us one of those)
+	size_t mask;
+	size_t count;
+} CbrrrDigestSet;
+
+static const uint8_t CBRRR_EMPTY_DIGEST[32] = {0};
+
+// returns 1 if digest was added, 0 if it was already there
+static int
+cbrrr_digest_set_insert(CbrrrDigestSet *set, const uint8_t digest[32])
+{
+	uint64_t idx;
+	memcpy(&idx, digest, sizeof(idx));
+	for (idx &= set->mask; ; idx = (idx + 1) & set->mask) {
+		if (memcmp(set->slots[idx], digest, 32) == 0) {
+			return 0;
+		}
+		if (memcmp(set->slots[idx], CBRRR_EMPTY_DIGEST, 32) == 0) {
+			memcpy(set->slots[idx], digest, 32);
+			set->count++;
+			return 1;
+		}
+	}
+}
+
+// returns 1 if digest was added, 0 if it was already there, or -1 on error (setting a python exception)
+static int
+cbrrr_digest_set_add(CbrrrDigestSet *set, const uint8_t digest[32])
+{
+	if (set->slots == NULL || (set->count + 1) * 2 > set->mask + 1) { // keep the load factor under 1/2
+		CbrrrDigestSet new_set;
+		size_t new_size = set->slots == NULL ? 0x100 : (set->mask + 1) * 2;
+		new_set.slots = calloc(new_size, sizeof(*new_set.slots));
+		if (new_set.slots == NULL) {
+			PyErr_SetString(PyExc_MemoryError, "calloc failed");
+			return -1;
+		}
+		new_set.mask = new_size - 1;
+		new_set.count = 0;
+		for (size_t i=0; set->slots != NULL && i<=set->mask; i++) {
+			if (memcmp(set->slots[i], CBRRR_EMPTY_DIGEST, 32) != 0) {
+				cbrrr_digest_set_insert(&new_set, set->slots[i]);
+			}
+		}
+		free(set->slots);
+		*set = new_set;
+	}
+	return cbrrr_digest_set_insert(set, digest);
+}
+
+/*
+CARv1 writer state, shared by encode_car and CarWriter.
+
+Each section is a uvarint length prefix, then the block's CID, then the block
+itself. Neither the length nor the CID is known until the block has been
+encoded, so we leave a gap for them (guessing a 2-byte prefix, which covers
+blocks up to ~16KiB), encode the block straight into the output after that,
+hash it in place, and then fill in the gap. The block only gets moved if the
+guess was wrong.
+
+The output either accumulates in memory (becoming a bytes object at the end),
+or goes to a CbrrrWriterBuf destination. In the latter case, it only gets
+flushed between sections (never by the encoder itself, since it'd flush the
+unfilled gap).
+*/
+
+#define CBRRR_CAR_PREFIX_GUESS 2
+#define CBRRR_CAR_CID_LEN 36 // we only write CIDv1 (dag-cbor, sha256)
+
+typedef struct {
+	CbrrrWriterBuf out; // out.buf.flush is NULL when writing to memory
+	size_t chunk_size;
+	int dedupe;
+	CbrrrDigestSet seen;
+	EncoderStackFrame *stack;
+	size_t stack_len;
+} CbrrrCar;
+
+static void
+cbrrr_car_free(CbrrrCar *car)
+{
+	cbrrr_buf_free(&car->out.buf);
+	Py_CLEAR(car->out.write);
+	free(car->seen.slots);
+	car->seen.slots = NULL;
+	free(car->stack);
+	car->stack = NULL;
+}
+
+/*
+Appends a section holding obj's encoding. If cid is non-NULL, the section is
+prefixed with the block's CID, which also gets stored in cid (and duplicate
+blocks are skipped, if car->dedupe is set).
+
+Returns 1 if the section was written, 0 if it was a duplicate, or -1 on error
+(setting a python exception). On error, the output is rolled back to where it
+was before, unless the buffer itself is gone (i.e. out.buf.buf is NULL).
+*/
+static int
+cbrrr_car_write_section(CbrrrState *st, CbrrrCar *car, PyObject *obj, PyObject *cid_type, int atjson_mode, uint8_t *cid)
+{
+	CbrrrBuf *buf = &car->out.buf;
+	size_t start = buf->length;
+	size_t cid_len = cid == NULL ? 0 : CBRRR_CAR_CID_LEN;
+	size_t data_start = start + CBRRR_CAR_PREFIX_GUESS + cid_len;
+	uint8_t prefix[10];
+
+	if (cbrrr_buf_make_room(buf, CBRRR_CAR_PREFIX_GUESS + cid_len) < 0) {
+		return -1;
+	}
+	buf->length = data_start;
+	if (cbrrr_encode_object_scratch(st, buf, obj, cid_type, atjson_mode, &car->stack, &car->stack_len) < 0) {
+		buf->length = start;
+		return -1;
+	}
+	size_t data_len = buf->length - data_start;
+
+	/* nb: this is the last thing that can fail, and it has to come before the
+	   digest goes into car->seen, or else a failure would leave the block
+	   looking like it had been written */
+	size_t prefix_len = cbrrr_write_uvarint(prefix, cid_len + data_len);
+	if (prefix_len > CBRRR_CAR_PREFIX_GUESS && cbrrr_buf_make_room(buf, prefix_len - CBRRR_CAR_PREFIX_GUESS) < 0) {
+		buf->length = start;
+		return -1;
+	}
+
+	if (cid != NULL) {
+		CbrrrSha256 hash;
+		cbrrr_sha256_init(&hash);
+		cbrrr_sha256_update(&hash, buf->buf + data_start, data_len);
+		memcpy(cid, CIDV1_DAG_CBOR_SHA256_32_PFX, 4);
+		cbrrr_sha256_final(&hash, cid + 4);
+		if (car->dedupe) {
+			int added = cbrrr_digest_set_add(&car->seen, cid + 4);
+			if (added <= 0) {
+				buf->length = start;
+				return added;
+			}
+		}
+	}
+
+	if (prefix_len != CBRRR_CAR_PREFIX_GUESS) {
+		memmove(buf->buf + start + prefix_len + cid_len, buf->buf + data_start, data_len);
+		buf->length = start + prefix_len + cid_len + data_len;
+	}
+	memcpy(buf->buf + start, prefix, prefix_len);
+	if (cid != NULL) {
+		memcpy(buf->buf + start + prefix_len, cid, cid_len);
+	}
+	return 1;
+}
+
+// if we're writing to a destination, and enough output has built up, write it out
+static int
+cbrrr_car_maybe_flush(CbrrrCar *car)
+{
+	if (car->out.buf.flush == NULL || car->out.buf.length < car->chunk_size) {
+		return 0;
+	}
+	return cbrrr_buf_flush(&car->out.buf);
+}
+
+/*
+Sets up car to write to dest (or to memory, if dest is None), and writes the
+header. roots can be any iterable of cid_type instances. On error, sets a
+python exception and cleans up after itself.
+*/
+static int
+cbrrr_car_init(CbrrrState *st, CbrrrCar *car, PyObject *roots, PyObject *dest, Py_ssize_t chunk_size, int dedupe, PyObject *cid_type)
+{
+	memset(car, 0, sizeof(*car));
+	car->dedupe = dedupe;
+
+	PyObject *roots_list = PySequence_List(roots);
+	if (roots_list == NULL) {
+		return -1;
+	}
+	for (Py_ssize_t i=0; i<PyList_GET_SIZE(roots_list); i++) {
+		if (Py_TYPE(PyList_GET_ITEM(roots_list, i)) != (PyTypeObject *)cid_type) {
+			Py_DECREF(roots_list);
+			PyErr_SetString(PyExc_TypeError, "CAR roots must be CIDs");
+			return -1;
+		}
+	}
+	PyObject *header = Py_BuildValue("{s:N,s:i}", "roots", roots_list, "version", 1);
+	if (header == NULL) {
+		return -1;
+	}
+
+	int res;
+	if (dest == Py_None) {
+		res = cbrrr_buf_init_bytes(&car->out.buf, 0x1000, 0);
+	} else if (chunk_size <= 0) {
+		PyErr_SetString(PyExc_ValueError, "chunk_size must be positive");
+		res = -1;
+	} else if ((res = cbrrr_writer_set_dest(&car->out, dest)) == 0) {
+		res = cbrrr_buf_init_chunked(&car->out.buf, chunk_size, cbrrr_writer_flush);
+		car->out.buf.flush_at = SIZE_MAX; // see above
+		car->chunk_size = chunk_size;
+	}
+	if (res == 0) {
+		res = cbrrr_car_write_section(st, car, header, cid_type, 0, NULL);
+	}
+	Py_DECREF(header);
+	if (res < 0) {
+		cbrrr_car_free(car);
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *
+cbrrr_encode_car(PyObject *self, PyObject *args)
+{
+	CbrrrState *st = cbrrr_module_state(self);
+	PyObject *roots;
+	PyObject *blocks;
+	int dedupe;
+	PyObject *cid_type;
+	int atjson_mode;
+	CbrrrCar car;
+	uint8_t cid[CBRRR_CAR_CID_LEN];
+
+	if (!PyArg_ParseTuple(args, "OOpOp", &roots, &blocks, &dedupe, &cid_type, &atjson_mode)) {
+		return NULL;
+	}
+
+	PyObject *iter = PyObject_GetIter(blocks);
+	if (iter == NULL) {
+		return NULL;
+	}
+	if (cbrrr_car_init(st, &car, roots, Py_None, 0, dedupe, cid_type) < 0) {
+		Py_DECREF(iter);
+		return NULL;
+	}
+
+	PyObject *block;
+	while ((block = PyIter_Next(iter)) != NULL) {
+		int res = cbrrr_car_write_section(st, &car, block, cid_type, atjson_mode, cid);
+		Py_DECREF(block);
+		if (res < 0) {
+			break;
+		}
+	}
+	Py_DECREF(iter);
+	if (PyErr_Occurred()) {
+		cbrrr_car_free(&car);
+		return NULL;
+	}
+
+	PyObject *res = cbrrr_buf_finish_bytes(&car.out.buf);
+	cbrrr_car_free(&car);
+	return res;
+}
+
+
+/*
+Decoder and Encoder bind their options once, and keep their scratch memory
+(the parser/encoder stack, and the encoder's output buffer) warm between calls.
+For small objects, like firehose blocks, the per-call mallocs and argument
+parsing would otherwise be a significant part of the cost.
+
+If a call re-enters the same object (e.g. a cid_ctor that decodes something
+itself), the inner call just uses temporary scratch space instead.
+*/
+
+#define CBRRR_SCRATCH_BUF_SIZE 0x400 // initial size of the Encoder's output buffer
+#define CBRRR_SCRATCH_BUF_MAX 0x100000 // if it grows beyond this, it gets shrunk back down after use
+#define CBRRR_SCRATCH_STACK_MAX 0x400 // likewise, for stacks (in frames)
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *cid_ctor;
+	int atjson_mode;
+	SchemaObject *schema; // may be NULL
+	int busy; // set while the scratch stack is in use
+	DCToken *stack;
+	size_t stack_len;
+} DecoderObject;
+
+static PyObject *
+Decoder_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"atjson_mode", "cid_ctor", "schema", NULL};
+	CbrrrState *st = cbrrr_type_state(type);
+	int atjson_mode = 0;
+	PyObject *cid_ctor = NULL;
+	PyObject *schema = Py_None;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|pOO", kwlist, &atjson_mode, &cid_ctor, &schema)) {
+		return NULL;
+	}
+	if (cid_ctor == NULL) {
+		cid_ctor = (PyObject *)st->cid_type;
+	}
+	if (schema != Py_None) {
+		if (!PyObject_TypeCheck(schema, st->schema_type)) {
+			PyErr_SetString(PyExc_TypeError, "schema must be a Schema instance, or None");
+			return NULL;
+		}
+	}
+
+	DecoderObject *self = (DecoderObject *)type->tp_alloc(type, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+	Py_INCREF(cid_ctor);
+	self->cid_ctor = cid_ctor;
+	self->atjson_mode = atjson_mode;
+	if (schema != Py_None) {
+		Py_INCREF(schema);
+		self->schema = (SchemaObject *)schema;
+	}
+	return (PyObject *)self;
+}
+
+static int
+Decoder_traverse(DecoderObject *self, visitproc visit, void *arg)
+{
+#if PY_VERSION_HEX >= 0x03090000
+	Py_VISIT(Py_TYPE(self));
+#endif
+	Py_VISIT(self->cid_ctor);
+	Py_VISIT(self->schema);
+	return 0;
+}
+
+static int
+Decoder_clear(DecoderObject *self)
+{
+	Py_CLEAR(self->cid_ctor);
+	Py_CLEAR(self->schema);
+	return 0;
+}
+
+static void
+Decoder_dealloc(DecoderObject *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+	PyObject_GC_UnTrack(self);
+	Decoder_clear(self);
+	free(self->stack);
+	tp->tp_free((PyObject *)self);
+	CBRRR_RELEASE_TYPE(tp, Decoder_dealloc);
+}
+
+static PyObject *
+Decoder_decode_locked(DecoderObject *self, const Py_buffer *buf)
+{
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	PyObject *value = NULL;
+	size_t res;
+
+	if (self->cid_ctor == NULL) { // i.e. cleared by the GC
+		PyErr_SetString(PyExc_RuntimeError, "Decoder has been cleared");
+		return NULL;
+	}
+
+	SchemaTable *table = self->schema == NULL ? NULL : cbrrr_schema_table_acquire(self->schema);
+	size_t max_depth = 0;
+	CBRRR_PROBE2(decode__start, buf->buf, buf->len);
+	if (self->busy) {
+		res = cbrrr_parse_object_with_schema(st, buf->buf, buf->len, &value, self->cid_ctor, self->atjson_mode, table, &max_depth);
+	} else {
+		self->busy = 1;
+		res = cbrrr_parse_object_scratch(st, buf->buf, buf->len, &value, self->cid_ctor, self->atjson_mode, table, &self->stack, &self->stack_len, &max_depth);
+		self->busy = 0;
+		if (self->stack_len > CBRRR_SCRATCH_STACK_MAX) { // don't hang on to it after decoding something unusually deep
+			free(self->stack);
+			self->stack = NULL;
+			self->stack_len = 0;
+		}
+	}
+	CBRRR_PROBE4(decode__done, buf->len, res, max_depth, res == (size_t)-1 ? (int)cbrrr_fail_kind(st) + 1 : 0);
+	if (table != NULL) {
+		cbrrr_schema_table_decref(table);
+	}
+	if (res == (size_t)-1) {
+		return NULL;
+	}
+	if (res != (size_t)buf->len) {
+		Py_DECREF(value);
+		PyErr_SetString(PyExc_ValueError, "did not parse to end of buffer");
+		return NULL;
+	}
+	return value;
+}
+
+static PyObject *
+Decoder_decode(DecoderObject *self, PyObject *arg)
+{
+	Py_buffer buf;
+	PyObject *res;
+
+	if (PyObject_GetBuffer(arg, &buf, PyBUF_SIMPLE) < 0) {
+		return NULL;
+	}
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	res = Decoder_decode_locked(self, &buf);
+	CBRRR_END_CRITICAL_SECTION();
+	PyBuffer_Release(&buf);
+	return res;
+}
+
+static PyMethodDef Decoder_methods[] = {
+	{"decode", (PyCFunction)Decoder_decode, METH_O,
+		"decode a buffer containing exactly one DAG-CBOR object"},
+	{NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyType_Slot Decoder_slots[] = {
+	{Py_tp_doc,
+		"Decoder(atjson_mode=False, cid_ctor=CID, schema=None)\n"
+		"--\n\n"
+		"A reusable DAG-CBOR decoder. Decoder(...).decode(data) is equivalent to\n"
+		"decode_dag_cbor(data, ...), but the options are only bound once, and\n"
+		"scratch memory is kept around between calls, which makes it cheaper for\n"
+		"decoding lots of small objects."},
+	{Py_tp_new, CBRRR_SLOT(Decoder_new)},
+	{Py_tp_dealloc, CBRRR_SLOT(Decoder_dealloc)},
+	{Py_tp_traverse, CBRRR_SLOT(Decoder_traverse)},
+	{Py_tp_clear, CBRRR_SLOT(Decoder_clear)},
+	{Py_tp_methods, Decoder_methods},
+	{0, NULL}
+};
+
+static PyType_Spec Decoder_spec = {
+	.name = "cbrrr._cbrrr.Decoder",
+	.basicsize = sizeof(DecoderObject),
+	.itemsize = 0,
+	.flags = Py_TPFLAGS_DEFAULT | CBRRR_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+	.slots = Decoder_slots,
+};
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *cid_type;
+	int atjson_mode;
+	int busy; // set while the scratch stack and buffer are in use
+	EncoderStackFrame *stack;
+	size_t stack_len;
+	uint8_t *out; // output scratch buffer
+	size_t out_capacity;
+} EncoderObject;
+
+static PyObject *
+Encoder_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"atjson_mode", "cid_type", NULL};
+	CbrrrState *st = cbrrr_type_state(type);
+	int atjson_mode = 0;
+	PyObject *cid_type = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|pO", kwlist, &atjson_mode, &cid_type)) {
+		return NULL;
+	}
+	if (cid_type == NULL) {
+		cid_type = (PyObject *)st->cid_type;
+	}
+
+	EncoderObject *self = (EncoderObject *)type->tp_alloc(type, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+	Py_INCREF(cid_type);
+	self->cid_type = cid_type;
+	self->atjson_mode = atjson_mode;
+	return (PyObject *)self;
+}
+
+static int
+Encoder_traverse(EncoderObject *self, visitproc visit, void *arg)
+{
+#if PY_VERSION_HEX >= 0x03090000
+	Py_VISIT(Py_TYPE(self));
+#endif
+	Py_VISIT(self->cid_type);
+	return 0;
+}
+
+static int
+Encoder_clear(EncoderObject *self)
+{
+	Py_CLEAR(self->cid_type);
+	return 0;
+}
+
+static void
+Encoder_dealloc(EncoderObject *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+	PyObject_GC_UnTrack(self);
+	Encoder_clear(self);
+	free(self->stack);
+	free(self->out);
+	tp->tp_free((PyObject *)self);
+	CBRRR_RELEASE_TYPE(tp, Encoder_dealloc);
+}
+
+static PyObject *
+Encoder_encode_locked(EncoderObject *self, PyObject *obj)
+{
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	CbrrrBuf buf;
+
+	if (self->cid_type == NULL) { // i.e. cleared by the GC
+		PyErr_SetString(PyExc_RuntimeError, "Encoder has been cleared");
+		return NULL;
+	}
+
+	if (self->busy) {
+		return cbrrr_encode_to_bytes(st, obj, self->cid_type, self->atjson_mode);
+	}
+
+	if (self->out == NULL) {
+		self->out = malloc(CBRRR_SCRATCH_BUF_SIZE);
+		if (self->out == NULL) {
+			PyErr_SetString(PyExc_MemoryError, "malloc failed");
+			return NULL;
+		}
+		self->out_capacity = CBRRR_SCRATCH_BUF_SIZE;
+	}
+
+	cbrrr_buf_init_scratch(&buf, self->out, self->out_capacity);
+	self->busy = 1;
+	int res = cbrrr_encode_object_scratch(st, &buf, obj, self->cid_type, self->atjson_mode, &self->stack, &self->stack_len);
+	self->busy = 0;
+	self->out = buf.buf; // it may have moved
+	self->out_capacity = buf.capacity;
+
+	/* nb: copying the result out is cheaper than the malloc it saves, at least
+	   for the small objects this is intended for */
+	PyObject *result = res < 0 ? NULL : PyBytes_FromStringAndSize((const char *)buf.buf, buf.length);
+
+	// don't hang on to lots of memory after encoding something unusually big (or deep)
+	if (self->out_capacity > CBRRR_SCRATCH_BUF_MAX) {
+		free(self->out);
+		self->out = NULL;
+		self->out_capacity = 0;
+	}
+	if (self->stack_len > CBRRR_SCRATCH_STACK_MAX) {
+		free(self->stack);
+		self->stack = NULL;
+		self->stack_len = 0;
+	}
+	return result;
+}
+
+static PyObject *
+Encoder_encode(EncoderObject *self, PyObject *obj)
+{
+	PyObject *res;
+
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	res = Encoder_encode_locked(self, obj);
+	CBRRR_END_CRITICAL_SECTION();
+	return res;
+}
+
+static PyObject *
+Encoder_encoded_size(EncoderObject *self, PyObject *obj)
+{
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	PyObject *cid_type;
+	size_t size;
+
+	// nb: doesn't touch the scratch space, so no need for the lock (or to worry about re-entrancy)
+	cid_type = self->cid_type;
+	if (cid_type == NULL) { // i.e. cleared by the GC
+		PyErr_SetString(PyExc_RuntimeError, "Encoder has been cleared");
+		return NULL;
+	}
+	if (cbrrr_encoded_size(st, obj, cid_type, self->atjson_mode, 0, &size) < 0) {
+		return NULL;
+	}
+	return PyLong_FromSize_t(size);
+}
+
+static PyMethodDef Encoder_methods[] = {
+	{"encode", (PyCFunction)Encoder_encode, METH_O,
+		"encode a python object as DAG-CBOR bytes"},
+	{"encoded_size", (PyCFunction)Encoder_encoded_size, METH_O,
+		"compute the exact length of a python object's DAG-CBOR encoding, without encoding it"},
+	{NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyType_Slot Encoder_slots[] = {
+	{Py_tp_doc,
+		"Encoder(atjson_mode=False, cid_type=CID)\n"
+		"--\n\n"
+		"A reusable DAG-CBOR encoder. Encoder(...).encode(obj) is equivalent to\n"
+		"encode_dag_cbor(obj, ...), but the options are only bound once, and\n"
+		"scratch memory (including the output buffer) is kept around between\n"
+		"calls, which makes it cheaper for encoding lots of small objects."},
+	{Py_tp_new, CBRRR_SLOT(Encoder_new)},
+	{Py_tp_dealloc, CBRRR_SLOT(Encoder_dealloc)},
+	{Py_tp_traverse, CBRRR_SLOT(Encoder_traverse)},
+	{Py_tp_clear, CBRRR_SLOT(Encoder_clear)},
+	{Py_tp_methods, Encoder_methods},
+	{0, NULL}
+};
+
+static PyType_Spec Encoder_spec = {
+	.name = "cbrrr._cbrrr.Encoder",
+	.basicsize = sizeof(EncoderObject),
+	.itemsize = 0,
+	.flags = Py_TPFLAGS_DEFAULT | CBRRR_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+	.slots = Encoder_slots,
+};
+
+typedef struct {
+	PyObject_HEAD
+	CbrrrCar car;
+	PyObject *cid_type;
+	PyObject *cid_ctor;
+	int atjson_mode;
+	int busy; // set while a write is in progress, which might call back into python
+	int closed;
+	int failed; // set if the output might be in an inconsistent state
+} CarWriterObject;
+
+static PyObject *
+CarWriter_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"roots", "dest", "dedupe", "chunk_size", "atjson_mode", "cid_type", "cid_ctor", NULL};
+	CbrrrState *st = cbrrr_type_state(type);
+	PyObject *roots;
+	PyObject *dest = Py_None;
+	int dedupe = 1;
+	Py_ssize_t chunk_size = 0x10000;
+	int atjson_mode = 0;
+	PyObject *cid_type = NULL;
+	PyObject *cid_ctor = Py_None;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OpnpOO", kwlist, &roots, &dest, &dedupe, &chunk_size, &atjson_mode, &cid_type, &cid_ctor)) {
+		return NULL;
+	}
+	if (cid_type == NULL) {
+		cid_type = (PyObject *)st->cid_type;
+	}
+	if (cid_ctor == Py_None) {
+		cid_ctor = cid_type;
+	}
+
+	CarWriterObject *self = (CarWriterObject *)type->tp_alloc(type, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+	if (cbrrr_car_init(st, &self->car, roots, dest, chunk_size, dedupe, cid_type) < 0) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	Py_INCREF(cid_type);
+	self->cid_type = cid_type;
+	Py_INCREF(cid_ctor);
+	self->cid_ctor = cid_ctor;
+	self->atjson_mode = atjson_mode;
+	return (PyObject *)self;
+}
+
+static int
+CarWriter_traverse(CarWriterObject *self, visitproc visit, void *arg)
+{
+#if PY_VERSION_HEX >= 0x03090000
+	Py_VISIT(Py_TYPE(self));
+#endif
+	Py_VISIT(self->cid_type);
+	Py_VISIT(self->cid_ctor);
+	Py_VISIT(self->car.out.write);
+	return 0;
+}
+
+static int
+CarWriter_clear(CarWriterObject *self)
+{
+	Py_CLEAR(self->cid_type);
+	Py_CLEAR(self->cid_ctor);
+	Py_CLEAR(self->car.out.write);
+	return 0;
+}
+
+static void
+CarWriter_dealloc(CarWriterObject *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+	PyObject_GC_UnTrack(self);
+	CarWriter_clear(self);
+	cbrrr_car_free(&self->car);
+	tp->tp_free((PyObject *)self);
+	CBRRR_RELEASE_TYPE(tp, CarWriter_dealloc);
+}
+
+// checks whether we're in a fit state to do anything
+static int
+CarWriter_check(CarWriterObject *self, int writing)
+{
+	if (self->cid_type == NULL) { // i.e. cleared by the GC
+		PyErr_SetString(PyExc_RuntimeError, "CarWriter has been cleared");
+		return -1;
+	}
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "CarWriter re-entered while writing");
+		return -1;
+	}
+	if (self->failed) {
+		PyErr_SetString(PyExc_RuntimeError, "CarWriter previously encountered an error");
+		return -1;
+	}
+	if (writing && self->closed) {
+		PyErr_SetString(PyExc_ValueError, "CarWriter is closed");
+		return -1;
+	}
+	return 0;
+}
+
+static PyObject *
+CarWriter_write_locked(CarWriterObject *self, PyObject *obj)
+{
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	uint8_t cid[CBRRR_CAR_CID_LEN];
+
+	if (CarWriter_check(self, 1) < 0) {
+		return NULL;
+	}
+
+	self->busy = 1;
+	int res = cbrrr_car_write_section(st, &self->car, obj, self->cid_type, self->atjson_mode, cid);
+	if (res < 0) {
+		// an encoding error just gets rolled back, but losing the buffer doesn't
+		self->failed = self->car.out.buf.buf == NULL;
+	} else if (cbrrr_car_maybe_flush(&self->car) < 0) {
+		self->failed = 1; // we don't know how much got written
+		res = -1;
+	}
+	self->busy = 0;
+	if (res < 0) {
+		return NULL;
+	}
+	return cbrrr_cid_from_raw(st, self->cid_ctor, cid, sizeof(cid));
+}
+
+static PyObject *
+CarWriter_write(CarWriterObject *self, PyObject *obj)
+{
+	PyObject *res;
+
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	res = CarWriter_write_locked(self, obj);
+	CBRRR_END_CRITICAL_SECTION();
+	return res;
+}
+
+static PyObject *
+CarWriter_getvalue(CarWriterObject *self, PyObject *Py_UNUSED(ignored))
+{
+	PyObject *res = NULL;
+
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	if (CarWriter_check(self, 0) == 0) {
+		if (self->car.out.buf.flush != NULL) {
+			PyErr_SetString(PyExc_ValueError, "getvalue() is only available when writing to memory (dest=None)");
+		} else {
+			res = PyBytes_FromStringAndSize((const char *)self->car.out.buf.buf, self->car.out.buf.length);
+		}
+	}
+	CBRRR_END_CRITICAL_SECTION();
+	return res;
+}
+
+static PyObject *
+CarWriter_close(CarWriterObject *self, PyObject *Py_UNUSED(ignored))
+{
+	PyObject *res = NULL;
+
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	if (CarWriter_check(self, 0) == 0) {
+		int flush_res = 0;
+		if (!self->closed && self->car.out.buf.flush != NULL) {
+			self->busy = 1;
+			flush_res = cbrrr_buf_flush(&self->car.out.buf);
+			self->busy = 0;
+			self->failed = flush_res < 0;
+		}
+		if (flush_res == 0) {
+			self->closed = 1;
+			res = PyLong_FromSize_t(self->car.out.buf.flushed + self->car.out.buf.length);
+		}
+	}
+	CBRRR_END_CRITICAL_SECTION();
+	return res;
+}
+
+static PyMethodDef CarWriter_methods[] = {
+	{"write", (PyCFunction)CarWriter_write, METH_O,
+		"encode a python object as a DAG-CBOR block, append it to the CAR, and return its CID"},
+	{"getvalue", (PyCFunction)CarWriter_getvalue, METH_NOARGS,
+		"return the CAR written so far (only when writing to memory)"},
+	{"close", (PyCFunction)CarWriter_close, METH_NOARGS,
+		"write out any buffered output, and return the total length of the CAR"},
+	{NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyType_Slot CarWriter_slots[] = {
+	{Py_tp_doc,
+		"CarWriter(roots, dest=None, dedupe=True, chunk_size=65536, atjson_mode=False, cid_type=CID, cid_ctor=None)\n"
+		"--\n\n"
+		"Incrementally writes a CARv1 file. The header (listing the root CIDs)\n"
+		"is written straight away. Then, each write(obj) encodes obj as a\n"
+		"DAG-CBOR block, appends it, and returns its CIDv1 (dag-cbor, sha256),\n"
+		"as constructed by cid_ctor (which defaults to cid_type).\n\n"
+		"If dest is None, the output accumulates in memory (see getvalue()).\n"
+		"Otherwise it's written to dest (a file-like object, or a raw file\n"
+		"descriptor, as for encode_dag_cbor_to) in chunks of roughly\n"
+		"chunk_size. Either way, call close() once you're done. It does not\n"
+		"close dest.\n\n"
+		"If dedupe is True, blocks identical to one that's already been\n"
+		"written are skipped (but write() still returns their CID). If write()\n"
+		"raises an encoding error, nothing gets written for that block."},
+	{Py_tp_new, CBRRR_SLOT(CarWriter_new)},
+	{Py_tp_dealloc, CBRRR_SLOT(CarWriter_dealloc)},
+	{Py_tp_traverse, CBRRR_SLOT(CarWriter_traverse)},
+	{Py_tp_clear, CBRRR_SLOT(CarWriter_clear)},
+	{Py_tp_methods, CarWriter_methods},
+	{0, NULL}
+};
+
+static PyType_Spec CarWriter_spec = {
+	.name = "cbrrr._cbrrr.CarWriter",
+	.basicsize = sizeof(CarWriterObject),
+	.itemsize = 0,
+	.flags = Py_TPFLAGS_DEFAULT | CBRRR_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+	.slots = CarWriter_slots,
+};
+
+/*
+atproto Merkle Search Tree walking, directly over the blocks of a CAR file.
+https://atproto.com/specs/repository#mst-structure
+
+Each node is {"e": [entries...], "l": CID|null}, and each entry is
+{"k": key suffix, "p": prefix length, "t": CID|null, "v": CID}, where the key
+prefix is shared with the previous entry in the same node. An in-order walk
+visits the "l" subtree, then each entry followed by its "t" subtree.
+
+Rather than decoding nodes into python objects, we read them straight out of
+the CAR, rebuilding each node's keys in a scratch buffer. Nodes are validated
+strictly (they must be exactly the above shape, in canonical DAG-CBOR form),
+and so is key ordering, both within and between nodes. Hashes are not.
+*/
+
+typedef struct {
+	const uint8_t *cid; // NULL means the slot is empty
+	size_t cid_len;
+	const uint8_t *block;
+	size_t block_len;
+} CarIndexSlot;
+
+// maps CIDs to their blocks, pointing into a CAR that's owned by someone else
+typedef struct {
+	CarIndexSlot *slots;
+	size_t mask;
+	size_t count;
+} CarIndex;
+
+static size_t
+cbrrr_car_index_slot(const CarIndex *index, const uint8_t *cid, size_t cid_len)
+{
+	uint64_t idx;
+	if (cid_len >= sizeof(idx)) { // the end of a CID is (usually) a hash digest, so makes a fine hash itself
+		memcpy(&idx, cid + cid_len - sizeof(idx), sizeof(idx));
+	} else {
+		idx = cbrrr_key_hash(cid, cid_len);
+	}
+	for (idx &= index->mask; ; idx = (idx + 1) & index->mask) {
+		const CarIndexSlot *slot = &index->slots[idx];
+		if (slot->cid == NULL || (slot->cid_len == cid_len && memcmp(slot->cid, cid, cid_len) == 0)) {
+			return idx;
+		}
+	}
+}
+
+static const CarIndexSlot *
+cbrrr_car_index_lookup(const CarIndex *index, const uint8_t *cid, size_t cid_len)
+{
+	const CarIndexSlot *slot = &index->slots[cbrrr_car_index_slot(index, cid, cid_len)];
+	return slot->cid == NULL ? NULL : slot;
+}
+
+// returns 0 on success, or -1 on error (setting a python exception)
+static int
+cbrrr_car_index_grow(CarIndex *index)
+{
+	CarIndex new_index;
+	size_t new_size = index->slots == NULL ? 0x100 : (index->mask + 1) * 2;
+	new_index.slots = calloc(new_size, sizeof(*new_index.slots));
+	if (new_index.slots == NULL) {
+		PyErr_SetString(PyExc_MemoryError, "calloc failed");
+		return -1;
+	}
+	new_index.mask = new_size - 1;
+	new_index.count = 0;
+	for (size_t i=0; index->slots != NULL && i<=index->mask; i++) {
+		if (index->slots[i].cid != NULL) {
+			new_index.slots[cbrrr_car_index_slot(&new_index, index->slots[i].cid, index->slots[i].cid_len)] = index->slots[i];
+			new_index.count++;
+		}
+	}
+	free(index->slots);
+	*index = new_index;
+	return 0;
+}
+
+// indexes all the blocks of a CAR, and returns its header (or NULL on error)
+static PyObject *
+cbrrr_car_index_build(CbrrrState *st, CarIndex *index, const uint8_t *data, size_t len)
+{
+	PyObject *header = NULL;
+	size_t idx;
+
+	index->slots = NULL;
+	index->count = 0;
+	idx = cbrrr_car_parse_header(st, data, len, &header, (PyObject *)st->cid_type, 0);
+	if (idx == (size_t)-1 || cbrrr_car_index_grow(index) < 0) {
+		Py_XDECREF(header);
+		return NULL;
+	}
+
+	while (idx < len) {
+		CarIndexSlot entry;
+		uint64_t codec;
+		if (
+			   cbrrr_car_parse_section(st, data, len, &idx, &entry.cid, &entry.cid_len, &codec, &entry.block, &entry.block_len) < 0
+			|| ((index->count + 1) * 2 > index->mask + 1 && cbrrr_car_index_grow(index) < 0) // keep the load factor under 1/2
+		) {
+			free(index->slots);
+			index->slots = NULL;
+			Py_DECREF(header);
+			return NULL;
+		}
+		CarIndexSlot *slot = &index->slots[cbrrr_car_index_slot(index, entry.cid, entry.cid_len)];
+		if (slot->cid == NULL) { // if a block appears twice, the first one wins
+			*slot = entry;
+			index->count++;
+		}
+	}
+	return header;
+}
+
+// bytewise comparison, like memcmp but for strings of different lengths
+static int
+cbrrr_bytes_cmp(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len)
+{
+	int res = memcmp(a, b, a_len < b_len ? a_len : b_len);
+	if (res != 0) {
+		return res;
+	}
+	return (a_len > b_len) - (a_len < b_len);
+}
+
+// the layer a key lives on: the number of leading zero bits of sha256(key), in pairs (i.e. fanout 4)
+static int
+cbrrr_mst_key_layer(const uint8_t *key, size_t key_len)
+{
+	CbrrrSha256 hash;
+	uint8_t digest[32];
+	int layer = 0;
+
+	cbrrr_sha256_init(&hash);
+	cbrrr_sha256_update(&hash, key, key_len);
+	cbrrr_sha256_final(&hash, digest);
+	for (size_t i=0; i<sizeof(digest); i++) {
+		if (digest[i] != 0) {
+			return layer + (digest[i] < 0x04) + (digest[i] < 0x10) + (digest[i] < 0x40);
+		}
+		layer += 4;
+	}
+	return layer;
+}
+
+typedef struct {
+	size_t key; // offset of the (full) key in the cursor's key buffer
+	size_t key_len;
+	const uint8_t *value; // the value CID's bytes, pointing into the CAR
+	size_t value_len;
+	const uint8_t *tree; // the right subtree's CID, or NULL
+	size_t tree_len;
+} MstEntry;
+
+// bounds on the keys of a subtree, as offsets into the cursor's key buffer
+typedef struct {
+	size_t lo, lo_len; // exclusive, or SIZE_MAX if unbounded
+	size_t hi, hi_len; // likewise
+} MstBounds;
+
+/*
+A node we're partway through. Its entries (and their keys) live at the top of
+the cursor's entry (and key) stacks, until it's popped.
+pos goes from 0 to 2*count: even positions are subtrees ("l", then each
+entry's "t"), and odd positions are the entries themselves.
+*/
+typedef struct {
+	const uint8_t *left; // the "l" subtree's CID, or NULL
+	size_t left_len;
+	size_t entries; // index of the node's first entry
+	size_t count;
+	size_t keys; // offset of the node's first key
+	size_t pos;
+	MstBounds bounds;
+} MstFrame;
+
+typedef enum {
+	MST_END,
+	MST_ENTRY,
+	MST_SUBTREE,
+} MstItemType;
+
+typedef struct {
+	MstItemType type;
+	const uint8_t *key; // for entries. Valid until the next cbrrr_mst_descend
+	size_t key_len;
+	const uint8_t *cid; // the value CID for entries, or the node's CID for subtrees
+	size_t cid_len;
+	MstBounds bounds; // for subtrees
+} MstItem;
+
+/*
+Iterates over a tree as a sequence of entries and (unvisited) subtrees. The
+caller can either skip a subtree entirely, or descend into it. Keys outside of
+[start, end) are skipped, as are subtrees that can't contain any in-range keys.
+*/
+typedef struct {
+	CbrrrState *st;
+	const CarIndex *index;
+	const uint8_t *root; // the root node's CID, until we've descended into (or skipped) it
+	size_t root_len;
+	const uint8_t *start; // may be NULL, for no lower bound
+	size_t start_len;
+	const uint8_t *end; // may be NULL, for no upper bound
+	size_t end_len;
+	MstFrame *frames;
+	size_t frames_len;
+	size_t frames_cap;
+	MstEntry *entries;
+	size_t entries_len;
+	size_t entries_cap;
+	uint8_t *keys;
+	size_t keys_len;
+	size_t keys_cap;
+} MstCursor;
+
+static void
+cbrrr_mst_cursor_free(MstCursor *c)
+{
+	free(c->frames);
+	c->frames = NULL;
+	free(c->entries);
+	c->entries = NULL;
+	free(c->keys);
+	c->keys = NULL;
+}
+
+// make room for n more items in one of the cursor's stacks
+static int
+cbrrr_mst_reserve(void **stack, size_t *cap, size_t len, size_t n, size_t item_size)
+{
+	if (*cap - len >= n) {
+		return 0;
+	}
+	size_t new_cap = *cap ? *cap : 0x10;
+	while (new_cap - len < n) {
+		new_cap *= 2;
+	}
+	void *new_stack = realloc(*stack, new_cap * item_size);
+	if (new_stack == NULL) {
+		PyErr_SetString(PyExc_MemoryError, "realloc failed");
+		return -1;
+	}
+	*stack = new_stack;
+	*cap = new_cap;
+	return 0;
+}
+
+static int
+cbrrr_mst_node_error(CbrrrState *st, const char *msg)
+{
+	PyErr_Format(st->decode_error, "invalid MST node (%s)", msg);
+	return -1;
+}
+
+// reads a token of the expected type, see cbrrr_validate_token for what info means
+static int
+cbrrr_mst_read(CbrrrState *st, const uint8_t *buf, size_t len, size_t *idx, DCMajorType want, uint64_t *info)
+{
+	DCMajorType type;
+	CbrrrError err = CBRRR_ERR_NONE;
+	size_t res = cbrrr_validate_token(&buf[*idx], len - *idx, &type, info, &err);
+	if (res == (size_t)-1) {
+		return cbrrr_mst_node_error(st, CBRRR_ERROR_MESSAGES[err]);
+	}
+	if (type != want) {
+		return cbrrr_mst_node_error(st, CBRRR_ERROR_MESSAGES[CBRRR_ERR_UNEXPECTED_TYPE]);
+	}
+	*idx += res;
+	return 0;
+}
+
+// reads a single-character map key, which must be `key`
+static int
+cbrrr_mst_read_key(CbrrrState *st, const uint8_t *buf, size_t len, size_t *idx, char key)
+{
+	uint64_t info;
+	if (cbrrr_mst_read(st, buf, len, idx, DCMT_TEXT_STRING, &info) < 0) {
+		return -1;
+	}
+	if (info != 1 || buf[*idx - 1] != (uint8_t)key) {
+		return cbrrr_mst_node_error(st, "unexpected map key");
+	}
+	return 0;
+}
+
+// reads a CID (or a null, if nullable is set, in which case *cid is set to NULL)
+static int
+cbrrr_mst_read_cid(CbrrrState *st, const uint8_t *buf, size_t len, size_t *idx, int nullable, const uint8_t **cid, size_t *cid_len)
+{
+	uint64_t info;
+	if (nullable && *idx < len && buf[*idx] == 0xf6) {
+		*idx += 1;
+		*cid = NULL;
+		*cid_len = 0;
+		return 0;
+	}
+	if (cbrrr_mst_read(st, buf, len, idx, DCMT_TAG, &info) < 0) {
+		return -1;
+	}
+	*cid = &buf[*idx - info + 1]; // skip the leading 0 byte
+	*cid_len = info - 1;
+	return 0;
+}
+
+static const uint8_t *
+cbrrr_mst_find_node(const MstCursor *c, const uint8_t *cid, size_t cid_len, size_t *len)
+{
+	const CarIndexSlot *slot = cbrrr_car_index_lookup(c->index, cid, cid_len);
+	if (slot == NULL) {
+		PyErr_SetString(c->st->decode_error, "MST node not found in CAR");
+		return NULL;
+	}
+	*len = slot->block_len;
+	return slot->block;
+}
+
+/*
+Parses the node with the given CID onto the top of the stack. Its keys must
+all lie within bounds.
+*/
+static int
+cbrrr_mst_push(MstCursor *c, const uint8_t *cid, size_t cid_len, const MstBounds *bounds)
+{
+	size_t len, idx = 0;
+	uint64_t info, count;
+	CbrrrState *st = c->st;
+	const uint8_t *buf = cbrrr_mst_find_node(c, cid, cid_len, &len);
+	if (buf == NULL) {
+		return -1;
+	}
+
+	if (cbrrr_mst_read(st, buf, len, &idx, DCMT_MAP, &info) < 0) {
+		return -1;
+	}
+	if (info != 2) {
+		return cbrrr_mst_node_error(st, "wrong number of fields");
+	}
+	if (
+		   cbrrr_mst_read_key(st, buf, len, &idx, 'e') < 0
+		|| cbrrr_mst_read(st, buf, len, &idx, DCMT_ARRAY, &count) < 0
+		|| cbrrr_mst_reserve((void **)&c->frames, &c->frames_cap, c->frames_len, 1, sizeof(*c->frames)) < 0
+		|| cbrrr_mst_reserve((void **)&c->entries, &c->entries_cap, c->entries_len, count, sizeof(*c->entries)) < 0
+	) {
+		return -1;
+	}
+
+	MstFrame *frame = &c->frames[c->frames_len];
+	frame->entries = c->entries_len;
+	frame->count = count;
+	frame->keys = c->keys_len;
+	frame->pos = 0;
+	frame->bounds = *bounds;
+
+	size_t keys_len = c->keys_len;
+	for (size_t i=0; i<count; i++) {
+		MstEntry *entry = &c->entries[frame->entries + i];
+		const uint8_t *suffix;
+		uint64_t suffix_len, prefix_len;
+		if (
+			   cbrrr_mst_read(st, buf, len, &idx, DCMT_MAP, &info) < 0
+			|| (info != 4 && cbrrr_mst_node_error(st, "wrong number of entry fields") < 0)
+			|| cbrrr_mst_read_key(st, buf, len, &idx, 'k') < 0
+			|| cbrrr_mst_read(st, buf, len, &idx, DCMT_BYTE_STRING, &suffix_len) < 0
+		) {
+			return -1;
+		}
+		suffix = &buf[idx - suffix_len];
+		if (
+			   cbrrr_mst_read_key(st, buf, len, &idx, 'p') < 0
+			|| cbrrr_mst_read(st, buf, len, &idx, DCMT_UNSIGNED_INT, &prefix_len) < 0
+			|| cbrrr_mst_read_key(st, buf, len, &idx, 't') < 0
+			|| cbrrr_mst_read_cid(st, buf, len, &idx, 1, &entry->tree, &entry->tree_len) < 0
+			|| cbrrr_mst_read_key(st, buf, len, &idx, 'v') < 0
+			|| cbrrr_mst_read_cid(st, buf, len, &idx, 0, &entry->value, &entry->value_len) < 0
+		) {
+			return -1;
+		}
+
+		// the key is (a prefix of) the previous one, followed by the suffix
+		size_t prev = i == 0 ? keys_len : entry[-1].key;
+		size_t prev_len = i == 0 ? 0 : entry[-1].key_len;
+		if (prefix_len > prev_len) {
+			return cbrrr_mst_node_error(st, "key prefix too long");
+		}
+		if (cbrrr_mst_reserve((void **)&c->keys, &c->keys_cap, keys_len, prefix_len + suffix_len, 1) < 0) {
+			return -1;
+		}
+		memcpy(c->keys + keys_len, c->keys + prev, prefix_len); // nb: prev is the most recent key, so they can't overlap
+		memcpy(c->keys + keys_len + prefix_len, suffix, suffix_len);
+		entry->key = keys_len;
+		entry->key_len = prefix_len + suffix_len;
+		keys_len += entry->key_len;
+
+		if (i == 0 ? (
+			bounds->lo != SIZE_MAX && cbrrr_bytes_cmp(c->keys + entry->key, entry->key_len, c->keys + bounds->lo, bounds->lo_len) <= 0
+		) : (
+			cbrrr_bytes_cmp(c->keys + entry->key, entry->key_len, c->keys + prev, prev_len) <= 0
+		)) {
+			PyErr_SetString(st->decode_error, "MST keys out of order");
+			return -1;
+		}
+	}
+	if (count > 0 && bounds->hi != SIZE_MAX) {
+		const MstEntry *last = &c->entries[frame->entries + count - 1];
+		if (cbrrr_bytes_cmp(c->keys + last->key, last->key_len, c->keys + bounds->hi, bounds->hi_len) >= 0) {
+			PyErr_SetString(st->decode_error, "MST keys out of order");
+			return -1;
+		}
+	}
+
+	if (
+		   cbrrr_mst_read_key(st, buf, len, &idx, 'l') < 0
+		|| cbrrr_mst_read_cid(st, buf, len, &idx, 1, &frame->left, &frame->left_len) < 0
+	) {
+		return -1;
+	}
+	if (idx != len) {
+		return cbrrr_mst_node_error(st, "trailing bytes");
+	}
+
+	// only now that everything checks out do we actually push it
+	c->frames_len++;
+	c->entries_len += count;
+	c->keys_len = keys_len;
+	return 0;
+}
+
+/*
+The layer of the node with the given CID, i.e. that of its first key. Empty
+nodes (which only ever have an "l" subtree) have no layer of their own, so
+they count as being infinitely tall.
+*/
+static int
+cbrrr_mst_node_layer(const MstCursor *c, const uint8_t *cid, size_t cid_len, int *layer)
+{
+	size_t len, idx = 0;
+	uint64_t info;
+	CbrrrState *st = c->st;
+	const uint8_t *buf = cbrrr_mst_find_node(c, cid, cid_len, &len);
+	if (
+		   buf == NULL
+		|| cbrrr_mst_read(st, buf, len, &idx, DCMT_MAP, &info) < 0
+		|| cbrrr_mst_read_key(st, buf, len, &idx, 'e') < 0
+		|| cbrrr_mst_read(st, buf, len, &idx, DCMT_ARRAY, &info) < 0
+	) {
+		return -1;
+	}
+	if (info == 0) {
+		*layer = INT_MAX;
+		return 0;
+	}
+	// the first key has no prefix, so its suffix is the whole thing (if not, cbrrr_mst_push will complain)
+	if (
+		   cbrrr_mst_read(st, buf, len, &idx, DCMT_MAP, &info) < 0
+		|| cbrrr_mst_read_key(st, buf, len, &idx, 'k') < 0
+		|| cbrrr_mst_read(st, buf, len, &idx, DCMT_BYTE_STRING, &info) < 0
+	) {
+		return -1;
+	}
+	*layer = cbrrr_mst_key_layer(&buf[idx - info], info);
+	return 0;
+}
+
+static void
+cbrrr_mst_pop(MstCursor *c)
+{
+	MstFrame *frame = &c->frames[--c->frames_len];
+	c->entries_len = frame->entries;
+	c->keys_len = frame->keys;
+}
+
+// finds the next item, without consuming it
+static void
+cbrrr_mst_peek(MstCursor *c, MstItem *item)
+{
+	if (c->root != NULL) {
+		item->type = MST_SUBTREE;
+		item->cid = c->root;
+		item->cid_len = c->root_len;
+		item->bounds.lo = item->bounds.hi = SIZE_MAX;
+		return;
+	}
+	while (c->frames_len > 0) {
+		MstFrame *frame = &c->frames[c->frames_len - 1];
+		const MstEntry *entries = &c->entries[frame->entries];
+		if (frame->pos > 2 * frame->count) {
+			cbrrr_mst_pop(c);
+			continue;
+		}
+
+		size_t i = frame->pos / 2;
+		if (frame->pos % 2 == 1) { // an entry
+			const uint8_t *key = c->keys + entries[i].key;
+			if (c->end != NULL && cbrrr_bytes_cmp(key, entries[i].key_len, c->end, c->end_len) >= 0) {
+				while (c->frames_len > 0) { // everything from here on is out of range
+					cbrrr_mst_pop(c);
+				}
+				break;
+			}
+			if (c->start != NULL && cbrrr_bytes_cmp(key, entries[i].key_len, c->start, c->start_len) < 0) {
+				frame->pos++;
+				continue;
+			}
+			item->type = MST_ENTRY;
+			item->key = key;
+			item->key_len = entries[i].key_len;
+			item->cid = entries[i].value;
+			item->cid_len = entries[i].value_len;
+			return;
+		}
+
+		// a subtree, which lies between the keys on either side of it (or else, our own bounds)
+		item->cid = i == 0 ? frame->left : entries[i - 1].tree;
+		item->cid_len = i == 0 ? frame->left_len : entries[i - 1].tree_len;
+		item->bounds = frame->bounds;
+		if (i > 0) {
+			item->bounds.lo = entries[i - 1].key;
+			item->bounds.lo_len = entries[i - 1].key_len;
+		}
+		if (i < frame->count) {
+			item->bounds.hi = entries[i].key;
+			item->bounds.hi_len = entries[i].key_len;
+		}
+		if (
+			   item->cid == NULL
+			|| (c->start != NULL && item->bounds.hi != SIZE_MAX && cbrrr_bytes_cmp(c->keys + item->bounds.hi, item->bounds.hi_len, c->start, c->start_len) <= 0)
+			|| (c->end != NULL && item->bounds.lo != SIZE_MAX && cbrrr_bytes_cmp(c->keys + item->bounds.lo, item->bounds.lo_len, c->end, c->end_len) >= 0)
+		) {
+			frame->pos++;
+			continue;
+		}
+		item->type = MST_SUBTREE;
+		return;
+	}
+	item->type = MST_END;
+}
+
+// consumes the current item (for subtrees, without visiting them)
+static void
+cbrrr_mst_skip(MstCursor *c)
+{
+	if (c->root != NULL) {
+		c->root = NULL;
+	} else {
+		c->frames[c->frames_len - 1].pos++;
+	}
+}
+
+// consumes the current item, which must be a subtree, by descending into it
+static int
+cbrrr_mst_descend(MstCursor *c, const MstItem *item)
+{
+	size_t parent = c->frames_len; // nb: if pushing fails, the subtree doesn't get consumed
+	if (cbrrr_mst_push(c, item->cid, item->cid_len, &item->bounds) < 0) {
+		return -1;
+	}
+	if (c->root != NULL) {
+		c->root = NULL;
+	} else {
+		c->frames[parent - 1].pos++;
+	}
+	return 0;
+}
+
+/*
+The MST root of an atproto repo: the "data" field of the commit block, which
+is the CAR's (first) root. Returns its CID's bytes.
+*/
+static PyObject *
+cbrrr_mst_commit_data(CbrrrState *st, const CarIndex *index, PyObject *header)
+{
+	PyTypeObject *cid_type = st->cid_type;
+	PyObject *roots = PyDict_GetItemString(header, "roots"); // borrowed
+	if (roots == NULL || !PyList_CheckExact(roots) || PyList_GET_SIZE(roots) == 0) {
+		PyErr_SetString(st->decode_error, "CAR header has no roots");
+		return NULL;
+	}
+	CIDObject *root = (CIDObject *)PyList_GET_ITEM(roots, 0);
+	if (Py_TYPE(root) != cid_type) {
+		PyErr_SetString(st->decode_error, "CAR root is not a CID");
+		return NULL;
+	}
+	const CarIndexSlot *slot = cbrrr_car_index_lookup(index, root->cid_bytes, Py_SIZE(root));
+	if (slot == NULL) {
+		PyErr_SetString(st->decode_error, "commit block not found in CAR");
+		return NULL;
+	}
+
+	PyObject *commit, *res = NULL;
+	size_t len = cbrrr_parse_object(st, slot->block, slot->block_len, &commit, (PyObject *)cid_type, 0);
+	if (len == (size_t)-1) {
+		return NULL;
+	}
+	PyObject *data = PyDict_CheckExact(commit) ? PyDict_GetItemString(commit, "data") : NULL; // borrowed
+	if (len != slot->block_len || data == NULL || Py_TYPE(data) != cid_type) {
+		PyErr_SetString(st->decode_error, "CAR root is not an atproto commit");
+	} else {
+		res = PyBytes_FromStringAndSize((const char *)((CIDObject *)data)->cid_bytes, Py_SIZE(data));
+	}
+	Py_DECREF(commit);
+	return res;
+}
+
+typedef struct {
+	PyObject_HEAD
+	PyObject *cid_ctor;
+	PyObject *sources[2]; // the bytes objects that the CARs live in (the second is only used for diffs)
+	PyObject *roots[2]; // bytes objects holding the root CIDs
+	PyObject *start; // the key range as UTF-8 bytes, or NULL
+	PyObject *end;
+	CarIndex indexes[2];
+	MstCursor cursors[2];
+	int diff;
+	int busy; // set while we might be calling into python
+} MstWalkerObject;
+
+// these are only ever created by mst_walk and mst_diff
+static PyObject *
+MstWalker_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	(void)args; // unused
+	(void)kwds; // unused
+	PyErr_Format(PyExc_TypeError, "cannot create '%s' instances", type->tp_name);
+	return NULL;
+}
+
+static int
+MstWalker_traverse(MstWalkerObject *self, visitproc visit, void *arg)
+{
+#if PY_VERSION_HEX >= 0x03090000
+	Py_VISIT(Py_TYPE(self));
+#endif
+	Py_VISIT(self->cid_ctor);
+	return 0;
+}
+
+static int
+MstWalker_clear(MstWalkerObject *self)
+{
+	Py_CLEAR(self->cid_ctor);
+	/* nb: the cursors point into everything else, so it can't be dropped yet */
+	return 0;
+}
+
+static void
+MstWalker_dealloc(MstWalkerObject *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+	PyObject_GC_UnTrack(self);
+	MstWalker_clear(self);
+	for (int i=0; i<2; i++) {
+		cbrrr_mst_cursor_free(&self->cursors[i]);
+		free(self->indexes[i].slots);
+		Py_XDECREF(self->sources[i]);
+		Py_XDECREF(self->roots[i]);
+	}
+	Py_XDECREF(self->start);
+	Py_XDECREF(self->end);
+	tp->tp_free((PyObject *)self);
+	CBRRR_RELEASE_TYPE(tp, MstWalker_dealloc);
+}
+
+// the CID for an item, or None if there isn't one
+static PyObject *
+MstWalker_cid(MstWalkerObject *self, const MstItem *item)
+{
+	CbrrrState *st = cbrrr_type_state(Py_TYPE(self));
+	if (item == NULL) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	return cbrrr_cid_from_raw(st, self->cid_ctor, item->cid, item->cid_len);
+}
+
+// builds (key, cid) or, for diffs, (key, old_cid, new_cid)
+static PyObject *
+MstWalker_result(MstWalkerObject *self, const MstItem *key_item, const MstItem *old, const MstItem *new)
+{
+	PyObject *res = PyTuple_New(self->diff ? 3 : 2);
+	if (res == NULL) {
+		return NULL;
+	}
+	PyObject *key = PyUnicode_DecodeUTF8((const char *)key_item->key, key_item->key_len, NULL);
+	if (key == NULL) {
+		Py_DECREF(res);
+		return NULL;
+	}
+	PyTuple_SET_ITEM(res, 0, key);
+	for (int i=0; i<PyTuple_GET_SIZE(res) - 1; i++) {
+		PyObject *cid = MstWalker_cid(self, i == 0 ? old : new);
+		if (cid == NULL) {
+			Py_DECREF(res);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(res, i + 1, cid);
+	}
+	return res;
+}
+
+static PyObject *
+MstWalker_walk_next(MstWalkerObject *self)
+{
+	MstCursor *c = &self->cursors[0];
+	MstItem item;
+
+	for (;;) {
+		cbrrr_mst_peek(c, &item);
+		if (item.type == MST_END) {
+			return NULL;
 		}
-		if (obj_type == &PyList_Type) {
-			if (cbrrr_write_cbor_varint(buf, DCMT_ARRAY, PySequence_Fast_GET_SIZE(obj)) < 0) {
-				break;
+		if (item.type == MST_SUBTREE) {
+			if (cbrrr_mst_descend(c, &item) < 0) {
+				return NULL;
 			}
-			sp++;
-			encoder_stack[sp].dict = NULL;
-			encoder_stack[sp].list = obj;
-			encoder_stack[sp].idx = 0;
 			continue;
 		}
-		if (obj == Py_None) { // none/null
-			if (cbrrr_write_cbor_varint(buf, DCMT_FLOAT, 22) < 0) {
-				break;
+		PyObject *res = MstWalker_result(self, &item, &item, NULL);
+		if (res != NULL) {
+			cbrrr_mst_skip(c);
+		}
+		return res;
+	}
+}
+
+#define CBRRR_MST_SAME_CID(x, y) ((x).cid_len == (y).cid_len && memcmp((x).cid, (y).cid, (x).cid_len) == 0)
+
+/*
+Walks both trees in step. Whenever both sides are at the start of identical
+subtrees, they can be skipped entirely, which is what makes diffing cheap.
+For that to happen, the subtrees need to line up, so when they differ we
+only descend into the taller one (or both, if they're the same height).
+*/
+static PyObject *
+MstWalker_diff_next(MstWalkerObject *self)
+{
+	MstCursor *a = &self->cursors[0], *b = &self->cursors[1];
+	MstItem x, y;
+
+	for (;;) {
+		cbrrr_mst_peek(a, &x);
+		cbrrr_mst_peek(b, &y);
+		if (x.type == MST_END && y.type == MST_END) {
+			return NULL;
+		}
+
+		if (x.type == MST_SUBTREE && y.type == MST_SUBTREE) {
+			int x_layer, y_layer;
+			if (CBRRR_MST_SAME_CID(x, y)) {
+				cbrrr_mst_skip(a);
+				cbrrr_mst_skip(b);
+				continue;
+			}
+			if (cbrrr_mst_node_layer(a, x.cid, x.cid_len, &x_layer) < 0 || cbrrr_mst_node_layer(b, y.cid, y.cid_len, &y_layer) < 0) {
+				return NULL;
+			}
+			if (x_layer >= y_layer && cbrrr_mst_descend(a, &x) < 0) {
+				return NULL;
+			}
+			if (y_layer >= x_layer && cbrrr_mst_descend(b, &y) < 0) {
+				return NULL;
 			}
 			continue;
 		}
-		if (obj_type == &PyBool_Type) { // bool
-			if (cbrrr_write_cbor_varint(buf, DCMT_FLOAT, 20 + (obj == Py_True)) < 0) {
-				break;
+		if (x.type == MST_SUBTREE || y.type == MST_SUBTREE) { // the other side is an entry (or the end)
+			if (cbrrr_mst_descend(x.type == MST_SUBTREE ? a : b, x.type == MST_SUBTREE ? &x : &y) < 0) {
+				return NULL;
 			}
 			continue;
 		}
-		if (obj_type == &PyFloat_Type) {
-			double doubleval = PyFloat_AS_DOUBLE(obj);
-			if (isnan(doubleval)) {
-				PyErr_SetString(PyExc_ValueError, "NaNs are not allowed");
-				break;
+
+		// both sides are entries (or the end)
+		int cmp = x.type == MST_END ? 1 : y.type == MST_END ? -1 : cbrrr_bytes_cmp(x.key, x.key_len, y.key, y.key_len);
+		PyObject *res;
+		if (cmp == 0) {
+			if (CBRRR_MST_SAME_CID(x, y)) {
+				cbrrr_mst_skip(a);
+				cbrrr_mst_skip(b);
+				continue;
 			}
-			if (isinf(doubleval)) {
-				PyErr_SetString(PyExc_ValueError, "+/-Infinities are not allowed");
-				break;
+			if ((res = MstWalker_result(self, &x, &x, &y)) != NULL) { // updated
+				cbrrr_mst_skip(a);
+				cbrrr_mst_skip(b);
 			}
-
-			// we can't use cbrrr_write_cbor_varint because it'd use the wrong sizes
-			uint8_t tmp = DCMT_FLOAT << 5 | 27;
-			if (cbrrr_buf_write(buf, &tmp, sizeof(tmp)) < 0) {
-				break;
+		} else if (cmp < 0) {
+			if ((res = MstWalker_result(self, &x, &x, NULL)) != NULL) { // deleted
+				cbrrr_mst_skip(a);
 			}
-			uint64_t dub_int = ((union {uint64_t num; double dub;}){.dub=doubleval}).num;
-			uint8_t dub_be[8];
-
-			/* the compiler should be smart about emitting an endian swap if necessary */
-			dub_be[0] = (dub_int >> 56) & 0xff;
-			dub_be[1] = (dub_int >> 48) & 0xff;
-			dub_be[2] = (dub_int >> 40) & 0xff;
-			dub_be[3] = (dub_int >> 32) & 0xff;
-			dub_be[4] = (dub_int >> 24) & 0xff;
-			dub_be[5] = (dub_int >> 16) & 0xff;
-			dub_be[6] = (dub_int >>  8) & 0xff;
-			dub_be[7] = (dub_int >>  0) & 0xff;
-
-			if (cbrrr_buf_write(buf, dub_be, sizeof(dub_be)) < 0) {
-				break;
+		} else {
+			if ((res = MstWalker_result(self, &y, NULL, &y)) != NULL) { // created
+				cbrrr_mst_skip(b);
 			}
-			continue;
 		}
-
-		PyErr_Format(PyExc_TypeError, "I don't know how to encode type %R", obj_type);
-		break;
+		return res;
 	}
+}
 
-	// if we bailed out due to error, there might be some dict key lists left over on the stack
-	for (size_t i=1; i<=sp; i++) {
-		if (encoder_stack[i].dict != NULL) {
-			Py_DECREF(encoder_stack[i].list);
-		}
+static PyObject *
+MstWalker_next_locked(MstWalkerObject *self)
+{
+	if (self->cid_ctor == NULL) { // i.e. cleared by the GC
+		PyErr_SetString(PyExc_RuntimeError, "MST walker has been cleared");
+		return NULL;
+	}
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "MST walker re-entered");
+		return NULL;
 	}
+	self->busy = 1;
+	PyObject *res = self->diff ? MstWalker_diff_next(self) : MstWalker_walk_next(self);
+	self->busy = 0;
+	return res;
+}
+
+static PyObject *
+MstWalker_next(MstWalkerObject *self)
+{
+	PyObject *res;
 
-	free(encoder_stack);
+	CBRRR_BEGIN_CRITICAL_SECTION(self);
+	res = MstWalker_next_locked(self);
+	CBRRR_END_CRITICAL_SECTION();
 	return res;
 }
 
+static PyType_Slot MstWalker_slots[] = {
+	{Py_tp_doc, "iterator over the entries of an atproto MST (see mst_walk and mst_diff)"},
+	{Py_tp_new, CBRRR_SLOT(MstWalker_new)},
+	{Py_tp_dealloc, CBRRR_SLOT(MstWalker_dealloc)},
+	{Py_tp_traverse, CBRRR_SLOT(MstWalker_traverse)},
+	{Py_tp_clear, CBRRR_SLOT(MstWalker_clear)},
+	{Py_tp_iter, CBRRR_SLOT(PyObject_SelfIter)},
+	{Py_tp_iternext, CBRRR_SLOT(MstWalker_next)},
+	{0, NULL}
+};
 
+static PyType_Spec MstWalker_spec = {
+	.name = "cbrrr._cbrrr.MSTWalker",
+	.basicsize = sizeof(MstWalkerObject),
+	.itemsize = 0,
+	.flags = Py_TPFLAGS_DEFAULT | CBRRR_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_HAVE_GC,
+	.slots = MstWalker_slots,
+};
 
+// gets a key range bound as UTF-8 bytes (or NULL, for None)
+static int
+cbrrr_mst_key_bound(PyObject *bound, PyObject **res)
+{
+	*res = NULL;
+	if (bound == Py_None) {
+		return 0;
+	}
+	if (!PyUnicode_Check(bound)) {
+		PyErr_SetString(PyExc_TypeError, "start and end must be str or None");
+		return -1;
+	}
+	*res = PyUnicode_AsUTF8String(bound);
+	return *res == NULL ? -1 : 0;
+}
 
+/*
+Sets up a walker over n (1, or 2 for diffs) trees. If a root is None, the
+tree is found via the CAR's commit instead.
+*/
 static PyObject *
-cbrrr_encode_dag_cbor(PyObject *self, PyObject *args)
+cbrrr_mst_walker_new(CbrrrState *st, PyObject *const *cars, PyObject *const *roots, int n, PyObject *start, PyObject *end, PyObject *cid_ctor)
 {
-	PyObject *obj;
-	PyObject *cid_type;
-	PyObject *res;
-	int atjson_mode;
-	CbrrrBuf buf;
+	MstWalkerObject *self = (MstWalkerObject *)st->mst_walker_type->tp_alloc(st->mst_walker_type, 0);
+	if (self == NULL) {
+		return NULL;
+	}
+	Py_INCREF(cid_ctor);
+	self->cid_ctor = cid_ctor;
+	self->diff = n == 2;
+	if (cbrrr_mst_key_bound(start, &self->start) < 0 || cbrrr_mst_key_bound(end, &self->end) < 0) {
+		goto fail;
+	}
 
-	(void)self; // unused
+	for (int i=0; i<n; i++) {
+		MstCursor *c = &self->cursors[i];
+		PyObject *header = NULL;
+
+		c->st = st; // the walker's type keeps it alive
+		if (i > 0 && cars[i] == cars[0]) { // no need to index the same CAR twice
+			c->index = &self->indexes[0];
+			Py_INCREF(self->sources[0]);
+			self->sources[i] = self->sources[0];
+			if (roots[i] == Py_None) {
+				PyErr_SetString(PyExc_ValueError, "when diffing within a single CAR, both roots must be given");
+				goto fail;
+			}
+		} else {
+			c->index = &self->indexes[i];
+			if (PyBytes_CheckExact(cars[i])) { // the index needs a buffer that can't change underneath it
+				Py_INCREF(cars[i]);
+				self->sources[i] = cars[i];
+			} else if ((self->sources[i] = PyBytes_FromObject(cars[i])) == NULL) {
+				goto fail;
+			}
+			header = cbrrr_car_index_build(st, &self->indexes[i], (const uint8_t *)PyBytes_AS_STRING(self->sources[i]), PyBytes_GET_SIZE(self->sources[i]));
+			if (header == NULL) {
+				goto fail;
+			}
+		}
+
+		if (roots[i] == Py_None) {
+			self->roots[i] = cbrrr_mst_commit_data(st, c->index, header);
+		} else {
+			self->roots[i] = PyObject_Bytes(roots[i]);
+		}
+		Py_XDECREF(header);
+		if (self->roots[i] == NULL) {
+			goto fail;
+		}
+
+		c->root = (const uint8_t *)PyBytes_AS_STRING(self->roots[i]);
+		c->root_len = PyBytes_GET_SIZE(self->roots[i]);
+		if (self->start != NULL) {
+			c->start = (const uint8_t *)PyBytes_AS_STRING(self->start);
+			c->start_len = PyBytes_GET_SIZE(self->start);
+		}
+		if (self->end != NULL) {
+			c->end = (const uint8_t *)PyBytes_AS_STRING(self->end);
+			c->end_len = PyBytes_GET_SIZE(self->end);
+		}
+	}
+	return (PyObject *)self;
+
+fail:
+	Py_DECREF(self);
+	return NULL;
+}
+
+static PyObject *
+cbrrr_mst_walk(PyObject *self, PyObject *args)
+{
+	PyObject *car, *root, *start, *end, *cid_ctor;
 
-	if (!PyArg_ParseTuple(args, "OOp", &obj, &cid_type, &atjson_mode)) {
+	if (!PyArg_ParseTuple(args, "OOOOO", &car, &root, &start, &end, &cid_ctor)) {
 		return NULL;
 	}
+	return cbrrr_mst_walker_new(cbrrr_module_state(self), &car, &root, 1, start, end, cid_ctor);
+}
 
-	buf.length = 0;
-	buf.capacity = 0x400; // TODO:PERF: tune this?
-	buf.buf = malloc(buf.capacity);
-	if (buf.buf == NULL) {
-		PyErr_SetString(PyExc_MemoryError, "malloc failed");
+static PyObject *
+cbrrr_mst_diff(PyObject *self, PyObject *args)
+{
+	PyObject *cars[2], *roots[2], *start, *end, *cid_ctor;
+
+	if (!PyArg_ParseTuple(args, "OOOOOOO", &cars[0], &cars[1], &roots[0], &roots[1], &start, &end, &cid_ctor)) {
 		return NULL;
 	}
+	return cbrrr_mst_walker_new(cbrrr_module_state(self), cars, roots, 2, start, end, cid_ctor);
+}
 
-	if (cbrrr_encode_object(&buf, obj, cid_type, atjson_mode) < 0) {
-		res = NULL;
-	} else {
-		res = PyBytes_FromStringAndSize((const char*)buf.buf, buf.length); // nb: this incurs a copy
+
+
+static PyMethodDef CbrrrMethods[] = {
+	{"decode_dag_cbor", (PyCFunction)(void(*)(void))cbrrr_decode_dag_cbor, METH_FASTCALL,
+		"parse a buffer of DAG-CBOR into python objects"},
+	{"encode_dag_cbor", (PyCFunction)(void(*)(void))cbrrr_encode_dag_cbor, METH_FASTCALL,
+		"convert a python object into DAG-CBOR bytes"},
+	{"decode_dag_cbor_lazy", cbrrr_decode_dag_cbor_lazy, METH_VARARGS,
+		"validate a buffer of DAG-CBOR, returning lazily-decoded views over it"},
+	{"decode_many", cbrrr_decode_many, METH_VARARGS,
+		"decode a batch of independent DAG-CBOR buffers, validating them in parallel"},
+	{"validate_dag_cbor", cbrrr_validate_dag_cbor, METH_VARARGS,
+		"check that a buffer starts with a valid DAG-CBOR object, without decoding it"},
+	{"extract", cbrrr_extract, METH_VARARGS,
+		"decode only the values at the given paths within a buffer of DAG-CBOR"},
+	{"multi_offsets", cbrrr_multi_offsets, METH_VARARGS,
+		"find the boundaries between back-to-back DAG-CBOR objects in a buffer, validating but not decoding them"},
+	{"decode_car", cbrrr_decode_car, METH_VARARGS,
+		"parse a CARv1 file, decoding all of its DAG-CBOR blocks"},
+	{"encoded_size", (PyCFunction)(void(*)(void))cbrrr_encoded_size_py, METH_FASTCALL,
+		"compute the exact length of a python object's DAG-CBOR encoding, without encoding it"},
+	{"encode_dag_cbor_into", cbrrr_encode_dag_cbor_into, METH_VARARGS,
+		"encode a python object as DAG-CBOR, into an existing writable buffer"},
+	{"encode_dag_cbor_to", cbrrr_encode_dag_cbor_to, METH_VARARGS,
+		"encode a python object as DAG-CBOR, writing it out in chunks to a file-like object or file descriptor"},
+	{"encode_dag_cbor_with_cid", cbrrr_encode_dag_cbor_with_cid, METH_VARARGS,
+		"encode a python object as DAG-CBOR, also returning its (sha256) CIDv1"},
+	{"hash_dag_cbor", cbrrr_hash_dag_cbor, METH_VARARGS,
+		"compute the (sha256) CIDv1 of a python object's DAG-CBOR encoding"},
+	{"encode_car", cbrrr_encode_car, METH_VARARGS,
+		"encode python objects as DAG-CBOR blocks, and write them out as a CARv1 file"},
+	{"mst_walk", cbrrr_mst_walk, METH_VARARGS,
+		"iterate over the (key, value CID) entries of an atproto MST stored in a CAR, in key order"},
+	{"mst_diff", cbrrr_mst_diff, METH_VARARGS,
+		"iterate over the (key, old CID, new CID) differences between two atproto MSTs"},
+	{"set_key_cache_size", cbrrr_set_key_cache_size, METH_VARARGS,
+		"resize (and clear) the decoder's map key cache, 0 disables it"},
+	{"key_cache_info", cbrrr_key_cache_info, METH_NOARGS,
+		"get hit/miss statistics for the decoder's map key cache"},
+	{"set_stats_enabled", cbrrr_set_stats_enabled, METH_VARARGS,
+		"turn hot-path statistics collection on or off"},
+	{"get_stats", cbrrr_get_stats, METH_NOARGS,
+		"get the calling thread's hot-path statistics"},
+	{"reset_stats", cbrrr_reset_stats, METH_NOARGS,
+		"zero the calling thread's hot-path statistics"},
+	{"_sha256_impls", cbrrr_sha256_impls, METH_NOARGS,
+		"(for testing) list the sha256 implementations usable on this machine, the last being the one in use"},
+	{"_sha256_with_impl", cbrrr_sha256_with_impl, METH_VARARGS,
+		"(for testing) sha256 a sequence of chunks, using the named implementation"},
+	{NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static char CBRRR_PROCESS_INIT_LOCK;
+static int CBRRR_PROCESS_INIT_DONE; // guarded by CBRRR_PROCESS_INIT_LOCK
+
+// process-wide things, which only need doing once
+static void
+cbrrr_process_init(void)
+{
+	/* nb: not CBRRR_TRYLOCK, since interpreters with their own GILs (3.12+)
+	   can import us concurrently, even without free-threading. It's only
+	   ever held for a moment, so spinning is fine. */
+	while (__atomic_test_and_set(&CBRRR_PROCESS_INIT_LOCK, __ATOMIC_ACQUIRE)) {
+	}
+	if (!CBRRR_PROCESS_INIT_DONE) {
+#if CBRRR_HAVE_X86_SHA || CBRRR_HAVE_X86_AVX2 || CBRRR_ARM_SHA_RUNTIME
+		cbrrr_cpu_detect();
+#endif
+		cbrrr_sha256_select_impl();
+		CBRRR_PROCESS_INIT_DONE = 1;
+	}
+	__atomic_clear(&CBRRR_PROCESS_INIT_LOCK, __ATOMIC_RELEASE);
+}
+
+// like PyModule_AddObjectRef (3.10+), i.e. it doesn't steal the reference
+static int
+cbrrr_module_add(PyObject *m, const char *name, PyObject *value)
+{
+	Py_INCREF(value);
+	if (PyModule_AddObject(m, name, value) < 0) {
+		Py_DECREF(value);
+		return -1;
 	}
+	return 0;
+}
 
-	free(buf.buf);
-	return res;
+static PyTypeObject *
+cbrrr_module_add_type(PyObject *m, const char *name, PyType_Spec *spec)
+{
+#if PY_VERSION_HEX >= 0x03090000
+	PyObject *type = PyType_FromModuleAndSpec(m, spec, NULL); // the type keeps the module (and hence our state) alive
+#else
+	// the equivalent of the above, for cbrrr_type_state
+	PyObject *type = PyType_FromSpec(spec);
+	if (type != NULL) {
+		if (PyDict_SetItemString(((PyTypeObject *)type)->tp_dict, "__cbrrr_module__", m) < 0) {
+			Py_CLEAR(type);
+		} else {
+			PyType_Modified((PyTypeObject *)type);
+		}
+	}
+#endif
+	if (type == NULL || cbrrr_module_add(m, name, type) < 0) {
+		Py_XDECREF(type);
+		return NULL;
+	}
+	return (PyTypeObject *)type; // the state owns this reference
 }
 
+static int
+cbrrr_module_exec(PyObject *m)
+{
+	CbrrrState *st = cbrrr_module_state(m);
+
+	cbrrr_process_init();
+
+	st->zero = PyLong_FromLong(0);
+	st->uint64_max = PyLong_FromUnsignedLongLong(UINT64_MAX);
+	st->uint64_max_inverted = st->uint64_max == NULL ? NULL : PyNumber_Invert(st->uint64_max);
+	st->string_link = PyUnicode_InternFromString("$link");
+	st->string_bytes = PyUnicode_InternFromString("$bytes");
+	st->decode_error = PyErr_NewException("cbrrr.CbrrrDecodeError", PyExc_ValueError, NULL);
+	if (
+		   st->zero == NULL
+		|| st->uint64_max == NULL
+		|| st->uint64_max_inverted == NULL
+		|| st->string_link == NULL
+		|| st->string_bytes == NULL
+		|| st->decode_error == NULL
+		|| cbrrr_module_add(m, "CbrrrDecodeError", st->decode_error) < 0
+	) {
+		return -1; // m_free cleans up whatever we did manage to create
+	}
 
+	if (cbrrr_key_cache_resize(st, CBRRR_KEY_CACHE_DEFAULT_SIZE) < 0) {
+		return -1;
+	}
 
+	PyObject *abc = PyImport_ImportModule("collections.abc");
+	if (abc == NULL) {
+		return -1;
+	}
+	st->keys_view = PyObject_GetAttrString(abc, "KeysView");
+	st->values_view = PyObject_GetAttrString(abc, "ValuesView");
+	st->items_view = PyObject_GetAttrString(abc, "ItemsView");
+	Py_DECREF(abc);
+	if (st->keys_view == NULL || st->values_view == NULL || st->items_view == NULL) {
+		return -1;
+	}
 
+	if (
+		   (st->stream_decoder_type = cbrrr_module_add_type(m, "StreamDecoder", &StreamDecoder_spec)) == NULL
+		|| (st->cid_type = cbrrr_module_add_type(m, "CID", &CID_spec)) == NULL
+		|| cbrrr_cid_type_init(st->cid_type) < 0
+		|| (st->multi_decoder_type = cbrrr_module_add_type(m, "MultiDecoder", &MultiDecoder_spec)) == NULL
+		|| (st->schema_type = cbrrr_module_add_type(m, "Schema", &Schema_spec)) == NULL
+		|| (st->lazy_map_type = cbrrr_module_add_type(m, "LazyMap", &LazyMap_spec)) == NULL
+		|| (st->lazy_list_type = cbrrr_module_add_type(m, "LazyList", &LazyList_spec)) == NULL
+		|| (st->decoder_type = cbrrr_module_add_type(m, "Decoder", &Decoder_spec)) == NULL
+		|| (st->encoder_type = cbrrr_module_add_type(m, "Encoder", &Encoder_spec)) == NULL
+		|| (st->car_writer_type = cbrrr_module_add_type(m, "CarWriter", &CarWriter_spec)) == NULL
+		|| (st->mst_walker_type = cbrrr_module_add_type(m, "MSTWalker", &MstWalker_spec)) == NULL
+	) {
+		return -1;
+	}
 
+	return 0;
+}
 
+static int
+cbrrr_module_traverse(PyObject *m, visitproc visit, void *arg)
+{
+	CbrrrState *st = cbrrr_module_state(m);
+	if (st == NULL) {
+		return 0;
+	}
+	Py_VISIT(st->decode_error);
+	Py_VISIT(st->keys_view);
+	Py_VISIT(st->values_view);
+	Py_VISIT(st->items_view);
+	Py_VISIT(st->cid_type);
+	Py_VISIT(st->schema_type);
+	Py_VISIT(st->stream_decoder_type);
+	Py_VISIT(st->multi_decoder_type);
+	Py_VISIT(st->lazy_map_type);
+	Py_VISIT(st->lazy_list_type);
+	Py_VISIT(st->decoder_type);
+	Py_VISIT(st->encoder_type);
+	Py_VISIT(st->car_writer_type);
+	Py_VISIT(st->mst_walker_type);
+	return 0;
+}
 
+static int
+cbrrr_module_clear(PyObject *m)
+{
+	CbrrrState *st = cbrrr_module_state(m);
+	if (st == NULL) {
+		return 0;
+	}
+	Py_CLEAR(st->decode_error);
+	Py_CLEAR(st->zero);
+	Py_CLEAR(st->uint64_max);
+	Py_CLEAR(st->uint64_max_inverted);
+	Py_CLEAR(st->string_link);
+	Py_CLEAR(st->string_bytes);
+	Py_CLEAR(st->keys_view);
+	Py_CLEAR(st->values_view);
+	Py_CLEAR(st->items_view);
+	Py_CLEAR(st->cid_type);
+	Py_CLEAR(st->schema_type);
+	Py_CLEAR(st->stream_decoder_type);
+	Py_CLEAR(st->multi_decoder_type);
+	Py_CLEAR(st->lazy_map_type);
+	Py_CLEAR(st->lazy_list_type);
+	Py_CLEAR(st->decoder_type);
+	Py_CLEAR(st->encoder_type);
+	Py_CLEAR(st->car_writer_type);
+	Py_CLEAR(st->mst_walker_type);
+	return 0;
+}
 
+static void
+cbrrr_module_free(void *m)
+{
+	CbrrrState *st = cbrrr_module_state(m);
+	if (st == NULL) {
+		return;
+	}
+	for (size_t i=0; i<st->key_cache_size; i++) {
+		Py_XDECREF(st->key_cache[i].str);
+	}
+	free(st->key_cache);
+	st->key_cache = NULL;
+	st->key_cache_size = 0;
+	for (size_t i=0; i<CBRRR_SHAPE_CACHE_SIZE; i++) {
+		if (st->shape_cache[i] != NULL) {
+			cbrrr_shape_decref(st->shape_cache[i]);
+			st->shape_cache[i] = NULL;
+		}
+	}
+	cbrrr_module_clear(m);
+}
 
-static PyMethodDef CbrrrMethods[] = {
-	{"decode_dag_cbor", cbrrr_decode_dag_cbor, METH_VARARGS,
-		"parse a buffer of DAG-CBOR into python objects"},
-	{"encode_dag_cbor", cbrrr_encode_dag_cbor, METH_VARARGS,
-		"convert a python object into DAG-CBOR bytes"},
-	{NULL, NULL, 0, NULL}        /* Sentinel */
+static PyModuleDef_Slot cbrrr_slots[] = {
+	{Py_mod_exec, CBRRR_SLOT(cbrrr_module_exec)},
+#ifdef Py_mod_multiple_interpreters
+	{Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+	{Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+	{0, NULL}
 };
 
 static struct PyModuleDef cbrrrmodule = {
 	PyModuleDef_HEAD_INIT,
 	"_cbrrr",  /* name of module */
 	NULL,      /* module documentation, may be NULL */
-	-1,        /* size of per-interpreter state of the module,
-	              or -1 if the module keeps state in global variables. */
+	sizeof(CbrrrState), /* size of per-interpreter state of the module */
 	CbrrrMethods,
-	NULL, NULL, NULL, NULL
+	cbrrr_slots,
+	cbrrr_module_traverse,
+	cbrrr_module_clear,
+	cbrrr_module_free
 };
 
 PyMODINIT_FUNC
 PyInit__cbrrr(void)
 {
-	PyObject *m;
-
-	m = PyModule_Create(&cbrrrmodule);
-	if (m == NULL) {
-		return NULL;
-	}
-
-	PY_ZERO = PyLong_FromLong(0);
-	PY_UINT64_MAX = PyLong_FromUnsignedLongLong(UINT64_MAX);
-	PY_UINT64_MAX_INVERTED = PyNumber_Invert(PY_UINT64_MAX);
-	PY_STRING_ENCODE = PyUnicode_InternFromString("encode");
-	PY_STRING_DECODE = PyUnicode_InternFromString("decode");
-	PY_STRING_LINK = PyUnicode_InternFromString("$link");
-	PY_STRING_BYTES = PyUnicode_InternFromString("$bytes");
-	PY_CBRRR_DECODE_ERROR = PyErr_NewException("cbrrr.CbrrrDecodeError", PyExc_ValueError, NULL);
-	int res = PyModule_AddObject(m, "CbrrrDecodeError", PY_CBRRR_DECODE_ERROR);
-	if (
-		   PY_ZERO == NULL
-		|| PY_UINT64_MAX == NULL
-		|| PY_UINT64_MAX_INVERTED == NULL
-		|| PY_STRING_ENCODE == NULL
-		|| PY_STRING_DECODE == NULL
-		|| PY_STRING_LINK == NULL
-		|| PY_STRING_BYTES == NULL
-		|| PY_CBRRR_DECODE_ERROR == NULL
-		|| res < 0
-	) {
-		Py_XDECREF(PY_ZERO);
-		Py_XDECREF(PY_UINT64_MAX);
-		Py_XDECREF(PY_UINT64_MAX_INVERTED);
-		Py_XDECREF(PY_STRING_ENCODE);
-		Py_XDECREF(PY_STRING_DECODE);
-		Py_XDECREF(PY_STRING_LINK);
-		Py_XDECREF(PY_STRING_BYTES);
-		Py_XDECREF(PY_CBRRR_DECODE_ERROR);
-		return NULL;
-	}
-
-	return m;
+	return PyModuleDef_Init(&cbrrrmodule);
 }
@@ -1,9 +1,167 @@
-from typing import Type, TypeVar, Tuple, Callable, Any
+from typing import Type, TypeVar, Tuple, Callable, Any, Dict, List, Iterator, Iterable, Mapping, KeysView, ValuesView, ItemsView, Optional, Union, overload
 
 CbrrrDecodeErrorType = TypeVar("CbrrrDecodeErrorType", bound=ValueError)
 CbrrrDecodeError: CbrrrDecodeErrorType
+T = TypeVar("T")
+CIDT = TypeVar("CIDT", bound="CID")
+
+class CID:
+	CIDV1_DAG_CBOR_SHA256_32_PFX: bytes
+	CIDV1_RAW_SHA256_32_PFX: bytes
+	def __init__(self, cid_bytes: bytes) -> None: ...
+	@property
+	def cid_bytes(self) -> bytes: ...
+	@classmethod
+	def cidv1_dag_cbor_sha256_32_from(cls: Type[CIDT], data: bytes) -> CIDT: ...
+	@classmethod
+	def cidv1_raw_sha256_32_from(cls: Type[CIDT], data: bytes) -> CIDT: ...
+	@classmethod
+	def decode(cls: Type[CIDT], data: Union[bytes, str]) -> CIDT: ...
+	def encode(self, base: str = "base32") -> str: ...
+	def is_cidv1_dag_cbor_sha256_32(self) -> bool: ...
+	def is_cidv1_raw_sha256_32(self) -> bool: ...
+	def __bytes__(self) -> bytes: ...
+	def __hash__(self) -> int: ...
+	def __eq__(self, other: object) -> bool: ...
+
+class Schema:
+	@property
+	def by_type(self) -> Dict[str, Callable[..., Any]]: ...
+	def register(
+		self,
+		cls: Callable[..., Any],
+		fields: Union[Iterable[str], Mapping[str, str]],
+		type_name: Optional[str] = None,
+		required: Iterable[str] = (),
+	) -> None: ...
 
 def decode_dag_cbor(
+	buf: bytes, cid_ctor: Callable[[bytes], Any], atjson_mode: bool, schema: Optional[Schema] = None
+) -> Tuple[Any, int]: ...
+
+class LazyMap:
+	def __len__(self) -> int: ...
+	def __getitem__(self, key: str) -> Any: ...
+	def __contains__(self, key: object) -> bool: ...
+	def __iter__(self) -> Iterator[str]: ...
+	def get(self, key: str, default: Any = None) -> Any: ...
+	def keys(self) -> KeysView[str]: ...
+	def values(self) -> ValuesView[Any]: ...
+	def items(self) -> ItemsView[str, Any]: ...
+	def materialize(self) -> Dict[str, Any]: ...
+
+class LazyList:
+	def __len__(self) -> int: ...
+	@overload
+	def __getitem__(self, idx: int) -> Any: ...
+	@overload
+	def __getitem__(self, idx: slice) -> List[Any]: ...
+	def __iter__(self) -> Iterator[Any]: ...
+	def materialize(self) -> List[Any]: ...
+
+def decode_dag_cbor_lazy(
 	buf: bytes, cid_ctor: Callable[[bytes], Any], atjson_mode: bool
 ) -> Tuple[Any, int]: ...
+def decode_many(
+	buffers: List[bytes],
+	cid_ctor: Callable[[bytes], Any],
+	atjson_mode: bool,
+	threads: int,
+	auto_threads: bool = False,
+) -> List[Any]: ...
+def validate_dag_cbor(buf: bytes) -> int: ...
+def extract(
+	buf: bytes, paths: Iterable[Iterable[Any]], cid_ctor: Callable[[bytes], Any], atjson_mode: bool
+) -> Tuple[List[List[Any]], int]: ...
+class MultiDecoder:
+	@property
+	def offset(self) -> int: ...
+	def __init__(
+		self, buf: bytes, cid_ctor: Callable[[bytes], Any], atjson_mode: bool, max_items: int = -1
+	) -> None: ...
+	def __iter__(self) -> "MultiDecoder": ...
+	def __next__(self) -> Any: ...
+
+def multi_offsets(buf: bytes, max_items: int = -1) -> List[int]: ...
+def decode_car(
+	buf: bytes, cid_ctor: Callable[[bytes], Any], atjson_mode: bool
+) -> Tuple[Dict[str, Any], Dict[Any, Any]]: ...
+
+class StreamDecoder:
+	buffered: int
+	def __init__(self, cid_ctor: Callable[[bytes], Any], atjson_mode: bool, max_object_size: int = -1) -> None: ...
+	def feed(self, chunk: bytes) -> List[Any]: ...
+	def finish(self) -> None: ...
+
 def encode_dag_cbor(obj: Any, cid_type: Type, atjson_mode: bool) -> bytes: ...
+def encoded_size(obj: Any, cid_type: Type, atjson_mode: bool) -> int: ...
+def encode_dag_cbor_into(
+	obj: Any,
+	buf: Union[bytearray, memoryview],
+	offset: int,
+	cid_type: Type,
+	atjson_mode: bool,
+) -> int: ...
+def encode_dag_cbor_to(
+	obj: Any, dest: Any, chunk_size: int, cid_type: Type, atjson_mode: bool
+) -> int: ...
+def encode_dag_cbor_with_cid(
+	obj: Any, cid_type: Type, atjson_mode: bool, cid_ctor: Callable[[bytes], T]
+) -> Tuple[bytes, T]: ...
+def hash_dag_cbor(
+	obj: Any, cid_type: Type, atjson_mode: bool, cid_ctor: Callable[[bytes], T]
+) -> T: ...
+
+def encode_car(
+	roots: Iterable[Any], blocks: Iterable[Any], dedupe: bool, cid_type: Type, atjson_mode: bool
+) -> bytes: ...
+
+class CarWriter:
+	def __init__(
+		self,
+		roots: Iterable[Any],
+		dest: Any = None,
+		dedupe: bool = True,
+		chunk_size: int = 0x10000,
+		atjson_mode: bool = False,
+		cid_type: Type = ...,
+		cid_ctor: Optional[Callable[[bytes], Any]] = None,
+	) -> None: ...
+	def write(self, obj: Any) -> Any: ...
+	def getvalue(self) -> bytes: ...
+	def close(self) -> int: ...
+
+def mst_walk(
+	car: bytes, root: Any, start: Optional[str], end: Optional[str], cid_ctor: Callable[[bytes], T]
+) -> Iterator[Tuple[str, T]]: ...
+def mst_diff(
+	old_car: bytes,
+	new_car: bytes,
+	old_root: Any,
+	new_root: Any,
+	start: Optional[str],
+	end: Optional[str],
+	cid_ctor: Callable[[bytes], T],
+) -> Iterator[Tuple[str, Optional[T], Optional[T]]]: ...
+
+class Decoder:
+	def __init__(
+		self,
+		atjson_mode: bool = False,
+		cid_ctor: Callable[[bytes], Any] = ...,
+		schema: Optional[Schema] = None,
+	) -> None: ...
+	def decode(self, buf: bytes) -> Any: ...
+
+class Encoder:
+	def __init__(self, atjson_mode: bool = False, cid_type: Type = ...) -> None: ...
+	def encode(self, obj: Any) -> bytes: ...
+	def encoded_size(self, obj: Any) -> int: ...
+
+def set_key_cache_size(size: int) -> None: ...
+def key_cache_info() -> Dict[str, int]: ...
+def set_stats_enabled(enabled: bool) -> None: ...
+def get_stats() -> Dict[str, Any]: ...
+def reset_stats() -> None: ...
+def _sha256_impls() -> List[str]: ...
+def _sha256_with_impl(chunks: List[bytes], impl: str) -> bytes: ...
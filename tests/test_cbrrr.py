@@ -1,6 +1,21 @@
 import unittest
 from enum import Enum
 import math
+import hashlib
+import base64
+import pickle
+import dataclasses
+import threading
+import sys
+import gc
+import importlib
+import types
+import os
+import io
+import tempfile
+import random
+import collections.abc
+from typing import Optional
 import cbrrr
 
 
@@ -23,6 +38,63 @@ def cbor_head(mtype, info):
 	return bytes([mtype << 5 | info])
 
 
+def uvarint(n):
+	res = b""
+	while n > 0x7F:
+		res += bytes([(n & 0x7F) | 0x80])
+		n >>= 7
+	return res + bytes([n])
+
+
+def car_section(data):
+	return uvarint(len(data)) + data
+
+
+def mst_layer(key):
+	digest = hashlib.sha256(key).digest()
+	bits = "".join(format(b, "08b") for b in digest)
+	return (len(bits) - len(bits.lstrip("0"))) // 2
+
+
+def build_mst(items, blocks, layer=None):
+	"""
+	Builds an atproto MST over a sorted list of (key, cid) pairs, appending its
+	nodes to blocks. Returns the root node's CID.
+	"""
+	if layer is None:
+		layer = max((mst_layer(k.encode()) for k, _ in items), default=0)
+	if layer < 0:
+		return None
+	entries, left, pending, prev = [], None, [], b""
+	for key, cid in items + [(None, None)]:
+		if key is not None and mst_layer(key.encode()) < layer:
+			pending.append((key, cid))
+			continue
+		subtree = build_mst(pending, blocks, layer - 1) if pending else None
+		pending = []
+		if entries:
+			entries[-1]["t"] = subtree
+		else:
+			left = subtree
+		if key is not None:
+			key = key.encode()
+			p = len(os.path.commonprefix([prev, key]))
+			entries.append({"k": key[p:], "p": p, "t": None, "v": cid})
+			prev = key
+	node = {"e": entries, "l": left}
+	blocks.append(node)
+	return cbrrr.hash_dag_cbor(node)
+
+
+def repo_car(records):
+	"""A repo export-style CAR, for a dict of key: cid records"""
+	blocks = []
+	root = build_mst(sorted(records.items()), blocks)
+	commit = {"did": "did:plc:x", "version": 3, "data": root, "rev": "x", "prev": None, "sig": b""}
+	blocks.append(commit)
+	return cbrrr.encode_car([cbrrr.hash_dag_cbor(commit)], blocks), root
+
+
 def roundrip(obj, atjson_mode=False):
 	return cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor(obj, atjson_mode))
 
@@ -128,6 +200,32 @@ class TestCbrrr(unittest.TestCase):
 			[b"hello", {"world": 0}, [1, 2, 3]],
 		)
 
+	def test_multi_decode_max_items(self):
+		objs = [b"hello", {"world": 0}, [1, 2, 3], None, "x" * 100]
+		parts = [cbrrr.encode_dag_cbor(obj) for obj in objs]
+		data = b"".join(parts)
+		ends = [sum(map(len, parts[: i + 1])) for i in range(len(parts))]
+
+		it = cbrrr.decode_multi_dag_cbor_in_violation_of_the_spec(data, max_items=2)
+		self.assertEqual(list(it), objs[:2])
+		self.assertEqual(it.offset, ends[1])
+		self.assertEqual(list(cbrrr.decode_multi_dag_cbor_in_violation_of_the_spec(memoryview(data)[it.offset :])), objs[2:])
+		self.assertEqual(list(cbrrr.decode_multi_dag_cbor_in_violation_of_the_spec(data, max_items=0)), [])
+		self.assertEqual(list(cbrrr.decode_multi_dag_cbor_in_violation_of_the_spec(b"")), [])
+
+		self.assertEqual(cbrrr.multi_dag_cbor_offsets_in_violation_of_the_spec(data), [0] + ends)
+		self.assertEqual(cbrrr.multi_dag_cbor_offsets_in_violation_of_the_spec(data, max_items=3), [0] + ends[:3])
+		self.assertEqual(cbrrr.multi_dag_cbor_offsets_in_violation_of_the_spec(b""), [0])
+
+		# errors are raised once, then the iterator is finished
+		it = cbrrr.decode_multi_dag_cbor_in_violation_of_the_spec(data + b"\x18\x01" + parts[0])
+		self.assertEqual([next(it) for _ in objs], objs)
+		self.assertRaises(cbrrr.CbrrrDecodeError, next, it)
+		self.assertEqual(list(it), [])
+		with self.assertRaises(cbrrr.CbrrrDecodeError) as cm:
+			cbrrr.multi_dag_cbor_offsets_in_violation_of_the_spec(data + b"\x18\x01")
+		self.assertEqual(cm.exception.offset, len(data))
+
 	def test_duplicate_map_keys(self):
 		# {"abc": 1, "abc": 2}
 		dup = cbor_head(MajorType.MAP, 2)
@@ -161,6 +259,1102 @@ class TestCbrrr(unittest.TestCase):
 		with self.assertRaisesRegex(ValueError, "non-canonical"):
 			cbrrr.decode_dag_cbor(obj)
 
+	def test_key_cache(self):
+		encoded = cbrrr.encode_dag_cbor([{"$type": 1}, {"$type": 2, "text": 3}])
+		cbrrr.set_key_cache_size(16)
+		try:
+			a, b = cbrrr.decode_dag_cbor(encoded)
+			self.assertIs(list(a)[0], list(b)[1])  # same "$type" object
+			info = cbrrr.key_cache_info()
+			self.assertEqual(info["size"], 16)
+			self.assertEqual(info["hits"], 1)
+			self.assertEqual(info["misses"], 2)
+
+			cbrrr.set_key_cache_size(0)
+			a, b = cbrrr.decode_dag_cbor(encoded)
+			self.assertIsNot(list(a)[0], list(b)[1])
+			self.assertEqual(b, {"$type": 2, "text": 3})
+		finally:
+			cbrrr.set_key_cache_size(1024)
+
+	def test_stats(self):
+		obj = {"b": [1, -2, b"xy", None], "a": "hello", "c": cbrrr.CID.cidv1_raw_sha256_32_from(b"x")}
+		cbrrr.set_stats_enabled(False)
+		cbrrr.reset_stats()
+		encoded = cbrrr.encode_dag_cbor(obj)
+		self.assertEqual(cbrrr.get_stats()["encode"]["calls"], 0)
+
+		cbrrr.set_stats_enabled(True)
+		try:
+			encoded = cbrrr.encode_dag_cbor(obj)
+			self.assertEqual(cbrrr.decode_dag_cbor(encoded), obj)
+			stats = cbrrr.get_stats()
+			with self.assertRaises(cbrrr.CbrrrDecodeError):
+				cbrrr.decode_dag_cbor(b"\xff")
+			with self.assertRaises(TypeError):
+				cbrrr.encode_dag_cbor({"a": object()})
+			failed = cbrrr.get_stats()
+		finally:
+			cbrrr.set_stats_enabled(False)
+			cbrrr.reset_stats()
+
+		self.assertTrue(stats["enabled"])
+		self.assertEqual(failed["decode"]["calls"], 2)
+		self.assertEqual(failed["decode"]["failures"]["decode_error"], 1)
+		self.assertEqual(failed["encode"]["calls"], 2)
+		self.assertEqual(failed["encode"]["failures"]["type_error"], 1)
+
+		dec, enc = stats["decode"], stats["encode"]
+		# both directions see the same tokens, accounting for every byte
+		for d in (dec, enc):
+			self.assertEqual(d["bytes"], len(encoded))
+			self.assertEqual(sum(d["token_bytes"].values()), len(encoded))
+			self.assertEqual(d["tokens"]["text_string"], 4)
+			self.assertEqual(d["tokens"]["tag"], 1)
+			self.assertEqual(d["tokens"]["float"], 1)
+			self.assertEqual(d["max_depth"], 2)
+		self.assertEqual(dec["tokens"], enc["tokens"])
+		self.assertEqual(stats["sorts"], 1)
+		self.assertGreater(stats["sort_comparisons"], 0)
+		self.assertEqual(stats["cids"], 1)
+		self.assertEqual(cbrrr.get_stats()["decode"]["calls"], 0)
+
+		# a big enough object gets pre-sized, but that's still just one call
+		big = [b"x" * 300000]
+		cbrrr.set_stats_enabled(True)
+		try:
+			encoded = cbrrr.encode_dag_cbor(big)
+			stats = cbrrr.get_stats()["encode"]
+		finally:
+			cbrrr.set_stats_enabled(False)
+			cbrrr.reset_stats()
+		self.assertEqual(stats["calls"], 1)
+		self.assertEqual(stats["bytes"], len(encoded))
+		self.assertEqual(sum(stats["token_bytes"].values()), len(encoded))
+		self.assertEqual(stats["tokens"]["byte_string"], 1)
+		self.assertEqual(sum(stats["failures"].values()), 0)
+
+	def test_decode_car(self):
+		block = cbrrr.encode_dag_cbor({"hello": "world"})
+		cid = cbrrr.CID.cidv1_dag_cbor_sha256_32_from(block)
+		raw_cid = cbrrr.CID.cidv1_raw_sha256_32_from(b"rawdata")
+		car = car_section(cbrrr.encode_dag_cbor({"version": 1, "roots": [cid]}))
+		car += car_section(bytes(cid) + block)
+		car += car_section(bytes(raw_cid) + b"rawdata")
+
+		header, blocks = cbrrr.decode_car(car)
+		self.assertEqual(header, {"version": 1, "roots": [cid]})
+		self.assertEqual(blocks, {cid: {"hello": "world"}, raw_cid: b"rawdata"})
+
+		with self.assertRaises(cbrrr.CbrrrDecodeError):
+			cbrrr.decode_car(car[:-1])
+		with self.assertRaises(cbrrr.CbrrrDecodeError):  # trailing bytes in block
+			cbrrr.decode_car(car + car_section(bytes(cid) + block + b"\x00"))
+		with self.assertRaises(cbrrr.CbrrrDecodeError):  # non-minimal varint
+			cbrrr.decode_car(b"\x80\x00" + car[1:])
+
+	def test_encode_car(self):
+		blocks = [{"hello": "world"}, {"big": b"x" * 20000}, {"hello": "world"}, 1]
+		cids = [cbrrr.hash_dag_cbor(b) for b in blocks]
+		root = cids[0]
+		car = cbrrr.encode_car([root], blocks)
+
+		expected = car_section(cbrrr.encode_dag_cbor({"version": 1, "roots": [root]}))
+		for cid, block in list(zip(cids, blocks))[:2] + [(cids[3], blocks[3])]:  # the duplicate is skipped
+			expected += car_section(bytes(cid) + cbrrr.encode_dag_cbor(block))
+		self.assertEqual(car, expected)
+		header, decoded = cbrrr.decode_car(car)
+		self.assertEqual(header, {"version": 1, "roots": [root]})
+		self.assertEqual(decoded, dict(zip(cids, blocks)))
+
+		self.assertEqual(len(cbrrr.encode_car([root], blocks, dedupe=False)), len(car) + 1 + 36 + 13)
+		self.assertEqual(cbrrr.encode_car([], iter(blocks)), cbrrr.encode_car((), blocks))
+		self.assertEqual(
+			cbrrr.encode_car([], [{"$link": root.encode()}], atjson_mode=True), cbrrr.encode_car([], [root])
+		)
+
+		with self.assertRaises(TypeError):
+			cbrrr.encode_car([bytes(root)], blocks)
+		with self.assertRaises(TypeError):
+			cbrrr.encode_car([root], [{"a": object()}])
+
+	def test_car_writer(self):
+		blocks = [{"n": i, "pad": "y" * (i * 97)} for i in range(300)]
+		expected = cbrrr.encode_car([], blocks + blocks)
+
+		w = cbrrr.CarWriter([])
+		self.assertEqual([w.write(b) for b in blocks + blocks], [cbrrr.hash_dag_cbor(b) for b in blocks + blocks])
+		self.assertEqual(w.close(), len(expected))
+		self.assertEqual(w.getvalue(), expected)
+		with self.assertRaises(ValueError):
+			w.write({})
+
+		f = io.BytesIO()
+		w = cbrrr.CarWriter([], f, chunk_size=1000)
+		for b in blocks:
+			w.write(b)
+		self.assertGreater(len(f.getvalue()), len(expected) - 1000)  # most of it is already written out
+		with self.assertRaises(TypeError):  # rolled back, and the writer remains usable
+			w.write({"a": object()})
+		with self.assertRaises(ValueError):
+			w.getvalue()
+		self.assertEqual(w.close(), len(expected))
+		self.assertEqual(f.getvalue(), expected)
+
+		with tempfile.TemporaryFile() as tf:
+			w = cbrrr.CarWriter([], tf.fileno(), dedupe=False)
+			for b in blocks:
+				w.write(b)
+			w.close()
+			tf.seek(0)
+			self.assertEqual(tf.read(), cbrrr.encode_car([], blocks, dedupe=False))
+
+		class Reentrant:
+			def __init__(self):
+				self.w = None
+
+			def write(self, data):
+				self.w.write({})
+
+		r = Reentrant()
+		r.w = cbrrr.CarWriter([], r, chunk_size=1)
+		with self.assertRaises(RuntimeError):
+			r.w.write({})
+		with self.assertRaises(RuntimeError):  # we don't know what state the output's in
+			r.w.close()
+
+	def test_mst_walk(self):
+		records = {"app.bsky.feed.post/%05d" % i: cbrrr.hash_dag_cbor(i) for i in range(0, 3000, 3)}
+		car, root = repo_car(records)
+		self.assertEqual(list(cbrrr.mst_walk(car)), sorted(records.items()))
+		self.assertEqual(list(cbrrr.mst_walk(bytearray(car), root)), sorted(records.items()))
+		self.assertEqual(list(cbrrr.mst_walk(repo_car({})[0])), [])
+
+		start, end = "app.bsky.feed.post/01000", "app.bsky.feed.post/01100"
+		self.assertEqual(
+			list(cbrrr.mst_walk(car, start=start, end=end)),
+			[(k, v) for k, v in sorted(records.items()) if start <= k < end],
+		)
+		self.assertEqual(list(cbrrr.mst_walk(car, start="b")), [])
+		self.assertEqual(len(list(cbrrr.mst_walk(car, end="app.bsky.feed.post/00010"))), 4)
+
+		# missing nodes
+		header, blocks = cbrrr.decode_car(car)
+		some_blocks = list(blocks.values())[1:]
+		with self.assertRaises(cbrrr.CbrrrDecodeError):
+			list(cbrrr.mst_walk(cbrrr.encode_car(header["roots"], some_blocks)))
+
+		# out of order keys, and malformed nodes
+		leaf = lambda *keys: {"e": [{"k": k, "p": 0, "t": None, "v": root} for k in keys], "l": None}
+		for node in [leaf(b"b", b"a"), leaf(b"a", b"a"), {"e": [], "l": None, "x": 1}, {"e": [{"k": b"a"}], "l": None}]:
+			with self.assertRaises(cbrrr.CbrrrDecodeError):
+				list(cbrrr.mst_walk(cbrrr.encode_car([], [node]), cbrrr.hash_dag_cbor(node)))
+		inner = leaf(b"z")  # sorted within its own node, but not relative to its parent
+		outer = {"e": [{"k": b"m", "p": 0, "t": None, "v": root}], "l": cbrrr.hash_dag_cbor(inner)}
+		with self.assertRaises(cbrrr.CbrrrDecodeError):
+			list(cbrrr.mst_walk(cbrrr.encode_car([], [inner, outer]), cbrrr.hash_dag_cbor(outer)))
+
+	def test_mst_diff(self):
+		old = {"app.bsky.feed.post/%05d" % i: cbrrr.hash_dag_cbor(i) for i in range(0, 3000, 3)}
+		new = dict(old)
+		for i in range(0, 3000, 97):
+			new.pop("app.bsky.feed.post/%05d" % i, None)
+			new["app.bsky.feed.post/%05d" % (i + 1)] = cbrrr.hash_dag_cbor(-i)
+			new["app.bsky.feed.post/%05d" % (i + 3)] = cbrrr.hash_dag_cbor(-i)
+		keys = sorted(set(old) | set(new))
+		expected = [(k, old.get(k), new.get(k)) for k in keys if old.get(k) != new.get(k)]
+
+		old_car, old_root = repo_car(old)
+		new_car, new_root = repo_car(new)
+		self.assertEqual(list(cbrrr.mst_diff(old_car, new_car)), expected)
+		self.assertEqual(list(cbrrr.mst_diff(new_car, old_car)), [(k, b, a) for k, a, b in expected])
+		self.assertEqual(list(cbrrr.mst_diff(old_car, old_car, old_root, old_root)), [])
+		self.assertEqual(list(cbrrr.mst_diff(repo_car({})[0], old_car)), [(k, None, v) for k, v in sorted(old.items())])
+
+		both = cbrrr.encode_car([], list(cbrrr.decode_car(old_car)[1].values()) + list(cbrrr.decode_car(new_car)[1].values()))
+		self.assertEqual(list(cbrrr.mst_diff(both, both, old_root, new_root)), expected)
+		with self.assertRaises(ValueError):
+			cbrrr.mst_diff(both, both)
+		start, end = "app.bsky.feed.post/01000", "app.bsky.feed.post/02000"
+		self.assertEqual(
+			list(cbrrr.mst_diff(old_car, new_car, start=start, end=end)), [d for d in expected if start <= d[0] < end]
+		)
+
+	def test_stream_decoder(self):
+		objs = [b"hello", {"world": [0, 1.5, None]}, cbrrr.CID(b"blah"), [], {}, 1 << 40]
+		encoded = b"".join(cbrrr.encode_dag_cbor(o) for o in objs)
+		for chunk_size in [1, 2, 3, 7, len(encoded)]:
+			decoder = cbrrr.StreamDecoder()
+			results = []
+			for i in range(0, len(encoded), chunk_size):
+				results += decoder.feed(encoded[i : i + chunk_size])
+			decoder.finish()
+			self.assertEqual(results, objs)
+
+		decoder = cbrrr.StreamDecoder()
+		self.assertEqual(decoder.feed(encoded[:-1]), objs[:-1])
+		self.assertEqual(decoder.buffered, 8)
+		self.assertRaises(cbrrr.CbrrrDecodeError, decoder.finish)
+
+		decoder = cbrrr.StreamDecoder()
+		self.assertRaises(cbrrr.CbrrrDecodeError, decoder.feed, b"\x1c")
+		self.assertRaises(cbrrr.CbrrrDecodeError, decoder.feed, b"\x00")
+
+		# headers that promise more than max_object_size fail straight away, rather than buffering forever
+		for header in [
+			b"\x5b\xff\xff\xff\xff\xff\xff\xff\xff",  # bytes
+			b"\x7a\x00\x01\x00\x00",  # str
+			b"\x82\x01\x9a\x00\x01\x00\x00",  # array (nested)
+			b"\xbb\x00\x00\x00\x01\x00\x00\x00\x00",  # map
+		]:
+			decoder = cbrrr.StreamDecoder(max_object_size=0x10000)
+			with self.assertRaisesRegex(cbrrr.CbrrrDecodeError, "max_object_size"):
+				decoder.feed(header)
+			self.assertRaises(cbrrr.CbrrrDecodeError, decoder.feed, b"\x00")
+		decoder = cbrrr.StreamDecoder(max_object_size=0x10000)
+		with self.assertRaisesRegex(cbrrr.CbrrrDecodeError, "max_object_size"):
+			for _ in range(0x100):  # lots of small items add up too
+				decoder.feed(b"\x81" * 0x100)
+		big = cbrrr.encode_dag_cbor([b"x" * 0x8000, b"y" * 0x7000])
+		self.assertEqual(cbrrr.StreamDecoder(max_object_size=len(big)).feed(big * 2), [[b"x" * 0x8000, b"y" * 0x7000]] * 2)
+		self.assertRaises(cbrrr.CbrrrDecodeError, cbrrr.StreamDecoder(max_object_size=len(big) - 1).feed, big)
+		self.assertEqual(cbrrr.StreamDecoder(max_object_size=None).feed(big), [[b"x" * 0x8000, b"y" * 0x7000]])
+
+	def test_lazy_decode(self):
+		obj = {
+			"a": [1, {"b": b"bytes", "c": None}, "str"],
+			"bb": {"cid": cbrrr.CID(b"blah")},
+			"ccc": -1.5,
+		}
+		lazy = cbrrr.decode_dag_cbor_lazy(cbrrr.encode_dag_cbor(obj))
+		self.assertIsInstance(lazy, cbrrr.LazyMap)
+		self.assertEqual(len(lazy), 3)
+		self.assertEqual(list(lazy), ["a", "bb", "ccc"])
+		self.assertEqual(lazy["ccc"], -1.5)
+		self.assertIn("bb", lazy)
+		self.assertNotIn("zz", lazy)
+		self.assertNotIn(1, lazy)
+		self.assertNotIn("\ud800", lazy)  # not encodable as UTF-8, just like a dict
+		self.assertRaises(KeyError, lambda: lazy["zz"])
+		self.assertRaises(KeyError, lambda: lazy["\ud800"])
+		self.assertEqual(lazy.get("zz", 5), 5)
+
+		arr = lazy["a"]
+		self.assertIsInstance(arr, cbrrr.LazyList)
+		self.assertIs(lazy["a"], arr)  # materialized members are cached
+		self.assertEqual(arr[-1], "str")
+		self.assertEqual(arr[1]["b"], b"bytes")
+		self.assertEqual(arr[::2], [1, "str"])
+		self.assertRaises(IndexError, lambda: arr[3])
+		self.assertEqual(list(arr)[0], 1)
+		self.assertEqual(lazy["bb"]["cid"], cbrrr.CID(b"blah"))
+
+		self.assertEqual(lazy.materialize(), obj)
+		self.assertEqual(lazy, obj)
+		self.assertEqual(dict(lazy.items())["ccc"], -1.5)
+
+		# the views behave like a dict's
+		self.assertIsInstance(lazy.keys(), collections.abc.KeysView)
+		self.assertIsInstance(lazy.values(), collections.abc.ValuesView)
+		self.assertIsInstance(lazy.items(), collections.abc.ItemsView)
+		self.assertEqual(lazy.keys(), obj.keys())
+		self.assertEqual(lazy.keys() & {"a", "zz"}, {"a"})
+		self.assertIn("bb", lazy.keys())
+		self.assertIn(("ccc", -1.5), lazy.items())
+		self.assertIn(-1.5, lazy.values())
+		self.assertEqual(len(lazy.values()), 3)
+		self.assertEqual(list(lazy.items())[0], ("a", obj["a"]))
+
+		self.assertEqual(cbrrr.decode_dag_cbor_lazy(cbrrr.encode_dag_cbor(123)), 123)
+		self.assertEqual(
+			cbrrr.decode_dag_cbor_lazy(cbrrr.encode_dag_cbor([b"x"]), atjson_mode=True)[0],
+			{"$bytes": "eA"},
+		)
+
+	def test_lazy_decode_validates_up_front(self):
+		# {"def": [1], "abc": 2}, with the non-canonical key hidden in the second entry
+		obj = cbor_head(MajorType.MAP, 2)
+		obj += cbor_head(MajorType.TEXT_STRING, 3) + b"def"
+		obj += cbor_head(MajorType.ARRAY, 1) + cbor_head(MajorType.UNSIGNED_INT, 1)
+		obj += cbor_head(MajorType.TEXT_STRING, 3) + b"abc"
+		obj += cbor_head(MajorType.UNSIGNED_INT, 2)
+		with self.assertRaisesRegex(cbrrr.CbrrrDecodeError, "non-canonical"):
+			cbrrr.decode_dag_cbor_lazy(obj)
+		with self.assertRaisesRegex(cbrrr.CbrrrDecodeError, "UTF-8"):
+			cbrrr.decode_dag_cbor_lazy(cbor_head(MajorType.TEXT_STRING, 1) + b"\xff")
+		with self.assertRaisesRegex(cbrrr.CbrrrDecodeError, "not enough bytes"):
+			cbrrr.decode_dag_cbor_lazy(cbrrr.encode_dag_cbor([[1, 2]])[:-1])
+
+	def test_decode_many(self):
+		cid = cbrrr.CID.cidv1_dag_cbor_sha256_32_from(b"x")
+		objs = [
+			{"a": [1, -2, 2**64 - 1, -(2**64)], "b": {"c": None, "d": True, "e": False}},
+			[1.5, -0.0, "héllo", b"\x00\x01", cid],
+			"x" * 1000,
+			[],
+			{},
+			[[[[{"deep": [cid]}]]]] * 3,
+		] * 50
+		bufs = [cbrrr.encode_dag_cbor(obj) for obj in objs]
+		for threads in [1, 4, 1000]:
+			self.assertEqual(cbrrr.decode_many(bufs, threads=threads), objs)
+		self.assertEqual(cbrrr.decode_many(bufs, atjson_mode=True), [cbrrr.decode_dag_cbor(buf, atjson_mode=True) for buf in bufs])
+		self.assertEqual(cbrrr.decode_many(bytearray(buf) for buf in bufs[:5]), objs[:5])
+		self.assertEqual(cbrrr.decode_many([]), [])
+		# the default is only to use as many threads as the input size warrants
+		self.assertEqual(cbrrr.decode_many([b"\x00"] * 10), [0] * 10)
+		self.assertEqual(cbrrr.decode_many([cbrrr.encode_dag_cbor(b"x" * 0x40000)] * 8), [b"x" * 0x40000] * 8)
+
+		# a mutable buffer can change between validation and building the objects,
+		# e.g. from cid_ctor, so strs mustn't just trust that they were ASCII
+		for replacement, expected in [("é".encode(), "é"), (b"\xff\xff", None)]:
+			mutable = bytearray(cbrrr.encode_dag_cbor([cid, "ab"]))
+
+			def mutating_cid_ctor(cid_bytes):
+				mutable[-2:] = replacement
+				return cbrrr.CID(cid_bytes)
+
+			if expected is None:
+				self.assertRaises(ValueError, cbrrr.decode_many, [mutable], cid_ctor=mutating_cid_ctor)
+				continue
+			res = cbrrr.decode_many([mutable], cid_ctor=mutating_cid_ctor)
+			self.assertEqual(res, [[cid, expected]])
+			self.assertEqual(res[0][1].encode(), expected.encode())
+
+		bad = list(bufs)
+		bad[121] = bad[121][:-1]
+		bad[200] = b"\x18\x01"
+		with self.assertRaisesRegex(cbrrr.CbrrrDecodeError, "buffer 121") as cm:
+			cbrrr.decode_many(bad)
+		with self.assertRaises(cbrrr.CbrrrDecodeError) as cm2:
+			cbrrr.validate_dag_cbor(bad[121])
+		self.assertEqual(cm.exception.offset, cm2.exception.offset)
+		self.assertRaises(ValueError, cbrrr.decode_many, [bufs[0] + b"\x00"])
+		self.assertRaises(TypeError, cbrrr.decode_many, ["not bytes"])
+
+		# enough buffers for several chunks (of 1024), with errors either side of a chunk boundary, and at the very end
+		many_objs = (objs * 9)[:2500]
+		many = [cbrrr.encode_dag_cbor(obj) for obj in many_objs]
+		for threads in [1, 4]:
+			self.assertEqual(cbrrr.decode_many(many, threads=threads), many_objs)
+		for bad_idxs in [[1023], [1024], [2499], [1024, 2499], [1023, 1024, 2499]]:
+			bad = list(many)
+			for i in bad_idxs:
+				bad[i] = bad[i][:-1]
+			for threads in [1, 4]:
+				with self.assertRaisesRegex(cbrrr.CbrrrDecodeError, "of buffer %d\\)" % bad_idxs[0]) as cm:
+					cbrrr.decode_many(bad, threads=threads)
+				with self.assertRaises(cbrrr.CbrrrDecodeError) as cm2:
+					cbrrr.validate_dag_cbor(bad[bad_idxs[0]])
+				self.assertEqual(cm.exception.offset, cm2.exception.offset)
+
+	def test_validate(self):
+		obj = {"hello": [b"world", 1.5, -2, None, True], "x": {"y": "z" * 100}}
+		encoded = cbrrr.encode_dag_cbor(obj)
+		self.assertEqual(cbrrr.validate_dag_cbor(encoded), len(encoded))
+		self.assertEqual(cbrrr.validate_dag_cbor(bytearray(encoded)), len(encoded))
+		self.assertEqual(cbrrr.validate_dag_cbor(encoded + b"\x00", allow_trailing=True), len(encoded))
+		self.assertRaises(ValueError, cbrrr.validate_dag_cbor, encoded + b"\x00")
+
+		# {"def": [1], "abc": 2}, where the "abc" key starts at offset 7
+		obj = cbor_head(MajorType.MAP, 2)
+		obj += cbor_head(MajorType.TEXT_STRING, 3) + b"def"
+		obj += cbor_head(MajorType.ARRAY, 1) + cbor_head(MajorType.UNSIGNED_INT, 1)
+		obj += cbor_head(MajorType.TEXT_STRING, 3) + b"abc"
+		obj += cbor_head(MajorType.UNSIGNED_INT, 2)
+		with self.assertRaisesRegex(cbrrr.CbrrrDecodeError, "non-canonical") as cm:
+			cbrrr.validate_dag_cbor(obj)
+		self.assertEqual(cm.exception.offset, 7)
+
+		# everything decode_dag_cbor rejects, validate_dag_cbor should too
+		bad = [
+			b"\x18\x01",  # non-minimal int
+			b"\xfb\x7f\xf8\x00\x00\x00\x00\x00\x00",  # NaN
+			b"\xfb\x7f\xf0\x00\x00\x00\x00\x00\x00",  # Infinity
+			b"\xc1\x00",  # tag other than 42
+			b"\xd8\x2a\x42\x01\x02",  # CID without the leading 0
+			b"\x82\x61\xff\x00",  # invalid UTF-8
+			b"\xa2\x61a\x00\x61a\x00",  # duplicate key
+			b"\x9f\x00\xff",  # indefinite length
+			b"\x83\x01\x02",  # truncated
+		]
+		for data in bad:
+			self.assertRaises(ValueError, cbrrr.decode_dag_cbor, data)  # nb: may be a UnicodeDecodeError
+			self.assertRaises(cbrrr.CbrrrDecodeError, cbrrr.validate_dag_cbor, data)
+
+	def test_extract(self):
+		cid = cbrrr.CID.cidv1_dag_cbor_sha256_32_from(b"x")
+		commit = {
+			"ops": [
+				{"action": "create", "path": "app.bsky.feed.post/1", "cid": cid},
+				{"action": "delete", "path": "app.bsky.feed.like/2", "cid": None},
+			],
+			"blocks": b"\x00" * 1000,
+			"record": {"$type": "app.bsky.feed.post", "text": "hello", "embed": {"images": [1, 2, 3]}},
+			"seq": 12345,
+		}
+		encoded = cbrrr.encode_dag_cbor(commit)
+		paths = [
+			["ops", ..., "path"],
+			["record", "$type"],
+			["ops", 0],
+			["ops", -1, "action"],
+			["ops", 2],
+			["ops", -3],
+			["record", "embed", "images", ...],
+			[..., ..., "cid"],
+			["record"],
+			["record", "text"],
+			["seq", "nope"],
+			[],
+		]
+		self.assertEqual(cbrrr.extract(encoded, paths), [
+			["app.bsky.feed.post/1", "app.bsky.feed.like/2"],
+			["app.bsky.feed.post"],
+			[commit["ops"][0]],
+			["delete"],
+			[],
+			[],
+			[1, 2, 3],
+			[cid, None],
+			[commit["record"]],
+			["hello"],
+			[],
+			[commit],
+		])
+		self.assertEqual(cbrrr.extract(encoded, [("blocks",)], atjson_mode=True), [[{"$bytes": base64.b64encode(b"\x00" * 1000).decode().rstrip("=")}]])
+		self.assertEqual(cbrrr.extract(encoded, []), [])
+
+		self.assertRaises(TypeError, cbrrr.extract, encoded, [[1.5]])
+		self.assertRaises(ValueError, cbrrr.extract, encoded, [["seq"]] * 65)
+		self.assertRaises(ValueError, cbrrr.extract, encoded + b"\x00", [["seq"]])
+
+		# skipped subtrees are still validated
+		bad = cbrrr.encode_dag_cbor({"a": [1, 2], "b": 3}).replace(b"\x82\x01", b"\x82\x18\x01")
+		with self.assertRaisesRegex(cbrrr.CbrrrDecodeError, "minimal") as cm:
+			cbrrr.extract(bad, [["b"]])
+		self.assertEqual(cm.exception.offset, 4)
+		self.assertRaises(cbrrr.CbrrrDecodeError, cbrrr.extract, b"\xa2\x61b\x01\x61a\x02", [["a"]])
+
+		# errors within selected subtrees (including nested walks) report their offset within the whole input
+		for doc, paths in [
+			({"x": 1, "a": {"b": [1, 2], "c": [1, 2]}}, [["a"], ["a", "b"]]),
+			({"x": 1, "a": {"b": [1, 2], "c": [1, 2]}}, [["a"], ["a", "c"]]),
+			({"x": 1, "a": {"b": [1, 2], "c": [1, 2]}}, [["a"]]),
+			({"x": 1, "a": {"b": [1, 2], "c": [1, 2]}}, [["a", "c"]]),
+			([0, [{"b": [1, 2]}]], [[1, 0], [1, 0, "b"], [1]]),
+		]:
+			for bad in [b"\x82\x18\x01", b"\x82\x01\x18\x02"]:
+				data = cbrrr.encode_dag_cbor(doc)
+				i = data.rindex(b"\x82\x01\x02")  # corrupt the last list
+				data = data[:i] + bad + data[i + 3 :]
+				with self.assertRaises(cbrrr.CbrrrDecodeError) as expected:
+					cbrrr.validate_dag_cbor(data)
+				with self.assertRaises(cbrrr.CbrrrDecodeError) as cm:
+					cbrrr.extract(data, paths)
+				self.assertEqual(cm.exception.offset, expected.exception.offset)
+				self.assertEqual(str(cm.exception), str(expected.exception))
+
+	def test_encode_into(self):
+		obj = {"hello": [b"world", 1, 2, 3], "x": "y" * 2000}
+		expected = cbrrr.encode_dag_cbor(obj)
+		buf = bytearray(len(expected) + 10)
+		self.assertEqual(cbrrr.encode_dag_cbor_into(obj, buf, 10), len(expected))
+		self.assertEqual(buf[10:], expected)
+		self.assertEqual(cbrrr.encode_dag_cbor_into(obj, memoryview(buf)[5:]), len(expected))
+		self.assertEqual(buf[5 : 5 + len(expected)], expected)
+		self.assertRaises(ValueError, cbrrr.encode_dag_cbor_into, obj, buf, 11)
+		self.assertRaises(ValueError, cbrrr.encode_dag_cbor_into, obj, buf, -1)
+		self.assertRaises(TypeError, cbrrr.encode_dag_cbor_into, obj, bytes(buf))
+		self.assertEqual(cbrrr.encode_dag_cbor_into(None, buf, len(buf) - 1), 1)
+		self.assertEqual(
+			cbrrr.encode_dag_cbor_into({"$bytes": "aGVsbG8"}, buf, atjson_mode=True), 6
+		)
+		self.assertEqual(buf[:6], cbrrr.encode_dag_cbor(b"hello"))
+
+	def test_encode_with_cid(self):
+		objs = [
+			None,
+			{},
+			{"a": [1, 2, 3], "b": b"x" * 55},
+			# straddle every sha256 block-padding edge case, and the chunk size
+			*[b"y" * n for n in range(50, 140)],
+			["z" * 5000, {"hello": "world"}, b"\x00" * 0x3000],
+			{"$link": "bafyreidfayvfuwqa7qlnopdjiqrxzs6blmoeu4rujcjtnci5beludirz2a"},
+		]
+		for obj in objs:
+			encoded = cbrrr.encode_dag_cbor(obj)
+			expected_cid = cbrrr.CID.cidv1_dag_cbor_sha256_32_from(encoded)
+			self.assertEqual(cbrrr.encode_dag_cbor_with_cid(obj), (encoded, expected_cid))
+			self.assertEqual(cbrrr.hash_dag_cbor(obj), expected_cid)
+			self.assertEqual(
+				cbrrr.hash_dag_cbor(obj, cid_ctor=bytes), expected_cid.cid_bytes
+			)
+		self.assertEqual(
+			cbrrr.hash_dag_cbor(objs[-1], atjson_mode=True),
+			cbrrr.CID.cidv1_dag_cbor_sha256_32_from(
+				cbrrr.encode_dag_cbor(objs[-1], atjson_mode=True)
+			),
+		)
+		self.assertEqual(
+			cbrrr.hash_dag_cbor({"x": b"y" * 100}).cid_bytes[4:],
+			hashlib.sha256(cbrrr.encode_dag_cbor({"x": b"y" * 100})).digest(),
+		)
+		self.assertRaises(TypeError, cbrrr.hash_dag_cbor, [1, 2, object()])
+		self.assertRaises(TypeError, cbrrr.encode_dag_cbor_with_cid, {1: 2})
+
+	def test_sha256_impls(self):
+		impls = cbrrr._cbrrr._sha256_impls()
+		self.assertEqual(impls[0], "portable")  # always available
+		rng = random.Random(1234)
+		inputs = [b"", b"x" * 55, b"x" * 56, b"x" * 64]
+		inputs += [rng.getrandbits(n * 8).to_bytes(n, "little") for n in [rng.randrange(1, 300) for _ in range(200)] + [100000]]
+		for data in inputs:
+			expected = hashlib.sha256(data).digest()
+			# (the default implementation, via the public API)
+			self.assertEqual(cbrrr.CID.cidv1_raw_sha256_32_from(data).cid_bytes[4:], expected)
+			# fed in uneven pieces, so partial blocks get topped up
+			cuts = sorted(rng.randrange(len(data) + 1) for _ in range(3))
+			chunks = [data[i:j] for i, j in zip([0] + cuts, cuts + [len(data)])]
+			for impl in impls:
+				self.assertEqual(cbrrr._cbrrr._sha256_with_impl([data], impl), expected, impl)
+				self.assertEqual(cbrrr._cbrrr._sha256_with_impl(chunks, impl), expected, impl)
+		self.assertRaisesRegex(ValueError, "not available", cbrrr._cbrrr._sha256_with_impl, [b""], "nope")
+
+	def test_native_cid(self):
+		raw = b"\x01\x71\x12\x20" + hashlib.sha256(b"hello").digest()
+		b32 = "b" + base64.b32encode(raw).decode().lower().rstrip("=")
+		cid = cbrrr.CID(raw)
+		self.assertEqual(cid.cid_bytes, raw)
+		self.assertEqual(bytes(cid), raw)
+		self.assertEqual(cid.encode(), b32)
+		self.assertEqual(repr(cid), f"CID({b32})")
+		self.assertEqual(cbrrr.CID.decode(b32), cid)
+		self.assertEqual(cbrrr.CID.decode("b" + b32[1:].upper()), cid)
+		self.assertEqual(cbrrr.CID.decode(b32.encode()), cid)
+		self.assertEqual(cbrrr.CID.decode(b"\x00" + raw), cid)
+		self.assertEqual(cbrrr.CID.cidv1_dag_cbor_sha256_32_from(b"hello"), cid)
+		self.assertTrue(cid.is_cidv1_dag_cbor_sha256_32())
+		self.assertFalse(cid.is_cidv1_raw_sha256_32())
+		self.assertTrue(cbrrr.CID.cidv1_raw_sha256_32_from(b"x").is_cidv1_raw_sha256_32())
+		self.assertEqual(cid.CIDV1_DAG_CBOR_SHA256_32_PFX, raw[:4])
+		self.assertRaises(ValueError, cbrrr.CID.decode, b32 + "=")
+		self.assertRaises(ValueError, cbrrr.CID.decode, "z" + b32[1:])
+		self.assertRaises(ValueError, cbrrr.CID.decode, b32 + "a")  # bad length
+		self.assertRaises(ValueError, cid.encode, "base58btc")
+
+		# hashing and equality behave like the underlying bytes
+		self.assertEqual(hash(cid), hash(raw))
+		self.assertEqual(cid, cbrrr.CID(bytearray(raw)))
+		self.assertNotEqual(cid, raw)
+		self.assertNotEqual(cid, cbrrr.CID(raw[:-1]))
+		self.assertEqual({cid: 1}[cbrrr.CID(raw)], 1)
+		self.assertEqual(pickle.loads(pickle.dumps(cid)), cid)
+
+		# subclasses work, but go the slow way through the codecs
+		class MyCID(cbrrr.CID):
+			pass
+
+		sub = MyCID.decode(b32)
+		self.assertIs(type(sub), MyCID)
+		self.assertEqual(sub, cid)
+		encoded = cbrrr.encode_dag_cbor([cid, cbrrr.CID(b"")])
+		self.assertEqual(cbrrr.decode_dag_cbor(encoded), [cid, cbrrr.CID(b"")])
+		self.assertEqual(cbrrr.encode_dag_cbor(sub, cid_type=MyCID), encoded[1:-4])
+		decoded = cbrrr.decode_dag_cbor(encoded, cid_ctor=MyCID)
+		self.assertIs(type(decoded[0]), MyCID)
+
+	def test_text_string_fast_path(self):
+		# put a non-ASCII (or invalid) byte at every position relative to the
+		# SIMD block boundaries
+		for length in [0, 1, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100]:
+			ascii = "a" * length
+			self.assertEqual(cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor(ascii)), ascii)
+			self.assertEqual(
+				cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor({ascii: 1})), {ascii: 1}
+			)
+			for i in range(length):
+				s = ascii[:i] + "\u00e9\U0001f980" + ascii[i + 1 :]
+				encoded = cbrrr.encode_dag_cbor(s)
+				self.assertEqual(cbrrr.decode_dag_cbor(encoded), s)
+				self.assertEqual(cbrrr.decode_dag_cbor_lazy(encoded), s)
+				self.assertEqual(cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor({s: 1})), {s: 1})
+
+				bad = bytearray(cbrrr.encode_dag_cbor(ascii))
+				bad[len(bad) - length + i] = 0xFF
+				self.assertRaises(UnicodeDecodeError, cbrrr.decode_dag_cbor, bytes(bad))
+				self.assertRaises(
+					cbrrr.CbrrrDecodeError, cbrrr.decode_dag_cbor_lazy, bytes(bad)
+				)
+
+	def test_atjson_base_encodings(self):
+		# long enough to exercise the vectorised paths, plus all the tail lengths
+		for length in list(range(0, 70)) + [200, 1000, 1001, 1002]:
+			data = bytes((i * 151 + 7) & 0xFF for i in range(length))
+			b64 = base64.b64encode(data).decode()
+			atjson = cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor(data), atjson_mode=True)
+			self.assertEqual(atjson, {"$bytes": b64.rstrip("=")})
+			for s in [b64, b64.rstrip("=")]:
+				self.assertEqual(
+					cbrrr.encode_dag_cbor({"$bytes": s}, atjson_mode=True),
+					cbrrr.encode_dag_cbor(data),
+				)
+			b32 = "b" + base64.b32encode(data).decode().lower().rstrip("=")
+			self.assertEqual(cbrrr.CID(data).encode(), b32)
+			self.assertEqual(
+				cbrrr.encode_dag_cbor({"$link": b32}, atjson_mode=True),
+				cbrrr.encode_dag_cbor(cbrrr.CID(data)),
+			)
+
+		b64 = base64.b64encode(bytes(range(256)) * 2).decode()
+		for i in range(0, len(b64), 7):
+			for bad in ["-", "_", "\x00", "\x7f", "\u00e9", "\U0001f980", "="]:
+				s = b64[:i] + bad + b64[i + 1 :]
+				self.assertRaises(
+					ValueError, cbrrr.encode_dag_cbor, {"$bytes": s}, atjson_mode=True
+				)
+
+	def test_dict_shape_cache(self):
+		def reference(d):  # canonical encoding, built by hand
+			out = bytearray(cbrrr.encode_dag_cbor([None] * len(d))[:1])
+			out[0] += 0x20  # array header -> map header
+			for k in sorted(d, key=lambda k: (len(k.encode()), k.encode())):
+				out += cbrrr.encode_dag_cbor(k) + cbrrr.encode_dag_cbor(d[k])
+			return bytes(out)
+
+		post = lambda i: {"text": f"post {i}", "$type": "app.bsky.feed.post", "createdAt": "x", "é": i}
+		for i in range(5):  # first time round it's not cached, then it is
+			self.assertEqual(cbrrr.encode_dag_cbor(post(i)), reference(post(i)))
+			# same key set, different insertion order (and thus a different shape)
+			rev = dict(reversed(list(post(i).items())))
+			self.assertEqual(cbrrr.encode_dag_cbor(rev), reference(rev))
+			# equal but non-identical keys
+			fresh = {"".join(k): v for k, v in post(i).items()}
+			self.assertEqual(cbrrr.encode_dag_cbor(fresh), reference(fresh))
+
+		# dicts straight from the decoder are already in canonical order
+		decoded = cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor(post(0)))
+		self.assertEqual(cbrrr.encode_dag_cbor(decoded), reference(post(0)))
+
+		# evict the outer dict's cache entry while it's still being encoded
+		many_shapes = [{f"k{i}": 1, "x": 2} for i in range(2000)] * 2
+		outer = {"shapes": many_shapes, "after": {"a": 1, "b": 2}}
+		for _ in range(3):
+			self.assertEqual(cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor(outer)), outer)
+
+		for _ in range(3):
+			self.assertRaises(TypeError, cbrrr.encode_dag_cbor, {"a": 1, 2: 3})
+			self.assertRaises(TypeError, cbrrr.encode_dag_cbor, {"a": object(), "b": 1})
+
+	def test_int_boundaries(self):
+		# values either side of every boundary between the fast and slow paths,
+		# and between the different CBOR header sizes
+		edges = [0, 23, 24, 255, 256, 65535, 65536, 2**32 - 1, 2**32, 2**63 - 1, 2**63, 2**64 - 1]
+		for edge in edges:
+			for n in [edge, -edge - 1]:
+				encoded = cbrrr.encode_dag_cbor(n)
+				major = 0 if n >= 0 else 1
+				self.assertEqual(encoded[0] >> 5, major)
+				self.assertEqual(cbrrr.decode_dag_cbor(encoded), n)
+				self.assertIs(type(cbrrr.decode_dag_cbor(encoded)), int)
+		self.assertEqual(cbrrr.encode_dag_cbor(-(2**63)), b"\x3b\x7f" + b"\xff" * 7)
+		self.assertEqual(cbrrr.encode_dag_cbor(-(2**63) - 1), b"\x3b\x80" + b"\x00" * 7)
+		for n in [2**64, -(2**64) - 1, 2**100, -(2**100)]:
+			self.assertRaises(ValueError, cbrrr.encode_dag_cbor, n)
+
+	def test_schema_decode(self):
+		@dataclasses.dataclass
+		class Post:
+			text: str
+			createdAt: str
+			langs: Optional[list] = None
+
+		@dataclasses.dataclass
+		class StrongRef:
+			cid: object
+			uri: str
+
+		schema = cbrrr.Schema()
+		schema.register(Post, ["text", "createdAt", "langs"], type_name="app.bsky.feed.post")
+		schema.register(StrongRef, {"uri": "uri", "cid": "cid"})
+		self.assertEqual(schema.by_type, {"app.bsky.feed.post": Post})
+
+		cid = cbrrr.CID.cidv1_dag_cbor_sha256_32_from(b"hello")
+		post = {"$type": "app.bsky.feed.post", "text": "hi", "createdAt": "now"}
+		ref = {"cid": cid, "uri": "at://foo"}
+		doc = {
+			"posts": [post, {**post, "langs": ["en"]}],
+			"ref": ref,
+			"nested": {"a": [[ref]]},
+			"extra_key": {**post, "reply": ref},
+			"not_quite_ref": {"cid": cid, "uri": "at://foo", "x": 1},
+			"other_type": {"$type": "app.bsky.feed.like", "text": "hi"},
+		}
+		decoded = cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor(doc), schema=schema)
+		self.assertEqual(decoded["posts"], [Post("hi", "now"), Post("hi", "now", ["en"])])
+		self.assertEqual(decoded["ref"], StrongRef(cid, "at://foo"))
+		self.assertEqual(decoded["nested"], {"a": [[StrongRef(cid, "at://foo")]]})
+		# unknown keys fall back to plain dicts (but their values still get the schema applied)
+		self.assertEqual(decoded["extra_key"], {**post, "reply": StrongRef(cid, "at://foo")})
+		self.assertEqual(decoded["not_quite_ref"], doc["not_quite_ref"])
+		self.assertEqual(decoded["other_type"], doc["other_type"])
+		self.assertEqual(cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor(ref), schema=schema), StrongRef(cid, "at://foo"))
+		# without a schema, nothing changes
+		self.assertEqual(cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor(doc)), doc)
+
+		# maps missing a field the class requires fall back to plain dicts, rather than failing the decode
+		no_date = {"$type": "app.bsky.feed.post", "text": "hi", "langs": ["en"]}
+		self.assertEqual(cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor([no_date, post]), schema=schema), [no_date, Post("hi", "now")])
+		schema.register(lambda **kwargs: StrongRef(**kwargs), ["cid", "uri"], type_name="ref", required=["uri"])
+		self.assertEqual(cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor({"$type": "ref", "cid": cid}), schema=schema), {"$type": "ref", "cid": cid})
+		# an explicit required list is trusted, so other errors from the class still propagate
+		self.assertRaisesRegex(TypeError, "cid", cbrrr.decode_dag_cbor, cbrrr.encode_dag_cbor({"$type": "ref", "uri": "x"}), schema=schema)
+		self.assertRaisesRegex(ValueError, "isn't one of the fields", schema.register, Post, ["text"], type_name="x")
+		self.assertRaises(ValueError, schema.register, Post, ["text", "createdAt"], type_name="x", required=["nope"])
+
+		# any mapping will do for fields, not just a dict
+		schema = cbrrr.Schema()
+		schema.register(lambda **kwargs: kwargs, types.MappingProxyType({"uri": "u", "cid": "c"}))
+		self.assertEqual(cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor(ref), schema=schema), {"c": cid, "u": "at://foo"})
+
+	def test_schema_decode_errors(self):
+		class Boom(Exception):
+			pass
+
+		def explode(**kwargs):
+			raise Boom()
+
+		schema = cbrrr.Schema()
+		schema.register(explode, ["a", "b"])
+		self.assertRaises(TypeError, schema.register, explode, [1])
+		self.assertRaises(ValueError, schema.register, explode, ["a", "a"])
+		self.assertRaises(TypeError, schema.register, explode, "ab") # not ["a", "b"]
+		self.assertRaises(TypeError, schema.register, explode, b"ab")
+		self.assertRaises(TypeError, cbrrr.decode_dag_cbor, b"\xa0", schema={})
+
+		# constructor exceptions propagate, without leaking any staged items
+		self.assertRaises(Boom, cbrrr.decode_dag_cbor, cbrrr.encode_dag_cbor([{"x": [{"a": 1, "b": [2]}]}]), schema=schema)
+
+		# strictness checks are unaffected
+		self.assertRaises(cbrrr.CbrrrDecodeError, cbrrr.decode_dag_cbor, b"\xa2\x61b\x01\x61a\x02", schema=schema)
+		self.assertRaises(cbrrr.CbrrrDecodeError, cbrrr.decode_dag_cbor, b"\xa2\x61a\x01\x61a\x02", schema=schema)
+		self.assertRaises(cbrrr.CbrrrDecodeError, cbrrr.decode_dag_cbor, b"\xa1\x61a\xa2\x61a\x01\x61b", schema=schema)
+		self.assertEqual(cbrrr.decode_dag_cbor(b"\xa1\x61a\xa0", schema=schema), {"a": {}})
+
+	def test_schema_register_while_decoding(self):
+		@dataclasses.dataclass
+		class A:
+			a: int
+
+		@dataclasses.dataclass
+		class B:
+			b: int
+
+		schema = cbrrr.Schema()
+		decoder = cbrrr.Decoder(schema=schema)
+
+		def make_a(**kwargs):
+			# registering mid-decode replaces the table, but this decode carries on with the old one
+			schema.register(B, ["b"])
+			schema.register(make_a, ["a"])
+			return A(**kwargs)
+
+		schema.register(make_a, ["a"])
+		encoded = cbrrr.encode_dag_cbor([{"a": 1}, {"b": 2}, {"a": 3}])
+		for decode in [lambda: cbrrr.decode_dag_cbor(encoded, schema=schema), lambda: decoder.decode(encoded)]:
+			schema.register(dict, ["b"]) # i.e. no B, to start with
+			self.assertEqual(decode(), [A(1), {"b": 2}, A(3)])
+			self.assertEqual(decode(), [A(1), B(2), A(3)])
+		# a schema can still be added to after use
+		schema.register(B, {"a": "b"})
+		self.assertEqual(cbrrr.decode_dag_cbor(encoded, schema=schema), [B(1), B(2), B(3)])
+		schema.register(A, ["a"], type_name="x")
+		self.assertEqual(schema.by_type, {"x": A})
+
+	def test_threads(self):
+		docs = [{"text": "post %d" % i, "langs": ["en"], "n": i, "ref": cbrrr.CID.cidv1_raw_sha256_32_from(b"%d" % i)} for i in range(200)]
+		encoded = [cbrrr.encode_dag_cbor(doc) for doc in docs]
+		errors = []
+
+		def worker():
+			try:
+				for _ in range(20):
+					self.assertEqual([cbrrr.encode_dag_cbor(doc) for doc in docs], encoded)
+					self.assertEqual([cbrrr.decode_dag_cbor(buf) for buf in encoded], docs)
+					cbrrr.set_key_cache_size(512) # resizing underneath the other threads
+			except Exception as e:
+				errors.append(e)
+
+		threads = [threading.Thread(target=worker) for _ in range(4)]
+		for thread in threads:
+			thread.start()
+		for thread in threads:
+			thread.join()
+		cbrrr.set_key_cache_size(1024)
+		self.assertEqual(errors, [])
+
+	def test_subinterpreters(self):
+		try:
+			import _interpreters as interpreters # 3.13+
+		except ImportError:
+			try:
+				import _xxsubinterpreters as interpreters # 3.12
+			except ImportError:
+				self.skipTest("no subinterpreter support")
+		code = """if 1:
+			import sys
+			sys.path[:] = %r
+			import cbrrr
+			cid = cbrrr.CID.cidv1_raw_sha256_32_from(b"x")
+			doc = {"a": [1, "b", cid]}
+			assert cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor(doc)) == doc
+			try:
+				cbrrr.decode_dag_cbor(b"\\xff")
+			except cbrrr.CbrrrDecodeError:
+				pass
+			else:
+				raise AssertionError("expected an error")
+		""" % (sys.path,)
+		interp = interpreters.create()
+		try:
+			self.assertIsNone(interpreters.run_string(interp, code))
+		finally:
+			interpreters.destroy(interp)
+		# our own instance of the module is unaffected
+		self.assertIsInstance(cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor(cbrrr.CID.cidv1_raw_sha256_32_from(b"x"))), cbrrr.CID)
+
+	def test_reimport(self):
+		# a second instance of the extension module, alongside the first
+		old = sys.modules.pop("cbrrr._cbrrr")
+		try:
+			new = importlib.import_module("cbrrr._cbrrr")
+		finally:
+			sys.modules["cbrrr._cbrrr"] = old
+			cbrrr._cbrrr = old # importing a submodule sets it as an attribute of the package
+		self.assertIsNot(new, old)
+		self.assertIsNot(new.CID, old.CID)
+		for m in [new, old]: # each one sticks to its own types
+			cid = m.CID.cidv1_raw_sha256_32_from(b"x")
+			self.assertEqual(cid, m.CID.decode(cid.encode()))
+			value, _ = m.decode_dag_cbor(m.encode_dag_cbor({"a": [cid]}, m.CID, False), m.CID, False)
+			self.assertIs(type(value["a"][0]), m.CID)
+			self.assertIs(type(m.Decoder().decode(m.Encoder().encode(cid))), m.CID)
+			with self.assertRaises(m.CbrrrDecodeError):
+				m.decode_dag_cbor(b"\xff", m.CID, False)
+			with self.assertRaises(m.CbrrrDecodeError):
+				m.Decoder().decode(b"\xff")
+			with self.assertRaises(m.CbrrrDecodeError):
+				m.StreamDecoder(m.CID, False).feed(b"\xff")
+		del new
+		gc.collect()
+		# the original is unaffected by the other one going away
+		self.assertIsInstance(cbrrr.decode_dag_cbor(cbrrr.encode_dag_cbor(cbrrr.CID.cidv1_raw_sha256_32_from(b"x"))), cbrrr.CID)
+
+	def test_decoder_encoder(self):
+		cid = cbrrr.CID.cidv1_dag_cbor_sha256_32_from(b"hello")
+		deep = []
+		for _ in range(5000): # deep enough to grow (and then drop) the scratch stacks
+			deep = [deep]
+		docs = [{"a": 1, "b": [b"x", cid, None]}, "hello", deep, {"big": b"\x00" * 0x200000}, [1, 2, 3]]
+		enc = cbrrr.Encoder()
+		dec = cbrrr.Decoder()
+		for doc in docs * 2:
+			encoded = enc.encode(doc)
+			self.assertEqual(encoded, cbrrr.encode_dag_cbor(doc))
+			# nb: comparing the re-encoded bytes, since == on deep lists would hit the recursion limit
+			self.assertEqual(enc.encode(dec.decode(encoded)), encoded)
+			self.assertEqual(enc.encode(dec.decode(bytearray(encoded))), encoded)
+
+		atjson = {"a": {"$link": cid.encode()}, "b": {"$bytes": "aGk"}}
+		encoded = cbrrr.Encoder(atjson_mode=True).encode(atjson)
+		self.assertEqual(cbrrr.decode_dag_cbor(encoded), {"a": cid, "b": b"hi"})
+		self.assertEqual(cbrrr.Decoder(atjson_mode=True).decode(encoded), atjson)
+		self.assertEqual(cbrrr.Decoder(cid_ctor=bytes).decode(encoded)["a"], bytes(cid))
+
+		schema = cbrrr.Schema()
+		schema.register(tuple, ["x"]) # nb: called with kwargs, so this always fails
+		schema_dec = cbrrr.Decoder(schema=schema)
+		self.assertRaises(TypeError, schema_dec.decode, cbrrr.encode_dag_cbor({"x": 1}))
+		schema.register(dict, ["x"]) # picked up by existing decoders
+		self.assertEqual(schema_dec.decode(cbrrr.encode_dag_cbor({"x": 1})), {"x": 1})
+		self.assertRaises(TypeError, cbrrr.Decoder, schema={})
+
+		# errors leave the scratch space in a usable state
+		self.assertRaises(ValueError, dec.decode, b"\x01\x02")
+		self.assertRaises(cbrrr.CbrrrDecodeError, dec.decode, b"\x82\x01")
+		self.assertRaises(TypeError, dec.decode, "not bytes")
+		self.assertRaises(TypeError, enc.encode, [1, object()])
+		self.assertEqual(dec.decode(enc.encode(docs[0])), docs[0])
+
+	def test_decoder_encoder_reentrant(self):
+		# cid_ctor calls back into the same Decoder, part-way through a decode
+		def cid_ctor(raw):
+			return ("cid", dec.decode(cbrrr.encode_dag_cbor([[raw]])))
+
+		dec = cbrrr.Decoder(cid_ctor=cid_ctor)
+		cid = cbrrr.CID.cidv1_raw_sha256_32_from(b"x")
+		self.assertEqual(dec.decode(cbrrr.encode_dag_cbor([[[cid]]])), [[[("cid", [[bytes(cid)]])]]])
+
+		# likewise for the Encoder, via a non-native CID's __bytes__ method
+		class ReentrantCID:
+			def __bytes__(self):
+				return enc.encode([[b"\x01"]])[3:]
+
+		enc = cbrrr.Encoder(cid_type=ReentrantCID)
+		doc = {"x": [1, {"y": ReentrantCID()}], "z": "hello"}
+		expected = {"x": [1, {"y": cbrrr.CID(b"\x01")}], "z": "hello"}
+		self.assertEqual(enc.encode(doc), cbrrr.encode_dag_cbor(expected))
+
+	def test_encoded_size(self):
+		cid = cbrrr.CID.cidv1_dag_cbor_sha256_32_from(b"hello")
+		docs = [
+			0, -1, 2**64 - 1, 1.5, None, True, "", "héllo", b"\x00" * 300, cid,
+			{"a": [1, {"b": cid}], "cc": "x" * 100},
+			[{"text": "post %d" % i, "n": i} for i in range(20000)], # lots of small items
+			[{"a": b"x" * 3000, "b": "y" * 1000} for i in range(200)], # mostly payload, gets pre-sized
+			[b"x" * 0x50000],
+		]
+		enc = cbrrr.Encoder()
+		for doc in docs:
+			encoded = cbrrr.encode_dag_cbor(doc)
+			self.assertEqual(cbrrr.encoded_size(doc), len(encoded))
+			self.assertEqual(enc.encoded_size(doc), len(encoded))
+			self.assertEqual(cbrrr.decode_dag_cbor(encoded), doc)
+
+		# the scratch area fills up (and gets flushed) before the big payload,
+		# which should still only be counted, not copied (or buffered)
+		doc = [list(range(2000)), b"x" * 0x1000000]
+		size = 1 + len(cbrrr.encode_dag_cbor(doc[0])) + 5 + 0x1000000
+		cbrrr.reset_stats()
+		cbrrr.set_stats_enabled(True)
+		try:
+			self.assertEqual(cbrrr.encoded_size(doc), size)
+			self.assertEqual(cbrrr.get_stats()["buf_grows"], 0)
+		finally:
+			cbrrr.set_stats_enabled(False)
+			cbrrr.reset_stats()
+
+		atjson = {"a": {"$link": cid.encode()}, "b": {"$bytes": "aGVsbG8"}, "c": [{"$bytes": "A" * 0x100000}]}
+		encoded = cbrrr.encode_dag_cbor(atjson, atjson_mode=True)
+		self.assertEqual(cbrrr.encoded_size(atjson, atjson_mode=True), len(encoded))
+		self.assertEqual(cbrrr.decode_dag_cbor(encoded, atjson_mode=True), atjson)
+
+		# same validation as encoding
+		self.assertRaises(TypeError, cbrrr.encoded_size, {1: 2})
+		self.assertRaises(TypeError, cbrrr.encoded_size, [object()])
+		self.assertRaises(ValueError, cbrrr.encoded_size, {"$bytes": "a"}, atjson_mode=True)
+		self.assertRaises(TypeError, cbrrr.encoded_size, b"x", atjson_mode=True)
+
+		# a CID type that encodes differently every time throws off the size
+		# pass, but the output should still be whatever the final pass saw
+		class ShiftyCID:
+			n = 0
+			def __bytes__(self):
+				ShiftyCID.n += 1
+				return b"\x01" * (ShiftyCID.n * 1000)
+
+		encoded = cbrrr.encode_dag_cbor([b"x" * 0x50000, ShiftyCID()], cid_type=ShiftyCID)
+		self.assertEqual(cbrrr.decode_dag_cbor(encoded), [b"x" * 0x50000, cbrrr.CID(b"\x01" * (ShiftyCID.n * 1000))])
+
+		class ShrinkingCID:
+			n = 3
+			def __bytes__(self):
+				ShrinkingCID.n -= 1
+				return b"\x01" * (ShrinkingCID.n * 1000)
+
+		encoded = cbrrr.encode_dag_cbor([b"x" * 0x50000, ShrinkingCID()], cid_type=ShrinkingCID)
+		self.assertEqual(cbrrr.decode_dag_cbor(encoded), [b"x" * 0x50000, cbrrr.CID(b"\x01" * 1000)])
+
+		# likewise for a list that grows between the size pass and the final one
+		class GrowingCID:
+			def __bytes__(self):
+				later.append(b"y" * 0x10000)
+				return b"\x01"
+
+		later = []
+		encoded = cbrrr.encode_dag_cbor([b"x" * 0x50000, GrowingCID(), later], cid_type=GrowingCID)
+		self.assertEqual(cbrrr.decode_dag_cbor(encoded), [b"x" * 0x50000, cbrrr.CID(b"\x01"), later])
+
+	def test_encode_to(self):
+		cid = cbrrr.CID.cidv1_dag_cbor_sha256_32_from(b"hello")
+		docs = [
+			1, "hello", {"a": [cid, b"x", None]},
+			[{"text": "post %d" % i, "n": i, "ref": cid} for i in range(5000)],
+			{"big": b"\xaa" * 100000, "s": "é" * 50000, "after": [1, 2, 3]},
+		]
+
+		class ChunkRecorder:
+			def __init__(self):
+				self.chunks = []
+			def write(self, data):
+				self.chunks.append(bytes(data))
+
+		for doc in docs:
+			expected = cbrrr.encode_dag_cbor(doc)
+			f = io.BytesIO()
+			self.assertEqual(cbrrr.encode_dag_cbor_to(doc, f), len(expected))
+			self.assertEqual(f.getvalue(), expected)
+
+			rec = ChunkRecorder()
+			self.assertEqual(cbrrr.encode_dag_cbor_to(doc, rec, chunk_size=1000), len(expected))
+			self.assertEqual(b"".join(rec.chunks), expected)
+			self.assertLessEqual(max(map(len, rec.chunks)), 1000 + 100) # a chunk, plus at most one (small) item
+
+			with tempfile.TemporaryFile() as tf:
+				self.assertEqual(cbrrr.encode_dag_cbor_to(doc, tf.fileno(), chunk_size=4096), len(expected))
+				tf.seek(0)
+				self.assertEqual(tf.read(), expected)
+
+		atjson = {"a": {"$link": cid.encode()}, "b": {"$bytes": "aGVsbG8"}}
+		f = io.BytesIO()
+		cbrrr.encode_dag_cbor_to(atjson, f, atjson_mode=True)
+		self.assertEqual(f.getvalue(), cbrrr.encode_dag_cbor(atjson, atjson_mode=True))
+
+	def test_encode_to_errors(self):
+		doc = [{"n": i, "s": "x" * 100} for i in range(1000)]
+		expected = cbrrr.encode_dag_cbor(doc)
+
+		class ShortWriter: # like a raw file, only ever writes part of what it's given
+			def __init__(self):
+				self.buf = bytearray()
+			def write(self, data):
+				n = min(len(data), 7)
+				self.buf += data[:n]
+				return n
+
+		w = ShortWriter()
+		cbrrr.encode_dag_cbor_to(doc, w, chunk_size=100)
+		self.assertEqual(bytes(w.buf), expected)
+
+		class Boom(Exception):
+			pass
+
+		class FailingWriter:
+			def write(self, data):
+				raise Boom()
+
+		self.assertRaises(Boom, cbrrr.encode_dag_cbor_to, doc, FailingWriter(), chunk_size=100)
+		self.assertRaises(Boom, cbrrr.encode_dag_cbor_to, 1, FailingWriter())
+		self.assertRaises(TypeError, cbrrr.encode_dag_cbor_to, [object()], io.BytesIO())
+		self.assertRaises(AttributeError, cbrrr.encode_dag_cbor_to, 1, object())
+		self.assertRaises(ValueError, cbrrr.encode_dag_cbor_to, 1, io.BytesIO(), chunk_size=0)
+		self.assertRaises(ValueError, cbrrr.encode_dag_cbor_to, 1, -1)
+		self.assertRaises(OSError, cbrrr.encode_dag_cbor_to, 1, 2**20) # not an open fd
+
+		# the writer mutating the object part-way through can't crash the encoder
+		class MeddlingWriter:
+			def __init__(self, victim):
+				self.victim = victim
+			def write(self, data):
+				self.victim.clear()
+
+		victim = [[i, "x" * 100] for i in range(100)]
+		self.assertRaises(RuntimeError, cbrrr.encode_dag_cbor_to, victim, MeddlingWriter(victim), chunk_size=100)
+		victim = {"k%03d" % i: [i, "x" * 100] for i in range(100)}
+		self.assertRaises(RuntimeError, cbrrr.encode_dag_cbor_to, victim, MeddlingWriter(victim), chunk_size=100)
+		victim = [{"a": [b"x" * 1000], "b": 1}]
+		self.assertRaises(RuntimeError, cbrrr.encode_dag_cbor_to, victim, MeddlingWriter(victim[0]), chunk_size=100)
+
 
 if __name__ == "__main__":
 	unittest.main(module="tests.test_cbrrr")